@@ -8,8 +8,74 @@
 
 #include "simpletest.hpp"
 #include "simpletest_ext.hpp"
+#include "simpletest_agent.hpp"
+#include "simpletest_coverage.hpp"
+#include "simpletest_crash.hpp"
+#include "simpletest_fsbench.hpp"
+#include "simpletest_history.hpp"
+#include "simpletest_journal.hpp"
+#include "simpletest_leaks.hpp"
+#include "simpletest_netsim.hpp"
+#include "simpletest_order.hpp"
+#include "simpletest_ring.hpp"
+#include "simpletest_runner.hpp"
+#include "simpletest_sandbox.hpp"
+#include "simpletest_session.hpp"
+#include "simpletest_soak.hpp"
+#include "simpletest_startup.hpp"
+#include "simpletest_watch.hpp"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::vector<int> squares;
+
+GLOBAL_SETUP(build_squares){
+	for (int i = 0; i < 1000; ++i){
+		squares.push_back(i * i);
+	}
+}
+
+// a directory under /tmp of the test's own, removed along with whatever the test left in it
+class ScratchDir{
+public:
+	ScratchDir(){
+		char templ[] = "/tmp/demo.XXXXXX";
+		if (mkdtemp(templ) == nullptr){
+			throw std::runtime_error(std::string("Failed to create a scratch directory (") + std::strerror(errno) + ")");
+		}
+		path = templ;
+	}
+
+	~ScratchDir(){
+		nftw(path.c_str(), [](const char* entry, const struct stat*, int, struct FTW*){
+			return remove(entry);
+		}, 16, FTW_DEPTH | FTW_PHYS);
+	}
+
+	std::string operator/(const std::string& name) const{
+		return path + "/" + name;
+	}
+
+	std::string path;
+};
+
+// the directory the demo was built in, which has simpletest.hpp, libsimpletest.a and simpletest-run
+static std::string buildDir(){
+	char buf[4096];
+	ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf));
+	std::string exe(buf, len > 0 ? len : 0);
+	return exe.substr(0, exe.rfind('/'));
+}
 
 UNIT_TEST(PASS_arithmetic1){
 	ASSERT(2 + 2 == 4);
@@ -21,6 +87,10 @@ UNIT_TEST(PASS_arithmetic2){
 	ASSERT(4 >> 1 == 2);
 }
 
+UNIT_TEST(PASS_global_setup){
+	ASSERT(squares.size() == 1000 && squares[12] == 144);
+}
+
 UNIT_TEST(PASS_expect1){
 	std::cout << "expectme" << std::endl;
 	EXPECT("expectme");
@@ -62,12 +132,722 @@ UNIT_TEST(PASS_send2){
 	EXPECT("testprompt:");
 }
 
+UNIT_TEST(PASS_expect_match){
+	for (int i = 0; i < 3; ++i){
+		std::cout << "request " << i << " took " << (i + 1) * 17 << "ms" << std::endl;
+		EXPECT_MATCH("^request \\d+ took [0-9]{2}ms$");
+	}
+
+	std::cout << "status: OK" << std::endl << "done" << std::endl;
+	EXPECT_LINE_MATCH(1, "status: (OK|FAIL)");
+}
+
+UNIT_TEST(PASS_output_digest){
+	simpletest::StreamHash expected;
+	DIGEST_OUTPUT(3);
+
+	for (int i = 0; i < 100000; ++i){
+		std::string line = "row " + std::to_string(i) + "\n";
+		expected.update(line);
+		std::cout << line;
+	}
+
+	EXPECT_OUTPUT_LINES(100000);
+	EXPECT_OUTPUT_HASH(expected.digest());
+	ASSERT(__stdigest.getLastLines().back() == "row 99999");
+}
+
+UNIT_TEST(PASS_measure_response){
+	// a tiny REPL running alongside the test
+	std::thread repl([](){
+		std::string line;
+		while (std::getline(std::cin, line) && line != "quit"){
+			std::cout << "echo: " << line << std::endl;
+		}
+	});
+
+	MEASURE_RESPONSE_N("hello", "^echo: hello$", 50);
+	SEND("quit");
+	repl.join();
+}
+
+UNIT_TEST(PASS_startup_benchmark){
+	STARTUP_BENCHMARK("echo", "hello");
+}
+
+UNIT_TEST(PASS_only_modified){
+	ScratchDir scratch;
+	std::string base = scratch / "changeenv";
+	simpletest::TestEnvironment env;
+	env.setupFullEnvironment(base.c_str());
+
+	std::ofstream(base + "/dir1/dir11.txt") << "rewritten";
+	std::ofstream(base + "/dir2/log.txt") << "log";
+
+	ASSERT_ONLY_MODIFIED(env, base + "/dir1/dir11.txt", base + "/dir2/log.txt");
+	remove((base + "/dir2/log.txt").c_str());
+}
+
+UNIT_TEST(PASS_fs_metadata_benchmark){
+	ScratchDir scratch;
+	simpletest::TestEnvironment env;
+	simpletest::FsBenchOptions opt;
+	env.setupBasicEnvironment((scratch / "fsenv").c_str());
+
+	// keep the demo quick; FS_METADATA_BENCHMARK(env) runs the full default suite
+	opt.dirSizes = {100};
+	opt.threads = {1, 2};
+	ASSERT(simpletest::fsMetadataBenchmark(env, opt).size() == 18);
+	ASSERT_UNCHANGED(env);
+}
+
+UNIT_TEST(PASS_crash_consistent){
+	ScratchDir scratch;
+	std::string base = scratch / "crashenv";
+	simpletest::TestEnvironment env;
+	env.setupBasicEnvironment(base.c_str());
+	simpletest::CrashRecorder rec(env);
+
+	// the classic safe save: write a temporary file, fsync it, then rename it over the old one
+	int fd = open((base + "/db.tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT(write(fd, "version-2", 9) == 9);
+	fsync(fd);
+	close(fd);
+	rename((base + "/db.tmp").c_str(), (base + "/file1.txt").c_str());
+	rec.stop();
+
+	ASSERT_CRASH_CONSISTENT(rec, [&](const char* dir){
+		std::ifstream ifs(std::string(dir) + "/file1.txt");
+		std::string s;
+		std::getline(ifs, s);
+		// either the old random contents or the whole new version, never a torn mix
+		ASSERT(s == "version-2" || s.find("version") == std::string::npos);
+	});
+}
+
+UNIT_TEST(PASS_crash_consistent_stdio){
+	ScratchDir scratch;
+	std::string base = scratch / "crashenv_stdio";
+	simpletest::TestEnvironment env;
+	env.setupBasicEnvironment(base.c_str());
+	simpletest::CrashRecorder rec(env);
+	bool recorded = false;
+
+	// the same safe save through a FILE*, with the directory fsynced so the rename is durable too
+	FILE* fp = fopen((base + "/db.tmp").c_str(), "w");
+	ASSERT(fp != nullptr);
+	fputs("version-2", fp);
+	fflush(fp);
+	fsync(fileno(fp));
+	fclose(fp);
+	rename((base + "/db.tmp").c_str(), (base + "/file1.txt").c_str());
+	int dir = open(base.c_str(), O_RDONLY | O_DIRECTORY);
+	fsync(dir);
+	close(dir);
+	rec.stop();
+
+	// what the stream flushed is recorded, so the crash states are not missing it
+	for (const simpletest::FsOp& op : rec.getOps()){
+		recorded |= op.type == simpletest::FsOp::WRITE && op.data == "version-2";
+	}
+	ASSERT(recorded);
+
+	ASSERT_CRASH_CONSISTENT(rec, [&](const char* dir){
+		std::ifstream ifs(std::string(dir) + "/file1.txt");
+		std::string s;
+		std::getline(ifs, s);
+		ASSERT(s == "version-2" || s.find("version") == std::string::npos);
+	});
+}
+
+UNIT_TEST(PASS_crash_missing_dir_fsync){
+	ScratchDir scratch;
+	std::string base = scratch / "crashenv_dirsync";
+	simpletest::TestEnvironment env;
+	env.setupBasicEnvironment(base.c_str());
+	simpletest::CrashRecorder rec(env);
+
+	// the rename is never made durable with an fsync() of the directory, yet a durable marker claims it happened
+	int fd = open((base + "/db.tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ASSERT(write(fd, "version-2", 9) == 9);
+	fsync(fd);
+	close(fd);
+	rename((base + "/db.tmp").c_str(), (base + "/file1.txt").c_str());
+	fd = open((base + "/file2.txt").c_str(), O_WRONLY);
+	ASSERT(pwrite(fd, "done\n", 5, 0) == 5);
+	fsync(fd);
+	close(fd);
+	rec.stop();
+
+	simpletest::CrashCheckResult res = rec.check([&](const char* dir){
+		std::ifstream marker(std::string(dir) + "/file2.txt");
+		std::ifstream ifs(std::string(dir) + "/file1.txt");
+		std::string m;
+		std::string s;
+		std::getline(marker, m);
+		std::getline(ifs, s);
+		ASSERT(m != "done" || s == "version-2");
+	});
+	ASSERT(!res.failures.empty());
+}
+
+UNIT_TEST(PASS_session_replay){
+	ScratchDir scratch;
+	std::string path = scratch / "demo.session";
+	simpletest::Session session;
+	simpletest::SessionEvent in;
+	simpletest::SessionEvent out;
+	simpletest::SessionEvent exit;
+	bool rejected = false;
+
+	// what ./demo --record=demo.session cat would save after typing one line and Ctrl-D
+	session.args = {"cat"};
+	in.stream = simpletest::SessionEvent::STDIN;
+	in.data = "hello\n";
+	out.stream = simpletest::SessionEvent::STDOUT;
+	out.data = "hello\n";
+	out.time = std::chrono::milliseconds(1);
+	exit.stream = simpletest::SessionEvent::EXIT;
+	exit.time = std::chrono::milliseconds(2);
+	session.events = {in, out, exit};
+	session.save(path.c_str());
+	simpletest::replaySession(path.c_str());
+
+	// a stray event from a stream that does not exist
+	std::ofstream(path, std::ios::app) << '\x07';
+	try{
+		simpletest::Session::load(path.c_str());
+	}
+	catch (std::runtime_error&){
+		rejected = true;
+	}
+	ASSERT(rejected);
+}
+
 UNIT_TEST(PASS_test_printf){
 	TEST_PRINTF("qqq\n");
 	std::cout << "IF THIS SHOWS, IT IS A BUG" << std::endl;
 	TEST_PRINTF("test printf %d\n", 123);
 }
 
+UNIT_TEST(PASS_fd_capture){
+	simpletest::FdCapturer log(3);
+
+	dprintf(3, "log line 1\n");
+	dprintf(3, "log line 2\n");
+	EXPECT_FD(log, "log line 2");
+}
+
+UNIT_TEST(PASS_fd_socketpair){
+	simpletest::FdCapturer sock = simpletest::FdCapturer::socketPair();
+	char buf[64] = {0};
+
+	SEND_FD(sock, "ping");
+	ASSERT(read(sock.getFd(), buf, sizeof(buf) - 1) == 5);
+	ASSERT(std::string(buf) == "ping\n");
+
+	dprintf(sock.getFd(), "pong\n");
+	EXPECT_FD(sock, "pong");
+}
+
+UNIT_TEST(PASS_simulated_link){
+	simpletest::EventLoop loop;
+	simpletest::LinkShape shape;
+	char buf[64] = {0};
+
+	shape.latencyMin = std::chrono::milliseconds(2);
+	shape.latencyMax = std::chrono::milliseconds(4);
+	simpletest::SimulatedLink link(loop, shape, shape);
+	link.onPeerData([](std::string_view data, simpletest::SimulatedLink& l){
+		l.peerSend(std::string("echo:") + std::string(data));
+	});
+
+	ASSERT(write(link.getFd(), "hi", 2) == 2);
+	ASSERT(loop.runUntil([&link]{ return link.getStats(simpletest::SimulatedLink::FROM_PEER).bytesDelivered == 7; }, std::chrono::seconds(1)));
+	ASSERT(read(link.getFd(), buf, sizeof(buf) - 1) == 7);
+	ASSERT(std::string(buf) == "echo:hi");
+}
+
+UNIT_TEST(PASS_simulated_link_boundaries){
+	simpletest::EventLoop loop;
+	simpletest::LinkShape shape;
+	simpletest::SimulatedLink datagrams(loop, shape, shape, true);
+	std::string big(10000, 'x');
+	size_t received = 0;
+	size_t got = 0;
+
+	// a message bigger than a chunk arrives whole
+	datagrams.onPeerData([&received](std::string_view data, simpletest::SimulatedLink&){
+		received = data.size();
+	});
+	ASSERT(write(datagrams.getFd(), big.data(), big.size()) == (ssize_t)big.size());
+	ASSERT(loop.runUntil([&received]{ return received != 0; }, std::chrono::seconds(1)));
+	ASSERT(received == big.size());
+
+	// everything up to the disconnect is delivered, even past what the socket buffer holds
+	shape.disconnectAfterBytes = 1 << 20;
+	simpletest::SimulatedLink stream(loop, simpletest::LinkShape(), shape);
+	fcntl(stream.getFd(), F_SETFL, O_NONBLOCK);
+	stream.peerSend(std::string(2 << 20, 'y'));
+	ASSERT(loop.runUntil([&]{
+		char buf[65536];
+		ssize_t ss;
+		while ((ss = read(stream.getFd(), buf, sizeof(buf))) > 0){
+			got += ss;
+		}
+		return ss == 0;
+	}, std::chrono::seconds(5)));
+	ASSERT(got == (size_t)1 << 20);
+	ASSERT(stream.disconnected());
+}
+
+UNIT_TEST(PASS_result_encoding){
+	simpletest::TestResult res;
+	simpletest::TestResult got;
+	simpletest::Benchmark b;
+	std::string buf;
+	uint64_t slot;
+
+	res.status = simpletest::TestResult::FAILED;
+	res.reason = "expected 4, got 5";
+	res.duration = std::chrono::microseconds(1500);
+	b.name = "parse";
+	b.samples = {std::chrono::nanoseconds(10), std::chrono::nanoseconds(20)};
+	b.details = {{"bytes", "4096"}};
+	res.benchmarks = {b};
+	res.leaks = {"1 file descriptor"};
+	buf = simpletest::encodeResult(7, res) + simpletest::encodeResult(9, simpletest::TestResult());
+
+	// a message that has not fully arrived is left in the buffer
+	std::string partial = buf.substr(0, 20);
+	ASSERT(!simpletest::decodeResult(partial, slot, got) && partial.size() == 20);
+
+	ASSERT(simpletest::decodeResult(buf, slot, got) && slot == 7);
+	ASSERT(got.status == res.status && got.reason == res.reason && got.duration == res.duration);
+	ASSERT(got.benchmarks.size() == 1 && got.benchmarks[0].samples == b.samples && got.benchmarks[0].details == b.details);
+	ASSERT(got.leaks == res.leaks);
+	ASSERT(simpletest::decodeResult(buf, slot, got) && slot == 9 && got.status == simpletest::TestResult::PASSED && got.benchmarks.empty());
+	ASSERT(buf.empty());
+}
+
+UNIT_TEST(PASS_run_driver){
+	ScratchDir scratch;
+	std::string build = "g++ -std=c++17 -I" + buildDir() + " -o ";
+	std::ifstream ifs;
+	std::string out;
+	auto line = [&out](const std::string& start){
+		size_t pos = out.find(start);
+		return pos == std::string::npos ? std::string() : out.substr(pos, out.find('\n', pos) - pos);
+	};
+
+	// two test programs, and an executable that is not one
+	std::ofstream(scratch / "parser_test.cpp") << "#include \"simpletest.hpp\"\nUNIT_TEST(parse_ok){ ASSERT(1 + 1 == 2); }\nUNIT_TEST(parse_bad){ ASSERT(1 + 1 == 3); }\nint main(int argc, char** argv){ return EXECUTE_TESTS(); }\n";
+	std::ofstream(scratch / "render_test.cpp") << "#include \"simpletest.hpp\"\nUNIT_TEST(render_ok){ ASSERT(true); }\nint main(int argc, char** argv){ return EXECUTE_TESTS(); }\n";
+	std::ofstream(scratch / "tool") << "#!/bin/sh\nexit 1\n";
+	chmod((scratch / "tool").c_str(), 0755);
+	for (const char* name : {"parser_test", "render_test"}){
+		ASSERT(system((build + scratch / name + " " + scratch / name + ".cpp " + buildDir() + "/libsimpletest.a").c_str()) == 0);
+	}
+
+	// the exit code is the number of failed tests
+	ASSERT(WEXITSTATUS(system((buildDir() + "/simpletest-run " + scratch.path + " >" + scratch / "out" + " 2>&1").c_str())) == 1);
+	ifs.open(scratch / "out");
+	std::getline(ifs, out, '\0');
+	ASSERT(out.find("Skipping " + scratch / "tool") != std::string::npos);
+	// merged into one report, with each test under its program's name
+	ASSERT(line(scratch / "parser_test: parse_ok.").find("...Passed") != std::string::npos);
+	ASSERT(line(scratch / "parser_test: parse_bad.").find("...Failed") != std::string::npos);
+	ASSERT(line(scratch / "render_test: render_ok.").find("...Passed") != std::string::npos);
+	ASSERT(out.find("2 Passed\n1 Failed\n2 programs") != std::string::npos);
+}
+
+UNIT_TEST(PASS_result_ring){
+	simpletest::ResultRing consumer(16, 1 << 16);
+	std::vector<std::string> reasons;
+	std::vector<std::string> received;
+	std::vector<uint64_t> slots;
+	std::chrono::nanoseconds elapsed;
+	simpletest::TestResult res;
+	uint64_t slot;
+
+	// more results than records, with reasons longer than the arena, so the producer has to wait for the consumer
+	for (size_t i = 0; i < 100; ++i){
+		reasons.push_back(std::string(i * 1000, 'a' + i % 26));
+	}
+	std::thread worker([&consumer, &reasons]{
+		simpletest::ResultRing producer(consumer.getFd());
+		for (size_t i = 0; i < reasons.size(); ++i){
+			simpletest::TestResult r;
+			r.status = simpletest::TestResult::FAILED;
+			r.reason = reasons[i];
+			producer.testStarted(i);
+			producer.testFinished(i, r);
+		}
+		producer.testStarted(100);
+	});
+	for (size_t i = 0; i < reasons.size(); ++i){
+		while (!consumer.next(slot, res)){
+			std::this_thread::yield();
+		}
+		slots.push_back(slot);
+		received.push_back(res.reason);
+	}
+	worker.join();
+	ASSERT(received == reasons && slots.size() == 100 && slots.back() == 99);
+	ASSERT(!consumer.next(slot, res));
+	ASSERT(consumer.running(slot, elapsed) && slot == 100);
+
+	// a reset ring starts over for the next producer
+	consumer.reset();
+	ASSERT(!consumer.running(slot, elapsed));
+	simpletest::ResultRing(consumer.getFd()).testFinished(5, simpletest::TestResult());
+	ASSERT(consumer.next(slot, res) && slot == 5 && res.status == simpletest::TestResult::PASSED);
+}
+
+UNIT_TEST(PASS_resource_packing){
+	simpletest::ResourcePool pool(simpletest::parseWeights("cores=4,memory=1G,io=100"), false);
+	simpletest::ResourceWeights big = simpletest::parseWeights("cores=2,memory=512M");
+	simpletest::Allocation a;
+	simpletest::Allocation b;
+	simpletest::Allocation c;
+	bool rejected = false;
+
+	ASSERT(big.cores == 2 && big.memory == (uint64_t)512 << 20 && big.io == 0 && !big.isolated);
+	ASSERT(simpletest::parseWeights("io=10,isolated", big).cores == 2);
+	ASSERT(simpletest::parseWeights(big.describe()).describe() == big.describe());
+	try{
+		simpletest::parseWeights("io=150");
+	}
+	catch (std::invalid_argument&){
+		rejected = true;
+	}
+	ASSERT(rejected);
+
+	// a test only starts if every one of its weights still fits
+	ASSERT(pool.acquire(big, a));
+	ASSERT(!pool.acquire(simpletest::parseWeights("memory=768M"), b));
+	ASSERT(pool.acquire(simpletest::parseWeights("io=60"), b));
+	ASSERT(!pool.acquire(simpletest::parseWeights("io=60"), c));
+	ASSERT(!pool.full());
+
+	// one that needs more than the machine has runs on its own
+	ASSERT(!pool.acquire(simpletest::parseWeights("cores=16"), c));
+	pool.release(a);
+	pool.release(b);
+	ASSERT(pool.acquire(simpletest::parseWeights("cores=16"), c) && c.weights.cores == 4 && pool.full());
+}
+
+UNIT_TEST(PASS_history_regressions){
+	ScratchDir scratch;
+	std::string path = scratch / "demo.history";
+	std::ostringstream os;
+	auto record = [](const std::string& name, simpletest::TestResult::Status status, int ms){
+		simpletest::HistoryRecord r;
+		r.name = name;
+		r.status = status;
+		r.duration = std::chrono::milliseconds(ms);
+		return r;
+	};
+
+	// parse gets slower in the third run, and io fails in the first and third
+	simpletest::appendHistory(path, {record("parse", simpletest::TestResult::PASSED, 10), record("io", simpletest::TestResult::FAILED, 5)});
+	simpletest::appendHistory(path, {record("parse", simpletest::TestResult::PASSED, 10), record("io", simpletest::TestResult::PASSED, 5)});
+	simpletest::appendHistory(path, {record("parse", simpletest::TestResult::PASSED, 25), record("io", simpletest::TestResult::FAILED, 5)});
+
+	simpletest::History history(path);
+	ASSERT(history.size() == 3 && history.run(2).size() == 2);
+	ASSERT(history.run(2)[0].name == "parse" && history.run(2)[0].duration == std::chrono::milliseconds(25));
+
+	ASSERT(simpletest::queryHistory(path, "slower:50", os) == 1);
+	ASSERT(os.str().find("  parse: ") != std::string::npos && os.str().find("io") == std::string::npos);
+	os.str("");
+	ASSERT(simpletest::queryHistory(path, "slower:200", os) == 0);
+
+	// io already failed in the first run
+	ASSERT(simpletest::queryHistory(path, "failing-since:2", os) == 1);
+	ASSERT(simpletest::queryHistory(path, "failing-since:1", os) == 0);
+}
+
+UNIT_TEST(PASS_summarize_runs){
+	simpletest::TestResult pass;
+	simpletest::TestResult crash;
+	simpletest::TestResult fail;
+	simpletest::TestResult sum;
+
+	pass.duration = std::chrono::milliseconds(10);
+	pass.benchmarks = {{"parse", {std::chrono::nanoseconds(1)}, {}}};
+	crash.status = simpletest::TestResult::CRASHED;
+	crash.reason = "Segmentation fault";
+	crash.duration = std::chrono::milliseconds(30);
+	crash.benchmarks = {{"parse", {std::chrono::nanoseconds(2)}, {}}};
+	fail.status = simpletest::TestResult::FAILED;
+	fail.reason = "expected 4";
+
+	sum = simpletest::summarizeRuns({pass, pass});
+	ASSERT(sum.status == simpletest::TestResult::PASSED && sum.runs == 2 && sum.failures == 0);
+
+	// some runs passing is flaky, and the first failure says why
+	sum = simpletest::summarizeRuns({pass, crash, fail});
+	ASSERT(sum.status == simpletest::TestResult::FLAKY && sum.runs == 3 && sum.failures == 2);
+	ASSERT(sum.reason.find("Segmentation fault") != std::string::npos);
+	ASSERT(sum.duration == std::chrono::nanoseconds(std::chrono::milliseconds(40)) / 3);
+	ASSERT(sum.benchmarks.size() == 1 && sum.benchmarks[0].samples.size() == 2);
+
+	// none passing keeps the first failure's status
+	sum = simpletest::summarizeRuns({crash, fail});
+	ASSERT(sum.status == simpletest::TestResult::CRASHED && sum.failures == 2);
+}
+
+UNIT_TEST(PASS_coverage_affected){
+	ScratchDir scratch;
+	std::vector<std::string> tests = {"parse_test", "render_test", "new_test"};
+	simpletest::CoverageMap cov;
+	// runs the app with its counters written where coverageDump() would put a test's
+	auto run = [&scratch](const std::string& what){
+		return system(("GCOV_PREFIX=" + scratch / what + " " + scratch / "app" + " " + what).c_str()) == 0;
+	};
+	using Affected = std::vector<bool>;
+
+	// parse_test runs parse(), render_test runs render(), which calls parse(), and the global setup runs init()
+	std::ofstream(scratch / "parser.cpp") << "int parse(){ return 0; }\n";
+	std::ofstream(scratch / "render.cpp") << "int parse();\nint render(){ return parse(); }\n";
+	std::ofstream(scratch / "setup.cpp") << "int init(){ return 0; }\n";
+	std::ofstream(scratch / "main.cpp") << "#include <string>\nint parse();\nint render();\nint init();\n"
+		"int main(int, char** argv){ std::string what = argv[1]; return what == \"parse\" ? parse() : what == \"render\" ? render() : init(); }\n";
+	ASSERT(system(("cd " + scratch.path + " && g++ --coverage -c parser.cpp render.cpp setup.cpp main.cpp && g++ --coverage -o app parser.o render.o setup.o main.o").c_str()) == 0);
+	ASSERT(run("parse") && run("render") && run("init"));
+	cov.record("parse_test", scratch / "parse");
+	cov.record("render_test", scratch / "render");
+	cov.record(simpletest::CoverageMap::globalSetup, scratch / "init");
+	cov.save(scratch / "map");
+	cov = simpletest::CoverageMap::load(scratch / "map");
+
+	// a test nothing was recorded for always runs
+	ASSERT(cov.contains("parse_test") && !cov.contains("new_test"));
+	ASSERT(cov.affected(tests, {"render.cpp"}) == Affected({false, true, true}));
+	ASSERT(cov.affected(tests, {"parser.cpp"}) == Affected({true, true, true}));
+	ASSERT(cov.affected(tests, {"README.md"}) == Affected({false, false, true}));
+
+	// so does everything if the global setup ran the file, or it is a source file no recorded function is from
+	ASSERT(cov.affected(tests, {"setup.cpp"}) == Affected({true, true, true}));
+	ASSERT(cov.affected(tests, {"new.hpp"}) == Affected({true, true, true}));
+}
+
+UNIT_TEST(PASS_shuffle_and_bisect){
+	std::vector<size_t> order = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+	std::vector<size_t> again = order;
+	std::vector<size_t> minimal;
+
+	// a seed printed by one run must reproduce its order anywhere
+	simpletest::shuffleOrder(order, 42);
+	simpletest::shuffleOrder(again, 42);
+	ASSERT(order == again);
+	ASSERT(order == std::vector<size_t>({1, 7, 9, 0, 3, 8, 4, 2, 5, 6}));
+
+	// the test only fails once both 3 and 7 ran before it
+	minimal = simpletest::minimizeFailingPrefix(order, [](const std::vector<size_t>& before){
+		return std::find(before.begin(), before.end(), 3) != before.end() && std::find(before.begin(), before.end(), 7) != before.end();
+	});
+	ASSERT(minimal == std::vector<size_t>({7, 3}));
+}
+
+UNIT_TEST(PASS_sandbox_restore){
+	std::string root = simpletest::makeSandboxRoot();
+	std::string dir;
+	char before[4096];
+	char after[4096];
+	mode_t mask = umask(022);
+
+	umask(mask);
+	setenv("DEMO_SANDBOX_KEPT", "before", 1);
+	unsetenv("DEMO_SANDBOX_ADDED");
+	ASSERT(getcwd(before, sizeof(before)) != nullptr);
+	{
+		simpletest::TestSandbox sandbox(root, "PASS_sandbox_restore");
+		dir = sandbox.getDirectory();
+		ASSERT(getcwd(after, sizeof(after)) != nullptr && dir == after);
+
+		ASSERT(chdir("/") == 0);
+		setenv("DEMO_SANDBOX_KEPT", "changed", 1);
+		setenv("DEMO_SANDBOX_ADDED", "added", 1);
+		umask(mask ^ 077);
+	}
+
+	ASSERT(getcwd(after, sizeof(after)) != nullptr && std::string(after) == before);
+	ASSERT(std::string(getenv("DEMO_SANDBOX_KEPT")) == "before" && getenv("DEMO_SANDBOX_ADDED") == nullptr);
+	ASSERT(umask(mask) == mask);
+	ASSERT(access(dir.c_str(), F_OK) != 0);
+	unsetenv("DEMO_SANDBOX_KEPT");
+	simpletest::removeSandboxRoot(root);
+}
+
+UNIT_TEST(PASS_leak_audit){
+	int fds[2];
+	char c = 0;
+	pid_t child;
+	std::vector<std::string> leaks;
+	auto reported = [&leaks](const std::string& prefix){
+		return std::any_of(leaks.begin(), leaks.end(), [&prefix](const std::string& leak){ return leak.compare(0, prefix.size(), prefix) == 0; });
+	};
+
+	simpletest::prepareLeakAudits();
+	// what is cleaned up before finish() is not reported
+	{
+		simpletest::LeakAudit audit(16 << 10);
+		ASSERT(pipe(fds) == 0);
+		close(fds[0]);
+		close(fds[1]);
+		std::thread([](){}).join();
+		child = fork();
+		if (child == 0){
+			_exit(0);
+		}
+		waitpid(child, nullptr, 0);
+		ASSERT(audit.finish().empty() && audit.getHeapGrowth() == 0);
+	}
+
+	simpletest::LeakAudit audit(16 << 10);
+	ASSERT(pipe(fds) == 0);
+	std::thread reader([&fds, &c](){
+		while (read(fds[0], &c, 1) < 0 && errno == EINTR);
+	});
+	child = fork();
+	if (child == 0){
+		_exit(0);
+	}
+	// exited, but not waited for
+	waitid(P_PID, child, nullptr, WEXITED | WNOWAIT);
+	std::vector<char> held(1 << 20, 1);
+	leaks = audit.finish();
+	write(fds[1], &c, 1);
+	reader.join();
+	close(fds[0]);
+	close(fds[1]);
+	waitpid(child, nullptr, 0);
+
+	ASSERT(reported("fd " + std::to_string(fds[0]) + " (pipe:[") && reported("fd " + std::to_string(fds[1]) + " (pipe:["));
+	ASSERT(reported("thread "));
+	ASSERT(reported("child process " + std::to_string(child) + " (") && std::any_of(leaks.begin(), leaks.end(), [](const std::string& leak){ return leak.find("(not waited for)") != std::string::npos; }));
+	ASSERT(leaks.size() == 4);
+	ASSERT(audit.getHeapGrowth() >= held.size());
+}
+
+UNIT_TEST(PASS_soak_trend){
+	std::vector<std::pair<double, double>> growing;
+	std::vector<std::pair<double, double>> flat;
+	simpletest::TrendFit fit;
+
+	// 2 bytes a second with one huge outlier, like a pause in the middle of the run
+	for (int i = 0; i < 30; ++i){
+		growing.push_back({i, 100 + 2.0 * i + (i == 15 ? 5000 : 0)});
+		flat.push_back({i, 100.0 + (i % 3)});
+	}
+	fit = simpletest::fitTrend(growing);
+	ASSERT(fit.slope == 2 && fit.intercept == 100);
+	ASSERT(fit.z > 3.09);
+
+	fit = simpletest::fitTrend(flat);
+	ASSERT(fit.slope == 0 && fit.z < 3.09);
+
+	fit = simpletest::fitTrend({{0, 1}});
+	ASSERT(fit.slope == 0 && fit.intercept == 0 && fit.z == 0);
+}
+
+UNIT_TEST(PASS_watch_reload){
+	ScratchDir scratch;
+	std::string suite = scratch / "suite.so";
+	// each build of the suite says which one it is when it is loaded
+	auto build = [&scratch, &suite](int version){
+		std::ofstream(scratch / "suite.cpp") << "#include <cstdlib>\nstatic int loaded = setenv(\"DEMO_SUITE_BUILD\", \"" << version << "\", 1);\n";
+		return system(("g++ -shared -fPIC -o " + suite + " " + scratch / "suite.cpp").c_str()) == 0;
+	};
+
+	ASSERT(build(1));
+	simpletest::SuiteWatcher watcher({suite});
+	watcher.load(0);
+	ASSERT(std::string(getenv("DEMO_SUITE_BUILD")) == "1");
+
+	ASSERT(build(2));
+	ASSERT(watcher.waitForChanges() == std::vector<size_t>({0}));
+	watcher.unload(0);
+	watcher.load(0);
+	ASSERT(std::string(getenv("DEMO_SUITE_BUILD")) == "2");
+	unsetenv("DEMO_SUITE_BUILD");
+}
+
+UNIT_TEST(PASS_agent_messages){
+	simpletest::AgentJob job;
+	simpletest::AgentJob got;
+	std::string buf;
+	uint32_t slots;
+
+	job.id = 12;
+	job.index = 3;
+	job.program = "/build/tests/parser_test";
+	job.limits = "memory=512M";
+	job.fresh = true;
+	buf = simpletest::encodeHello(16) + simpletest::encodeJob(job);
+
+	ASSERT(simpletest::decodeHello(buf, slots) && slots == 16);
+
+	// a job that has not fully arrived is left in the buffer
+	std::string partial = buf.substr(0, buf.size() - 1);
+	ASSERT(!simpletest::decodeJob(partial, got) && partial.size() == buf.size() - 1);
+
+	ASSERT(simpletest::decodeJob(buf, got) && buf.empty());
+	ASSERT(got.id == 12 && got.index == 3 && got.program == job.program && got.limits == job.limits && got.fresh);
+}
+
+UNIT_TEST(PASS_journal_resume){
+	simpletest::TestResult first;
+	simpletest::TestResult failed;
+	simpletest::TestResult rerun;
+	struct stat st;
+	ScratchDir scratch;
+	std::string path = scratch / "demo.journal";
+
+	first.index = 0;
+	failed.index = 2;
+	failed.status = simpletest::TestResult::FAILED;
+	failed.reason = "expected 4";
+	failed.cpuTime = std::chrono::milliseconds(5);
+	failed.runs = 2;
+	failed.failures = 1;
+	rerun.index = 0;
+	rerun.status = simpletest::TestResult::CRASHED;
+	{
+		simpletest::ResultJournal journal(path, false, 3);
+		journal.append(first);
+		journal.append(failed);
+		journal.append(rerun);
+	}
+
+	// the run was killed halfway through writing its last record
+	ASSERT(stat(path.c_str(), &st) == 0 && truncate(path.c_str(), st.st_size - 3) == 0);
+	{
+		simpletest::ResultJournal journal(path, true, 3);
+		const std::vector<simpletest::TestResult>& resumed = journal.getResumed();
+		ASSERT(!journal.isStale() && resumed.size() == 2);
+		ASSERT(resumed[0].index == 0 && resumed[0].status == simpletest::TestResult::PASSED);
+		ASSERT(resumed[1].index == 2 && resumed[1].reason == "expected 4" && resumed[1].cpuTime == failed.cpuTime && resumed[1].runs == 2 && resumed[1].failures == 1);
+		journal.append(rerun);
+	}
+
+	// the cut record was overwritten, so the next resume sees the new one
+	{
+		simpletest::ResultJournal journal(path, true, 3);
+		ASSERT(journal.getResumed().size() == 2 && journal.getResumed()[0].status == simpletest::TestResult::CRASHED);
+	}
+
+	// a journal for another number of tests starts over
+	{
+		simpletest::ResultJournal journal(path, true, 4);
+		ASSERT(journal.isStale() && journal.getResumed().empty());
+		journal.remove();
+	}
+	ASSERT(access(path.c_str(), F_OK) != 0);
+}
+
 UNIT_TEST(FAIL_arithmetic1){
 	ASSERT(2 + 1 == 4);
 }
@@ -118,6 +898,13 @@ UNIT_TEST(FAIL_segfault){
 	*q = 0xF00BA4;
 }
 
+TEST_LIMITS(FAIL_memory_limit, "memory=64M");
+UNIT_TEST(FAIL_memory_limit){
+	// throws std::bad_alloc, which is reported as running into the limit
+	std::vector<char> big((size_t)256 << 20, 'x');
+	ASSERT(big.back() == 'x');
+}
+
 int main(int argc, char** argv){
 	return EXECUTE_TESTS();
 }
@@ -0,0 +1,1440 @@
+/** @file simpletest-run.cpp
+ * @brief simpletest-run, which runs the tests of many test programs on one pool of workers.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+// TestResult, describeCrash(), describeLimitCrash()
+#include "simpletest_runner.hpp"
+// ResultRing
+#include "simpletest_ring.hpp"
+// reportBenchmark(), printBenchmarks()
+#include "simpletest_benchmark.hpp"
+// appendHistory(), queryHistory()
+#include "simpletest_history.hpp"
+// listenOn(), connectTo(), AgentJob
+#include "simpletest_agent.hpp"
+
+// std::sort
+#include <algorithm>
+// std::chrono
+#include <chrono>
+// std::deque
+#include <deque>
+// std::cout, std::cerr
+#include <iostream>
+// std::setw
+#include <iomanip>
+// std::map
+#include <map>
+// std::runtime_error, std::invalid_argument
+#include <stdexcept>
+// std::string
+#include <string>
+// std::thread::hardware_concurrency()
+#include <thread>
+// std::vector
+#include <vector>
+// SIZE_MAX, uint64_t
+#include <cstdint>
+// std::strerror
+#include <cstring>
+// signal()
+#include <csignal>
+// opendir(), readdir()
+#include <dirent.h>
+// open(), fcntl()
+#include <fcntl.h>
+// poll()
+#include <poll.h>
+// posix_spawn()
+#include <spawn.h>
+// socketpair(), accept4()
+#include <sys/socket.h>
+// stat()
+#include <sys/stat.h>
+// waitpid()
+#include <sys/wait.h>
+// read(), write(), close(), access()
+#include <unistd.h>
+
+extern char** environ;
+
+using namespace simpletest;
+
+/**
+ * @brief A test program and the tests it contains.
+ */
+struct Binary{
+	/**
+	 * @brief The program's path.
+	 */
+	std::string path;
+
+	/**
+	 * @brief The names of its tests, in registration order.
+	 */
+	std::vector<std::string> tests;
+
+	/**
+	 * @brief The indexes of the tests that have not been handed to a worker yet.
+	 */
+	std::deque<size_t> pending;
+
+	/**
+	 * @brief The results of each test's runs so far, until all of them are in.
+	 */
+	std::vector<std::vector<TestResult>> runs;
+
+	/**
+	 * @brief The number of runs of each test that are pending or running.
+	 */
+	std::vector<size_t> remaining;
+
+	/**
+	 * @brief The number of times each test was retried.
+	 */
+	std::vector<size_t> retried;
+
+	/**
+	 * @brief The number of workers running this program.
+	 */
+	size_t workers = 0;
+};
+
+/**
+ * @brief A test program started with --worker, which runs one test at a time on request.
+ */
+struct Worker{
+	/**
+	 * @brief The index of the program in the list of binaries.
+	 */
+	size_t binary;
+
+	/**
+	 * @brief The worker's process id.
+	 */
+	pid_t pid;
+
+	/**
+	 * @brief The socket connected to the worker. Test indexes are sent over it, and the worker rings it when the driver is waiting for results.
+	 */
+	int fd;
+
+	/**
+	 * @brief The shared memory the worker reports test starts and results on.
+	 */
+	ResultRing ring;
+
+	/**
+	 * @brief True while the worker is running a test.
+	 */
+	bool busy = false;
+
+	/**
+	 * @brief The test the worker is running.
+	 */
+	size_t current = 0;
+
+	/**
+	 * @brief True if a test that is going to be retried failed in this worker, so it is replaced instead of running more tests.
+	 */
+	bool retire = false;
+
+	/**
+	 * @brief The coordinator's id for the test the worker is running, under --agent.
+	 */
+	uint64_t job = 0;
+};
+
+/**
+ * @brief An agent connected to the coordinator under --serve.
+ */
+struct Agent{
+	/**
+	 * @brief The connection to the agent.
+	 */
+	int fd;
+
+	/**
+	 * @brief Bytes received from the agent that do not make up a whole message yet.
+	 */
+	std::string received;
+
+	/**
+	 * @brief The number of tests the agent runs at once, or 0 until it has introduced itself.
+	 */
+	size_t slots = 0;
+
+	/**
+	 * @brief The program the agent was last given a test of, whose workers it has warm.
+	 */
+	size_t lastBinary = SIZE_MAX;
+
+	/**
+	 * @brief The program and test of each job the agent is running, by id.
+	 */
+	std::map<uint64_t, std::pair<size_t, size_t>> running;
+};
+
+/**
+ * @brief A finished test, along with the program it came from.
+ */
+struct Finished{
+	/**
+	 * @brief The index of the program in the list of binaries.
+	 */
+	size_t binary;
+
+	/**
+	 * @brief The test's result.
+	 */
+	TestResult result;
+};
+
+/**
+ * @brief The driver's command-line options.
+ */
+struct RunOptions{
+	/**
+	 * @brief The test programs, and directories to search for them.
+	 */
+	std::vector<std::string> paths;
+
+	/**
+	 * @brief Only programs whose file name contains this are run from directories.
+	 */
+	std::string match;
+
+	/**
+	 * @brief The most tests to run at once.
+	 */
+	size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+
+	/**
+	 * @brief The resource limits to give every test that does not set its own, or empty for none.
+	 */
+	std::string limits;
+
+	/**
+	 * @brief How many more times to run a test that did not pass, each time in a new worker.
+	 */
+	size_t retries = 0;
+
+	/**
+	 * @brief The number of times to run each test.
+	 */
+	size_t repeat = 1;
+
+	/**
+	 * @brief The history file to append the outcome of the run to, or empty for none.
+	 */
+	std::string history;
+
+	/**
+	 * @brief A query to answer from the history file instead of running the tests, or empty to run them.
+	 */
+	std::string query;
+
+	/**
+	 * @brief True to only print the tests that would be run.
+	 */
+	bool list = false;
+
+	/**
+	 * @brief The address to hand the tests out to agents on instead of running them, or empty to run them here.
+	 */
+	std::string serve;
+
+	/**
+	 * @brief The address of a coordinator to run tests for, or empty to run the given programs.
+	 */
+	std::string agent;
+
+	/**
+	 * @brief True if --jobs was given.
+	 */
+	bool jobsGiven = false;
+
+	/**
+	 * @brief True if --help was given.
+	 */
+	bool help = false;
+};
+
+/**
+ * @brief Prints the driver's usage.
+ */
+static void printUsage(const char* progName){
+	std::cout << "Usage: " << progName << " [options] PROGRAM|DIRECTORY..." << std::endl;
+	std::cout << std::endl;
+	std::cout << "Runs the tests of many simpletest programs on one pool of workers and prints one combined report." << std::endl;
+	std::cout << "Directories are searched recursively for executable files." << std::endl;
+	std::cout << std::endl;
+	std::cout << "Options:" << std::endl;
+	std::cout << "  -h, --help      Shows this help text." << std::endl;
+	std::cout << "  --jobs=N        Runs up to N tests at once. Defaults to the number of CPUs." << std::endl;
+	std::cout << "  --match=TEXT    Only runs programs found in directories whose file name contains TEXT." << std::endl;
+	std::cout << "  --limits=SPEC   Limits what each test may use, as with the --limits option of the test programs." << std::endl;
+	std::cout << "  --list          Prints the tests that would be run without running them." << std::endl;
+	std::cout << "  --retries=N     Runs a test that did not pass up to N more times in a new worker. A test that passes on a retry is flaky." << std::endl;
+	std::cout << "  --repeat=N      Runs each test N times, on as many workers as are free. A test that passes only some of the times is flaky." << std::endl;
+	std::cout << "  --history=FILE  Appends the outcome of each test to FILE, naming tests \"PROGRAM: TEST\"." << std::endl;
+	std::cout << "  --query=QUERY   Answers QUERY from the --history file instead of running the tests, as with the test programs." << std::endl;
+	std::cout << "  --serve=ADDR    Hands the tests out one at a time to agents connecting to ADDR, unix:PATH or HOST:PORT, instead of" << std::endl;
+	std::cout << "                  running them here. The programs must have the same paths on the agents' hosts." << std::endl;
+	std::cout << "  --agent=ADDR    Runs tests for the coordinator at ADDR on up to --jobs workers until it is done. Takes no programs." << std::endl;
+}
+
+/**
+ * @brief Parses a positive whole number given to an option.
+ *
+ * @exception std::invalid_argument value is not a positive whole number.
+ */
+static size_t parseCount(const std::string& value, const char* name){
+	size_t pos = 0;
+	size_t n = 0;
+
+	try{
+		n = std::stoul(value, &pos);
+	}
+	catch (std::exception&){
+		pos = 0;
+	}
+	if (pos == 0 || pos != value.size() || value[0] == '-' || n == 0){
+		throw std::invalid_argument(std::string(name) + " requires a positive integer");
+	}
+	return n;
+}
+
+/**
+ * @brief Parses the driver's command-line options.
+ *
+ * @exception std::invalid_argument The options are invalid.
+ */
+static RunOptions parseRunOptions(int argc, char** argv){
+	RunOptions opt;
+
+	for (int i = 1; i < argc; ++i){
+		std::string arg = argv[i];
+
+		if (arg == "-h" || arg == "--help"){
+			opt.help = true;
+		}
+		else if (arg == "--list"){
+			opt.list = true;
+		}
+		else if (arg.compare(0, 7, "--jobs=") == 0){
+			opt.jobs = parseCount(arg.substr(7), "--jobs");
+			opt.jobsGiven = true;
+		}
+		else if (arg.compare(0, 10, "--retries=") == 0){
+			opt.retries = parseCount(arg.substr(10), "--retries");
+		}
+		else if (arg.compare(0, 9, "--repeat=") == 0){
+			opt.repeat = parseCount(arg.substr(9), "--repeat");
+		}
+		else if (arg.compare(0, 8, "--match=") == 0){
+			opt.match = arg.substr(8);
+		}
+		else if (arg.compare(0, 9, "--limits=") == 0){
+			// checked here, so a typo is not reported once per worker
+			if (parseLimits(arg.substr(9)).empty()){
+				throw std::invalid_argument("--limits requires limits such as memory=512M,cpu=10s");
+			}
+			opt.limits = arg.substr(9);
+		}
+		else if (arg.compare(0, 10, "--history=") == 0 && arg.size() > 10){
+			opt.history = arg.substr(10);
+		}
+		else if (arg.compare(0, 8, "--query=") == 0 && arg.size() > 8){
+			opt.query = arg.substr(8);
+		}
+		else if (arg.compare(0, 8, "--serve=") == 0 && arg.size() > 8){
+			opt.serve = arg.substr(8);
+		}
+		else if (arg.compare(0, 8, "--agent=") == 0 && arg.size() > 8){
+			opt.agent = arg.substr(8);
+		}
+		else if (arg.compare(0, 2, "--") == 0){
+			throw std::invalid_argument("Unrecognized option " + arg);
+		}
+		else{
+			opt.paths.push_back(arg);
+		}
+	}
+	if (!opt.query.empty() && opt.history.empty()){
+		throw std::invalid_argument("--query requires --history");
+	}
+	if (!opt.agent.empty()){
+		if (!opt.paths.empty() || !opt.serve.empty() || opt.list || !opt.limits.empty() || opt.retries != 0 || opt.repeat != 1 || !opt.history.empty() || !opt.query.empty()){
+			throw std::invalid_argument("--agent takes its tests and how to run them from the coordinator, so it only combines with --jobs");
+		}
+		return opt;
+	}
+	if (!opt.serve.empty() && opt.jobsGiven){
+		throw std::invalid_argument("--serve runs as many tests at once as the agents have --jobs, so it does not take --jobs itself");
+	}
+	if (opt.paths.empty() && !opt.help && opt.query.empty()){
+		throw std::invalid_argument("No test programs given");
+	}
+	return opt;
+}
+
+/**
+ * @brief Finds the test programs in a directory, recursively.
+ *
+ * @param dir The directory.
+ * @param match Only file names containing this are returned.
+ * @param out The programs' paths are appended to this.
+ */
+static void findPrograms(const std::string& dir, const std::string& match, std::vector<std::string>& out){
+	DIR* d = opendir(dir.c_str());
+	struct dirent* de;
+
+	if (!d){
+		throw std::runtime_error("Failed to open directory " + dir + " (" + std::strerror(errno) + ")");
+	}
+	while ((de = readdir(d)) != nullptr){
+		std::string name = de->d_name;
+		std::string path = dir + (dir.back() == '/' ? "" : "/") + name;
+		struct stat st;
+
+		// skips ".", "..", hidden files and build directories like .git
+		if (name[0] == '.' || stat(path.c_str(), &st) != 0){
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)){
+			findPrograms(path, match, out);
+		}
+		else if (S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0 && name.find(match) != std::string::npos){
+			size_t dot = name.find_last_of('.');
+			std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+
+			// shared libraries and scripts are often executable too
+			if (ext != ".so" && ext != ".sh" && ext != ".py" && name.find(".so.") == std::string::npos){
+				out.push_back(path);
+			}
+		}
+	}
+	closedir(d);
+}
+
+/**
+ * @brief Starts a test program with its stdin from /dev/null.
+ *
+ * @param path The program.
+ * @param args The arguments to give it.
+ * @param out The file descriptor to use as its stdout.
+ * @param worker A socket to give it as file descriptor 3, or -1 for none.
+ * @param ring A ResultRing to give it as file descriptor 4, or -1 for none.
+ *
+ * @return Its process id.
+ */
+static pid_t spawnProgram(const std::string& path, const std::vector<std::string>& args, int out, int worker, int ring){
+	posix_spawn_file_actions_t fa;
+	std::vector<char*> argv;
+	pid_t pid;
+	int res;
+
+	argv.push_back(const_cast<char*>(path.c_str()));
+	for (const std::string& arg : args){
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+	if (worker >= 0){
+		posix_spawn_file_actions_adddup2(&fa, worker, 3);
+	}
+	if (ring >= 0){
+		posix_spawn_file_actions_adddup2(&fa, ring, 4);
+	}
+	res = posix_spawn(&pid, path.c_str(), &fa, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (res != 0){
+		throw std::runtime_error("Failed to start " + path + " (" + std::strerror(res) + ")");
+	}
+	return pid;
+}
+
+/**
+ * @brief The longest a program may take to list its tests before it is skipped.
+ */
+static const std::chrono::seconds listTimeout(10);
+
+/**
+ * @brief A program that is listing its tests.
+ */
+struct Listing{
+	/**
+	 * @brief The program's index in the list of programs.
+	 */
+	size_t program;
+
+	/**
+	 * @brief Its process id.
+	 */
+	pid_t pid;
+
+	/**
+	 * @brief The read end of its stdout.
+	 */
+	int fd;
+
+	/**
+	 * @brief What it printed so far.
+	 */
+	std::string out;
+
+	/**
+	 * @brief When it is killed if it has not finished.
+	 */
+	std::chrono::steady_clock::time_point deadline;
+};
+
+/**
+ * @brief Splits a program's --list output into its test names.
+ */
+static std::vector<std::string> splitLines(const std::string& out){
+	std::vector<std::string> tests;
+	std::string line;
+
+	for (char c : out){
+		if (c == '\n'){
+			tests.push_back(line);
+			line.clear();
+		}
+		else{
+			line += c;
+		}
+	}
+	return tests;
+}
+
+/**
+ * @brief Asks test programs for their tests with --list, up to jobs of them at once.
+ * A directory of test programs usually has other executables in it too, so a program that cannot be started, does not exit successfully, or takes longer than listTimeout is skipped with a warning instead of stopping the run.
+ *
+ * @param programs The programs.
+ * @param jobs The most programs to run at once.
+ * @param tests Set to the tests of each program, in the same order.
+ *
+ * @return For each program, false if it was skipped.
+ */
+static std::vector<bool> listTests(const std::vector<std::string>& programs, size_t jobs, std::vector<std::vector<std::string>>& tests){
+	std::vector<bool> listed(programs.size(), false);
+	std::vector<Listing> running;
+	size_t next = 0;
+
+	tests.assign(programs.size(), {});
+	while (next < programs.size() || !running.empty()){
+		std::vector<struct pollfd> pfds;
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::milliseconds wait = listTimeout;
+
+		while (next < programs.size() && running.size() < jobs){
+			Listing l;
+			int fds[2];
+
+			l.program = next++;
+			if (pipe2(fds, O_CLOEXEC) != 0){
+				throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+			}
+			try{
+				l.pid = spawnProgram(programs[l.program], {"--list"}, fds[1], -1, -1);
+			}
+			catch (std::exception& e){
+				close(fds[0]);
+				close(fds[1]);
+				std::cerr << "Skipping " << programs[l.program] << ": " << e.what() << std::endl;
+				continue;
+			}
+			close(fds[1]);
+			l.fd = fds[0];
+			l.deadline = now + listTimeout;
+			running.push_back(std::move(l));
+		}
+
+		for (const Listing& l : running){
+			pfds.push_back({l.fd, POLLIN, 0});
+			// rounded up, so the program is past its deadline when poll() returns
+			wait = std::min(wait, std::chrono::duration_cast<std::chrono::milliseconds>(l.deadline - now) + std::chrono::milliseconds(1));
+		}
+		if (pfds.empty()){
+			continue;
+		}
+		if (poll(pfds.data(), pfds.size(), std::max<int64_t>(wait.count(), 0)) < 0 && errno != EINTR){
+			throw std::runtime_error("Failed to poll (" + std::string(std::strerror(errno)) + ")");
+		}
+
+		now = std::chrono::steady_clock::now();
+		for (size_t i = pfds.size(); i-- > 0;){
+			Listing& l = running[i];
+			const std::string& path = programs[l.program];
+			bool done = false;
+			bool late = false;
+			int status;
+
+			if (pfds[i].revents != 0){
+				char buf[4096];
+				ssize_t ss = read(l.fd, buf, sizeof(buf));
+
+				if (ss > 0){
+					l.out.append(buf, ss);
+				}
+				done = ss == 0 || (ss < 0 && errno != EINTR && errno != EAGAIN);
+			}
+			if (!done && now >= l.deadline){
+				// a program that is not a simpletest program may just wait for input or run forever
+				kill(l.pid, SIGKILL);
+				done = late = true;
+			}
+			if (!done){
+				continue;
+			}
+
+			close(l.fd);
+			while (waitpid(l.pid, &status, 0) < 0 && errno == EINTR);
+			if (late){
+				std::cerr << "Skipping " << path << ": --list took longer than " << listTimeout.count() << "s; is it a simpletest program?" << std::endl;
+			}
+			else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+				std::cerr << "Skipping " << path << ": --list failed; is it a simpletest program?" << std::endl;
+			}
+			else{
+				tests[l.program] = splitLines(l.out);
+				listed[l.program] = true;
+			}
+			running.erase(running.begin() + i);
+		}
+	}
+	return listed;
+}
+
+/**
+ * @brief Starts a worker for a test program.
+ */
+static Worker startWorker(const std::string& path, size_t binary, const std::string& limits){
+	int sv[2];
+	int devnull;
+	int childEnd;
+	int ringFd;
+	std::vector<std::string> args = {"--worker=3", "--ring=4"};
+	Worker w;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0){
+		throw std::runtime_error("Failed to create socket (" + std::string(std::strerror(errno)) + ")");
+	}
+	// move the child's ends out of the way, so dup2() onto fds 3 and 4 always clears their close-on-exec flags
+	childEnd = fcntl(sv[1], F_DUPFD_CLOEXEC, 10);
+	close(sv[1]);
+	ringFd = fcntl(w.ring.getFd(), F_DUPFD_CLOEXEC, 10);
+	// test output that is not captured is not part of the report
+	devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	try{
+		if (!limits.empty()){
+			args.push_back("--limits=" + limits);
+		}
+		w.pid = spawnProgram(path, args, devnull, childEnd, ringFd);
+	}
+	catch (...){
+		close(sv[0]);
+		close(childEnd);
+		close(ringFd);
+		close(devnull);
+		throw;
+	}
+	close(childEnd);
+	close(ringFd);
+	close(devnull);
+
+	w.binary = binary;
+	w.fd = sv[0];
+	return w;
+}
+
+/**
+ * @brief Prints how a test ended, for example "Passed" or "Failed: [reason]".
+ */
+static void printOutcome(const TestResult& res){
+	if (res.status == TestResult::PASSED){
+		std::cout << "Passed";
+	}
+	else if (res.status == TestResult::FAILED){
+		std::cout << "Failed: " << res.reason;
+	}
+	else{
+		std::cout << res.reason;
+	}
+}
+
+/**
+ * @brief Returns the number of tests of all programs.
+ */
+static size_t countTests(const std::vector<Binary>& binaries){
+	size_t total = 0;
+
+	for (const Binary& b : binaries){
+		total += b.tests.size();
+	}
+	return total;
+}
+
+/**
+ * @brief Returns the length of the longest "PROGRAM: TEST" name, which results are aligned to.
+ */
+static size_t longestName(const std::vector<Binary>& binaries){
+	size_t nameLen = 0;
+
+	for (const Binary& b : binaries){
+		for (const std::string& t : b.tests){
+			nameLen = std::max(nameLen, b.path.size() + t.size() + 2);
+		}
+	}
+	return nameLen;
+}
+
+/**
+ * @brief Takes in the result of one run of a test. Once all of its runs are in, it is printed and added to the finished tests, or queued to run again if --retries allows.
+ *
+ * @param binaries The programs.
+ * @param opt The options, which give how often to retry a test.
+ * @param nameLen The length to align test names to.
+ * @param binary The index of the test's program.
+ * @param run The result of the run. It is moved from.
+ * @param finished The finished tests.
+ *
+ * @return True if the test was queued to run again, at the front of its program's pending tests.
+ */
+static bool reportRun(std::vector<Binary>& binaries, const RunOptions& opt, size_t nameLen, size_t binary, TestResult& run, std::vector<Finished>& finished){
+	Binary& b = binaries[binary];
+	size_t i = run.index;
+	TestResult res;
+	std::string name = b.path + ": " + b.tests[i];
+
+	b.runs[i].push_back(std::move(run));
+	if (--b.remaining[i] > 0){
+		return false;
+	}
+	if (b.retried[i] < opt.retries && std::none_of(b.runs[i].begin(), b.runs[i].end(), [](const TestResult& r){ return r.status == TestResult::PASSED; })){
+		b.retried[i]++;
+		b.remaining[i]++;
+		b.pending.push_front(i);
+		return true;
+	}
+	res = summarizeRuns(b.runs[i]);
+	b.runs[i].clear();
+
+	std::cout << name;
+	for (size_t i = 0; i < nameLen - name.size() + 3; ++i){
+		std::cout << '.';
+	}
+	printOutcome(res);
+	std::cout << std::endl;
+	for (const Benchmark& b : res.benchmarks){
+		reportBenchmark(b);
+	}
+	finished.push_back({binary, res});
+	return false;
+}
+
+/**
+ * @brief Runs every pending test of every program on a pool of workers.
+ * Each worker runs tests of one program and stays alive between them. When a worker's program has no tests left, the worker is stopped and its slot goes to the program with the most pending tests per worker, so a few long programs do not leave the rest of the machine idle at the end of the run.
+ *
+ * A test that runs more than once because of --retries or --repeat is reported once, with its runs combined by summarizeRuns().
+ *
+ * @param binaries The programs.
+ * @param opt The options, which give the most workers to run at once, the resource limits to pass to them, and how often to run each test.
+ *
+ * @return The results, in the order the tests finished.
+ */
+static std::vector<Finished> runAll(std::vector<Binary>& binaries, const RunOptions& opt){
+	std::vector<Finished> finished;
+	std::vector<Worker> workers;
+	size_t total = countTests(binaries);
+	size_t nameLen = longestName(binaries);
+
+	// returns true if the test was queued to run again instead
+	auto report = [&](size_t binary, TestResult& run){
+		return reportRun(binaries, opt, nameLen, binary, run, finished);
+	};
+	// closing the socket makes the worker exit
+	auto stopWorker = [&](size_t i, bool reap){
+		close(workers[i].fd);
+		if (reap){
+			while (waitpid(workers[i].pid, nullptr, 0) < 0 && errno == EINTR);
+		}
+		binaries[workers[i].binary].workers--;
+		workers.erase(workers.begin() + i);
+	};
+	auto dispatch = [&](Worker& w){
+		uint64_t index = binaries[w.binary].pending.front();
+		const char* ptr = (const char*)&index;
+		size_t len = sizeof(index);
+
+		binaries[w.binary].pending.pop_front();
+		w.busy = true;
+		w.current = index;
+		while (len > 0){
+			ssize_t ss = write(w.fd, ptr, len);
+			if (ss < 0 && errno == EINTR){
+				continue;
+			}
+			if (ss <= 0){
+				// the worker is gone; the poll loop reports the test as crashed
+				break;
+			}
+			ptr += ss;
+			len -= ss;
+		}
+	};
+
+	auto drain = [&](Worker& w){
+		uint64_t index;
+		TestResult res;
+
+		while (w.ring.next(index, res)){
+			res.index = index;
+			w.busy = false;
+			if (report(w.binary, res)){
+				// whatever the failed run left behind in this worker must not decide the retry
+				w.retire = true;
+			}
+		}
+	};
+
+	while (finished.size() < total){
+		std::vector<struct pollfd> pfds;
+		bool canWait = true;
+
+		for (Worker& w : workers){
+			drain(w);
+		}
+		if (finished.size() == total){
+			break;
+		}
+
+		// give idle workers another test of their program, or stop them if it has none left
+		for (size_t i = workers.size(); i-- > 0; ){
+			if (!workers[i].busy){
+				if (binaries[workers[i].binary].pending.empty() || workers[i].retire){
+					stopWorker(i, true);
+				}
+				else{
+					dispatch(workers[i]);
+				}
+			}
+		}
+
+		// then start workers for the programs with the most pending tests per worker
+		while (workers.size() < opt.jobs){
+			size_t best = binaries.size();
+			double bestLoad = 0;
+
+			for (size_t b = 0; b < binaries.size(); ++b){
+				double load = (double)binaries[b].pending.size() / (binaries[b].workers + 1);
+				if (binaries[b].pending.size() > 0 && load > bestLoad){
+					best = b;
+					bestLoad = load;
+				}
+			}
+			if (best == binaries.size()){
+				break;
+			}
+
+			workers.push_back(startWorker(binaries[best].path, best, opt.limits));
+			binaries[best].workers++;
+			dispatch(workers.back());
+		}
+
+		for (Worker& w : workers){
+			pfds.push_back({w.fd, POLLIN, 0});
+			// every ring must agree before sleeping, or a result could arrive without a doorbell
+			if (canWait && !w.ring.prepareToWait()){
+				canWait = false;
+			}
+		}
+		if (poll(pfds.data(), pfds.size(), canWait ? -1 : 0) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			throw std::runtime_error("Failed to poll workers (" + std::string(std::strerror(errno)) + ")");
+		}
+
+		for (size_t i = pfds.size(); i-- > 0; ){
+			Worker& w = workers[i];
+			char buf[256];
+			ssize_t ss;
+			uint64_t index;
+			std::chrono::nanoseconds elapsed{-1};
+			TestResult res;
+
+			if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))){
+				continue;
+			}
+			ss = read(w.fd, buf, sizeof(buf));
+			if (ss != 0){
+				// doorbell bytes carry no data; the results are read from the ring at the top of the loop
+				continue;
+			}
+
+			// the worker exited, which only happens on purpose once its socket is closed
+			int status = 0;
+			while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR);
+			// anything the worker reported before dying is still in the ring
+			drain(w);
+			if (w.busy){
+				w.ring.running(index, elapsed);
+				res = TestResult();
+				res.index = w.current;
+				// the worker applied the limits itself, so only the signals the kernel sends for them tell
+				res.reason = describeLimitCrash(status, ResourceLimits());
+				res.status = TestResult::LIMIT_EXCEEDED;
+				if (res.reason.empty()){
+					res.status = TestResult::CRASHED;
+					res.reason = describeCrash(status, elapsed);
+				}
+				report(w.binary, res);
+			}
+			stopWorker(i, false);
+		}
+	}
+
+	for (size_t i = workers.size(); i-- > 0; ){
+		stopWorker(i, true);
+	}
+	return finished;
+}
+
+/**
+ * @brief Writes all of a message to a socket.
+ *
+ * @return False if the other end is gone.
+ */
+static bool sendAll(int fd, const std::string& msg){
+	const char* ptr = msg.data();
+	size_t len = msg.size();
+
+	while (len > 0){
+		ssize_t ss = write(fd, ptr, len);
+		if (ss < 0 && errno == EINTR){
+			continue;
+		}
+		if (ss <= 0){
+			return false;
+		}
+		ptr += ss;
+		len -= ss;
+	}
+	return true;
+}
+
+/**
+ * @brief Hands every pending test of every program out to agents that connect to opt.serve, one test per free slot of theirs at a time, until all of them are finished.
+ * An idle slot is given the next test of the program its agent last ran if it has any, so the agent's workers stay warm, or else the next test of the program with the most left. Since no agent holds more tests than it has slots, an agent with free slots takes the next test that any other would have.
+ * When an agent disconnects, the tests it was running go back to the front of the queue, without counting as a run, for the other agents or one that connects later.
+ *
+ * @param binaries The programs.
+ * @param opt The options, which give the address, the resource limits to pass to the agents' workers, and how often to run each test.
+ * @param slots Set to the most tests the connected agents could run at once.
+ *
+ * @return The results, in the order the tests finished.
+ *
+ * @exception std::runtime_error Failed to listen on the address.
+ */
+static std::vector<Finished> serveAgents(std::vector<Binary>& binaries, const RunOptions& opt, size_t& slots){
+	std::vector<Finished> finished;
+	std::vector<Agent> agents;
+	size_t total = countTests(binaries);
+	size_t nameLen = longestName(binaries);
+	uint64_t nextJob = 0;
+	int listenFd = listenOn(opt.serve);
+
+	auto dropAgent = [&](size_t i){
+		Agent& a = agents[i];
+
+		if (!a.running.empty()){
+			std::cerr << "Lost an agent; requeueing its " << a.running.size() << " tests" << std::endl;
+		}
+		// not a run of theirs, so they go back as if never handed out
+		for (const auto& job : a.running){
+			binaries[job.second.first].pending.push_front(job.second.second);
+		}
+		close(a.fd);
+		agents.erase(agents.begin() + i);
+	};
+
+	slots = 0;
+	std::cout << "Waiting for agents on " << opt.serve << std::endl;
+	while (finished.size() < total){
+		std::vector<struct pollfd> pfds;
+		size_t connected = 0;
+
+		// fill every free slot
+		for (size_t i = agents.size(); i-- > 0; ){
+			Agent& a = agents[i];
+
+			while (a.running.size() < a.slots){
+				size_t best = binaries.size();
+				AgentJob job;
+
+				if (a.lastBinary < binaries.size() && !binaries[a.lastBinary].pending.empty()){
+					best = a.lastBinary;
+				}
+				for (size_t b = 0; best != a.lastBinary && b < binaries.size(); ++b){
+					if (!binaries[b].pending.empty() && (best == binaries.size() || binaries[b].pending.size() > binaries[best].pending.size())){
+						best = b;
+					}
+				}
+				if (best == binaries.size()){
+					break;
+				}
+
+				job.id = nextJob++;
+				job.program = binaries[best].path;
+				job.index = binaries[best].pending.front();
+				job.limits = opt.limits;
+				// whatever the failed run left behind in a worker must not decide the retry
+				job.fresh = binaries[best].retried[job.index] > 0;
+				binaries[best].pending.pop_front();
+				a.running[job.id] = {best, job.index};
+				a.lastBinary = best;
+				if (!sendAll(a.fd, encodeJob(job))){
+					// the poll below sees it hang up
+					break;
+				}
+			}
+			connected += a.slots;
+		}
+		slots = std::max(slots, connected);
+
+		pfds.push_back({listenFd, POLLIN, 0});
+		for (const Agent& a : agents){
+			pfds.push_back({a.fd, POLLIN, 0});
+		}
+		if (poll(pfds.data(), pfds.size(), -1) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			closeListener(listenFd, opt.serve);
+			throw std::runtime_error("Failed to poll agents (" + std::string(std::strerror(errno)) + ")");
+		}
+
+		for (size_t i = pfds.size(); i-- > 1; ){
+			Agent& a = agents[i - 1];
+			char buf[65536];
+			ssize_t ss;
+			uint64_t id;
+			uint32_t n;
+			TestResult res;
+
+			if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))){
+				continue;
+			}
+			ss = read(a.fd, buf, sizeof(buf));
+			if (ss < 0 && errno == EINTR){
+				continue;
+			}
+			if (ss <= 0){
+				dropAgent(i - 1);
+				continue;
+			}
+			a.received.append(buf, ss);
+
+			if (a.slots == 0){
+				if (!decodeHello(a.received, n)){
+					continue;
+				}
+				a.slots = std::max<uint32_t>(n, 1);
+			}
+			while (decodeResult(a.received, id, res)){
+				auto it = a.running.find(id);
+
+				if (it == a.running.end()){
+					continue;
+				}
+				res.index = it->second.second;
+				reportRun(binaries, opt, nameLen, it->second.first, res, finished);
+				a.running.erase(it);
+			}
+		}
+
+		if (pfds[0].revents & POLLIN){
+			int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+
+			if (fd >= 0){
+				Agent a;
+
+				tuneConnection(fd);
+				a.fd = fd;
+				agents.push_back(std::move(a));
+			}
+		}
+	}
+
+	// closing the connections tells the agents they are done
+	for (const Agent& a : agents){
+		close(a.fd);
+	}
+	closeListener(listenFd, opt.serve);
+	return finished;
+}
+
+/**
+ * @brief Runs tests for the coordinator at opt.agent on up to opt.jobs workers, until it closes the connection.
+ * Workers are started like the ones simpletest-run starts for its own programs, and stay alive between tests of the same program. When a test of another program arrives and every worker is in use or there are opt.jobs of them, an idle worker of another program is stopped to make room. A worker that dies mid-test reports the test as crashed to the coordinator.
+ * The connection is retried for 10 seconds, so the agents and the coordinator can be started in any order.
+ *
+ * @param opt The options, which give the address and the number of workers.
+ *
+ * @return 0 once the coordinator is done.
+ *
+ * @exception std::runtime_error Failed to connect to the coordinator or start a worker.
+ */
+static int runAgent(const RunOptions& opt){
+	std::vector<Worker> workers;
+	std::vector<std::string> programs;
+	std::string received;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	int fd = -1;
+
+	while (fd < 0){
+		try{
+			fd = connectTo(opt.agent);
+		}
+		catch (std::runtime_error&){
+			if (std::chrono::steady_clock::now() >= deadline){
+				throw;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		}
+	}
+
+	// closing the socket makes the worker exit
+	auto stopWorker = [&](size_t i){
+		close(workers[i].fd);
+		while (waitpid(workers[i].pid, nullptr, 0) < 0 && errno == EINTR);
+		workers.erase(workers.begin() + i);
+	};
+	auto drain = [&](Worker& w){
+		uint64_t index;
+		TestResult res;
+
+		while (w.ring.next(index, res)){
+			w.busy = false;
+			sendAll(fd, encodeResult(w.job, res));
+		}
+	};
+	auto run = [&](const AgentJob& job){
+		size_t program = std::find(programs.begin(), programs.end(), job.program) - programs.begin();
+		auto idle = [&](const Worker& w){
+			return !w.busy && w.binary == program;
+		};
+		uint64_t index = job.index;
+		std::vector<Worker>::iterator it;
+
+		if (program == programs.size()){
+			programs.push_back(job.program);
+		}
+		if (job.fresh){
+			for (size_t i = workers.size(); i-- > 0; ){
+				if (idle(workers[i])){
+					stopWorker(i);
+				}
+			}
+		}
+		it = std::find_if(workers.begin(), workers.end(), idle);
+		if (it == workers.end()){
+			if (workers.size() >= opt.jobs){
+				auto other = std::find_if(workers.begin(), workers.end(), [](const Worker& w){ return !w.busy; });
+				if (other != workers.end()){
+					stopWorker(other - workers.begin());
+				}
+			}
+			workers.push_back(startWorker(job.program, program, job.limits));
+			it = workers.end() - 1;
+		}
+		it->busy = true;
+		it->current = index;
+		it->job = job.id;
+		// a worker that is gone is noticed by the poll loop, which reports the test as crashed
+		sendAll(it->fd, std::string((const char*)&index, sizeof(index)));
+	};
+
+	if (!sendAll(fd, encodeHello(opt.jobs))){
+		close(fd);
+		throw std::runtime_error("Lost the connection to " + opt.agent);
+	}
+	std::cout << "Running tests for " << opt.agent << " on up to " << opt.jobs << " workers" << std::endl;
+
+	for (;;){
+		std::vector<struct pollfd> pfds;
+		bool canWait = true;
+		AgentJob job;
+		char buf[65536];
+		ssize_t ss;
+
+		for (Worker& w : workers){
+			drain(w);
+		}
+
+		pfds.push_back({fd, POLLIN, 0});
+		for (Worker& w : workers){
+			pfds.push_back({w.fd, POLLIN, 0});
+			// every ring must agree before sleeping, or a result could arrive without a doorbell
+			if (canWait && !w.ring.prepareToWait()){
+				canWait = false;
+			}
+		}
+		if (poll(pfds.data(), pfds.size(), canWait ? -1 : 0) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			throw std::runtime_error("Failed to poll workers (" + std::string(std::strerror(errno)) + ")");
+		}
+
+		for (size_t i = pfds.size(); i-- > 1; ){
+			Worker& w = workers[i - 1];
+			uint64_t index;
+			std::chrono::nanoseconds elapsed{-1};
+			TestResult res;
+			int status = 0;
+
+			if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))){
+				continue;
+			}
+			ss = read(w.fd, buf, sizeof(buf));
+			if (ss != 0){
+				// doorbell bytes carry no data; the results are read from the ring at the top of the loop
+				continue;
+			}
+
+			while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR);
+			// anything the worker reported before dying is still in the ring
+			drain(w);
+			if (w.busy){
+				w.ring.running(index, elapsed);
+				res.index = w.current;
+				// the worker applied the limits itself, so only the signals the kernel sends for them tell
+				res.reason = describeLimitCrash(status, ResourceLimits());
+				res.status = TestResult::LIMIT_EXCEEDED;
+				if (res.reason.empty()){
+					res.status = TestResult::CRASHED;
+					res.reason = describeCrash(status, elapsed);
+				}
+				sendAll(fd, encodeResult(w.job, res));
+			}
+			close(w.fd);
+			workers.erase(workers.begin() + (i - 1));
+		}
+
+		if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+			ss = read(fd, buf, sizeof(buf));
+			if (ss < 0 && errno == EINTR){
+				continue;
+			}
+			// the coordinator is done, or gone and will requeue what was running here
+			if (ss <= 0){
+				break;
+			}
+			received.append(buf, ss);
+			while (decodeJob(received, job)){
+				run(job);
+			}
+		}
+	}
+
+	for (size_t i = workers.size(); i-- > 0; ){
+		stopWorker(i);
+	}
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char** argv){
+	RunOptions opt;
+	std::vector<std::string> programs;
+	std::vector<std::vector<std::string>> tests;
+	std::vector<bool> listed;
+	std::vector<Binary> binaries;
+	std::vector<Finished> finished;
+	std::vector<const Finished*> failed;
+	std::vector<const Finished*> flaky;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::nanoseconds busy{0};
+	double wall;
+	size_t total = 0;
+	size_t nameLen = 0;
+
+	try{
+		opt = parseRunOptions(argc, argv);
+	}
+	catch (std::invalid_argument& e){
+		std::cerr << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (opt.help){
+		printUsage(argv[0]);
+		return 0;
+	}
+
+	if (!opt.query.empty()){
+		try{
+			return queryHistory(opt.history, opt.query, std::cout);
+		}
+		catch (std::exception& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	// a worker that dies must not take the driver with it
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!opt.agent.empty()){
+		try{
+			return runAgent(opt);
+		}
+		catch (std::exception& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	try{
+		for (const std::string& path : opt.paths){
+			struct stat st;
+			if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+				findPrograms(path, opt.match, programs);
+			}
+			else{
+				programs.push_back(path);
+			}
+		}
+		std::sort(programs.begin(), programs.end());
+
+		listed = listTests(programs, opt.jobs, tests);
+		for (size_t p = 0; p < programs.size(); ++p){
+			Binary b;
+			if (!listed[p]){
+				continue;
+			}
+			b.path = programs[p];
+			b.tests = std::move(tests[p]);
+			// a test's runs are queued next to each other, so they run at the same time on different workers
+			for (size_t i = 0; i < b.tests.size(); ++i){
+				b.pending.insert(b.pending.end(), opt.repeat, i);
+			}
+			b.runs.resize(b.tests.size());
+			b.remaining.assign(b.tests.size(), opt.repeat);
+			b.retried.assign(b.tests.size(), 0);
+			total += b.tests.size();
+			binaries.push_back(std::move(b));
+		}
+
+		if (opt.list){
+			for (const Binary& b : binaries){
+				for (const std::string& t : b.tests){
+					std::cout << b.path << ": " << t << std::endl;
+				}
+			}
+			return 0;
+		}
+
+		start = std::chrono::steady_clock::now();
+		if (opt.serve.empty()){
+			finished = runAll(binaries, opt);
+		}
+		else{
+			finished = serveAgents(binaries, opt, opt.jobs);
+		}
+		wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	catch (std::exception& e){
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	for (const Finished& f : finished){
+		busy += f.result.duration * f.result.runs;
+		if (f.result.status == TestResult::FLAKY){
+			flaky.push_back(&f);
+		}
+		else if (f.result.status != TestResult::PASSED){
+			failed.push_back(&f);
+		}
+	}
+	for (std::vector<const Finished*>* list : {&failed, &flaky}){
+		std::sort(list->begin(), list->end(), [](const Finished* a, const Finished* b){
+			return a->binary != b->binary ? a->binary < b->binary : a->result.index < b->result.index;
+		});
+		for (const Finished* f : *list){
+			nameLen = std::max(nameLen, binaries[f->binary].path.size() + binaries[f->binary].tests[f->result.index].size() + 2);
+		}
+	}
+	auto printList = [&](const char* title, const std::vector<const Finished*>& list){
+		std::cout << title << std::endl;
+		for (const Finished* f : list){
+			std::string name = binaries[f->binary].path + ": " + binaries[f->binary].tests[f->result.index];
+			std::cout << name;
+			for (size_t i = 0; i < nameLen - name.size() + 3; ++i){
+				std::cout << '.';
+			}
+			printOutcome(f->result);
+			std::cout << std::endl;
+		}
+	};
+
+	std::cout << std::endl;
+	std::cout << "Results:" << std::endl;
+	std::cout << total - failed.size() - flaky.size() << " Passed" << std::endl;
+	if (!flaky.empty()){
+		std::cout << flaky.size() << " Flaky" << std::endl;
+	}
+	std::cout << failed.size() << " Failed" << std::endl;
+	std::cout << binaries.size() << " programs, " << std::fixed << std::setprecision(2) << wall << "s on " << opt.jobs << " workers";
+	if (wall > 0 && opt.jobs > 0){
+		std::cout << " (" << std::setprecision(0) << 100 * std::chrono::duration<double>(busy).count() / (wall * opt.jobs) << "% busy)";
+	}
+	std::cout << std::endl << std::endl;
+
+	// flaky tests pass, but they are listed so they get fixed
+	if (!flaky.empty()){
+		printList("Flaky tests:", flaky);
+		std::cout << std::endl;
+	}
+	if (failed.empty()){
+		std::cout << "No failed tests" << std::endl;
+	}
+	else{
+		printList("Failed tests:", failed);
+	}
+	printBenchmarks(std::cout);
+
+	if (!opt.history.empty()){
+		std::vector<HistoryRecord> records;
+		for (const Finished& f : finished){
+			std::vector<HistoryRecord> rec = makeHistoryRecords({f.result}, [&](const TestResult& res){
+				return binaries[f.binary].path + ": " + binaries[f.binary].tests[res.index];
+			});
+			records.push_back(std::move(rec[0]));
+		}
+		try{
+			appendHistory(opt.history, records);
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+		}
+	}
+
+	return std::min<size_t>(failed.size(), 255);
+}
@@ -8,17 +8,61 @@
 
 // prototypes, std::vector, std::runtime_error
 #include "simpletest.hpp"
+// parseOptions()
+#include "simpletest_options.hpp"
+// runForked(), serveTests()
+#include "simpletest_runner.hpp"
+// ResourceLimits, LimitScope
+#include "simpletest_limits.hpp"
+// ResourceWeights, parseWeights()
+#include "simpletest_scheduler.hpp"
+// recordSession()
+#include "simpletest_session.hpp"
+// appendHistory(), queryHistory()
+#include "simpletest_history.hpp"
+// CoverageMap, coverageReset(), coverageDump()
+#include "simpletest_coverage.hpp"
+// shuffleOrder(), TrialRunner, minimizeFailingPrefix()
+#include "simpletest_order.hpp"
+// TestSandbox, makeSandboxRoot()
+#include "simpletest_sandbox.hpp"
+// LeakAudit
+#include "simpletest_leaks.hpp"
+// SoakMonitor
+#include "simpletest_soak.hpp"
+// SuiteWatcher
+#include "simpletest_watch.hpp"
+// ResultJournal
+#include "simpletest_journal.hpp"
 
 // std::optional
 #include <optional>
-// std::for_each
+// std::set
+#include <set>
+// std::chrono
+#include <chrono>
+// std::for_each, std::find_if, std::remove_if, std::any_of, std::none_of, std::stable_partition
 #include <algorithm>
 // std::cout, std::cerr
 #include <iostream>
 // std::setw
 #include <iomanip>
-// std::strlen
+// std::strlen, std::strerror
 #include <cstring>
+// errno
+#include <cerrno>
+// getenv(), mkdtemp()
+#include <cstdlib>
+// access(), unlink(), rmdir()
+#include <unistd.h>
+// opendir(), readdir()
+#include <dirent.h>
+// lstat()
+#include <sys/stat.h>
+// fnmatch()
+#include <fnmatch.h>
+// sigaction(), sig_atomic_t
+#include <csignal>
 
 namespace simpletest{
 
@@ -48,7 +92,7 @@ public:
 	/**
 	 * @brief Constructs a UnitTest with an empty failure reason.
 	 */
-	UnitTest(void(*func)(IOCapturer&, SignalHandler&), const char* name): func(func), name(name){
+	UnitTest(void(*func)(IOCapturer&, SignalHandler&), const char* name, size_t suite): func(func), name(name), suite(suite){
 	}
 
 	/**
@@ -57,6 +101,7 @@ public:
 	UnitTest(const UnitTest& other){
 		func = other.func;
 		name = other.name;
+		suite = other.suite;
 	}
 
 	/**
@@ -77,9 +122,19 @@ public:
 		return name;
 	}
 
+	/**
+	 * @brief Gets the suite the test was registered by.
+	 *
+	 * @return 0 if it is part of the program, or 1 + the index of the --watch suite it was loaded from.
+	 */
+	size_t getSuite() const{
+		return suite;
+	}
+
 private:
 	void(*func)(IOCapturer&, SignalHandler&);
 	const char* name;
+	size_t suite;
 };
 
 /**
@@ -109,20 +164,23 @@ struct FailedTestInfo{
 };
 
 /**
- * @brief Prints the results of the testing.
+ * @brief Prints a list of tests with the reason each did not pass, lined up.
  *
- * @param __testvec The test vector retrieved through __gettestvec()
- * @param __failvec The tests that failed.
+ * @param __testvec_size The number of tests.
+ * @param title The heading, for example "Failed tests:".
+ * @param vec The tests to list, which must not be empty.
+ * @param prefix What goes before each reason, for example "Failed: ".
  */
-static void printResults(size_t __testvec_size, std::vector<FailedTestInfo>& __failvec){
-	size_t totalLen;
+static void printTestList(size_t __testvec_size, const char* title, const std::vector<FailedTestInfo>& vec, const char* prefix){
+	size_t maxLen = 0;
+
 	// first, determine the maximum length of the unit test names
 	// this is so we can put the correct number of '.''s so everything ends up aligned
 
 	// get the length of the first test
-	size_t maxLen = std::strlen(__failvec[0].name);
+	maxLen = std::strlen(vec[0].name);
 	// for each test from {1..end}
-	std::for_each(__failvec.begin() + 1, __failvec.end(), [&maxLen](const auto& elem){
+	std::for_each(vec.begin() + 1, vec.end(), [&maxLen](const auto& elem){
 		// if its name's length is greater than our max
 		if (std::strlen(elem.name) > maxLen){
 			// set our max to the length of that test's name
@@ -130,36 +188,165 @@ static void printResults(size_t __testvec_size, std::vector<FailedTestInfo>& __f
 		}
 	});
 
+	std::cout << title << std::endl;
+	// for each test
+	std::for_each(vec.begin(), vec.end(), [__testvec_size, maxLen, prefix](const auto& elem){
+		// output "Test [index] ([func_name])"
+		// std::setw(nDigits) makes sure that all instances are aligned.
+		std::cout << "Test " << std::left << std::setw(nDigits(__testvec_size)) << elem.index + 1 << " (" << elem.name << ')';
+		// output 3 dots + the difference between the length of this string and the longest.
+		// this makes sure that all lines are aligned
+		for (size_t i = 0; i < maxLen - std::strlen(elem.name) + 3; ++i){
+			std::cout << '.';
+		}
+		// output [reason for failure]
+		std::cout << prefix << elem.reason << std::endl;
+	});
+}
+
+/**
+ * @brief Prints the results of the testing.
+ *
+ * @param __testvec The test vector retrieved through __gettestvec()
+ * @param ran The number of tests that ran, which is less than the size of the test vector if some were skipped.
+ * @param __failvec The tests that failed.
+ * @param __flakyvec The tests that failed on some runs but passed on others.
+ */
+static void printResults(size_t __testvec_size, size_t ran, std::vector<FailedTestInfo>& __failvec, std::vector<FailedTestInfo>& __flakyvec){
+	size_t totalLen;
+	size_t passed = ran - __failvec.size() - __flakyvec.size();
+	size_t skipped = __testvec_size - ran;
+
 	// Get the greater number of digits for alignment purposes
-	totalLen = nDigits(__testvec_size - __failvec.size() > __failvec.size() ? __testvec_size - __failvec.size() : __failvec.size());
+	totalLen = nDigits(std::max({passed, __failvec.size(), __flakyvec.size(), skipped}));
 	// output the numbers of tests that passed and failed
 	std::cout << std::endl;
 	std::cout << "Results:" << std::endl;
-	std::cout << std::setw(totalLen) << __testvec_size - __failvec.size() << " Passed" << std::endl;
+	std::cout << std::setw(totalLen) << passed << " Passed" << std::endl;
+	if (__flakyvec.size() > 0){
+		std::cout << std::setw(totalLen) << __flakyvec.size() << " Flaky" << std::endl;
+	}
 	std::cout << std::setw(totalLen) << __failvec.size() << " Failed" << std::endl;
+	if (skipped > 0){
+		std::cout << std::setw(totalLen) << skipped << " Skipped" << std::endl;
+	}
 	std::cout << std::endl;
 
+	// flaky tests pass, but they are listed so they get fixed
+	if (__flakyvec.size() > 0){
+		printTestList(__testvec_size, "Flaky tests:", __flakyvec, "");
+		std::cout << std::endl;
+	}
+
 	if (__failvec.size() == 0){
 		std::cout << "No failed tests" << std::endl;
 		return;
 	}
+	printTestList(__testvec_size, "Failed tests:", __failvec, "Failed: ");
+}
 
-	std::cout << "Failed tests:" << std::endl;
-	// for each test
-	std::for_each(__failvec.begin(), __failvec.end(), [__testvec_size, maxLen](const auto& elem){
-		// output "Test [index] ([func_name])"
-		// std::setw(nDigits) makes sure that all instances are aligned.
-		std::cout << "Test " << std::left << std::setw(nDigits(__testvec_size)) << elem.index + 1 << " (" << elem.name << ')';
-		// output 3 dots + the difference between the length of this string and the longest.
-		// this makes sure that all lines are aligned
-		for (size_t i = 0; i < maxLen - std::strlen(elem.name) + 3; ++i){
-			std::cout << '.';
-		}
-		// output [reason for failure]
-		std::cout << "Failed: " << elem.reason << std::endl;
+/**
+ * @brief The journal each finished test's result is appended to, or nullptr if there is none.
+ */
+static ResultJournal* journal = nullptr;
+
+/**
+ * @brief The name of the test that is running, or nullptr if none is.
+ */
+static const char* currentTestName = nullptr;
+
+/**
+ * @brief The directory each test gets a directory of its own in for --sandbox, or empty if they run where the program was started.
+ */
+static std::string sandboxRoot;
+
+/**
+ * @brief The sandbox of the test that is running, or nullptr if there is none.
+ */
+static const TestSandbox* currentSandbox = nullptr;
+
+/**
+ * @brief True to audit each test for leaked resources (--leaks).
+ */
+static bool auditLeaks = false;
+
+/**
+ * @brief True to fail tests that leak (--leaks=strict).
+ */
+static bool strictLeaks = false;
+
+/**
+ * @brief How many bytes the heap may grow by during a test before the leak audit reports it (--leaks-heap).
+ */
+static size_t leakHeapThreshold = 0;
+
+/**
+ * @brief Joins strings with ", ".
+ */
+static std::string joinList(const std::vector<std::string>& items){
+	std::string ret;
+
+	for (const std::string& item : items){
+		ret += (ret.empty() ? "" : ", ") + item;
+	}
+	return ret;
+}
+
+/**
+ * @brief Checks if a test was selected with --tests.
+ *
+ * @param name The test's name.
+ * @param patterns The names given to --tests, which may have shell wildcards. Empty selects every test.
+ */
+static bool isSelected(const char* name, const std::vector<std::string>& patterns){
+	if (patterns.empty()){
+		return true;
+	}
+	return std::any_of(patterns.begin(), patterns.end(), [name](const std::string& pattern){
+		return fnmatch(pattern.c_str(), name, 0) == 0;
 	});
 }
 
+/**
+ * @brief The suite whose registrations are being made: 0 for the program itself, or 1 + the index of the --watch suite being loaded.
+ * It is a constant-initialized integer, so it is already 0 when the program's static initializers register its tests.
+ */
+static size_t loadingSuite = 0;
+
+/**
+ * @brief The directory each test's coverage counters are dumped under for --coverage, or empty if they are not captured.
+ */
+static std::string coverageDir;
+
+/**
+ * @brief Removes a directory and everything in it.
+ */
+static void removeTree(const std::string& path){
+	DIR* dir = opendir(path.c_str());
+	struct dirent* ent;
+
+	if (dir == nullptr){
+		unlink(path.c_str());
+		return;
+	}
+	while ((ent = readdir(dir)) != nullptr){
+		std::string name = ent->d_name;
+		struct stat st;
+
+		if (name == "." || name == ".."){
+			continue;
+		}
+		if (lstat((path + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+			removeTree(path + "/" + name);
+		}
+		else{
+			unlink((path + "/" + name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
 /**
  * @brief Returns the test vector.
  * This function is needed so the test vector is initialized before any __registertest() functions are called.
@@ -169,19 +356,239 @@ static std::vector<UnitTest>& __gettestvec(){
 	return __testvec;
 }
 
+/**
+ * @brief A GLOBAL_SETUP() function.
+ */
+struct GlobalSetup{
+	/**
+	 * @brief The function.
+	 */
+	void(*func)();
+
+	/**
+	 * @brief Its name.
+	 */
+	const char* name;
+
+	/**
+	 * @brief The suite it was registered by, as UnitTest::getSuite() returns it.
+	 */
+	size_t suite;
+};
+
+/**
+ * @brief Returns the global setup functions.
+ * This function is needed so the vector is initialized before any __registerglobalsetup() functions are called.
+ */
+static std::vector<GlobalSetup>& __getsetupvec(){
+	static std::vector<GlobalSetup> __setupvec;
+	return __setupvec;
+}
+
+/**
+ * @brief Something registered about a test other than its code, such as its TEST_LIMITS().
+ */
+struct Annotation{
+	/**
+	 * @brief The name of the test.
+	 */
+	const char* test;
+
+	/**
+	 * @brief What is registered, for example "limits".
+	 */
+	const char* kind;
+
+	/**
+	 * @brief The value.
+	 */
+	const char* spec;
+
+	/**
+	 * @brief The suite it was registered by, as UnitTest::getSuite() returns it.
+	 */
+	size_t suite;
+};
+
+/**
+ * @brief Returns the annotations, such as TEST_LIMITS() and TEST_WEIGHTS().
+ * This function is needed so the vector is initialized before any __registerannotation() functions are called.
+ */
+static std::vector<Annotation>& __getannotationvec(){
+	static std::vector<Annotation> __annotationvec;
+	return __annotationvec;
+}
+
+/**
+ * @brief Runs a single test in this process.
+ *
+ * @param __testvec The vector of unit tests.
+ * @param i The index of the test to run.
+ * @param limits The test's resource limits, which are applied to this process while it runs.
+ *
+ * @return The test's result.
+ */
+static TestResult runOne(std::vector<UnitTest>& __testvec, size_t i, const ResourceLimits& limits){
+	TestResult res;
+	size_t nBench = getBenchmarks().size();
+	auto start = std::chrono::steady_clock::now();
+	// declared before the limits, so it is undone after them
+	std::optional<TestSandbox> sandbox;
+	std::optional<LimitScope> scope;
+	std::optional<LeakAudit> audit;
+
+	res.index = i;
+	// only what this test runs should be counted for it
+	if (!coverageDir.empty()){
+		coverageReset();
+	}
+	try{
+		currentTestName = __testvec[i].getName();
+		if (!sandboxRoot.empty()){
+			sandbox.emplace(sandboxRoot, currentTestName);
+			currentSandbox = &*sandbox;
+		}
+		if (!limits.empty()){
+			scope.emplace(limits);
+		}
+		// outside the capture, so what the capture allocates and the descriptors it redirects are back to how they were when it is compared
+		if (auditLeaks){
+			audit.emplace(leakHeapThreshold);
+		}
+		try{
+			IOCapturer __iocapt;
+			SignalHandler __sighand;
+			__testvec[i].getFunc()(__iocapt, __sighand);
+		}
+		catch (...){
+			// the exception the test failed with is still alive, so its heap cannot be compared
+			if (audit){
+				res.leaks = audit->finish();
+				audit.reset();
+			}
+			throw;
+		}
+		if (audit){
+			res.leaks = audit->finish();
+			// the samples of the benchmarks it reported are kept for the report, so they would count as heap it leaked
+			if (audit->getHeapGrowth() != 0 && getBenchmarks().size() == nBench){
+				res.leaks.push_back(formatBytes(audit->getHeapGrowth()) + " of heap");
+			}
+			audit.reset();
+		}
+		res.status = TestResult::PASSED;
+	}
+	catch (FailedAssertion& e){
+		res.status = TestResult::FAILED;
+		res.reason = e.what();
+	}
+	catch (FailedExpectation& e){
+		res.status = TestResult::FAILED;
+		res.reason = e.what();
+	}
+	catch (SignalException& e){
+		res.status = TestResult::ERROR;
+		res.reason = std::string("Signal thrown: ") + e.what();
+	}
+	catch (std::exception& e){
+		res.status = TestResult::ERROR;
+		res.reason = std::string("Internal error: ") + e.what();
+	}
+	catch (...){
+		res.status = TestResult::ERROR;
+		res.reason = "Unknown internal error";
+	}
+	if (strictLeaks && !res.leaks.empty()){
+		if (res.status == TestResult::PASSED){
+			res.status = TestResult::FAILED;
+			res.reason = "Leaked " + joinList(res.leaks);
+		}
+		else{
+			res.reason += " (and leaked " + joinList(res.leaks) + ")";
+		}
+	}
+	if (scope && res.status != TestResult::PASSED){
+		// for example std::bad_alloc because of the memory limit
+		std::string why = scope->explainFailure();
+		if (!why.empty()){
+			res.status = TestResult::LIMIT_EXCEEDED;
+			res.reason = why + " (" + res.reason + ")";
+		}
+	}
+	scope.reset();
+	sandbox.reset();
+	currentSandbox = nullptr;
+	currentTestName = nullptr;
+	res.duration = std::chrono::steady_clock::now() - start;
+	res.benchmarks.assign(getBenchmarks().begin() + nBench, getBenchmarks().end());
+	if (!coverageDir.empty()){
+		coverageDump(coverageDir + "/" + std::to_string(i));
+	}
+
+	return res;
+}
+
+/**
+ * @brief Prints "Test [index] ([name])" followed by enough dots to line up the results.
+ *
+ * @param __testvec The vector of unit tests.
+ * @param i The index of the test.
+ * @param maxLen The length of the longest test name.
+ */
+static void printTestHeader(std::vector<UnitTest>& __testvec, size_t i, size_t maxLen){
+	std::cout << "Test " << std::left << std::setw(nDigits(__testvec.size())) << i + 1 << " (" << __testvec[i].getName() << ")";
+	for (size_t j = 0; j < maxLen - std::strlen(__testvec[i].getName()) + 3; ++j){
+		std::cout << '.';
+	}
+}
+
+/**
+ * @brief Prints how a test ended, for example "Passed" or "Failed: [reason]".
+ */
+static void printOutcome(const TestResult& res){
+	if (res.status == TestResult::PASSED){
+		std::cout << "Passed";
+	}
+	else if (res.status == TestResult::FAILED){
+		std::cout << "Failed: " << res.reason;
+	}
+	else{
+		std::cout << res.reason;
+	}
+	if (res.cpuTime.count() >= 0){
+		std::cout << " (CPU " << formatDuration(res.cpuTime);
+		if (res.peakMemory >= 0){
+			std::cout << ", peak memory " << formatBytes(res.peakMemory);
+		}
+		std::cout << ")";
+	}
+	if (!strictLeaks && !res.leaks.empty()){
+		std::cout << " (leaked " << joinList(res.leaks) << ")";
+	}
+}
+
 /**
  * @brief Executes the tests.
  *
  * @param __testvec The vector of unit tests to execute.
+ * @param order The indexes of the tests to run, in the order to run them.
+ * @param opt The command-line options, which choose whether the tests run in this process or in forked children.
+ * @param limits The resource limits of each test. A test with limits runs in a forked child even without --fork.
+ * @param weights How much of the machine each test needs, for packing them when they run in parallel.
+ * @param results Set to the result of every test, in the order they finished.
+ * @param __flakyvec Set to the tests that did not pass on every run.
  *
  * @return A vector containing the unit tests that failed, along with their indexes within the test vector.
  */
-static std::vector<FailedTestInfo> runTests(std::vector<UnitTest>& __testvec){
-	size_t i = 0;
+static std::vector<FailedTestInfo> runTests(std::vector<UnitTest>& __testvec, const std::vector<size_t>& order, const Options& opt, const std::vector<ResourceLimits>& limits, const std::vector<ResourceWeights>& weights, std::vector<TestResult>& results, std::vector<FailedTestInfo>& __flakyvec){
 	size_t maxLen = 0;
 	std::vector<FailedTestInfo> __failvec;
+	ForkOptions fopt;
+	auto runHere = [&__testvec, &limits](size_t i){
+		return runOne(__testvec, i, limits[i]);
+	};
 
-	if (__testvec.size() == 0){
+	if (order.empty()){
 		return {};
 	}
 
@@ -192,46 +599,363 @@ static std::vector<FailedTestInfo> runTests(std::vector<UnitTest>& __testvec){
 		}
 	});
 
-	for (; i < __testvec.size(); ++i){
-		std::cout << "Test " << std::left << std::setw(nDigits(__testvec.size())) << i + 1 << " (" << __testvec[i].getName() << ")";
-		for (size_t j = 0; j < maxLen - std::strlen(__testvec[i].getName()) + 3; ++j){
-			std::cout << '.';
+	fopt.jobs = opt.jobs;
+	fopt.batch = opt.batch;
+	fopt.zygote = opt.zygote;
+	fopt.limits = [&limits](size_t i){
+		return limits[i];
+	};
+	fopt.cgroup = opt.cgroup;
+	fopt.retries = opt.retries;
+	fopt.repeat = opt.repeat;
+	fopt.weights = [&weights](size_t i){
+		return weights[i];
+	};
+	if (!opt.capacity.empty()){
+		fopt.capacity = parseWeights(opt.capacity, fopt.capacity);
+	}
+
+	if (!opt.fork){
+		for (size_t i : order){
+			std::vector<TestResult> runs;
+			auto passed = [&runs](){
+				return std::any_of(runs.begin(), runs.end(), [](const TestResult& r){ return r.status == TestResult::PASSED; });
+			};
+
+			// print the header first, so a test that hangs can be identified
+			if (!opt.untilFail){
+				printTestHeader(__testvec, i, maxLen);
+				std::cout.flush();
+			}
+			// without --fork, only TEST_LIMITS() gives a test limits, and a test that runs into one must not take the rest of the tests down with it
+			if (!limits[i].empty()){
+				results.push_back(runForked({i}, runHere, [](const TestResult&){}, fopt).front());
+			}
+			else{
+				for (size_t r = 0; r < opt.repeat; ++r){
+					runs.push_back(runOne(__testvec, i, limits[i]));
+				}
+				for (size_t r = 0; r < opt.retries && !passed(); ++r){
+					runs.push_back(runOne(__testvec, i, limits[i]));
+				}
+				results.push_back(summarizeRuns(runs));
+			}
+			if (journal){
+				journal->append(results.back());
+			}
+			if (!opt.untilFail || results.back().failures > 0){
+				if (opt.untilFail){
+					printTestHeader(__testvec, i, maxLen);
+				}
+				printOutcome(results.back());
+				std::cout << std::endl;
+			}
 		}
+	}
+	else{
+		std::vector<std::optional<TestResult>> arrived(__testvec.size());
+		size_t next = 0;
 
-		try{
-			{
-				IOCapturer __iocapt;
-				SignalHandler __sighand;
-				__testvec[i].getFunc()(__iocapt, __sighand);
+		results = runForked(order, runHere, [&](const TestResult& res){
+			if (journal){
+				journal->append(res);
+			}
+			// results arrive in any order, but are printed in the order the tests were queued
+			arrived[res.index] = res;
+			for (; next < order.size() && arrived[order[next]]; ++next){
+				const TestResult& cur = *arrived[order[next]];
+				// --until-fail only shows what went wrong, or every round would print every test
+				if (opt.untilFail && cur.failures == 0){
+					continue;
+				}
+				printTestHeader(__testvec, cur.index, maxLen);
+				printOutcome(cur);
+				std::cout << std::endl;
+			}
+		}, fopt);
+	}
+
+	for (const TestResult& res : results){
+		if (res.status == TestResult::FLAKY){
+			__flakyvec.push_back(FailedTestInfo(res.index, __testvec[res.index].getName(), res.reason.c_str()));
+		}
+		else if (res.status != TestResult::PASSED){
+			__failvec.push_back(FailedTestInfo(res.index, __testvec[res.index].getName(), res.reason.c_str()));
+		}
+	}
+	return __failvec;
+}
+
+/**
+ * @brief Runs tests over and over in this process for a while, and reports whether its resource usage or their latencies grow.
+ *
+ * @param __testvec The vector of unit tests.
+ * @param order The indexes of the tests to run, in the order to run them in each iteration.
+ * @param limits The resource limits of each test.
+ * @param duration How long to keep running them.
+ *
+ * @return 0 if every test passed every time and nothing grew, 1 otherwise.
+ */
+static int soakTests(std::vector<UnitTest>& __testvec, const std::vector<size_t>& order, const std::vector<ResourceLimits>& limits, std::chrono::seconds duration){
+	SoakMonitor monitor(duration, std::cout);
+	std::vector<size_t> failures(__testvec.size());
+	std::vector<std::string> reasons(__testvec.size());
+	std::vector<FailedTestInfo> __failvec;
+	std::vector<SoakTrend> trends;
+
+	std::cout << "Soaking " << order.size() << " tests for " << duration.count() << "s" << std::endl;
+	while (!monitor.done()){
+		for (size_t i : order){
+			size_t nBench = getBenchmarks().size();
+			TestResult res = runOne(__testvec, i, limits[i]);
+
+			monitor.recordLatency(__testvec[i].getName(), res.duration);
+			for (const Benchmark& b : res.benchmarks){
+				monitor.recordLatency(b.name, BenchmarkStats::of(b.samples).p50);
+			}
+			// the registry keeps them for the report, which would make the heap grow with every iteration
+			discardBenchmarks(nBench);
+			if (res.status != TestResult::PASSED && failures[i]++ == 0){
+				reasons[i] = res.reason;
 			}
-			std::cout << "Passed";
 		}
-		catch (FailedAssertion& e){
-			__failvec.push_back(FailedTestInfo(i, __testvec[i].getName(), e.what()));
-			std::cout << "Failed: " << e.what();
+		monitor.sample();
+	}
+
+	trends = monitor.getTrends();
+	printSoakReport(std::cout, trends);
+	for (size_t i : order){
+		if (failures[i] != 0){
+			std::string reason = "Failed " + std::to_string(failures[i]) + " of " + std::to_string(monitor.getIterations()) + " times, first with: " + reasons[i];
+			__failvec.push_back(FailedTestInfo(i, __testvec[i].getName(), reason.c_str()));
 		}
-		catch (FailedExpectation& e){
-			__failvec.push_back(FailedTestInfo(i, __testvec[i].getName(), e.what()));
-			std::cout << "Failed: " << e.what();
+	}
+	if (!__failvec.empty()){
+		std::cout << std::endl;
+		printTestList(__testvec.size(), "Failed tests:", __failvec, "");
+	}
+	return __failvec.empty() && std::none_of(trends.begin(), trends.end(), [](const SoakTrend& t){
+		return t.growing;
+	}) ? 0 : 1;
+}
+
+/**
+ * @brief Works out the limits and weights of each test from --limits and the TEST_LIMITS() and TEST_WEIGHTS() registered for it.
+ *
+ * @param __testvec The vector of unit tests.
+ * @param opt The options, for the global --limits.
+ * @param limits Set to the limits of each test.
+ * @param weights Set to the weights of each test.
+ *
+ * @return False if an annotation names a test that does not exist or cannot be parsed, which was printed to stderr.
+ */
+static bool resolveAnnotations(std::vector<UnitTest>& __testvec, const Options& opt, std::vector<ResourceLimits>& limits, std::vector<ResourceWeights>& weights){
+	// every test starts with the global limits, and its own TEST_LIMITS() take precedence
+	limits.assign(__testvec.size(), opt.limits);
+	weights.assign(__testvec.size(), ResourceWeights());
+	for (const Annotation& entry : __getannotationvec()){
+		const char* macro = std::strcmp(entry.kind, "limits") == 0 ? "TEST_LIMITS" : "TEST_WEIGHTS";
+		auto it = std::find_if(__testvec.begin(), __testvec.end(), [&entry](const UnitTest& test){
+			return std::strcmp(test.getName(), entry.test) == 0;
+		});
+		if (it == __testvec.end()){
+			std::cerr << macro << "(" << entry.test << ") names a test that does not exist" << std::endl;
+			return false;
 		}
-		catch (SignalException& e){
-			const std::string failureReason = std::string("Signal thrown: ") + e.what();
-			__failvec.push_back(FailedTestInfo(i, __testvec[i].getName(), failureReason.c_str()));
-			std::cout << failureReason;
+		try{
+			if (std::strcmp(entry.kind, "limits") == 0){
+				limits[it - __testvec.begin()].merge(parseLimits(entry.spec));
+			}
+			else{
+				weights[it - __testvec.begin()] = parseWeights(entry.spec);
+			}
+		}
+		catch (std::invalid_argument& e){
+			std::cerr << macro << "(" << entry.test << "): " << e.what() << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Runs GLOBAL_SETUP() functions in the order they were registered.
+ *
+ * @param setups The functions.
+ *
+ * @return False if one of them threw, which was printed to stderr. The ones after it are not run.
+ */
+static bool runGlobalSetups(const std::vector<GlobalSetup>& setups){
+	for (const GlobalSetup& setup : setups){
+		try{
+			setup.func();
 		}
 		catch (std::exception& e){
-			const std::string failureReason = std::string("Internal error: ") + e.what();
-			__failvec.push_back(FailedTestInfo(i, __testvec[i].getName(), failureReason.c_str()));
-			std::cout << failureReason;
+			std::cerr << "Global setup " << setup.name << " failed: " << e.what() << std::endl;
+			return false;
 		}
 		catch (...){
-			__failvec.push_back(FailedTestInfo(i, __testvec[i].getName(), "Unknown internal error"));
-			std::cout << "Unknown internal error";
+			std::cerr << "Global setup " << setup.name << " failed" << std::endl;
+			return false;
 		}
+	}
+	return true;
+}
+
+/**
+ * @brief Loads a --watch suite, which registers its tests, global setups and annotations as part of it.
+ *
+ * @param watcher The suites.
+ * @param suite The index of the suite.
+ *
+ * @return False if it could not be loaded, which was printed to stderr.
+ */
+static bool loadSuite(SuiteWatcher& watcher, size_t suite){
+	loadingSuite = suite + 1;
+	try{
+		watcher.load(suite);
+	}
+	catch (std::runtime_error& e){
+		loadingSuite = 0;
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+	loadingSuite = 0;
+	// its registrations went to a copy of the library of its own instead
+	if (std::none_of(__gettestvec().begin(), __gettestvec().end(), [suite](const UnitTest& test){
+		return test.getSuite() == suite + 1;
+	})){
+		std::cerr << watcher.getPath(suite) << " registered no tests. The program has to be linked with -rdynamic and the whole of libsimpletest.a, and the suite without it." << std::endl;
+	}
+	return true;
+}
+
+/**
+ * @brief Forgets everything a --watch suite registered, then unloads it.
+ *
+ * @param watcher The suites.
+ * @param suite The index of the suite.
+ */
+static void unloadSuite(SuiteWatcher& watcher, size_t suite){
+	std::vector<UnitTest>& tests = __gettestvec();
+	std::vector<GlobalSetup>& setups = __getsetupvec();
+	std::vector<Annotation>& annotations = __getannotationvec();
+
+	// all of them point into the suite's code and data
+	tests.erase(std::remove_if(tests.begin(), tests.end(), [suite](const UnitTest& t){
+		return t.getSuite() == suite + 1;
+	}), tests.end());
+	setups.erase(std::remove_if(setups.begin(), setups.end(), [suite](const GlobalSetup& g){
+		return g.suite == suite + 1;
+	}), setups.end());
+	annotations.erase(std::remove_if(annotations.begin(), annotations.end(), [suite](const Annotation& a){
+		return a.suite == suite + 1;
+	}), annotations.end());
+	watcher.unload(suite);
+}
+
+/**
+ * @brief Set when the program is asked to stop while it watches suites.
+ */
+static volatile sig_atomic_t watchInterrupted = 0;
+
+/**
+ * @brief Handles SIGINT and SIGTERM while watching suites, by interrupting the wait for changes.
+ */
+static void onWatchInterrupt(int){
+	watchInterrupted = 1;
+}
+
+/**
+ * @brief Runs tests, then runs the tests of the --watch suites that are rebuilt again each time they are, until SIGINT or SIGTERM.
+ * A rebuilt suite is unloaded, loaded again and has its GLOBAL_SETUP()s run again, while the program's own global setup is not, so what it prepared stays warm across reloads. The tests that did not pass the last time they ran go first.
+ *
+ * @param __testvec The vector of unit tests.
+ * @param watcher The suites, already loaded.
+ * @param order The tests to run first.
+ * @param opt The options.
+ * @param limits The resource limits of each test, updated when a suite is reloaded.
+ * @param weights The resource weights of each test, updated when a suite is reloaded.
+ *
+ * @return 0 once interrupted.
+ */
+static int watchSuites(std::vector<UnitTest>& __testvec, SuiteWatcher& watcher, std::vector<size_t> order, Options& opt, std::vector<ResourceLimits>& limits, std::vector<ResourceWeights>& weights){
+	std::set<std::string> failing;
+	struct sigaction sa = {};
+	struct sigaction oldInt;
+	struct sigaction oldTerm;
+	auto run = [&](){
+		std::vector<FailedTestInfo> __flakyvec;
+		std::vector<TestResult> results;
+		std::vector<FailedTestInfo> __failvec = runTests(__testvec, order, opt, limits, weights, results, __flakyvec);
+
+		printResults(__testvec.size(), order.size(), __failvec, __flakyvec);
+		for (const TestResult& res : results){
+			if (res.status == TestResult::PASSED){
+				failing.erase(__testvec[res.index].getName());
+			}
+			else{
+				failing.insert(__testvec[res.index].getName());
+			}
+		}
+	};
+
+	// without SA_RESTART, so the wait for changes returns
+	sa.sa_handler = onWatchInterrupt;
+	sigaction(SIGINT, &sa, &oldInt);
+	sigaction(SIGTERM, &sa, &oldTerm);
+
+	run();
+	while (!watchInterrupted){
+		std::vector<size_t> changed;
+		std::vector<GlobalSetup> setups;
+
+		// the SignalHandler of each test run here resets them to the default when it ends
+		sigaction(SIGINT, &sa, nullptr);
+		sigaction(SIGTERM, &sa, nullptr);
+		std::cout << std::endl << "Watching " << watcher.size() << " suites for changes" << std::endl;
+		try{
+			changed = watcher.waitForChanges();
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+			break;
+		}
+		if (changed.empty()){
+			break;
+		}
+
+		for (size_t suite : changed){
+			unloadSuite(watcher, suite);
+			if (loadSuite(watcher, suite)){
+				std::cout << "Reloaded " << watcher.getPath(suite) << std::endl;
+			}
+		}
+		for (const GlobalSetup& setup : __getsetupvec()){
+			if (std::find(changed.begin(), changed.end(), setup.suite - 1) != changed.end()){
+				setups.push_back(setup);
+			}
+		}
+		if (!resolveAnnotations(__testvec, opt, limits, weights) || !runGlobalSetups(setups)){
+			continue;
+		}
+
+		order.clear();
+		for (size_t i = 0; i < __testvec.size(); ++i){
+			if (std::find(changed.begin(), changed.end(), __testvec[i].getSuite() - 1) != changed.end() && isSelected(__testvec[i].getName(), opt.tests)){
+				order.push_back(i);
+			}
+		}
+		std::stable_partition(order.begin(), order.end(), [&__testvec, &failing](size_t i){
+			return failing.count(__testvec[i].getName()) != 0;
+		});
 		std::cout << std::endl;
+		run();
 	}
 
-	return __failvec;
+	sigaction(SIGINT, &oldInt, nullptr);
+	sigaction(SIGTERM, &oldTerm, nullptr);
+	return 0;
 }
 
 FailedAssertion::FailedAssertion(const char* assertion): std::runtime_error(assertion) {
@@ -240,6 +964,9 @@ FailedAssertion::FailedAssertion(const char* assertion): std::runtime_error(asse
 FailedExpectation::FailedExpectation(const char* expected, const char* actual): std::runtime_error('\"' + std::string(expected) + "\" == \"" + actual + '\"'){
 }
 
+FailedExpectation::FailedExpectation(const char* expected, const char* actual, const char* where): std::runtime_error(std::string(where) + ": \"" + expected + "\" == \"" + actual + '\"'){
+}
+
 void __expect(const char* str, IOCapturer& __iocapt){
 	std::string q = IOCapturer::getLastLine(__iocapt.getStdout());
 	if (str != q){
@@ -247,22 +974,434 @@ void __expect(const char* str, IOCapturer& __iocapt){
 	}
 }
 
+void __expect(const char* str, FdCapturer& capturer){
+	std::string q = IOCapturer::getLastLine(capturer.getOutput());
+	if (str != q){
+		throw FailedExpectation(str, q.c_str());
+	}
+}
+
+/**
+ * @brief Returns the last line of some output, the same way IOCapturer::getLastLine() does, without copying the rest of it.
+ */
+static std::string lastLineOf(std::string_view out){
+	size_t pos;
+
+	if (!out.empty() && out.back() == '\n'){
+		out.remove_suffix(1);
+	}
+	pos = out.find_last_of('\n');
+	return std::string(pos == std::string_view::npos ? out : out.substr(pos + 1));
+}
+
+void __expectmatch(const Regex& re, IOCapturer& __iocapt){
+	FdCapturer& capt = __iocapt.getStdoutCapturer();
+	// search the capture buffer in place instead of copying it, since it can be huge
+	std::string_view out = capt.peek();
+	bool found = re.search(out);
+	std::string last = lastLineOf(out);
+
+	capt.consume(out.size());
+	if (!found){
+		throw FailedExpectation(("/" + re.getPattern() + "/").c_str(), last.c_str());
+	}
+}
+
+void __expectlinematch(int n, const Regex& re, IOCapturer& __iocapt){
+	FdCapturer& capt = __iocapt.getStdoutCapturer();
+	std::string_view out = capt.peek();
+	std::vector<std::string_view> lines;
+	std::string_view line;
+	std::string where = "line " + std::to_string(n);
+	size_t pos = 0;
+
+	// split the output into lines without copying it
+	while (pos < out.size()){
+		size_t nl = out.find('\n', pos);
+		if (nl == std::string_view::npos){
+			nl = out.size();
+		}
+		lines.push_back(out.substr(pos, nl - pos));
+		pos = nl + 1;
+	}
+
+	if (n == 0 || (n > 0 && (size_t)n > lines.size()) || (n < 0 && (size_t)-n > lines.size())){
+		capt.consume(out.size());
+		throw FailedExpectation(("/" + re.getPattern() + "/").c_str(), ("(only " + std::to_string(lines.size()) + " lines)").c_str(), where.c_str());
+	}
+
+	line = n > 0 ? lines[n - 1] : lines[lines.size() + n];
+	if (!re.match(line)){
+		std::string actual(line);
+		capt.consume(out.size());
+		throw FailedExpectation(("/" + re.getPattern() + "/").c_str(), actual.c_str(), where.c_str());
+	}
+	capt.consume(out.size());
+}
+
+const char* getCurrentTestName(){
+	return currentTestName;
+}
+
+const char* getTestDirectory(){
+	return currentSandbox ? currentSandbox->getDirectory().c_str() : nullptr;
+}
+
 void __registertest(void(*test)(IOCapturer&, SignalHandler&), const char* name){
-	__gettestvec().push_back(UnitTest(test, name));
+	__gettestvec().push_back(UnitTest(test, name, loadingSuite));
+}
+
+void __registerglobalsetup(void(*setup)(), const char* name){
+	__getsetupvec().push_back({setup, name, loadingSuite});
+}
+
+void __registerannotation(const char* test, const char* kind, const char* spec){
+	__getannotationvec().push_back({test, kind, spec, loadingSuite});
 }
 
 int __executetests(int argc, char** argv){
 	std::vector<UnitTest>& __testvec = __gettestvec();
 	std::vector<FailedTestInfo> __failvec;
+	std::vector<FailedTestInfo> __flakyvec;
+	std::vector<TestResult> results;
+	std::optional<SuiteWatcher> watcher;
+	Options opt;
+
+	try{
+		opt = parseOptions(argc, argv);
+	}
+	catch (std::invalid_argument& e){
+		std::cerr << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if (opt.help){
+		printUsage(argv[0]);
+		return 0;
+	}
+
+	if (!opt.recordPath.empty()){
+		try{
+			return recordSession(opt.recordPath.c_str(), opt.recordArgs);
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	if (!opt.query.empty()){
+		try{
+			return queryHistory(opt.history, opt.query, std::cout);
+		}
+		catch (std::exception& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	// before anything looks at the tests, so the suites' tests are among them
+	if (!opt.watch.empty()){
+		try{
+			watcher.emplace(opt.watch);
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		for (size_t i = 0; i < watcher->size(); ++i){
+			// one that fails to load now is loaded once it is rebuilt
+			loadSuite(*watcher, i);
+		}
+	}
+
+	if (opt.list){
+		for (const UnitTest& test : __testvec){
+			std::cout << test.getName() << '\n';
+		}
+		std::cout.flush();
+		return 0;
+	}
+
+	std::vector<ResourceLimits> limits;
+	std::vector<ResourceWeights> weights;
+	if (!resolveAnnotations(__testvec, opt, limits, weights) || !runGlobalSetups(__getsetupvec())){
+		return 1;
+	}
+
+	if (opt.workerFd >= 0){
+		try{
+			return serveTests(opt.workerFd, __testvec.size(), [&__testvec, &limits](size_t i){
+				return runOne(__testvec, i, limits[i]);
+			}, opt.ringFd);
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<size_t> order;
+	std::optional<CoverageMap> coverage;
+	std::optional<TrialRunner> trials;
+	std::optional<ResultJournal> journalFile;
+	std::vector<TestResult> resumed;
+	std::string coverageTemp;
+	for (size_t i = 0; i < __testvec.size(); ++i){
+		if (isSelected(__testvec[i].getName(), opt.tests)){
+			order.push_back(i);
+		}
+	}
+	// a suite that has not loaded yet may have them
+	if (order.empty() && !opt.tests.empty() && !watcher){
+		std::cerr << "--tests matches none of the tests" << std::endl;
+		return 1;
+	}
+	if (!opt.coverage.empty()){
+		// a program built without coverage can still use a map to pick tests, just not record one
+		if (!coverageAvailable() && !opt.affectedBy){
+			std::cerr << "--coverage requires compiling with --coverage and linking with -Wl,-u,__gcov_dump,-u,__gcov_reset" << std::endl;
+			return 1;
+		}
+		try{
+			coverage = access(opt.coverage.c_str(), F_OK) == 0 ? CoverageMap::load(opt.coverage) : CoverageMap();
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		if (opt.affectedBy){
+			std::vector<std::string> names;
+			std::vector<bool> affected;
+
+			for (const UnitTest& test : __testvec){
+				names.push_back(test.getName());
+			}
+			affected = coverage->affected(names, *opt.affectedBy);
+			size_t selected = order.size();
+			order.erase(std::remove_if(order.begin(), order.end(), [&affected](size_t i){
+				return !affected[i];
+			}), order.end());
+			if (order.size() < selected){
+				std::cout << "Running " << order.size() << " of " << selected << " tests affected by the changed files" << std::endl;
+			}
+		}
+		if (coverageAvailable()){
+			const char* tmp = getenv("TMPDIR");
+			std::string templ = std::string(tmp && *tmp ? tmp : "/tmp") + "/simpletest-coverage-XXXXXX";
+
+			if (mkdtemp(&templ[0]) == nullptr){
+				std::cerr << "Failed to create a directory for coverage counters (" << std::strerror(errno) << ")" << std::endl;
+				return 1;
+			}
+			// what ran so far is the static initialization and the global setup
+			coverageDump(templ + "/setup");
+			coverageTemp = templ;
+		}
+	}
+
+	auditLeaks = opt.leaks;
+	strictLeaks = opt.strictLeaks;
+	leakHeapThreshold = opt.leakHeapThreshold;
+	if (auditLeaks){
+		prepareLeakAudits();
+	}
+	// the rest is in effect in the process bisection reruns the tests from too, except capturing coverage
+	try{
+		if (opt.sandbox){
+			sandboxRoot = makeSandboxRoot();
+		}
+		if (opt.bisect){
+			trials.emplace([&__testvec, &limits](size_t i){
+				return runOne(__testvec, i, limits[i]);
+			});
+		}
+		if (!opt.journal.empty()){
+			journalFile.emplace(opt.journal, opt.resume, __testvec.size());
+		}
+	}
+	catch (std::runtime_error& e){
+		std::cerr << e.what() << std::endl;
+		if (!coverageTemp.empty()){
+			removeTree(coverageTemp);
+		}
+		if (!sandboxRoot.empty()){
+			removeSandboxRoot(sandboxRoot);
+		}
+		return 1;
+	}
+	if (opt.soak.count() != 0){
+		// what a test covers is the same every time, and dumping it every time would only slow the iterations down
+		int ret = soakTests(__testvec, order, limits, opt.soak);
+		if (!coverageTemp.empty()){
+			removeTree(coverageTemp);
+		}
+		if (!sandboxRoot.empty()){
+			removeSandboxRoot(sandboxRoot);
+		}
+		return ret;
+	}
+	if (watcher){
+		int ret = watchSuites(__testvec, *watcher, order, opt, limits, weights);
+		if (!coverageTemp.empty()){
+			removeTree(coverageTemp);
+		}
+		if (!sandboxRoot.empty()){
+			removeSandboxRoot(sandboxRoot);
+		}
+		return ret;
+	}
+	if (journalFile){
+		if (journalFile->isStale()){
+			std::cout << opt.journal << " is from another build of the program, so every test runs again" << std::endl;
+		}
+		// only the selected tests, which the journal may have more or fewer of
+		for (const TestResult& res : journalFile->getResumed()){
+			auto it = std::find(order.begin(), order.end(), res.index);
+			if (it != order.end()){
+				order.erase(it);
+				resumed.push_back(res);
+			}
+		}
+		if (!resumed.empty()){
+			std::cout << "Resuming from " << opt.journal << ": " << resumed.size() << " tests already finished, " << order.size() << " to go" << std::endl;
+		}
+		journal = &*journalFile;
+	}
+	coverageDir = coverageTemp;
+
+	std::vector<size_t> ranOrder = order;
+	uint64_t seed = opt.shuffle ? (opt.seed ? *opt.seed : randomSeed()) : 0;
+	for (size_t round = 1; ; ++round){
+		results.clear();
+		__flakyvec.clear();
+		if (opt.shuffle){
+			// every round gets a new order, and each can be reproduced on its own
+			ranOrder = order;
+			shuffleOrder(ranOrder, seed + round - 1);
+			std::cout << "Shuffled with seed " << seed + round - 1 << " (--shuffle=" << seed + round - 1 << ")" << std::endl;
+		}
+		__failvec = runTests(__testvec, ranOrder, opt, limits, weights, results, __flakyvec);
+		if (!opt.untilFail || results.empty() || __failvec.size() + __flakyvec.size() > 0){
+			if (opt.untilFail && !results.empty()){
+				std::cout << "Round " << round << ": a test did not pass" << std::endl;
+			}
+			break;
+		}
+		std::cout << "Round " << round << ": all " << results.size() << " tests passed" << std::endl;
+	}
+
+	if (!resumed.empty()){
+		std::vector<FailedTestInfo> resumedFails;
+		std::vector<FailedTestInfo> resumedFlaky;
+
+		// the journaled results come first, since those tests ran first
+		for (const TestResult& res : resumed){
+			for (const Benchmark& b : res.benchmarks){
+				reportBenchmark(b);
+			}
+			if (res.status == TestResult::FLAKY){
+				resumedFlaky.push_back(FailedTestInfo(res.index, __testvec[res.index].getName(), res.reason.c_str()));
+			}
+			else if (res.status != TestResult::PASSED){
+				resumedFails.push_back(FailedTestInfo(res.index, __testvec[res.index].getName(), res.reason.c_str()));
+			}
+		}
+		__failvec.insert(__failvec.begin(), resumedFails.begin(), resumedFails.end());
+		__flakyvec.insert(__flakyvec.begin(), resumedFlaky.begin(), resumedFlaky.end());
+		results.insert(results.begin(), resumed.begin(), resumed.end());
+	}
+	printResults(__testvec.size(), order.size() + resumed.size(), __failvec, __flakyvec);
+	if (auditLeaks && !strictLeaks){
+		std::vector<FailedTestInfo> leakvec;
+		for (const TestResult& res : results){
+			if (!res.leaks.empty()){
+				leakvec.push_back(FailedTestInfo(res.index, __testvec[res.index].getName(), joinList(res.leaks).c_str()));
+			}
+		}
+		if (!leakvec.empty()){
+			std::cout << std::endl;
+			printTestList(__testvec.size(), "Leaking tests:", leakvec, "Leaked ");
+		}
+	}
+	printBenchmarks(std::cout);
+
+	if (!opt.history.empty()){
+		try{
+			appendHistory(opt.history, makeHistoryRecords(results, [&__testvec](const TestResult& res){
+				return std::string(__testvec[res.index].getName());
+			}));
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+		}
+	}
 
-	(void)argc;
-	(void)argv;
+	if (!coverageDir.empty()){
+		try{
+			coverage->record(CoverageMap::globalSetup, coverageDir + "/setup");
+			for (size_t i : order){
+				std::string dir = coverageDir + "/" + std::to_string(i);
+				// a test that took its child down with it never dumped its counters
+				if (access(dir.c_str(), F_OK) == 0){
+					coverage->record(__testvec[i].getName(), dir);
+				}
+				else{
+					coverage->forget(__testvec[i].getName());
+				}
+			}
+			coverage->save(opt.coverage);
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+		}
+		removeTree(coverageDir);
+		coverageDir.clear();
+	}
 
-	__failvec = runTests(__testvec);
+	if (trials){
+		try{
+			for (const FailedTestInfo& fail : __failvec){
+				std::vector<size_t> before(ranOrder.begin(), std::find(ranOrder.begin(), ranOrder.end(), fail.index));
+				std::vector<size_t> culprits;
 
-	printResults(__testvec.size(), __failvec);
+				std::cout << std::endl;
+				std::cout << "Bisecting Test " << fail.index + 1 << " (" << fail.name << ")" << std::endl;
+				if (trials->failsAfter({}, fail.index)){
+					std::cout << "  It fails on its own, so it does not depend on the tests before it" << std::endl;
+					continue;
+				}
+				if (!trials->failsAfter(before, fail.index)){
+					std::cout << "  It passed after the same " << before.size() << " tests, so it may be flaky instead" << std::endl;
+					continue;
+				}
+				culprits = minimizeFailingPrefix(before, [&trials, &fail](const std::vector<size_t>& subset){
+					return trials->failsAfter(subset, fail.index);
+				});
+				std::cout << "  It fails after:" << std::endl;
+				for (size_t i : culprits){
+					std::cout << "    Test " << i + 1 << " (" << __testvec[i].getName() << ")" << std::endl;
+				}
+			}
+		}
+		catch (std::runtime_error& e){
+			std::cerr << e.what() << std::endl;
+		}
+		trials.reset();
+	}
+	// every selected test has a result now, so there is nothing left to resume
+	if (journalFile){
+		journal = nullptr;
+		journalFile->remove();
+	}
+	if (!sandboxRoot.empty()){
+		removeSandboxRoot(sandboxRoot);
+		sandboxRoot.clear();
+	}
 
-	return __failvec.size();
+	// flaky tests pass, unless finding one is the point of the run
+	return opt.untilFail ? __failvec.size() + __flakyvec.size() : __failvec.size();
 }
 
 }
@@ -9,7 +9,11 @@
 #ifndef __SIMPLETEST_HPP
 #define __SIMPLETEST_HPP
 
+#include "simpletest_benchmark.hpp"
+#include "simpletest_digest.hpp"
+#include "simpletest_fdcapturer.hpp"
 #include "simpletest_iocapturer.hpp"
+#include "simpletest_regex.hpp"
 #include "simpletest_signal.hpp"
 #include <vector>
 #include <stdexcept>
@@ -61,6 +65,15 @@ public:
 	 * @param actual   The actual output on stdout.
 	 */
 	FailedExpectation(const char* expected, const char* actual);
+
+	/**
+	 * @brief Constructs a FailedExpectation exception that says where the mismatch is.
+	 *
+	 * @param expected The expected output.
+	 * @param actual   The actual output.
+	 * @param where    Where the mismatch is, for example "stdout line 3".
+	 */
+	FailedExpectation(const char* expected, const char* actual, const char* where);
 };
 
 /**
@@ -84,10 +97,75 @@ public:
 void __expect(const char* str, simpletest::IOCapturer& __iocapt);
 
 /**
- * @brief Sends a line to stdin.
+ * @brief Expects a particular line on a captured file descriptor, failing the test if not.
+ *
+ * @param capturer An FdCapturer made with CaptureMode::OUTPUT or CaptureMode::SOCKET.
+ * @param expectation A const char* containing the text to expect. This does not include the newline.
  *
- * @bug stdin must be empty before SEND() can be used.
- * This means that SEND() can only be called once until stdin is emptied through std::cin or other input fetching functions.
+ * @exception FailedExpectation Thrown if the last line written to the file descriptor does not match the expectation.
+ */
+#define EXPECT_FD(capturer, expectation)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__expect(expectation, capturer)
+
+/**
+ * @brief Do not call this function directly. Use the EXPECT_FD() macro instead.
+ *
+ * @param str      The string to expect.
+ * @param capturer The FdCapturer to check.
+ */
+void __expect(const char* str, simpletest::FdCapturer& capturer);
+
+/**
+ * @brief Expects a regular expression to match somewhere in the output since the last check, failing the test if not.
+ * The pattern is compiled once per call site, no matter how many times this line runs. See simpletest::Regex for the supported syntax.
+ *
+ * @param pattern A string literal containing the pattern.
+ *
+ * @exception FailedExpectation Thrown if the pattern does not match anywhere in the output.
+ */
+#define EXPECT_MATCH(pattern)\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__expectmatch(__STATIC_REGEX(pattern), __iocapt)
+
+/**
+ * @brief Do not call this function directly. Use the EXPECT_MATCH() macro instead.
+ *
+ * @param re       The compiled pattern.
+ * @param __iocapt The current I/O capturer object.
+ */
+void __expectmatch(const simpletest::Regex& re, simpletest::IOCapturer& __iocapt);
+
+/**
+ * @brief Expects one line of the output since the last check to match a regular expression in its entirety, failing the test if not.
+ * The pattern is compiled once per call site, no matter how many times this line runs. See simpletest::Regex for the supported syntax.
+ *
+ * @param n The line number, starting at 1. Negative numbers count from the end, so -1 is the last line.
+ * @param pattern A string literal containing the pattern.
+ *
+ * @exception FailedExpectation Thrown if the line does not match the pattern or there is no such line.
+ */
+#define EXPECT_LINE_MATCH(n, pattern)\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__expectlinematch(n, __STATIC_REGEX(pattern), __iocapt)
+
+/**
+ * @brief Do not call this function directly. Use the EXPECT_LINE_MATCH() macro instead.
+ *
+ * @param n        The line number.
+ * @param re       The compiled pattern.
+ * @param __iocapt The current I/O capturer object.
+ */
+void __expectlinematch(int n, const simpletest::Regex& re, simpletest::IOCapturer& __iocapt);
+
+/**
+ * @brief Sends a line to stdin.
+ * If the stdin pipe is full, the remainder is written once the code under test reads enough of it.
  *
  * @param line The line to send.
  */
@@ -96,6 +174,30 @@ void __expect(const char* str, simpletest::IOCapturer& __iocapt);
 (void)__sighand;\
 __iocapt.sendToStdin(line)
 
+/**
+ * @brief Sends a line to a captured file descriptor.
+ *
+ * @param capturer An FdCapturer made with CaptureMode::INPUT or CaptureMode::SOCKET.
+ * @param line The line to send.
+ */
+#define SEND_FD(capturer, line)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	(capturer).sendLine(line)
+
+/**
+ * @brief Returns the name of the test that is running, or nullptr if no test is running.
+ */
+const char* getCurrentTestName();
+
+/**
+ * @brief Returns the directory the running test was given with --sandbox, which is also its working directory when it starts, or nullptr if there is none.
+ * The directory and everything in it is removed when the test ends.
+ */
+const char* getTestDirectory();
+
 /**
  * @brief Do not call this function directly. Use the UNIT_TEST macro.
  * This function registers a test with the internal test vector.
@@ -105,6 +207,25 @@ __iocapt.sendToStdin(line)
  */
 void __registertest(void(*test)(simpletest::IOCapturer&, simpletest::SignalHandler&), const char* name);
 
+/**
+ * @brief Do not call this function directly. Use the GLOBAL_SETUP macro.
+ * This function registers a global setup function.
+ *
+ * @param setup The setup function.
+ * @param name The name of the setup function.
+ */
+void __registerglobalsetup(void(*setup)(), const char* name);
+
+/**
+ * @brief Do not call this function directly. Use the TEST_LIMITS or TEST_WEIGHTS macros.
+ * This function registers something about a test other than its code, such as its resource limits.
+ *
+ * @param test The name of the test.
+ * @param kind What is registered, for example "limits".
+ * @param spec The value, for example in the format parseLimits() reads.
+ */
+void __registerannotation(const char* test, const char* kind, const char* spec);
+
 /**
  * @brief Do not instantiate this class directly. Use the UNIT_TEST macro.
  * This class is needed to run the __registertest() function at global scope.
@@ -120,6 +241,27 @@ public:
 	__registerdummy(void(*test)(simpletest::IOCapturer&, simpletest::SignalHandler&), const char* name){
 		__registertest(test, name);
 	}
+
+	/**
+	 * @brief Dummy function used to call __registerglobalsetup()
+	 *
+	 * @param setup The setup function to register.
+	 * @param name The name of the setup function.
+	 */
+	__registerdummy(void(*setup)(), const char* name){
+		__registerglobalsetup(setup, name);
+	}
+
+	/**
+	 * @brief Dummy function used to call __registerannotation()
+	 *
+	 * @param test The name of the test.
+	 * @param kind What is registered.
+	 * @param spec The value.
+	 */
+	__registerdummy(const char* test, const char* kind, const char* spec){
+		__registerannotation(test, kind, spec);
+	}
 };
 
 /**
@@ -140,6 +282,57 @@ public:
 	/* finally define the function prototype so the unit test can be defined */\
 	void str(simpletest::IOCapturer& __iocapt, simpletest::SignalHandler& __sighand)
 
+/**
+ * @brief Instantiate a global setup function like below:<br>
+ * ```C++
+ * static Model* model;
+ *
+ * GLOBAL_SETUP(load_model){
+ *     model = loadModel("model.bin");
+ * }
+ * ```
+ *
+ * Global setup functions run once, in the order they were defined, before any test.
+ * With --fork or --zygote, every test runs in a copy-on-write fork of the process made after the setup, so expensive state is built once and shared.
+ * If a setup function throws, no tests are run.
+ */
+#define GLOBAL_SETUP(str)\
+	/* declare the function so it is visible in the following line */\
+	void str();\
+	/* now register the setup function by instantiating a __registerdummy */\
+	simpletest::__registerdummy __##str(str, #str);\
+	/* finally define the function prototype so the setup function can be defined */\
+	void str()
+
+/**
+ * @brief Sets the resources a test may use, like below:<br>
+ * ```C++
+ * TEST_LIMITS(parse_huge_file, "memory=512M,cpu=10s,files=64,processes=16,output=100M");
+ * ```
+ *
+ * The limits are applied in the child process that runs the test, so a test with limits runs in a forked child of its own even without --fork.
+ * They take precedence over the ones given with --limits. A test that runs into one fails with TestResult::LIMIT_EXCEEDED.
+ * See parseLimits() for the format.
+ */
+#define TEST_LIMITS(str, spec)\
+	/* register the limits by instantiating a __registerdummy */\
+	simpletest::__registerdummy __limits_##str(#str, "limits", spec)
+
+/**
+ * @brief Declares how much of the machine a test needs, like below:<br>
+ * ```C++
+ * TEST_WEIGHTS(train_model, "cores=8,memory=4G,io=50");
+ * TEST_WEIGHTS(bench_parser, "isolated");
+ * ```
+ *
+ * When tests run in parallel with --jobs, they are packed so the tests running at once never need more cores, memory or disk bandwidth than the machine has, and each is pinned to CPUs of its own.
+ * An isolated test gets whole physical cores that no other test runs on, so its benchmarks and timing assertions are not disturbed.
+ * Tests without weights count as one core. See parseWeights() for the format.
+ */
+#define TEST_WEIGHTS(str, spec)\
+	/* register the weights by instantiating a __registerdummy */\
+	simpletest::__registerdummy __weights_##str(#str, "weights", spec)
+
 /**
  * @brief Throws an exception instead of crashing the program when a signal is thrown.
  */
@@ -0,0 +1,323 @@
+/** @file simpletest_agent.cpp
+ * @brief simpletest connections between simpletest-run's coordinator and the agents that run its tests on other hosts.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_agent.hpp"
+
+// std::runtime_error, std::invalid_argument
+#include <stdexcept>
+// std::strerror, std::memcpy
+#include <cstring>
+// errno
+#include <cerrno>
+// getaddrinfo(), freeaddrinfo(), gai_strerror()
+#include <netdb.h>
+// TCP_NODELAY, TCP_KEEPIDLE, TCP_KEEPINTVL, TCP_KEEPCNT
+#include <netinet/tcp.h>
+// socket(), bind(), listen(), connect(), setsockopt()
+#include <sys/socket.h>
+// lstat()
+#include <sys/stat.h>
+// sockaddr_un
+#include <sys/un.h>
+// close(), unlink()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief An address given as "unix:PATH" or "HOST:PORT".
+ */
+struct AgentAddress{
+	/**
+	 * @brief The path of a Unix socket, or empty for TCP.
+	 */
+	std::string path;
+
+	/**
+	 * @brief The host for TCP, without brackets. Empty for any.
+	 */
+	std::string host;
+
+	/**
+	 * @brief The port for TCP.
+	 */
+	std::string port;
+};
+
+/**
+ * @brief Splits an address into its parts.
+ *
+ * @exception std::invalid_argument The address is malformed.
+ */
+static AgentAddress parseAddress(const std::string& address){
+	AgentAddress ret;
+	size_t colon;
+
+	if (address.compare(0, 5, "unix:") == 0){
+		ret.path = address.substr(5);
+		if (ret.path.empty() || ret.path.size() >= sizeof(((struct sockaddr_un*)nullptr)->sun_path)){
+			throw std::invalid_argument("The Unix socket path in " + address + " is empty or too long");
+		}
+		return ret;
+	}
+
+	colon = address.rfind(':');
+	if (colon == std::string::npos || colon + 1 == address.size() || address.find_first_not_of("0123456789", colon + 1) != std::string::npos){
+		throw std::invalid_argument("The address " + address + " is not unix:PATH or HOST:PORT");
+	}
+	ret.host = address.substr(0, colon);
+	ret.port = address.substr(colon + 1);
+	if (ret.host.size() >= 2 && ret.host.front() == '[' && ret.host.back() == ']'){
+		ret.host = ret.host.substr(1, ret.host.size() - 2);
+	}
+	return ret;
+}
+
+/**
+ * @brief Makes a Unix socket address.
+ */
+static struct sockaddr_un unixAddress(const std::string& path){
+	struct sockaddr_un sun = {};
+
+	sun.sun_family = AF_UNIX;
+	std::memcpy(sun.sun_path, path.c_str(), path.size() + 1);
+	return sun;
+}
+
+/**
+ * @brief Resolves a TCP address.
+ *
+ * @param passive True to resolve an empty host to every interface, or false to this host.
+ *
+ * @exception std::runtime_error It could not be resolved.
+ */
+static struct addrinfo* resolve(const AgentAddress& addr, bool passive){
+	struct addrinfo hints = {};
+	struct addrinfo* res;
+	int err;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	err = getaddrinfo(addr.host.empty() ? nullptr : addr.host.c_str(), addr.port.c_str(), &hints, &res);
+	if (err != 0){
+		throw std::runtime_error("Failed to resolve " + addr.host + ":" + addr.port + " (" + gai_strerror(err) + ")");
+	}
+	return res;
+}
+
+int listenOn(const std::string& address){
+	AgentAddress addr = parseAddress(address);
+	struct addrinfo* res;
+	int fd = -1;
+	int err = 0;
+
+	if (!addr.path.empty()){
+		struct sockaddr_un sun = unixAddress(addr.path);
+		struct stat st;
+
+		// left behind by a coordinator that did not get to clean up
+		if (lstat(addr.path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)){
+			unlink(addr.path.c_str());
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0 || listen(fd, SOMAXCONN) != 0){
+			err = errno;
+			if (fd >= 0){
+				close(fd);
+			}
+			throw std::runtime_error("Failed to listen on " + address + " (" + std::strerror(err) + ")");
+		}
+		return fd;
+	}
+
+	res = resolve(addr, true);
+	for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next){
+		int one = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0){
+			err = errno;
+			continue;
+		}
+		// so a coordinator can be restarted on the same port right away
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0){
+			break;
+		}
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0){
+		throw std::runtime_error("Failed to listen on " + address + " (" + std::strerror(err) + ")");
+	}
+	return fd;
+}
+
+void closeListener(int fd, const std::string& address){
+	close(fd);
+	if (address.compare(0, 5, "unix:") == 0){
+		unlink(address.c_str() + 5);
+	}
+}
+
+void tuneConnection(int fd){
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	int one = 1;
+	int idle = 10;
+	int interval = 5;
+	int count = 3;
+
+	if (getsockname(fd, (struct sockaddr*)&ss, &len) != 0 || ss.ss_family == AF_UNIX){
+		return;
+	}
+	// tests and results are small, and waiting to batch them only adds latency
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	// a host that loses power never closes its connections, so probe them
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+int connectTo(const std::string& address){
+	AgentAddress addr = parseAddress(address);
+	struct addrinfo* res;
+	int fd = -1;
+	int err = 0;
+
+	if (!addr.path.empty()){
+		struct sockaddr_un sun = unixAddress(addr.path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0){
+			err = errno;
+			if (fd >= 0){
+				close(fd);
+			}
+			throw std::runtime_error("Failed to connect to " + address + " (" + std::strerror(err) + ")");
+		}
+		return fd;
+	}
+
+	res = resolve(addr, false);
+	for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next){
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0){
+			err = errno;
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+			break;
+		}
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0){
+		throw std::runtime_error("Failed to connect to " + address + " (" + std::strerror(err) + ")");
+	}
+	tuneConnection(fd);
+	return fd;
+}
+
+/**
+ * @brief Appends a value's bytes to a message.
+ */
+template <typename T>
+static void put(std::string& msg, T val){
+	msg.append((const char*)&val, sizeof(val));
+}
+
+/**
+ * @brief Appends a length-prefixed string to a message.
+ */
+static void putString(std::string& msg, const std::string& str){
+	put<uint32_t>(msg, str.size());
+	msg += str;
+}
+
+/**
+ * @brief Reads a value from a message, advancing pos past it.
+ */
+template <typename T>
+static T get(const std::string& msg, size_t& pos){
+	T val;
+	std::memcpy(&val, msg.data() + pos, sizeof(val));
+	pos += sizeof(val);
+	return val;
+}
+
+/**
+ * @brief Reads a length-prefixed string from a message, advancing pos past it.
+ */
+static std::string getString(const std::string& msg, size_t& pos){
+	uint32_t len = get<uint32_t>(msg, pos);
+	std::string ret = msg.substr(pos, len);
+	pos += len;
+	return ret;
+}
+
+std::string encodeHello(uint32_t slots){
+	std::string msg;
+
+	put<uint32_t>(msg, slots);
+	return msg;
+}
+
+bool decodeHello(std::string& buf, uint32_t& slots){
+	size_t pos = 0;
+
+	if (buf.size() < sizeof(uint32_t)){
+		return false;
+	}
+	slots = get<uint32_t>(buf, pos);
+	buf.erase(0, pos);
+	return true;
+}
+
+// the format is: payload length (8 bytes), then the id, index, fresh flag, program and limits
+std::string encodeJob(const AgentJob& job){
+	std::string payload;
+	std::string msg;
+
+	put<uint64_t>(payload, job.id);
+	put<uint64_t>(payload, job.index);
+	put<uint8_t>(payload, job.fresh);
+	putString(payload, job.program);
+	putString(payload, job.limits);
+
+	put<uint64_t>(msg, payload.size());
+	return msg + payload;
+}
+
+bool decodeJob(std::string& buf, AgentJob& job){
+	size_t pos = 0;
+	uint64_t len;
+
+	if (buf.size() < sizeof(len)){
+		return false;
+	}
+	len = get<uint64_t>(buf, pos);
+	if (buf.size() < pos + len){
+		return false;
+	}
+	job.id = get<uint64_t>(buf, pos);
+	job.index = get<uint64_t>(buf, pos);
+	job.fresh = get<uint8_t>(buf, pos) != 0;
+	job.program = getString(buf, pos);
+	job.limits = getString(buf, pos);
+	buf.erase(0, pos);
+	return true;
+}
+
+}
@@ -0,0 +1,120 @@
+/** @file simpletest_agent.hpp
+ * @brief simpletest connections between simpletest-run's coordinator and the agents that run its tests on other hosts.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_AGENT_HPP
+#define __SIMPLETEST_AGENT_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace simpletest{
+
+/**
+ * @brief A test the coordinator hands to an agent.
+ */
+struct AgentJob{
+	/**
+	 * @brief The coordinator's number for this run of the test, which the agent's result is sent back with through encodeResult().
+	 */
+	uint64_t id = 0;
+
+	/**
+	 * @brief The path of the test program, which must be the same on every host.
+	 */
+	std::string program;
+
+	/**
+	 * @brief The index of the test within the program.
+	 */
+	uint64_t index = 0;
+
+	/**
+	 * @brief The resource limits to give the program's workers, or empty for none.
+	 */
+	std::string limits;
+
+	/**
+	 * @brief True if the test is being retried, so it has to run in a new worker instead of one that already ran tests.
+	 */
+	bool fresh = false;
+};
+
+/**
+ * @brief Listens for agents on an address.
+ *
+ * @param address "unix:PATH" for a Unix socket, which replaces a stale socket left at PATH, or "HOST:PORT" for TCP. HOST may be empty to listen on every interface, and an IPv6 HOST is given in brackets.
+ *
+ * @return The listening socket.
+ *
+ * @exception std::invalid_argument The address is malformed.
+ * @exception std::runtime_error Failed to resolve or bind the address.
+ */
+int listenOn(const std::string& address);
+
+/**
+ * @brief Stops listening, removing the socket file of a Unix address.
+ *
+ * @param fd The socket returned by listenOn().
+ * @param address The address given to listenOn().
+ */
+void closeListener(int fd, const std::string& address);
+
+/**
+ * @brief Connects to a coordinator.
+ * TCP connections send small messages right away and are probed while idle, so a host that disappears without closing them is noticed within half a minute.
+ *
+ * @param address The address, as given to listenOn(). An empty HOST means this host.
+ *
+ * @return The connected socket.
+ *
+ * @exception std::invalid_argument The address is malformed.
+ * @exception std::runtime_error Failed to resolve or connect to the address.
+ */
+int connectTo(const std::string& address);
+
+/**
+ * @brief Sets the options connectTo() sets on a TCP connection the coordinator accepted. Does nothing for a Unix socket.
+ */
+void tuneConnection(int fd);
+
+/**
+ * @brief Serializes the message an agent introduces itself with.
+ * Messages are in native byte order, so the coordinator and its agents must run on machines of the same byte order, as running the same test programs requires anyway.
+ *
+ * @param slots The number of tests the agent runs at once.
+ */
+std::string encodeHello(uint32_t slots);
+
+/**
+ * @brief Deserializes an agent's introduction from the front of a buffer of received bytes, removing it from the buffer.
+ *
+ * @param buf The received bytes.
+ * @param slots Set to the number of tests the agent runs at once.
+ *
+ * @return False if the buffer does not hold a whole message yet.
+ */
+bool decodeHello(std::string& buf, uint32_t& slots);
+
+/**
+ * @brief Serializes a test for an agent to run.
+ */
+std::string encodeJob(const AgentJob& job);
+
+/**
+ * @brief Deserializes a test to run from the front of a buffer of received bytes, removing it from the buffer.
+ *
+ * @param buf The received bytes.
+ * @param job Set to the test.
+ *
+ * @return False if the buffer does not hold a whole message yet.
+ */
+bool decodeJob(std::string& buf, AgentJob& job);
+
+}
+
+#endif
@@ -0,0 +1,224 @@
+/** @file simpletest_benchmark.cpp
+ * @brief simpletest benchmark reporting.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_benchmark.hpp"
+// FailedExpectation, getCurrentTestName
+#include "simpletest.hpp"
+
+// std::sort
+#include <algorithm>
+// std::ceil, std::exp, std::log
+#include <cmath>
+// std::setw
+#include <iomanip>
+// std::ostringstream
+#include <sstream>
+
+namespace simpletest{
+
+/**
+ * @brief The number of bars in a histogram.
+ */
+static const size_t histogramBuckets = 12;
+
+/**
+ * @brief The width of the longest bar in a histogram.
+ */
+static const size_t histogramWidth = 40;
+
+/**
+ * @brief How long MEASURE_RESPONSE() waits for each response.
+ */
+static const std::chrono::seconds responseTimeout{10};
+
+/**
+ * @brief Returns the benchmark vector.
+ * This function is needed so the vector is initialized before anything reports to it.
+ */
+static std::vector<Benchmark>& __getbenchvec(){
+	static std::vector<Benchmark> __benchvec;
+	return __benchvec;
+}
+
+/**
+ * @brief Returns the sample at a percentile of sorted samples, using the nearest-rank method.
+ */
+static std::chrono::nanoseconds percentile(const std::vector<std::chrono::nanoseconds>& sorted, double p){
+	size_t rank = (size_t)std::ceil(p * sorted.size());
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+BenchmarkStats BenchmarkStats::of(std::vector<std::chrono::nanoseconds> samples){
+	BenchmarkStats st;
+	std::chrono::nanoseconds total{0};
+
+	if (samples.empty()){
+		return st;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	for (auto s : samples){
+		total += s;
+	}
+	st.count = samples.size();
+	st.min = samples.front();
+	st.max = samples.back();
+	st.mean = total / samples.size();
+	st.p50 = percentile(samples, 0.50);
+	st.p90 = percentile(samples, 0.90);
+	st.p99 = percentile(samples, 0.99);
+	return st;
+}
+
+BenchmarkStats reportBenchmark(Benchmark bench){
+	BenchmarkStats st = BenchmarkStats::of(bench.samples);
+	__getbenchvec().push_back(std::move(bench));
+	return st;
+}
+
+const std::vector<Benchmark>& getBenchmarks(){
+	return __getbenchvec();
+}
+
+void discardBenchmarks(size_t keep){
+	if (keep < __getbenchvec().size()){
+		__getbenchvec().resize(keep);
+	}
+}
+
+std::string formatDuration(std::chrono::nanoseconds d){
+	std::ostringstream oss;
+	double ns = d.count();
+
+	oss << std::fixed << std::setprecision(2);
+	if (ns < 1e3){
+		oss << ns << "ns";
+	}
+	else if (ns < 1e6){
+		oss << ns / 1e3 << "us";
+	}
+	else if (ns < 1e9){
+		oss << ns / 1e6 << "ms";
+	}
+	else{
+		oss << ns / 1e9 << "s";
+	}
+	return oss.str();
+}
+
+/**
+ * @brief Prints a histogram of samples with logarithmically sized buckets, so both the bulk and the tail are visible.
+ */
+static void printHistogram(std::ostream& os, const std::vector<std::chrono::nanoseconds>& samples, const BenchmarkStats& st){
+	std::vector<size_t> counts(histogramBuckets);
+	// bucket edges are spaced evenly between log(min) and log(max). +1 keeps a 0ns minimum from breaking the logarithm.
+	double lo = std::log((double)st.min.count() + 1);
+	double hi = std::log((double)st.max.count() + 1);
+	double step = (hi - lo) / histogramBuckets;
+	size_t largest = 0;
+
+	if (st.min == st.max){
+		os << "  " << std::setw(10) << formatDuration(st.min) << " | " << std::string(histogramWidth, '#') << ' ' << samples.size() << std::endl;
+		return;
+	}
+
+	for (auto s : samples){
+		size_t b = (size_t)((std::log((double)s.count() + 1) - lo) / step);
+		counts[std::min(b, histogramBuckets - 1)]++;
+	}
+	for (size_t c : counts){
+		largest = std::max(largest, c);
+	}
+
+	for (size_t i = 0; i < histogramBuckets; ++i){
+		std::chrono::nanoseconds edge((long long)(std::exp(lo + step * i) - 1));
+		size_t bar = counts[i] * histogramWidth / largest;
+
+		// make sure a bucket with anything in it is visible
+		if (counts[i] > 0 && bar == 0){
+			bar = 1;
+		}
+		os << "  " << std::setw(10) << std::right << formatDuration(edge) << " | " << std::left << std::setw(histogramWidth) << std::string(bar, '#') << ' ' << counts[i] << std::endl;
+	}
+}
+
+void printBenchmarks(std::ostream& os){
+	const std::vector<Benchmark>& benches = getBenchmarks();
+
+	if (benches.empty()){
+		return;
+	}
+
+	os << std::endl;
+	os << "Benchmarks:" << std::endl;
+	for (const Benchmark& b : benches){
+		BenchmarkStats st = BenchmarkStats::of(b.samples);
+
+		os << std::endl;
+		os << b.name << " (" << st.count << " samples)" << std::endl;
+		if (st.count > 0){
+			os << "  min " << formatDuration(st.min) << ", p50 " << formatDuration(st.p50) << ", p90 " << formatDuration(st.p90) << ", p99 " << formatDuration(st.p99) << ", max " << formatDuration(st.max) << ", mean " << formatDuration(st.mean) << std::endl;
+			printHistogram(os, b.samples, st);
+		}
+		for (const auto& d : b.details){
+			os << "  " << d.first << ": " << d.second << std::endl;
+		}
+	}
+}
+
+BenchmarkStats __measureresponse(const char* text, Regex& re, size_t n, IOCapturer& __iocapt){
+	FdCapturer& out = __iocapt.getStdoutCapturer();
+	FdCapturer& in = __iocapt.getStdinCapturer();
+	Benchmark bench;
+	const char* testName = getCurrentTestName();
+
+	bench.name = std::string(testName ? testName : "MEASURE_RESPONSE") + ": \"" + text + "\"";
+	bench.samples.reserve(n);
+
+	for (size_t i = 0; i < n; ++i){
+		std::chrono::steady_clock::time_point start;
+		std::chrono::steady_clock::time_point deadline;
+		size_t fed = 0;
+		bool matched = false;
+
+		// anything already written is a response to something else
+		out.consume(out.peek().size());
+		re.resetFeed();
+
+		start = std::chrono::steady_clock::now();
+		deadline = start + responseTimeout;
+		__iocapt.sendToStdin(text);
+
+		// spin instead of sleeping, since waking up from a sleep takes longer than many of the responses being measured
+		while (!matched){
+			std::string_view view;
+			std::chrono::steady_clock::time_point now;
+
+			in.pump();
+			view = out.peek();
+			// only the new output is fed, so long responses are not scanned over and over
+			matched = re.feed(view.substr(fed));
+			fed = view.size();
+			now = std::chrono::steady_clock::now();
+
+			if (matched){
+				bench.samples.push_back(now - start);
+			}
+			else if (now > deadline){
+				std::string last = IOCapturer::getLastLine(std::string(view));
+				throw FailedExpectation(("/" + re.getPattern() + "/").c_str(), last.c_str(), ("response " + std::to_string(i + 1) + " to \"" + text + "\" after " + formatDuration(now - start)).c_str());
+			}
+		}
+	}
+	// do not leave the responses for the next EXPECT()
+	out.consume(out.peek().size());
+
+	return reportBenchmark(std::move(bench));
+}
+
+}
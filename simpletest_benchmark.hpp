@@ -0,0 +1,145 @@
+/** @file simpletest_benchmark.hpp
+ * @brief simpletest benchmark reporting.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_BENCHMARK_HPP
+#define __SIMPLETEST_BENCHMARK_HPP
+
+#include "simpletest_iocapturer.hpp"
+#include "simpletest_regex.hpp"
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Summary statistics of a set of timing samples.
+ */
+struct BenchmarkStats{
+	/**
+	 * @brief The number of samples.
+	 */
+	size_t count = 0;
+
+	std::chrono::nanoseconds min{0};
+	std::chrono::nanoseconds max{0};
+	std::chrono::nanoseconds mean{0};
+
+	/**
+	 * @brief The median.
+	 */
+	std::chrono::nanoseconds p50{0};
+	std::chrono::nanoseconds p90{0};
+	std::chrono::nanoseconds p99{0};
+
+	/**
+	 * @brief Computes the statistics of a set of samples.
+	 *
+	 * @param samples The samples, in any order.
+	 */
+	static BenchmarkStats of(std::vector<std::chrono::nanoseconds> samples);
+};
+
+/**
+ * @brief A named set of timing samples to report after the tests run.
+ */
+struct Benchmark{
+	/**
+	 * @brief The name shown in the report, usually the test's name and what was measured.
+	 */
+	std::string name;
+
+	/**
+	 * @brief The timing samples.
+	 */
+	std::vector<std::chrono::nanoseconds> samples;
+
+	/**
+	 * @brief Extra measurements shown under the histogram, as (label, value) pairs.
+	 */
+	std::vector<std::pair<std::string, std::string>> details;
+};
+
+/**
+ * @brief Adds a benchmark to the report that is printed after the test results.
+ *
+ * @param bench The benchmark.
+ *
+ * @return The benchmark's statistics.
+ */
+BenchmarkStats reportBenchmark(Benchmark bench);
+
+/**
+ * @brief Returns the benchmarks reported so far.
+ */
+const std::vector<Benchmark>& getBenchmarks();
+
+/**
+ * @brief Forgets the benchmarks reported after the first few, so they are not in the report.
+ *
+ * @param keep How many of the benchmarks reported so far to keep, for example getBenchmarks().size() before running something.
+ */
+void discardBenchmarks(size_t keep);
+
+/**
+ * @brief Prints each reported benchmark's statistics and a latency histogram.
+ * EXECUTE_TESTS() calls this after printing the test results.
+ *
+ * @param os The stream to print to.
+ */
+void printBenchmarks(std::ostream& os);
+
+/**
+ * @brief Formats a duration with a readable unit, for example "1.52ms".
+ *
+ * @param d The duration.
+ */
+std::string formatDuration(std::chrono::nanoseconds d);
+
+/**
+ * @brief Measures the time from sending a line to stdin to the output matching a pattern, 100 times.
+ * The code under test must be running on another thread (or in a process sharing stdin/stdout), for example a REPL loop reading std::cin.
+ * The latencies are reported as a benchmark named after the test and the line.
+ *
+ * @param text The line to send.
+ * @param pattern A string literal containing a pattern that the response matches. See simpletest::Regex for the syntax.
+ *
+ * @exception FailedExpectation Thrown if a response does not arrive within 10 seconds.
+ */
+#define MEASURE_RESPONSE(text, pattern)\
+	MEASURE_RESPONSE_N(text, pattern, 100)
+
+/**
+ * @brief The same as MEASURE_RESPONSE(), but with a custom number of repetitions.
+ *
+ * @param text The line to send.
+ * @param pattern A string literal containing a pattern that the response matches.
+ * @param n The number of times to send the line.
+ */
+#define MEASURE_RESPONSE_N(text, pattern, n)\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__measureresponse(text, __STATIC_REGEX(pattern), n, __iocapt)
+
+/**
+ * @brief Do not call this function directly. Use the MEASURE_RESPONSE() macro instead.
+ *
+ * @param text     The line to send.
+ * @param re       The compiled pattern.
+ * @param n        The number of repetitions.
+ * @param __iocapt The current I/O capturer object.
+ *
+ * @return The latency statistics.
+ */
+BenchmarkStats __measureresponse(const char* text, Regex& re, size_t n, IOCapturer& __iocapt);
+
+}
+
+#endif
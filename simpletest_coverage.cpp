@@ -0,0 +1,620 @@
+/** @file simpletest_coverage.cpp
+ * @brief simpletest per-test coverage capture and test impact analysis.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_coverage.hpp"
+
+// std::sort, std::unique, std::any_of
+#include <algorithm>
+// std::ifstream, std::ofstream
+#include <fstream>
+// std::ostringstream
+#include <sstream>
+// std::runtime_error
+#include <stdexcept>
+// std::set
+#include <set>
+// std::strerror, std::strcmp
+#include <cstring>
+// errno
+#include <cerrno>
+// getenv(), setenv(), unsetenv(), realpath(), free()
+#include <cstdlib>
+// opendir(), readdir()
+#include <dirent.h>
+// lstat()
+#include <sys/stat.h>
+
+/**
+ * @brief The gcov runtime's entry points.
+ * They are weak, so programs built without --coverage still link, and coverageAvailable() tells whether they are there.
+ */
+extern "C" void __gcov_reset(void) __attribute__((weak));
+extern "C" void __gcov_dump(void) __attribute__((weak));
+
+namespace simpletest{
+
+const char* const CoverageMap::globalSetup = "(global setup)";
+
+/**
+ * @brief The first 8 bytes of a coverage map.
+ */
+static const uint64_t mapMagic = 0x313030564f435453ULL; // "STCOV001"
+
+/**
+ * @brief The magic numbers and record tags of .gcno and .gcda files.
+ */
+static const uint32_t gcnoMagic = 0x67636e6f;
+static const uint32_t gcdaMagic = 0x67636461;
+static const uint32_t tagFunction = 0x01000000;
+static const uint32_t tagArcCounts = 0x01a10000;
+
+bool coverageAvailable(){
+	return __gcov_reset != nullptr && __gcov_dump != nullptr;
+}
+
+void coverageReset(){
+	if (coverageAvailable()){
+		__gcov_reset();
+	}
+}
+
+/**
+ * @brief Sets or unsets an environment variable to what getenv() returned for it earlier.
+ */
+static void restoreVariable(const char* name, const char* value, const std::string& saved){
+	if (value){
+		setenv(name, saved.c_str(), 1);
+	}
+	else{
+		unsetenv(name);
+	}
+}
+
+void coverageDump(const std::string& dir){
+	const char* prefix = getenv("GCOV_PREFIX");
+	const char* strip = getenv("GCOV_PREFIX_STRIP");
+	std::string oldPrefix = prefix ? prefix : "";
+	std::string oldStrip = strip ? strip : "";
+
+	if (!coverageAvailable()){
+		return;
+	}
+	// the runtime reads these each time it dumps; stripping would lose the paths the .gcno files are found by
+	setenv("GCOV_PREFIX", dir.c_str(), 1);
+	unsetenv("GCOV_PREFIX_STRIP");
+	__gcov_dump();
+	restoreVariable("GCOV_PREFIX", prefix, oldPrefix);
+	restoreVariable("GCOV_PREFIX_STRIP", strip, oldStrip);
+}
+
+/**
+ * @brief Reads a whole file.
+ */
+static std::string readWholeFile(const std::string& path){
+	std::ifstream ifs(path, std::ios::binary);
+	std::ostringstream oss;
+
+	if (!ifs){
+		throw std::runtime_error("Failed to open " + path + " (" + std::strerror(errno) + ")");
+	}
+	oss << ifs.rdbuf();
+	return oss.str();
+}
+
+/**
+ * @brief Reads the parts of a gcov file, or a coverage map, with bounds checks.
+ */
+class Reader{
+public:
+	/**
+	 * @brief Reads from a file's contents.
+	 *
+	 * @param data The contents.
+	 * @param path The file's path, for error messages.
+	 */
+	Reader(const std::string& data, const std::string& path): data(data), path(path){}
+
+	/**
+	 * @brief Reads a value in this machine's byte order.
+	 */
+	template <typename T>
+	T get(){
+		T val;
+		need(sizeof(val));
+		std::memcpy(&val, data.data() + pos, sizeof(val));
+		pos += sizeof(val);
+		return val;
+	}
+
+	/**
+	 * @brief Reads a string stored as its length in bytes followed by the bytes, which may end with NULs.
+	 */
+	std::string getString(){
+		uint32_t len = get<uint32_t>();
+		std::string ret;
+
+		need(len);
+		ret = data.substr(pos, len);
+		pos += len;
+		ret.erase(std::find(ret.begin(), ret.end(), '\0'), ret.end());
+		return ret;
+	}
+
+	/**
+	 * @brief Reads a number stored in 7-bit groups, lowest first.
+	 */
+	uint64_t getVarint(){
+		uint64_t ret = 0;
+
+		for (int shift = 0; shift < 64; shift += 7){
+			uint8_t b = get<uint8_t>();
+			ret |= (uint64_t)(b & 0x7f) << shift;
+			if (!(b & 0x80)){
+				return ret;
+			}
+		}
+		throw std::runtime_error(path + " is corrupt");
+	}
+
+	/**
+	 * @brief Moves to an offset, which may be the end but not past it.
+	 */
+	void seek(size_t offset){
+		if (offset > data.size()){
+			throw std::runtime_error(path + " is truncated");
+		}
+		pos = offset;
+	}
+
+	/**
+	 * @brief Returns the current offset.
+	 */
+	size_t tell() const{
+		return pos;
+	}
+
+	/**
+	 * @brief Returns true once everything was read.
+	 */
+	bool done() const{
+		return pos >= data.size();
+	}
+
+private:
+	/**
+	 * @brief Throws if fewer than n bytes are left.
+	 */
+	void need(size_t n){
+		if (data.size() - pos < n){
+			throw std::runtime_error(path + " is truncated");
+		}
+	}
+
+	/**
+	 * @brief The file's contents.
+	 */
+	const std::string& data;
+
+	/**
+	 * @brief The file's path.
+	 */
+	std::string path;
+
+	/**
+	 * @brief The current offset.
+	 */
+	size_t pos = 0;
+};
+
+/**
+ * @brief Reads the header shared by .gcno and .gcda files, checking that it is a version whose records are measured in bytes.
+ *
+ * @return The stamp that pairs a .gcda file with its .gcno file.
+ */
+static uint32_t readGcovHeader(Reader& r, uint32_t magic, const std::string& path){
+	uint32_t version;
+	char v[4];
+	uint32_t stamp;
+
+	if (r.get<uint32_t>() != magic){
+		throw std::runtime_error(path + " is not a gcov file written on this machine");
+	}
+	version = r.get<uint32_t>();
+	// the version is 4 characters such as "B22*" for GCC 12.2, stored as a number
+	for (int i = 0; i < 4; ++i){
+		v[i] = (version >> (24 - 8 * i)) & 0xff;
+	}
+	if (v[0] < 'B' || (v[0] == 'B' && v[1] < '2')){
+		throw std::runtime_error(path + " has gcov format " + std::string(v, 3) + ", which is older than GCC 12 and not supported");
+	}
+	stamp = r.get<uint32_t>();
+	// the checksum of the whole program
+	r.get<uint32_t>();
+	return stamp;
+}
+
+/**
+ * @brief Turns a path into an absolute one without "." or ".." components, without touching the file system.
+ */
+static std::string normalizePath(const std::string& path, const std::string& cwd){
+	std::vector<std::string> parts;
+	std::istringstream iss(path[0] == '/' ? path : cwd + "/" + path);
+	std::string part;
+	std::string ret;
+
+	while (std::getline(iss, part, '/')){
+		if (part.empty() || part == "."){
+			continue;
+		}
+		if (part == ".."){
+			if (!parts.empty()){
+				parts.pop_back();
+			}
+			continue;
+		}
+		parts.push_back(part);
+	}
+	for (const std::string& p : parts){
+		ret += "/" + p;
+	}
+	return ret.empty() ? "/" : ret;
+}
+
+/**
+ * @brief Lists the files under a directory whose names end with a suffix.
+ */
+static void findFiles(const std::string& dir, const std::string& suffix, std::vector<std::string>& out){
+	DIR* d = opendir(dir.c_str());
+	struct dirent* de;
+	struct stat st;
+
+	if (!d){
+		return;
+	}
+	while ((de = readdir(d)) != nullptr){
+		std::string path;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")){
+			continue;
+		}
+		path = dir + "/" + de->d_name;
+		if (lstat(path.c_str(), &st) != 0){
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)){
+			findFiles(path, suffix, out);
+		}
+		else if (path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0){
+			out.push_back(path);
+		}
+	}
+	closedir(d);
+}
+
+uint32_t CoverageMap::intern(const std::string& source, const std::string& name){
+	auto s = sourceIndex.find(source);
+	uint32_t si;
+
+	if (s == sourceIndex.end()){
+		s = sourceIndex.emplace(source, sources.size()).first;
+		sources.push_back(source);
+	}
+	si = s->second;
+
+	auto f = functionIndex.find({si, name});
+	if (f == functionIndex.end()){
+		f = functionIndex.emplace(std::make_pair(si, name), functions.size()).first;
+		functions.push_back({si, name});
+	}
+	return f->second;
+}
+
+void CoverageMap::record(const std::string& test, const std::string& dumpDir){
+	std::vector<std::string> gcdas;
+	std::vector<uint32_t> covered;
+
+	findFiles(dumpDir, ".gcda", gcdas);
+	for (const std::string& gcda : gcdas){
+		// the .gcno file is next to where the runtime would have put the .gcda file without a prefix
+		std::string gcno = gcda.substr(dumpDir.size(), gcda.size() - dumpDir.size() - 5) + ".gcno";
+		std::string data;
+		uint32_t ident = 0;
+		bool haveIdent = false;
+
+		auto it = notes.find(gcno);
+		if (it == notes.end()){
+			std::string nd = readWholeFile(gcno);
+			Reader r(nd, gcno);
+			uint32_t stamp = readGcovHeader(r, gcnoMagic, gcno);
+			std::string cwd = r.getString();
+			std::map<uint32_t, uint32_t> idents;
+
+			// whether the notes have unexecuted blocks
+			r.get<uint32_t>();
+			while (!r.done()){
+				uint32_t tag = r.get<uint32_t>();
+				uint32_t len;
+
+				if (tag == 0){
+					break;
+				}
+				len = r.get<uint32_t>();
+				size_t end = r.tell() + len;
+
+				if (tag == tagFunction){
+					uint32_t id = r.get<uint32_t>();
+					std::string name;
+					std::string source;
+					bool artificial;
+
+					// the line number and control flow checksums
+					r.get<uint32_t>();
+					r.get<uint32_t>();
+					name = r.getString();
+					artificial = r.get<uint32_t>() != 0;
+					source = r.getString();
+					// static initializers and the like are not something a change is made to
+					if (!artificial){
+						idents[id] = intern(normalizePath(source, cwd), name);
+					}
+				}
+				r.seek(end);
+			}
+			it = notes.emplace(gcno, std::make_pair(stamp, std::move(idents))).first;
+		}
+
+		data = readWholeFile(gcda);
+		Reader r(data, gcda);
+		if (readGcovHeader(r, gcdaMagic, gcda) != it->second.first){
+			throw std::runtime_error(gcno + " does not belong to the running program; rebuild it");
+		}
+		while (!r.done()){
+			uint32_t tag = r.get<uint32_t>();
+			int32_t len;
+			size_t end;
+
+			// the runtime ends the file with a zero tag
+			if (tag == 0){
+				break;
+			}
+			len = r.get<int32_t>();
+
+			// counters that are all zero are written as a negative length with nothing after it
+			if (len < 0){
+				if (tag == tagFunction){
+					haveIdent = false;
+				}
+				continue;
+			}
+			end = r.tell() + len;
+			if (tag == tagFunction){
+				haveIdent = len >= 4;
+				if (haveIdent){
+					ident = r.get<uint32_t>();
+				}
+			}
+			else if (tag == tagArcCounts && haveIdent){
+				bool ran = false;
+				for (int32_t i = 0; i < len / 8; ++i){
+					ran = ran || r.get<uint64_t>() != 0;
+				}
+				auto fn = it->second.second.find(ident);
+				if (ran && fn != it->second.second.end()){
+					covered.push_back(fn->second);
+				}
+			}
+			r.seek(end);
+		}
+	}
+
+	std::sort(covered.begin(), covered.end());
+	covered.erase(std::unique(covered.begin(), covered.end()), covered.end());
+	tests[test] = std::move(covered);
+}
+
+void CoverageMap::forget(const std::string& test){
+	tests.erase(test);
+}
+
+bool CoverageMap::contains(const std::string& test) const{
+	return tests.count(test) > 0;
+}
+
+/**
+ * @brief Returns true if a path looks like C or C++ source code or a header.
+ */
+static bool isSourceFile(const std::string& path){
+	static const char* const exts[] = {".c", ".cc", ".cpp", ".cxx", ".c++", ".h", ".hh", ".hpp", ".hxx", ".h++", ".inl", ".ipp", ".tcc"};
+	size_t dot = path.rfind('.');
+
+	if (dot == std::string::npos || path.find('/', dot) != std::string::npos){
+		return false;
+	}
+	return std::any_of(std::begin(exts), std::end(exts), [&](const char* ext){ return path.compare(dot, std::string::npos, ext) == 0; });
+}
+
+std::vector<bool> CoverageMap::affected(const std::vector<std::string>& testNames, const std::vector<std::string>& changed) const{
+	std::vector<bool> ret(testNames.size(), false);
+	std::vector<bool> touched(sources.size(), false);
+	std::set<uint32_t> hit;
+	bool all = false;
+
+	for (const std::string& c : changed){
+		char* real = realpath(c.c_str(), nullptr);
+		std::string resolved = real ? real : "";
+		std::string suffix = "/" + normalizePath(c, "").substr(1);
+		bool known = false;
+
+		free(real);
+		for (size_t i = 0; i < sources.size(); ++i){
+			const std::string& s = sources[i];
+			if (s == resolved || (s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0)){
+				touched[i] = true;
+				known = true;
+			}
+		}
+		if (!known && isSourceFile(c)){
+			all = true;
+		}
+	}
+	for (size_t i = 0; i < functions.size(); ++i){
+		if (touched[functions[i].first]){
+			hit.insert(i);
+		}
+	}
+	auto touches = [&](const std::vector<uint32_t>& fns){
+		return std::any_of(fns.begin(), fns.end(), [&hit](uint32_t f){ return hit.count(f) > 0; });
+	};
+
+	auto setup = tests.find(globalSetup);
+	if (setup != tests.end() && touches(setup->second)){
+		all = true;
+	}
+	for (size_t i = 0; i < testNames.size(); ++i){
+		auto t = tests.find(testNames[i]);
+		ret[i] = all || t == tests.end() || touches(t->second);
+	}
+	return ret;
+}
+
+/**
+ * @brief Appends a value in this machine's byte order.
+ */
+template <typename T>
+static void put(std::string& buf, T val){
+	buf.append((const char*)&val, sizeof(val));
+}
+
+/**
+ * @brief Appends a string as its length followed by its bytes.
+ */
+static void putString(std::string& buf, const std::string& str){
+	put<uint32_t>(buf, str.size());
+	buf += str;
+}
+
+/**
+ * @brief Appends a number in 7-bit groups, lowest first, so small numbers take one byte.
+ */
+static void putVarint(std::string& buf, uint64_t n){
+	while (n >= 0x80){
+		buf += (char)(n | 0x80);
+		n >>= 7;
+	}
+	buf += (char)n;
+}
+
+void CoverageMap::save(const std::string& path) const{
+	// only what some test ran is written, renumbered in order
+	std::vector<int64_t> newFunction(functions.size(), -1);
+	std::vector<int64_t> newSource(sources.size(), -1);
+	std::vector<uint32_t> keptFunctions;
+	std::vector<uint32_t> keptSources;
+	std::string buf;
+	std::string tmp = path + ".tmp";
+
+	for (const auto& t : tests){
+		for (uint32_t f : t.second){
+			newFunction[f] = 0;
+		}
+	}
+	for (size_t f = 0; f < functions.size(); ++f){
+		if (newFunction[f] >= 0){
+			newFunction[f] = keptFunctions.size();
+			keptFunctions.push_back(f);
+			if (newSource[functions[f].first] < 0){
+				newSource[functions[f].first] = keptSources.size();
+				keptSources.push_back(functions[f].first);
+			}
+		}
+	}
+
+	put<uint64_t>(buf, mapMagic);
+	put<uint32_t>(buf, keptSources.size());
+	for (uint32_t s : keptSources){
+		putString(buf, sources[s]);
+	}
+	put<uint32_t>(buf, keptFunctions.size());
+	for (uint32_t f : keptFunctions){
+		putVarint(buf, newSource[functions[f].first]);
+		putString(buf, functions[f].second);
+	}
+	put<uint32_t>(buf, tests.size());
+	for (const auto& t : tests){
+		std::vector<uint32_t> ids;
+		uint32_t prev = 0;
+
+		for (uint32_t f : t.second){
+			ids.push_back(newFunction[f]);
+		}
+		std::sort(ids.begin(), ids.end());
+		putString(buf, t.first);
+		putVarint(buf, ids.size());
+		// sorted, so the gaps are small
+		for (uint32_t id : ids){
+			putVarint(buf, id - prev);
+			prev = id;
+		}
+	}
+
+	{
+		std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+		ofs.write(buf.data(), buf.size());
+		if (!ofs){
+			throw std::runtime_error("Failed to write " + tmp + " (" + std::strerror(errno) + ")");
+		}
+	}
+	if (rename(tmp.c_str(), path.c_str()) != 0){
+		throw std::runtime_error("Failed to replace " + path + " (" + std::strerror(errno) + ")");
+	}
+}
+
+CoverageMap CoverageMap::load(const std::string& path){
+	std::string data = readWholeFile(path);
+	Reader r(data, path);
+	CoverageMap ret;
+	uint32_t n;
+
+	if (data.size() < sizeof(mapMagic) || r.get<uint64_t>() != mapMagic){
+		throw std::runtime_error(path + " is not a simpletest coverage map");
+	}
+	n = r.get<uint32_t>();
+	for (uint32_t i = 0; i < n; ++i){
+		std::string s = r.getString();
+		ret.sourceIndex[s] = ret.sources.size();
+		ret.sources.push_back(s);
+	}
+	n = r.get<uint32_t>();
+	for (uint32_t i = 0; i < n; ++i){
+		uint64_t source = r.getVarint();
+		std::string name = r.getString();
+		if (source >= ret.sources.size()){
+			throw std::runtime_error(path + " is corrupt");
+		}
+		ret.functionIndex[{(uint32_t)source, name}] = ret.functions.size();
+		ret.functions.push_back({(uint32_t)source, name});
+	}
+	n = r.get<uint32_t>();
+	for (uint32_t i = 0; i < n; ++i){
+		std::string name = r.getString();
+		uint64_t count = r.getVarint();
+		std::vector<uint32_t>& ids = ret.tests[name];
+		uint64_t id = 0;
+
+		for (uint64_t j = 0; j < count; ++j){
+			id += r.getVarint();
+			if (id >= ret.functions.size()){
+				throw std::runtime_error(path + " is corrupt");
+			}
+			ids.push_back(id);
+		}
+	}
+	return ret;
+}
+
+}
@@ -0,0 +1,147 @@
+/** @file simpletest_coverage.hpp
+ * @brief simpletest per-test coverage capture and test impact analysis.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_COVERAGE_HPP
+#define __SIMPLETEST_COVERAGE_HPP
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Returns true if this program has the gcov runtime's __gcov_reset() and __gcov_dump().
+ * That takes compiling with --coverage and linking with -Wl,-u,__gcov_dump,-u,__gcov_reset, since the runtime only brings them along when something asks for them.
+ */
+bool coverageAvailable();
+
+/**
+ * @brief Zeroes the coverage counters, so the next coverageDump() only shows what ran since.
+ * Does nothing if coverageAvailable() is false.
+ */
+void coverageReset();
+
+/**
+ * @brief Writes the coverage counters as .gcda files under a directory instead of next to the object files.
+ * Each file lands at the directory followed by its usual absolute path, as with the GCOV_PREFIX environment variable.
+ * If the directory already has counters for an object, the new ones are added to them.
+ * Does nothing if coverageAvailable() is false.
+ *
+ * @param dir The directory.
+ */
+void coverageDump(const std::string& dir);
+
+/**
+ * @brief Which functions each test ran, for picking the tests a change can affect.
+ * Functions are identified by their mangled name and the absolute path of the source file they are defined in, which may be a header.
+ */
+class CoverageMap{
+public:
+	/**
+	 * @brief The name the coverage of GLOBAL_SETUP() and static initialization is recorded under.
+	 * A change to anything it ran can affect every test.
+	 */
+	static const char* const globalSetup;
+
+	/**
+	 * @brief Reads a map saved by save().
+	 *
+	 * @param path The file.
+	 *
+	 * @exception std::runtime_error The file could not be read or is not a coverage map.
+	 */
+	static CoverageMap load(const std::string& path);
+
+	/**
+	 * @brief Writes the map to a file, replacing it atomically.
+	 * Functions and source files that no test ran are left out.
+	 *
+	 * @param path The file.
+	 *
+	 * @exception std::runtime_error The file could not be written.
+	 */
+	void save(const std::string& path) const;
+
+	/**
+	 * @brief Records what a test ran, replacing what was recorded for it before.
+	 *
+	 * @param test The test's name.
+	 * @param dumpDir The directory coverageDump() wrote the test's counters to. The .gcno files are read from next to where the .gcda files would normally go.
+	 *
+	 * @exception std::runtime_error A .gcno file is missing, does not match its .gcda file, or was written by a compiler older than GCC 12.
+	 */
+	void record(const std::string& test, const std::string& dumpDir);
+
+	/**
+	 * @brief Drops what was recorded for a test, so it is affected by every change until it is recorded again.
+	 * This is for a test whose counters were lost, for example because it crashed its child process.
+	 */
+	void forget(const std::string& test);
+
+	/**
+	 * @brief Returns true if anything was recorded for a test.
+	 */
+	bool contains(const std::string& test) const;
+
+	/**
+	 * @brief Decides which tests a set of changed files can affect.
+	 * A test is affected if it ran a function from one of the files, or if nothing was recorded for it.
+	 * Every test is affected if the global setup ran a function from one of the files, or if one of them is a C or C++ source file or header that no recorded function comes from, since it may be new or only declare things.
+	 * A changed path matches a recorded source file if both name the same file, or if the recorded path ends with it, so paths relative to the root of the repository work.
+	 *
+	 * @param tests The names of the tests.
+	 * @param changed The changed files.
+	 *
+	 * @return For each test, true if it should run.
+	 */
+	std::vector<bool> affected(const std::vector<std::string>& tests, const std::vector<std::string>& changed) const;
+
+private:
+	/**
+	 * @brief The absolute paths of the source files.
+	 */
+	std::vector<std::string> sources;
+
+	/**
+	 * @brief Each function's index in sources and mangled name.
+	 */
+	std::vector<std::pair<uint32_t, std::string>> functions;
+
+	/**
+	 * @brief The indexes in functions of what each test ran, sorted.
+	 */
+	std::map<std::string, std::vector<uint32_t>> tests;
+
+	/**
+	 * @brief The index of each source file in sources.
+	 */
+	std::map<std::string, uint32_t> sourceIndex;
+
+	/**
+	 * @brief The index of each function in functions.
+	 */
+	std::map<std::pair<uint32_t, std::string>, uint32_t> functionIndex;
+
+	/**
+	 * @brief Finds a function's index in functions, adding it if it is not there.
+	 */
+	uint32_t intern(const std::string& source, const std::string& name);
+
+	/**
+	 * @brief The functions read from each .gcno file so far, by their ident, along with the file's stamp.
+	 * This is not saved; it only spares reading the same notes for every test.
+	 */
+	std::map<std::string, std::pair<uint32_t, std::map<uint32_t, uint32_t>>> notes;
+};
+
+}
+
+#endif
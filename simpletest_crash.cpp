@@ -0,0 +1,684 @@
+/** @file simpletest_crash.cpp
+ * @brief simpletest crash-consistency checking.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_crash.hpp"
+
+// std::sort
+#include <algorithm>
+// std::atomic
+#include <atomic>
+// std::exception_ptr
+#include <exception>
+// std::map
+#include <map>
+// std::mutex
+#include <mutex>
+// std::set
+#include <set>
+// std::logic_error, std::runtime_error
+#include <stdexcept>
+// std::thread
+#include <thread>
+// std::strerror
+#include <cstring>
+// opendir(), readdir()
+#include <dirent.h>
+// open()
+#include <fcntl.h>
+// realpath(), PATH_MAX
+#include <climits>
+// stat()
+#include <sys/stat.h>
+// read(), write(), close(), rmdir(), unlink()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief The private implementation of the CrashRecorder class.
+ */
+struct CrashRecorderImpl{
+	/**
+	 * @brief The recorded directory as an absolute path with no symlinks.
+	 */
+	std::string base;
+
+	/**
+	 * @brief The path the directory was given as, used to name the crash state directories.
+	 */
+	std::string givenPath;
+
+	/**
+	 * @brief The directories under base when recording started, relative to base.
+	 */
+	std::vector<std::string> baseDirs;
+
+	/**
+	 * @brief The files under base and their contents when recording started, relative to base.
+	 */
+	std::map<std::string, std::string> baseFiles;
+
+	/**
+	 * @brief The operations recorded so far.
+	 */
+	std::vector<FsOp> ops;
+
+	/**
+	 * @brief True while recording.
+	 */
+	bool recording = false;
+
+	/**
+	 * @brief Returns a path relative to base, "." for base itself, or an empty string if it is not inside base.
+	 *
+	 * @param abs An absolute path with no "." or ".." components.
+	 */
+	std::string relative(const std::string& abs) const{
+		if (abs == base){
+			return ".";
+		}
+		if (abs.size() <= base.size() + 1 || abs.compare(0, base.size(), base) != 0 || abs[base.size()] != '/'){
+			return "";
+		}
+		return abs.substr(base.size() + 1);
+	}
+};
+
+/**
+ * @brief The recorder that is recording, or nullptr if none is.
+ * It is only read or changed with recorderMutex held, so a recorder cannot be destroyed while an interposer is recording into it.
+ */
+static CrashRecorderImpl* activeRecorder = nullptr;
+
+/**
+ * @brief Protects activeRecorder and the operations it records, since the code under test may write from several threads.
+ */
+static std::mutex recorderMutex;
+
+/**
+ * @brief True while a recorder is recording.
+ * The interposers check this on every call, so it can be read without taking recorderMutex.
+ */
+static std::atomic<bool> anyRecording{false};
+
+/**
+ * @brief True once simpletest_crash_hooks.o has told us it is linked in.
+ */
+static std::atomic<bool> hooksInstalled{false};
+
+/**
+ * @brief A pseudo-random number generator (splitmix64), so the crash states are the same on every run.
+ */
+static uint64_t nextRandom(uint64_t& state){
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * @brief Creates a directory and any missing parents.
+ */
+static void makeDirs(const std::string& path){
+	size_t pos = 0;
+
+	while ((pos = path.find('/', pos + 1)) != std::string::npos){
+		mkdir(path.substr(0, pos).c_str(), 0755);
+	}
+	if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST){
+		throw std::runtime_error("Failed to create directory " + path + " (" + std::strerror(errno) + ")");
+	}
+}
+
+/**
+ * @brief Removes a directory and everything in it.
+ */
+static void removeTree(const std::string& path){
+	DIR* dir = opendir(path.c_str());
+	struct dirent* ent;
+
+	if (dir == nullptr){
+		unlink(path.c_str());
+		return;
+	}
+	while ((ent = readdir(dir)) != nullptr){
+		std::string name = ent->d_name;
+		struct stat st;
+
+		if (name == "." || name == ".."){
+			continue;
+		}
+		if (lstat((path + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+			removeTree(path + "/" + name);
+		}
+		else{
+			unlink((path + "/" + name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
+/**
+ * @brief Reads a whole file.
+ */
+static std::string readWholeFile(const std::string& path){
+	std::string ret;
+	char buf[65536];
+	ssize_t ss;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0){
+		throw std::runtime_error("Failed to open " + path + " (" + std::strerror(errno) + ")");
+	}
+	while ((ss = read(fd, buf, sizeof(buf))) > 0){
+		ret.append(buf, ss);
+	}
+	close(fd);
+	return ret;
+}
+
+/**
+ * @brief Writes a whole file, replacing it if it exists.
+ */
+static void writeWholeFile(const std::string& path, const std::string& data){
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	size_t done = 0;
+
+	if (fd < 0){
+		throw std::runtime_error("Failed to create " + path + " (" + std::strerror(errno) + ")");
+	}
+	while (done < data.size()){
+		ssize_t ss = ::write(fd, data.data() + done, data.size() - done);
+		if (ss <= 0){
+			close(fd);
+			throw std::runtime_error("Failed to write " + path + " (" + std::strerror(errno) + ")");
+		}
+		done += ss;
+	}
+	close(fd);
+}
+
+/**
+ * @brief Snapshots a directory's files and subdirectories.
+ */
+static void snapshot(CrashRecorderImpl& impl, const std::string& rel){
+	std::string abs = rel.empty() ? impl.base : impl.base + "/" + rel;
+	DIR* dir = opendir(abs.c_str());
+	struct dirent* ent;
+
+	if (dir == nullptr){
+		throw std::runtime_error("Failed to open directory " + abs + " (" + std::strerror(errno) + ")");
+	}
+	while ((ent = readdir(dir)) != nullptr){
+		std::string name = ent->d_name;
+		std::string childRel = rel.empty() ? name : rel + "/" + name;
+		struct stat st;
+
+		if (name == "." || name == ".." || lstat((abs + "/" + name).c_str(), &st) != 0){
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)){
+			impl.baseDirs.push_back(childRel);
+			snapshot(impl, childRel);
+		}
+		else if (S_ISREG(st.st_mode)){
+			// unreadable files cannot be cloned, so they are treated as empty
+			try{
+				impl.baseFiles[childRel] = readWholeFile(abs + "/" + name);
+			}
+			catch (std::runtime_error&){
+				impl.baseFiles[childRel] = "";
+			}
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * @brief A candidate crash state: a prefix of the operation log, minus some operations that were not durable yet.
+ */
+typedef std::pair<size_t, std::vector<size_t>> CrashState;
+
+/**
+ * @brief Returns true for the operations that change a directory's entries, which only become durable once the directory is fsynced.
+ */
+static bool changesEntries(const FsOp& op){
+	return op.type == FsOp::CREATE || op.type == FsOp::RENAME || op.type == FsOp::EXCHANGE || op.type == FsOp::UNLINK;
+}
+
+/**
+ * @brief Returns the directory containing a path, relative to the recorded directory.
+ */
+static std::string parentOf(const std::string& path){
+	size_t slash = path.find_last_of('/');
+	return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+/**
+ * @brief Returns the directories whose entries an operation changes. The first is the one it is ordered with.
+ */
+static std::vector<std::string> entryDirs(const FsOp& op){
+	std::vector<std::string> ret;
+
+	if (op.type == FsOp::RENAME || op.type == FsOp::EXCHANGE){
+		ret.push_back(parentOf(op.newPath));
+	}
+	if (ret.empty() || parentOf(op.path) != ret[0]){
+		ret.push_back(parentOf(op.path));
+	}
+	return ret;
+}
+
+/**
+ * @brief Chooses which crash states to check.
+ */
+static std::vector<CrashState> chooseStates(const std::vector<FsOp>& ops, const CrashCheckOptions& options){
+	std::vector<int> node(ops.size(), -1);
+	std::vector<size_t> durableAt(ops.size(), SIZE_MAX);
+	std::map<std::string, int> ids;
+	std::vector<std::vector<size_t>> pending(ops.size() + 1);
+	std::vector<std::map<std::string, std::vector<size_t>>> pendingEntries(ops.size() + 1);
+	std::vector<CrashState> ret;
+	std::set<CrashState> seen;
+	uint64_t rng = options.seed;
+	int nextId = 0;
+
+	auto add = [&](CrashState st){
+		std::sort(st.second.begin(), st.second.end());
+		if (ret.size() < options.maxStates && seen.insert(st).second){
+			ret.push_back(std::move(st));
+		}
+	};
+
+	// figure out which file each write and fsync is about, following renames
+	auto idOf = [&](const std::string& path){
+		auto it = ids.find(path);
+		if (it == ids.end()){
+			it = ids.emplace(path, nextId++).first;
+		}
+		return it->second;
+	};
+	for (size_t i = 0; i < ops.size(); ++i){
+		switch (ops[i].type){
+		case FsOp::CREATE:
+		case FsOp::WRITE:
+		case FsOp::TRUNCATE:
+		case FsOp::FSYNC:
+			node[i] = idOf(ops[i].path);
+			break;
+		case FsOp::RENAME:
+			if (ids.count(ops[i].path)){
+				ids[ops[i].newPath] = ids[ops[i].path];
+				ids.erase(ops[i].path);
+			}
+			break;
+		case FsOp::EXCHANGE:{
+			int a = idOf(ops[i].path);
+			int b = idOf(ops[i].newPath);
+			ids[ops[i].path] = b;
+			ids[ops[i].newPath] = a;
+			break;
+		}
+		case FsOp::UNLINK:
+			ids.erase(ops[i].path);
+			break;
+		case FsOp::DIRSYNC:
+			break;
+		}
+	}
+
+	// a write is durable once the same file is fsynced, and a change to a directory's entries once every directory it changes is
+	for (size_t i = 0; i < ops.size(); ++i){
+		if (ops[i].type == FsOp::WRITE || ops[i].type == FsOp::TRUNCATE){
+			for (size_t j = i + 1; j < ops.size(); ++j){
+				if (ops[j].type == FsOp::FSYNC && node[j] == node[i]){
+					durableAt[i] = j;
+					break;
+				}
+			}
+		}
+		else if (changesEntries(ops[i])){
+			size_t latest = 0;
+
+			for (const std::string& dir : entryDirs(ops[i])){
+				size_t j = i + 1;
+				while (j < ops.size() && !(ops[j].type == FsOp::DIRSYNC && ops[j].path == dir)){
+					j++;
+				}
+				latest = std::max(latest, j < ops.size() ? j : SIZE_MAX);
+			}
+			durableAt[i] = latest;
+		}
+	}
+	for (size_t k = 0; k <= ops.size(); ++k){
+		for (size_t i = 0; i < k; ++i){
+			if (durableAt[i] < k){
+				continue;
+			}
+			if (ops[i].type == FsOp::WRITE || ops[i].type == FsOp::TRUNCATE){
+				pending[k].push_back(i);
+			}
+			else if (changesEntries(ops[i])){
+				pendingEntries[k][entryDirs(ops[i])[0]].push_back(i);
+			}
+		}
+	}
+
+	// every prefix with nothing lost comes first, then every prefix with everything unsynced lost, then single lost writes and lost tails of each directory's entry changes, then random combinations
+	for (size_t k = 0; k <= ops.size(); ++k){
+		add({k, {}});
+	}
+	for (size_t k = 0; k <= ops.size(); ++k){
+		std::vector<size_t> all = pending[k];
+		for (const auto& dir : pendingEntries[k]){
+			all.insert(all.end(), dir.second.begin(), dir.second.end());
+		}
+		if (!all.empty()){
+			add({k, all});
+		}
+	}
+	for (size_t k = 0; k <= ops.size(); ++k){
+		for (size_t p : pending[k]){
+			add({k, {p}});
+		}
+		// a journaling file system keeps a directory's changes in order, so only the last ones are lost
+		for (const auto& dir : pendingEntries[k]){
+			for (size_t t = 0; t < dir.second.size(); ++t){
+				add({k, std::vector<size_t>(dir.second.begin() + t, dir.second.end())});
+			}
+		}
+	}
+	for (size_t k = 0; k <= ops.size(); ++k){
+		for (int rep = 0; rep < 2 && pending[k].size() > 2; ++rep){
+			std::vector<size_t> subset;
+			for (size_t p : pending[k]){
+				if (nextRandom(rng) & 1){
+					subset.push_back(p);
+				}
+			}
+			add({k, subset});
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Builds a crash state's files in memory by replaying the operations onto the snapshot.
+ */
+static std::map<std::string, std::string> replay(const CrashRecorderImpl& impl, const CrashState& st){
+	std::map<std::string, std::string> files = impl.baseFiles;
+	// names whose file was lost along with the operation that created it or moved it there, so later writes to it are lost too
+	std::set<std::string> lost;
+	size_t d = 0;
+
+	for (size_t i = 0; i < st.first; ++i){
+		const FsOp& op = impl.ops[i];
+
+		if (d < st.second.size() && st.second[d] == i){
+			d++;
+			if (op.type == FsOp::CREATE && files.find(op.path) == files.end()){
+				lost.insert(op.path);
+			}
+			else if (op.type == FsOp::RENAME){
+				lost.insert(op.newPath);
+			}
+			continue;
+		}
+
+		switch (op.type){
+		case FsOp::CREATE:
+			lost.erase(op.path);
+			if (op.truncate){
+				files[op.path].clear();
+			}
+			else{
+				files[op.path];
+			}
+			break;
+		case FsOp::WRITE:{
+			if (lost.count(op.path)){
+				break;
+			}
+			std::string& data = files[op.path];
+			if (data.size() < op.offset + op.data.size()){
+				data.resize(op.offset + op.data.size());
+			}
+			data.replace(op.offset, op.data.size(), op.data);
+			break;
+		}
+		case FsOp::TRUNCATE:
+			if (!lost.count(op.path)){
+				files[op.path].resize(op.offset);
+			}
+			break;
+		case FsOp::FSYNC:
+		case FsOp::DIRSYNC:
+			break;
+		case FsOp::RENAME:{
+			auto it = files.find(op.path);
+			if (it != files.end()){
+				std::string data = std::move(it->second);
+				files.erase(it);
+				files[op.newPath] = std::move(data);
+				lost.erase(op.newPath);
+			}
+			break;
+		}
+		case FsOp::EXCHANGE:{
+			auto a = files.find(op.path);
+			auto b = files.find(op.newPath);
+			if (a != files.end() && b != files.end()){
+				std::swap(a->second, b->second);
+			}
+			break;
+		}
+		case FsOp::UNLINK:
+			files.erase(op.path);
+			break;
+		}
+	}
+	return files;
+}
+
+std::string FsOp::describe() const{
+	switch (type){
+	case CREATE:
+		return std::string(truncate ? "create/truncate(" : "create(") + path + ")";
+	case WRITE:
+		return "write(" + path + ", " + std::to_string(offset) + ", " + std::to_string(data.size()) + " bytes)";
+	case TRUNCATE:
+		return "truncate(" + path + ", " + std::to_string(offset) + ")";
+	case FSYNC:
+		return "fsync(" + path + ")";
+	case DIRSYNC:
+		return "fsync(" + path + "/)";
+	case RENAME:
+		return "rename(" + path + ", " + newPath + ")";
+	case EXCHANGE:
+		return "exchange(" + path + ", " + newPath + ")";
+	case UNLINK:
+		return "unlink(" + path + ")";
+	}
+	return "";
+}
+
+CrashRecorder::CrashRecorder(const char* basePath): impl(std::make_unique<CrashRecorderImpl>()){
+	char buf[PATH_MAX];
+
+	if (!hooksInstalled.load()){
+		throw std::logic_error("CrashRecorder needs simpletest_crash_hooks.o to be linked into the test program");
+	}
+	if (realpath(basePath, buf) == nullptr){
+		throw std::runtime_error("Failed to resolve " + std::string(basePath) + " (" + std::strerror(errno) + ")");
+	}
+	impl->base = buf;
+	impl->givenPath = basePath;
+	while (impl->givenPath.size() > 1 && impl->givenPath.back() == '/'){
+		impl->givenPath.pop_back();
+	}
+	snapshot(*impl, "");
+	std::sort(impl->baseDirs.begin(), impl->baseDirs.end());
+
+	std::lock_guard<std::mutex> lock(recorderMutex);
+	if (activeRecorder != nullptr){
+		throw std::logic_error("There can only be one recording CrashRecorder at a time");
+	}
+	activeRecorder = impl.get();
+	impl->recording = true;
+	anyRecording.store(true);
+}
+
+CrashRecorder::CrashRecorder(const TestEnvironment& env): CrashRecorder(env.getBasePath().c_str()){}
+
+CrashRecorder::~CrashRecorder(){
+	stop();
+}
+
+void CrashRecorder::stop(){
+	// an interposer that is recording holds the lock, so this waits for it
+	std::lock_guard<std::mutex> lock(recorderMutex);
+
+	if (impl->recording){
+		anyRecording.store(false);
+		activeRecorder = nullptr;
+		impl->recording = false;
+	}
+}
+
+const std::vector<FsOp>& CrashRecorder::getOps() const{
+	return impl->ops;
+}
+
+CrashCheckResult CrashRecorder::check(const std::function<void(const char* dir)>& recover, const CrashCheckOptions& options){
+	std::vector<CrashState> states;
+	std::vector<std::string> reasons;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next{0};
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	size_t nThreads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	CrashCheckResult result;
+
+	stop();
+	states = chooseStates(impl->ops, options);
+	reasons.resize(states.size());
+
+	auto work = [&](){
+		size_t i;
+
+		while ((i = next++) < states.size()){
+			std::string dir = impl->givenPath + ".crash" + std::to_string(i);
+
+			try{
+				std::map<std::string, std::string> files = replay(*impl, states[i]);
+
+				removeTree(dir);
+				makeDirs(dir);
+				for (const std::string& d : impl->baseDirs){
+					makeDirs(dir + "/" + d);
+				}
+				for (const auto& f : files){
+					size_t slash = f.first.find_last_of('/');
+					if (slash != std::string::npos){
+						makeDirs(dir + "/" + f.first.substr(0, slash));
+					}
+					writeWholeFile(dir + "/" + f.first, f.second);
+				}
+			}
+			catch (...){
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error){
+					error = std::current_exception();
+				}
+				removeTree(dir);
+				continue;
+			}
+
+			try{
+				recover(dir.c_str());
+			}
+			catch (std::exception& e){
+				reasons[i] = e.what();
+			}
+			catch (...){
+				reasons[i] = "Unknown exception";
+			}
+			removeTree(dir);
+		}
+	};
+
+	for (size_t t = 0; t < std::min(nThreads, states.size()); ++t){
+		workers.emplace_back(work);
+	}
+	for (std::thread& t : workers){
+		t.join();
+	}
+	if (error){
+		std::rethrow_exception(error);
+	}
+
+	result.statesChecked = states.size();
+	for (size_t i = 0; i < states.size(); ++i){
+		if (!reasons[i].empty()){
+			result.failures.push_back({states[i].first, states[i].second, reasons[i]});
+		}
+	}
+	return result;
+}
+
+std::string CrashRecorder::describe(const CrashFailure& failure) const{
+	std::string ret = "crash after " + std::to_string(failure.prefix) + " of " + std::to_string(impl->ops.size()) + " operations";
+
+	if (failure.prefix > 0){
+		ret += " (last: " + impl->ops[failure.prefix - 1].describe() + ")";
+	}
+	if (!failure.dropped.empty()){
+		ret += ", losing unsynced";
+		for (size_t i = 0; i < failure.dropped.size(); ++i){
+			ret += (i == 0 ? " " : ", ") + impl->ops[failure.dropped[i]].describe();
+		}
+	}
+	return ret + ": " + failure.reason;
+}
+
+void __crashhooksinstalled(){
+	hooksInstalled.store(true);
+}
+
+bool __crashrecording(){
+	return anyRecording.load(std::memory_order_relaxed);
+}
+
+std::string __crashrelative(const std::string& abs){
+	std::lock_guard<std::mutex> lock(recorderMutex);
+	return activeRecorder != nullptr ? activeRecorder->relative(abs) : "";
+}
+
+void __crashrecord(FsOp op){
+	std::lock_guard<std::mutex> lock(recorderMutex);
+	if (activeRecorder != nullptr){
+		activeRecorder->ops.push_back(std::move(op));
+	}
+}
+
+void __assertcrashconsistent(CrashRecorder& recorder, const std::function<void(const char* dir)>& recover){
+	CrashCheckResult res = recorder.check(recover);
+	std::string msg;
+
+	if (res.failures.empty()){
+		return;
+	}
+	msg = recorder.describe(res.failures[0]);
+	if (res.failures.size() > 1){
+		msg += " (" + std::to_string(res.failures.size() - 1) + " more of " + std::to_string(res.statesChecked) + " states failed)";
+	}
+	throw FailedAssertion(msg.c_str());
+}
+
+}
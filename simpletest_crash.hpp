@@ -0,0 +1,305 @@
+/** @file simpletest_crash.hpp
+ * @brief simpletest crash-consistency checking.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_CRASH_HPP
+#define __SIMPLETEST_CRASH_HPP
+
+#include "simpletest.hpp"
+#include "simpletest_ext.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief A file system operation recorded by a CrashRecorder.
+ */
+struct FsOp{
+	/**
+	 * @brief The kind of operation.
+	 */
+	enum Type{
+		/**
+		 * @brief A file was opened with O_CREAT and/or O_TRUNC, including through fopen().
+		 */
+		CREATE,
+
+		/**
+		 * @brief Data was written to a file with write(), pwrite(), writev() or pwritev(), including through a FILE*.
+		 */
+		WRITE,
+
+		/**
+		 * @brief A file was flushed with fsync() or fdatasync().
+		 */
+		FSYNC,
+
+		/**
+		 * @brief A file was renamed with rename(), renameat() or renameat2().
+		 */
+		RENAME,
+
+		/**
+		 * @brief A file was removed with unlink() or unlinkat().
+		 */
+		UNLINK,
+
+		/**
+		 * @brief A file's size was set with truncate() or ftruncate().
+		 */
+		TRUNCATE,
+
+		/**
+		 * @brief A directory was flushed with fsync() or fdatasync(), which makes the changes to its entries durable.
+		 */
+		DIRSYNC,
+
+		/**
+		 * @brief Two files were swapped with renameat2() and RENAME_EXCHANGE.
+		 */
+		EXCHANGE
+	};
+
+	/**
+	 * @brief The kind of operation.
+	 */
+	Type type;
+
+	/**
+	 * @brief The file, relative to the recorded directory. A DIRSYNC of the recorded directory itself has ".".
+	 */
+	std::string path;
+
+	/**
+	 * @brief The new name of a RENAME, or the other file of an EXCHANGE, relative to the recorded directory.
+	 */
+	std::string newPath;
+
+	/**
+	 * @brief The offset of a WRITE, or the new size of a TRUNCATE.
+	 */
+	uint64_t offset = 0;
+
+	/**
+	 * @brief The bytes of a WRITE.
+	 */
+	std::string data;
+
+	/**
+	 * @brief True if a CREATE truncated the file.
+	 */
+	bool truncate = false;
+
+	/**
+	 * @brief Returns a short description of the operation, for example "write(db.tmp, 0, 512 bytes)".
+	 */
+	std::string describe() const;
+};
+
+/**
+ * @brief Options for CrashRecorder::check().
+ */
+struct CrashCheckOptions{
+	/**
+	 * @brief The most crash states to check.
+	 * States are chosen so that every prefix of the operation log is covered before any state with only some unsynced operations dropped.
+	 */
+	size_t maxStates = 1000;
+
+	/**
+	 * @brief The number of states to materialize and check at once.
+	 * 0 means one per CPU.
+	 */
+	size_t threads = 0;
+
+	/**
+	 * @brief Seeds the choice of which unsynced writes to drop.
+	 */
+	uint64_t seed = 0;
+};
+
+/**
+ * @brief A crash state whose recovery check failed.
+ */
+struct CrashFailure{
+	/**
+	 * @brief The number of operations that happened before the crash.
+	 */
+	size_t prefix;
+
+	/**
+	 * @brief The indexes of the operations that were lost in the crash because they were not durable yet.
+	 */
+	std::vector<size_t> dropped;
+
+	/**
+	 * @brief Why the recovery check failed.
+	 */
+	std::string reason;
+};
+
+/**
+ * @brief The result of CrashRecorder::check().
+ */
+struct CrashCheckResult{
+	/**
+	 * @brief The number of crash states that were checked.
+	 */
+	size_t statesChecked = 0;
+
+	/**
+	 * @brief The crash states whose recovery check failed.
+	 */
+	std::vector<CrashFailure> failures;
+};
+
+struct CrashRecorderImpl;
+
+/**
+ * @brief Records the file system operations the code under test makes inside a directory, then checks that the code can recover from a crash at any point.
+ *
+ * The operations are seen by interposing libc's file functions, which is only done by the program that links simpletest_crash_hooks.o in addition to libsimpletest.a, so other test programs keep libc's own I/O.
+ * The program must be linked against libc dynamically, and only calls from outside libc are seen.
+ *
+ * While a CrashRecorder is recording, calls to open(), openat(), creat(), write(), pwrite(), writev(), pwritev(), truncate(), ftruncate(), fsync(), fdatasync(), rename(), renameat(), renameat2(), unlink() and unlinkat() that touch the directory are recorded.
+ * Streams that fopen() or fdopen() opens inside the directory while recording write through write(), so what they flush is recorded as well, and fileno() still returns their file descriptor for fsync().
+ *
+ * check() then rebuilds the states the directory could be in after a crash, in copies of the directory:<br>
+ * - every prefix of the operation log, and<br>
+ * - for each prefix, variations where writes that were not followed by an fsync() of the same file before the crash are lost, and<br>
+ * - variations where the last changes to a directory's entries (creating, renaming or removing files) that were not followed by an fsync() of the directory are lost.<br>
+ * <br>
+ * The changes to a directory's entries are assumed to persist in order, like on a journaling file system.
+ *
+ * There can only be one recording CrashRecorder at a time.
+ */
+class CrashRecorder{
+public:
+	/**
+	 * @brief Snapshots a directory and starts recording operations inside it.
+	 *
+	 * @param basePath The directory to record.
+	 *
+	 * @exception std::logic_error Another CrashRecorder is already recording, or simpletest_crash_hooks.o is not linked in.
+	 * @exception std::runtime_error Failed to read the directory.
+	 */
+	CrashRecorder(const char* basePath);
+
+	/**
+	 * @brief Snapshots a TestEnvironment and starts recording operations inside it.
+	 *
+	 * @param env The environment. It must already be set up.
+	 *
+	 * @exception std::logic_error Another CrashRecorder is already recording, or simpletest_crash_hooks.o is not linked in.
+	 * @exception std::runtime_error Failed to read the environment.
+	 */
+	CrashRecorder(const TestEnvironment& env);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	CrashRecorder(const CrashRecorder& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	CrashRecorder& operator=(const CrashRecorder& other) = delete;
+
+	/**
+	 * @brief Stops recording.
+	 */
+	~CrashRecorder();
+
+	/**
+	 * @brief Stops recording. Operations made afterwards are not recorded.
+	 */
+	void stop();
+
+	/**
+	 * @brief Returns the operations recorded so far.
+	 */
+	const std::vector<FsOp>& getOps() const;
+
+	/**
+	 * @brief Stops recording, then runs a recovery check against many possible post-crash states.
+	 * States are materialized and checked in parallel, so the check must be safe to call from several threads at once.
+	 *
+	 * @param recover Called with the path of a directory containing a crash state. It should run the code's recovery and throw (for example with ASSERT()) if the state is inconsistent.
+	 * The directory is removed afterwards.
+	 * @param options How to check.
+	 *
+	 * @return The states that failed.
+	 *
+	 * @exception std::runtime_error Failed to create a crash state.
+	 */
+	CrashCheckResult check(const std::function<void(const char* dir)>& recover, const CrashCheckOptions& options = CrashCheckOptions());
+
+	/**
+	 * @brief Describes a failed crash state, including the operations that led up to it.
+	 *
+	 * @param failure The failed state.
+	 */
+	std::string describe(const CrashFailure& failure) const;
+
+private:
+	std::unique_ptr<CrashRecorderImpl> impl;
+};
+
+/**
+ * @brief Asserts that the code under test can recover from a crash at any point of what a CrashRecorder recorded, failing the test if not.
+ *
+ * @param recorder The CrashRecorder.
+ * @param ... The recovery check, a callable taking the const char* path of a crash state. It should throw if the state is inconsistent.
+ *
+ * @exception FailedAssertion Thrown if any crash state fails the check. The message describes the first one.
+ */
+#define ASSERT_CRASH_CONSISTENT(recorder, ...)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__assertcrashconsistent(recorder, __VA_ARGS__)
+
+/**
+ * @brief Do not call this function directly. Use the ASSERT_CRASH_CONSISTENT() macro instead.
+ *
+ * @param recorder The CrashRecorder.
+ * @param recover  The recovery check.
+ */
+void __assertcrashconsistent(CrashRecorder& recorder, const std::function<void(const char* dir)>& recover);
+
+/**
+ * @brief Do not call this function directly. simpletest_crash_hooks.o calls it at startup so CrashRecorder knows the interposers are linked in.
+ */
+void __crashhooksinstalled();
+
+/**
+ * @brief Do not call this function directly. Returns true while a CrashRecorder is recording, so the interposers can skip everything else when none is.
+ */
+bool __crashrecording();
+
+/**
+ * @brief Do not call this function directly. Returns a path relative to the recorded directory, "." for the directory itself, or an empty string if it is outside of it or nothing is recording.
+ *
+ * @param abs An absolute path with no "." or ".." components.
+ */
+std::string __crashrelative(const std::string& abs);
+
+/**
+ * @brief Do not call this function directly. Appends an operation to the recording CrashRecorder's log, if one is still recording.
+ *
+ * @param op The operation, with its paths relative to the recorded directory.
+ */
+void __crashrecord(FsOp op);
+
+}
+
+#endif
@@ -0,0 +1,732 @@
+/** @file simpletest_crash_hooks.cpp
+ * @brief simpletest interposers that feed file system operations to a CrashRecorder.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * This file is built into its own object instead of libsimpletest.a, so that only the test programs that link it in have their I/O interposed.
+ */
+
+// the fortified versions of open() and friends are inline wrappers, which would clash with the interposers below. this only affects this file's own calls.
+#undef _FORTIFY_SOURCE
+
+#include "simpletest_crash.hpp"
+
+// std::min
+#include <algorithm>
+// std::atomic
+#include <atomic>
+// std::mutex
+#include <mutex>
+// std::unordered_map
+#include <unordered_map>
+// va_list
+#include <cstdarg>
+// fopencookie(), fprintf()
+#include <cstdio>
+// abort()
+#include <cstdlib>
+// errno
+#include <cerrno>
+// PATH_MAX
+#include <climits>
+// dlsym()
+#include <dlfcn.h>
+// O_CREAT, AT_FDCWD, AT_REMOVEDIR
+#include <fcntl.h>
+// fstat()
+#include <sys/stat.h>
+// writev(), pwritev(), RWF_APPEND
+#include <sys/uio.h>
+// lseek(), readlink(), getcwd()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief Looks up libc's version of a function this file replaces.
+ * There is only one if the program is linked against libc dynamically, so a statically linked program is stopped with a message instead.
+ */
+static void* findReal(const char* name){
+	void* fn = dlsym(RTLD_NEXT, name);
+
+	if (fn == nullptr){
+		// stdio writes through libc's own write(), so this cannot come back here
+		fprintf(stderr, "simpletest_crash_hooks.o: there is no libc %s() to forward to. The test program must be linked against libc dynamically.\n", name);
+		abort();
+	}
+	return fn;
+}
+
+/**
+ * @brief Returns libc's version of a function this file replaces.
+ *
+ * @tparam F The function's type.
+ */
+template <typename F>
+static F* real(const char* name){
+	return (F*)findReal(name);
+}
+
+/**
+ * @brief Keeps errno as it is for the rest of the scope, so recording an operation does not change what its caller sees.
+ */
+struct SavedErrno{
+	int err = errno;
+	~SavedErrno(){
+		errno = err;
+	}
+};
+
+/**
+ * @brief Makes a path absolute and removes "." and ".." components without following symlinks.
+ */
+static std::string absolutize(const std::string& path){
+	std::string full;
+	std::vector<std::string> parts;
+	std::string ret;
+	size_t pos = 0;
+
+	if (path.empty() || path[0] != '/'){
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof(cwd)) == nullptr){
+			return "";
+		}
+		full = std::string(cwd) + "/";
+	}
+	full += path;
+
+	while (pos < full.size()){
+		size_t end = full.find('/', pos);
+		std::string part;
+
+		if (end == std::string::npos){
+			end = full.size();
+		}
+		part = full.substr(pos, end - pos);
+		if (part == ".."){
+			if (!parts.empty()){
+				parts.pop_back();
+			}
+		}
+		else if (!part.empty() && part != "."){
+			parts.push_back(part);
+		}
+		pos = end + 1;
+	}
+
+	for (const std::string& p : parts){
+		ret += "/" + p;
+	}
+	return ret.empty() ? "/" : ret;
+}
+
+/**
+ * @brief Returns the path a file descriptor refers to, or an empty string if it is not a regular file or a directory.
+ *
+ * @param isDir Set to true if it is a directory.
+ */
+static std::string fdPath(int fd, bool* isDir = nullptr){
+	char buf[PATH_MAX];
+	struct stat st;
+	ssize_t len;
+
+	if (fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || (isDir != nullptr && S_ISDIR(st.st_mode)))){
+		return "";
+	}
+	if (isDir != nullptr){
+		*isDir = S_ISDIR(st.st_mode);
+	}
+	len = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(), buf, sizeof(buf) - 1);
+	if (len <= 0){
+		return "";
+	}
+	return std::string(buf, len);
+}
+
+/**
+ * @brief Makes a path given relative to a directory file descriptor absolute, like the *at() functions do.
+ */
+static std::string atPath(int dirfd, const char* path){
+	char buf[PATH_MAX];
+	ssize_t len;
+
+	if (path[0] == '/' || dirfd == AT_FDCWD){
+		return absolutize(path);
+	}
+	len = readlink(("/proc/self/fd/" + std::to_string(dirfd)).c_str(), buf, sizeof(buf) - 1);
+	if (len <= 0){
+		return "";
+	}
+	return absolutize(std::string(buf, len) + "/" + path);
+}
+
+/**
+ * @brief Returns the offset a write is about to happen at.
+ *
+ * @param pos The offset given to pwrite() or pwritev(), or -1 for the current one.
+ * @param append True if the write goes to the end of the file regardless.
+ */
+static off_t writeOffset(int fd, off_t pos, bool append){
+	struct stat st;
+
+	if (!append && pos >= 0){
+		return pos;
+	}
+	if (append || (fcntl(fd, F_GETFL) & O_APPEND)){
+		return fstat(fd, &st) == 0 ? st.st_size : -1;
+	}
+	return lseek(fd, 0, SEEK_CUR);
+}
+
+/**
+ * @brief Records a write that already happened.
+ *
+ * @param data The bytes that were written.
+ */
+static void recordWrite(int fd, off_t offset, std::string data){
+	SavedErrno saved;
+	std::string rel;
+	FsOp op;
+
+	if (offset < 0 || (rel = __crashrelative(fdPath(fd))).empty()){
+		return;
+	}
+	op.type = FsOp::WRITE;
+	op.path = rel;
+	op.offset = offset;
+	op.data = std::move(data);
+	__crashrecord(std::move(op));
+}
+
+/**
+ * @brief Returns the first n bytes of an iovec array as one buffer.
+ */
+static std::string gather(const struct iovec* iov, int count, size_t n){
+	std::string ret;
+
+	for (int i = 0; i < count && ret.size() < n; ++i){
+		ret.append((const char*)iov[i].iov_base, std::min(iov[i].iov_len, n - ret.size()));
+	}
+	return ret;
+}
+
+/**
+ * @brief Records a file being created or truncated by open(), if it was.
+ */
+static void recordOpen(int fd, int flags){
+	SavedErrno saved;
+	std::string rel;
+	FsOp op;
+
+	// an O_TMPFILE file has no name until it is linked, and directories are not modelled
+	if (fd < 0 || !(flags & (O_CREAT | O_TRUNC)) || (flags & O_TMPFILE) == O_TMPFILE || (rel = __crashrelative(fdPath(fd))).empty()){
+		return;
+	}
+	op.type = FsOp::CREATE;
+	op.path = rel;
+	op.truncate = (flags & O_TRUNC) != 0;
+	__crashrecord(std::move(op));
+}
+
+/**
+ * @brief Records an fsync() or fdatasync() of a file or directory.
+ */
+static void recordSync(int fd){
+	SavedErrno saved;
+	bool isDir = false;
+	std::string rel = __crashrelative(fdPath(fd, &isDir));
+	FsOp op;
+
+	if (rel.empty()){
+		return;
+	}
+	op.type = isDir ? FsOp::DIRSYNC : FsOp::FSYNC;
+	op.path = rel;
+	__crashrecord(std::move(op));
+}
+
+/**
+ * @brief Records a file's size being set.
+ */
+static void recordTruncate(const std::string& abs, off_t len){
+	SavedErrno saved;
+	std::string rel = __crashrelative(abs);
+	FsOp op;
+
+	if (rel.empty()){
+		return;
+	}
+	op.type = FsOp::TRUNCATE;
+	op.path = rel;
+	op.offset = len;
+	__crashrecord(std::move(op));
+}
+
+/**
+ * @brief Records a rename, exchange or removal that already happened.
+ *
+ * @param oldRel The file's old name relative to the recorded directory, or empty if it was outside of it.
+ * @param newRel The file's new name relative to the recorded directory, or empty if it is outside of it or the file was removed.
+ */
+static void recordMove(const std::string& oldRel, const std::string& newRel, bool exchange){
+	SavedErrno saved;
+	FsOp op;
+
+	if (oldRel.empty() || oldRel == "." || (exchange && newRel.empty())){
+		return;
+	}
+	// moving a file out of the directory looks the same as removing it
+	op.type = exchange ? FsOp::EXCHANGE : newRel.empty() ? FsOp::UNLINK : FsOp::RENAME;
+	op.path = oldRel;
+	op.newPath = newRel;
+	__crashrecord(std::move(op));
+}
+
+/**
+ * @brief Returns the flags fopen() opens a file with for a mode string.
+ */
+static int fopenFlags(const char* mode){
+	bool plus = false;
+	int flags = 0;
+
+	for (const char* c = mode + 1; *c; ++c){
+		switch (*c){
+		case '+':
+			plus = true;
+			break;
+		case 'x':
+			flags |= O_EXCL;
+			break;
+		case 'e':
+			flags |= O_CLOEXEC;
+			break;
+		}
+	}
+	switch (mode[0]){
+	case 'w':
+		return flags | (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+	case 'a':
+		return flags | (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+	default:
+		return flags | (plus ? O_RDWR : O_RDONLY);
+	}
+}
+
+/**
+ * @brief The streams opened by the interposed fopen() and fdopen(), and the file descriptors they write to, so fileno() can return them.
+ * It is never destroyed, since streams may still be closed while the program exits.
+ */
+static std::unordered_map<FILE*, int>& streams(){
+	static auto ret = new std::unordered_map<FILE*, int>();
+	return *ret;
+}
+
+/**
+ * @brief Protects streams().
+ */
+static std::mutex streamMutex;
+
+/**
+ * @brief The number of entries in streams(), so fileno() does not need the lock when there are none.
+ */
+static std::atomic<size_t> streamCount{0};
+
+/**
+ * @brief What a stream opened by the interposed fopen() or fdopen() keeps.
+ */
+struct StreamCookie{
+	/**
+	 * @brief The file descriptor the stream reads and writes.
+	 */
+	int fd;
+
+	/**
+	 * @brief The stream.
+	 */
+	FILE* fp = nullptr;
+};
+
+/**
+ * @brief Reads for a stream, with read().
+ */
+static ssize_t streamRead(void* cookie, char* buf, size_t n){
+	return read(((StreamCookie*)cookie)->fd, buf, n);
+}
+
+/**
+ * @brief Writes for a stream, with the interposed write(), so what it flushes is recorded.
+ */
+static ssize_t streamWrite(void* cookie, const char* buf, size_t n){
+	ssize_t ret = write(((StreamCookie*)cookie)->fd, buf, n);
+	return ret < 0 ? 0 : ret;
+}
+
+/**
+ * @brief Seeks for a stream, with lseek().
+ */
+static int streamSeek(void* cookie, off64_t* pos, int whence){
+	off_t ret = lseek(((StreamCookie*)cookie)->fd, *pos, whence);
+
+	if (ret < 0){
+		return -1;
+	}
+	*pos = ret;
+	return 0;
+}
+
+/**
+ * @brief Closes a stream's file descriptor and forgets the stream.
+ */
+static int streamClose(void* cookie){
+	StreamCookie* sc = (StreamCookie*)cookie;
+	int ret = close(sc->fd);
+
+	{
+		std::lock_guard<std::mutex> lock(streamMutex);
+		if (streams().erase(sc->fp)){
+			streamCount--;
+		}
+	}
+	delete sc;
+	return ret;
+}
+
+/**
+ * @brief Opens a stream on a file descriptor that writes through the interposed write().
+ *
+ * @return The stream, or nullptr with errno set. The file descriptor is left open on failure.
+ */
+static FILE* openStream(int fd, const char* mode){
+	static const cookie_io_functions_t io = {streamRead, streamWrite, streamSeek, streamClose};
+	StreamCookie* sc = new StreamCookie{fd};
+	FILE* fp = fopencookie(sc, mode, io);
+
+	if (fp == nullptr){
+		delete sc;
+		return nullptr;
+	}
+	sc->fp = fp;
+	if (mode[0] == 'a'){
+		// streams opened for appending start at the end
+		fseeko(fp, 0, SEEK_END);
+	}
+	std::lock_guard<std::mutex> lock(streamMutex);
+	streams()[fp] = fd;
+	streamCount++;
+	return fp;
+}
+
+/**
+ * @brief Returns the file descriptor of a stream opened by openStream(), or -1 if it was not.
+ */
+static int streamFd(FILE* fp){
+	if (streamCount.load() == 0){
+		return -1;
+	}
+	std::lock_guard<std::mutex> lock(streamMutex);
+	auto it = streams().find(fp);
+	return it != streams().end() ? it->second : -1;
+}
+
+/**
+ * @brief Tells CrashRecorder that the interposers are linked in.
+ */
+static const bool installed = (__crashhooksinstalled(), true);
+
+}
+
+/*
+ * The interposers.
+ * These are defined in the executable, so they take precedence over libc's for every caller outside of libc.
+ * When nothing is recording, they go straight to libc's.
+ */
+
+extern "C" ssize_t write(int fd, const void* buf, size_t n){
+	static auto realWrite = simpletest::real<ssize_t(int, const void*, size_t)>("write");
+	off_t offset;
+	ssize_t ret;
+
+	if (!simpletest::__crashrecording()){
+		return realWrite(fd, buf, n);
+	}
+	offset = simpletest::writeOffset(fd, -1, false);
+	ret = realWrite(fd, buf, n);
+	if (ret > 0){
+		simpletest::recordWrite(fd, offset, std::string((const char*)buf, ret));
+	}
+	return ret;
+}
+
+extern "C" ssize_t pwrite(int fd, const void* buf, size_t n, off_t pos){
+	static auto realPwrite = simpletest::real<ssize_t(int, const void*, size_t, off_t)>("pwrite");
+	ssize_t ret = realPwrite(fd, buf, n, pos);
+
+	if (ret > 0 && simpletest::__crashrecording()){
+		simpletest::recordWrite(fd, pos, std::string((const char*)buf, ret));
+	}
+	return ret;
+}
+
+extern "C" ssize_t pwrite64(int fd, const void* buf, size_t n, off64_t pos){
+	return pwrite(fd, buf, n, pos);
+}
+
+extern "C" ssize_t writev(int fd, const struct iovec* iov, int count){
+	static auto realWritev = simpletest::real<ssize_t(int, const struct iovec*, int)>("writev");
+	off_t offset;
+	ssize_t ret;
+
+	if (!simpletest::__crashrecording()){
+		return realWritev(fd, iov, count);
+	}
+	offset = simpletest::writeOffset(fd, -1, false);
+	ret = realWritev(fd, iov, count);
+	if (ret > 0){
+		simpletest::recordWrite(fd, offset, simpletest::gather(iov, count, ret));
+	}
+	return ret;
+}
+
+extern "C" ssize_t pwritev(int fd, const struct iovec* iov, int count, off_t pos){
+	static auto realPwritev = simpletest::real<ssize_t(int, const struct iovec*, int, off_t)>("pwritev");
+	ssize_t ret = realPwritev(fd, iov, count, pos);
+
+	if (ret > 0 && simpletest::__crashrecording()){
+		simpletest::recordWrite(fd, pos, simpletest::gather(iov, count, ret));
+	}
+	return ret;
+}
+
+extern "C" ssize_t pwritev64(int fd, const struct iovec* iov, int count, off64_t pos){
+	return pwritev(fd, iov, count, pos);
+}
+
+extern "C" ssize_t pwritev2(int fd, const struct iovec* iov, int count, off_t pos, int flags){
+	static auto realPwritev2 = simpletest::real<ssize_t(int, const struct iovec*, int, off_t, int)>("pwritev2");
+	bool append = (flags & RWF_APPEND) != 0;
+	off_t offset;
+	ssize_t ret;
+
+	if (!simpletest::__crashrecording()){
+		return realPwritev2(fd, iov, count, pos, flags);
+	}
+	offset = simpletest::writeOffset(fd, pos, append);
+	ret = realPwritev2(fd, iov, count, pos, flags);
+	if (ret > 0){
+		simpletest::recordWrite(fd, offset, simpletest::gather(iov, count, ret));
+	}
+	return ret;
+}
+
+extern "C" ssize_t pwritev64v2(int fd, const struct iovec* iov, int count, off64_t pos, int flags){
+	return pwritev2(fd, iov, count, pos, flags);
+}
+
+extern "C" int ftruncate(int fd, off_t len) noexcept{
+	static auto realFtruncate = simpletest::real<int(int, off_t)>("ftruncate");
+	int ret = realFtruncate(fd, len);
+
+	if (ret == 0 && simpletest::__crashrecording()){
+		simpletest::recordTruncate(simpletest::fdPath(fd), len);
+	}
+	return ret;
+}
+
+extern "C" int ftruncate64(int fd, off64_t len) noexcept{
+	return ftruncate(fd, len);
+}
+
+extern "C" int truncate(const char* path, off_t len) noexcept{
+	static auto realTruncate = simpletest::real<int(const char*, off_t)>("truncate");
+	int ret = realTruncate(path, len);
+
+	if (ret == 0 && simpletest::__crashrecording()){
+		simpletest::recordTruncate(simpletest::absolutize(path), len);
+	}
+	return ret;
+}
+
+extern "C" int truncate64(const char* path, off64_t len) noexcept{
+	return truncate(path, len);
+}
+
+extern "C" int fsync(int fd){
+	static auto realFsync = simpletest::real<int(int)>("fsync");
+	int ret = realFsync(fd);
+
+	if (ret == 0 && simpletest::__crashrecording()){
+		simpletest::recordSync(fd);
+	}
+	return ret;
+}
+
+extern "C" int fdatasync(int fd){
+	static auto realFdatasync = simpletest::real<int(int)>("fdatasync");
+	int ret = realFdatasync(fd);
+
+	if (ret == 0 && simpletest::__crashrecording()){
+		simpletest::recordSync(fd);
+	}
+	return ret;
+}
+
+extern "C" int openat(int dirfd, const char* path, int flags, ...){
+	static auto realOpenat = simpletest::real<int(int, const char*, int, ...)>("openat");
+	mode_t mode = 0;
+	int fd;
+
+	if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE){
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	fd = realOpenat(dirfd, path, flags, mode);
+	if (fd >= 0 && simpletest::__crashrecording()){
+		simpletest::recordOpen(fd, flags);
+	}
+	return fd;
+}
+
+extern "C" int openat64(int dirfd, const char* path, int flags, ...){
+	mode_t mode = 0;
+
+	if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE){
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	return openat(dirfd, path, flags | O_LARGEFILE, mode);
+}
+
+extern "C" int open(const char* path, int flags, ...){
+	mode_t mode = 0;
+
+	if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE){
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	return openat(AT_FDCWD, path, flags, mode);
+}
+
+extern "C" int open64(const char* path, int flags, ...){
+	mode_t mode = 0;
+
+	if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE){
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	return openat(AT_FDCWD, path, flags | O_LARGEFILE, mode);
+}
+
+extern "C" int creat(const char* path, mode_t mode){
+	return openat(AT_FDCWD, path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+extern "C" int creat64(const char* path, mode_t mode){
+	return openat(AT_FDCWD, path, O_CREAT | O_WRONLY | O_TRUNC | O_LARGEFILE, mode);
+}
+
+extern "C" FILE* fopen(const char* path, const char* mode){
+	static auto realFopen = simpletest::real<FILE*(const char*, const char*)>("fopen");
+	FILE* fp;
+	int fd;
+
+	// libc's streams write with its own write(), which nothing outside of libc can interpose, so streams inside the recorded directory write through ours instead
+	if (!simpletest::__crashrecording() || simpletest::__crashrelative(simpletest::absolutize(path)).empty()){
+		return realFopen(path, mode);
+	}
+	fd = open(path, simpletest::fopenFlags(mode), 0666);
+	if (fd < 0){
+		return nullptr;
+	}
+	fp = simpletest::openStream(fd, mode);
+	if (fp == nullptr){
+		simpletest::SavedErrno saved;
+		close(fd);
+	}
+	return fp;
+}
+
+extern "C" FILE* fopen64(const char* path, const char* mode){
+	return fopen(path, mode);
+}
+
+extern "C" FILE* fdopen(int fd, const char* mode) noexcept{
+	static auto realFdopen = simpletest::real<FILE*(int, const char*)>("fdopen");
+
+	if (!simpletest::__crashrecording() || simpletest::__crashrelative(simpletest::fdPath(fd)).empty()){
+		return realFdopen(fd, mode);
+	}
+	return simpletest::openStream(fd, mode);
+}
+
+extern "C" int fileno(FILE* fp) noexcept{
+	static auto realFileno = simpletest::real<int(FILE*)>("fileno");
+	int fd = simpletest::streamFd(fp);
+
+	return fd >= 0 ? fd : realFileno(fp);
+}
+
+extern "C" int fileno_unlocked(FILE* fp) noexcept{
+	static auto realFilenoUnlocked = simpletest::real<int(FILE*)>("fileno_unlocked");
+	int fd = simpletest::streamFd(fp);
+
+	return fd >= 0 ? fd : realFilenoUnlocked(fp);
+}
+
+extern "C" int renameat2(int oldDirfd, const char* oldPath, int newDirfd, const char* newPath, unsigned int flags) noexcept{
+	static auto realRenameat2 = simpletest::real<int(int, const char*, int, const char*, unsigned int)>("renameat2");
+	bool recording = simpletest::__crashrecording();
+	std::string oldRel;
+	std::string newRel;
+	int ret;
+
+	if (recording){
+		simpletest::SavedErrno saved;
+		oldRel = simpletest::__crashrelative(simpletest::atPath(oldDirfd, oldPath));
+		newRel = simpletest::__crashrelative(simpletest::atPath(newDirfd, newPath));
+	}
+	ret = realRenameat2(oldDirfd, oldPath, newDirfd, newPath, flags);
+	if (recording && ret == 0){
+		simpletest::recordMove(oldRel, newRel, (flags & RENAME_EXCHANGE) != 0);
+	}
+	return ret;
+}
+
+extern "C" int renameat(int oldDirfd, const char* oldPath, int newDirfd, const char* newPath) noexcept{
+	return renameat2(oldDirfd, oldPath, newDirfd, newPath, 0);
+}
+
+extern "C" int rename(const char* oldPath, const char* newPath) noexcept{
+	return renameat2(AT_FDCWD, oldPath, AT_FDCWD, newPath, 0);
+}
+
+extern "C" int unlinkat(int dirfd, const char* path, int flags) noexcept{
+	static auto realUnlinkat = simpletest::real<int(int, const char*, int)>("unlinkat");
+	// directories are not modelled, so removing one is not recorded
+	bool recording = simpletest::__crashrecording() && !(flags & AT_REMOVEDIR);
+	std::string rel;
+	int ret;
+
+	if (recording){
+		simpletest::SavedErrno saved;
+		rel = simpletest::__crashrelative(simpletest::atPath(dirfd, path));
+	}
+	ret = realUnlinkat(dirfd, path, flags);
+	if (recording && ret == 0){
+		simpletest::recordMove(rel, "", false);
+	}
+	return ret;
+}
+
+extern "C" int unlink(const char* path) noexcept{
+	return unlinkat(AT_FDCWD, path, 0);
+}
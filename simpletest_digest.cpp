@@ -0,0 +1,454 @@
+/** @file simpletest_digest.cpp
+ * @brief simpletest streaming output digests.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_digest.hpp"
+// FailedExpectation
+#include "simpletest.hpp"
+
+// std::deque
+#include <deque>
+// std::cout
+#include <iostream>
+// std::mutex
+#include <mutex>
+// std::runtime_error
+#include <stdexcept>
+// std::system_error
+#include <system_error>
+// std::thread
+#include <thread>
+// std::strerror, std::memchr
+#include <cstring>
+// fcntl
+#include <fcntl.h>
+// poll
+#include <poll.h>
+// ioctl, FIONREAD
+#include <sys/ioctl.h>
+
+namespace simpletest{
+
+/**
+ * @brief The XXH64 primes.
+ */
+static const uint64_t P1 = 11400714785074694791ULL;
+static const uint64_t P2 = 14029467366897019727ULL;
+static const uint64_t P3 = 1609587929392839161ULL;
+static const uint64_t P4 = 9650029242287828579ULL;
+static const uint64_t P5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * @brief Reads a little-endian 64-bit integer regardless of the host's byte order.
+ */
+static inline uint64_t read64(const unsigned char* p){
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; --i){
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+/**
+ * @brief Reads a little-endian 32-bit integer regardless of the host's byte order.
+ */
+static inline uint64_t read32(const unsigned char* p){
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static inline uint64_t xxRound(uint64_t acc, uint64_t input){
+	acc += input * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t val){
+	acc ^= xxRound(0, val);
+	return acc * P1 + P4;
+}
+
+StreamHash::StreamHash(): acc{P1 + P2, P2, 0, 0 - P1}, buf{}, bufLen(0), totalLen(0){}
+
+void StreamHash::update(std::string_view data){
+	const unsigned char* p = (const unsigned char*)data.data();
+	size_t len = data.size();
+
+	totalLen += len;
+
+	// top up a partial stripe first
+	if (bufLen > 0){
+		size_t n = std::min(len, sizeof(buf) - bufLen);
+		std::memcpy(buf + bufLen, p, n);
+		bufLen += n;
+		p += n;
+		len -= n;
+		if (bufLen < sizeof(buf)){
+			return;
+		}
+		for (int i = 0; i < 4; ++i){
+			acc[i] = xxRound(acc[i], read64(buf + i * 8));
+		}
+		bufLen = 0;
+	}
+
+	// the bulk of the data is hashed in place, 32 bytes at a time
+	while (len >= 32){
+		for (int i = 0; i < 4; ++i){
+			acc[i] = xxRound(acc[i], read64(p + i * 8));
+		}
+		p += 32;
+		len -= 32;
+	}
+
+	std::memcpy(buf, p, len);
+	bufLen = len;
+}
+
+uint64_t StreamHash::digest() const{
+	const unsigned char* p = buf;
+	size_t len = bufLen;
+	uint64_t h;
+
+	if (totalLen >= 32){
+		h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+		for (int i = 0; i < 4; ++i){
+			h = mergeRound(h, acc[i]);
+		}
+	}
+	else{
+		h = P5;
+	}
+	h += totalLen;
+
+	while (len >= 8){
+		h ^= xxRound(0, read64(p));
+		h = rotl(h, 27) * P1 + P4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4){
+		h ^= read32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+		len -= 4;
+	}
+	while (len > 0){
+		h ^= (*p) * P5;
+		h = rotl(h, 11) * P1;
+		p++;
+		len--;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * @brief Lines longer than this are truncated when they are kept.
+ */
+static const size_t maxKeptLineLength = 4096;
+
+/**
+ * @brief The private implementation of the OutputDigest class.
+ */
+struct OutputDigestImpl{
+	/**
+	 * @brief The file descriptor being digested.
+	 */
+	int target = -1;
+
+	/**
+	 * @brief A duplicate of the file descriptor that was at target before digesting started.
+	 */
+	int original = -1;
+
+	/**
+	 * @brief The reading end of the pipe.
+	 */
+	int readFd = -1;
+
+	/**
+	 * @brief How many of the first and last lines to keep.
+	 */
+	size_t keepLines = 0;
+
+	/**
+	 * @brief Held while the thread reads and digests a chunk.
+	 * Everything below this is protected by it.
+	 */
+	std::mutex mutex;
+
+	StreamHash hash;
+	uint64_t bytes = 0;
+	uint64_t newlines = 0;
+	bool unfinishedLine = false;
+
+	/**
+	 * @brief The first keepLines lines.
+	 */
+	std::vector<std::string> first;
+
+	/**
+	 * @brief The last keepLines finished lines.
+	 */
+	std::deque<std::string> last;
+
+	/**
+	 * @brief The line being written, up to maxKeptLineLength bytes of it.
+	 */
+	std::string current;
+
+	/**
+	 * @brief The thread that drains the pipe.
+	 */
+	std::thread drainer;
+
+	/**
+	 * @brief Adds a chunk of output to the digest.
+	 */
+	void digest(std::string_view data){
+		hash.update(data);
+		bytes += data.size();
+		if (data.empty()){
+			return;
+		}
+		unfinishedLine = data.back() != '\n';
+
+		// memchr is much faster than looking at every byte, which matters for gigabytes of output
+		while (!data.empty()){
+			const char* nl = (const char*)std::memchr(data.data(), '\n', data.size());
+			size_t len = nl ? nl - data.data() : data.size();
+
+			if (keepLines > 0 && current.size() < maxKeptLineLength){
+				current.append(data.data(), std::min(len, maxKeptLineLength - current.size()));
+			}
+			if (!nl){
+				break;
+			}
+
+			newlines++;
+			if (keepLines > 0){
+				if (first.size() < keepLines){
+					first.push_back(current);
+				}
+				last.push_back(std::move(current));
+				if (last.size() > keepLines){
+					last.pop_front();
+				}
+				current.clear();
+			}
+			data.remove_prefix(len + 1);
+		}
+	}
+
+	/**
+	 * @brief Drains the pipe until every writer has closed it.
+	 */
+	void drain(){
+		std::vector<char> buf(1 << 16);
+		struct pollfd pfd = {readFd, POLLIN, 0};
+
+		for (;;){
+			ssize_t ss;
+
+			// wait without the lock, but read and digest with it, so sync() can tell when everything written has been digested
+			if (poll(&pfd, 1, -1) < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			ss = read(readFd, buf.data(), buf.size());
+			if (ss < 0 && (errno == EAGAIN || errno == EINTR)){
+				continue;
+			}
+			if (ss <= 0){
+				return;
+			}
+			digest(std::string_view(buf.data(), ss));
+		}
+	}
+
+	/**
+	 * @brief Waits until everything written so far has been digested, then locks the digest.
+	 *
+	 * @return A lock on the digest.
+	 */
+	std::unique_lock<std::mutex> sync(){
+		int avail;
+
+		std::cout.flush();
+		fflush(stdout);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		// everything is read with the lock held, so an empty pipe means everything written has been digested
+		while (ioctl(readFd, FIONREAD, &avail) == 0 && avail > 0){
+			lock.unlock();
+			std::this_thread::yield();
+			lock.lock();
+		}
+		return lock;
+	}
+
+	/**
+	 * @brief Puts the original file descriptor back.
+	 */
+	void restore(){
+		if (original >= 0){
+			dup2(original, target);
+			close(original);
+			original = -1;
+		}
+	}
+
+	~OutputDigestImpl(){
+		std::cout.flush();
+		fflush(stdout);
+		// this closes the pipe's only writing end, so the thread sees EOF once it has drained the rest
+		restore();
+		if (drainer.joinable()){
+			drainer.join();
+		}
+		if (readFd >= 0){
+			close(readFd);
+		}
+	}
+};
+
+OutputDigest::OutputDigest(size_t keepLines, int fd): impl(std::make_unique<OutputDigestImpl>()){
+	int fds[2];
+
+	impl->target = fd;
+	impl->keepLines = keepLines;
+
+	// anything already buffered belongs to whatever was capturing before
+	std::cout.flush();
+	fflush(stdout);
+
+	if (pipe2(fds, O_CLOEXEC) != 0){
+		throw std::runtime_error("Failed to create the digest pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+	impl->readFd = fds[0];
+	fcntl(impl->readFd, F_SETFL, O_NONBLOCK);
+	// a bigger pipe means fewer context switches between the writer and the thread. this is only a hint.
+	fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+
+	impl->original = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (impl->original < 0 || dup2(fds[1], fd) < 0){
+		int err = errno;
+		close(fds[1]);
+		throw std::runtime_error("Failed to redirect file descriptor " + std::to_string(fd) + " (" + std::strerror(err) + ")");
+	}
+	close(fds[1]);
+
+	try{
+		impl->drainer = std::thread([this](){ impl->drain(); });
+	}
+	catch (std::system_error& e){
+		throw std::runtime_error("Failed to start the digest thread (" + std::string(e.what()) + ")");
+	}
+}
+
+OutputDigest::~OutputDigest() = default;
+
+uint64_t OutputDigest::getHash(){
+	auto lock = impl->sync();
+	return impl->hash.digest();
+}
+
+uint64_t OutputDigest::getBytes(){
+	auto lock = impl->sync();
+	return impl->bytes;
+}
+
+uint64_t OutputDigest::getLines(){
+	auto lock = impl->sync();
+	return impl->newlines + (impl->unfinishedLine ? 1 : 0);
+}
+
+std::vector<std::string> OutputDigest::getFirstLines(){
+	auto lock = impl->sync();
+	std::vector<std::string> ret = impl->first;
+
+	// a short output's unfinished last line is one of the first lines too
+	if (impl->unfinishedLine && ret.size() < impl->keepLines){
+		ret.push_back(impl->current);
+	}
+	return ret;
+}
+
+std::vector<std::string> OutputDigest::getLastLines(){
+	auto lock = impl->sync();
+	std::vector<std::string> ret(impl->last.begin(), impl->last.end());
+
+	if (impl->unfinishedLine && impl->keepLines > 0){
+		ret.push_back(impl->current);
+		if (ret.size() > impl->keepLines){
+			ret.erase(ret.begin());
+		}
+	}
+	return ret;
+}
+
+uint64_t OutputDigest::hash(std::string_view data){
+	StreamHash h;
+	h.update(data);
+	return h.digest();
+}
+
+/**
+ * @brief Formats a hash as 16 hex digits.
+ */
+static std::string toHex(uint64_t h){
+	char buf[19];
+	snprintf(buf, sizeof(buf), "0x%016llx", (unsigned long long)h);
+	return buf;
+}
+
+/**
+ * @brief Describes a digest for a failure message, including its last lines if any were kept.
+ */
+static std::string describe(OutputDigest& digest){
+	std::string ret = std::to_string(digest.getBytes()) + " bytes, " + std::to_string(digest.getLines()) + " lines";
+	std::vector<std::string> last = digest.getLastLines();
+
+	if (!last.empty()){
+		ret += ", ending with:";
+		for (const std::string& s : last){
+			ret += "\n\t" + s;
+		}
+	}
+	return ret;
+}
+
+void __expectoutputhash(uint64_t h, OutputDigest& digest){
+	uint64_t actual = digest.getHash();
+
+	if (actual != h){
+		throw FailedExpectation(toHex(h).c_str(), toHex(actual).c_str(), ("output hash (" + describe(digest) + ")").c_str());
+	}
+}
+
+void __expectoutputlines(uint64_t n, OutputDigest& digest){
+	uint64_t actual = digest.getLines();
+
+	if (actual != n){
+		throw FailedExpectation(std::to_string(n).c_str(), std::to_string(actual).c_str(), ("output line count (" + describe(digest) + ")").c_str());
+	}
+}
+
+}
@@ -0,0 +1,186 @@
+/** @file simpletest_digest.hpp
+ * @brief simpletest streaming output digests.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_DIGEST_HPP
+#define __SIMPLETEST_DIGEST_HPP
+
+#include "attribute.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief A streaming 64-bit hash (XXH64 with a seed of 0).
+ * Feeding data in pieces gives the same hash as feeding it all at once.
+ */
+class StreamHash{
+public:
+	/**
+	 * @brief Starts a new hash.
+	 */
+	StreamHash();
+
+	/**
+	 * @brief Adds data to the hash.
+	 *
+	 * @param data The data to add.
+	 */
+	void update(std::string_view data);
+
+	/**
+	 * @brief Returns the hash of everything added so far.
+	 * More data can still be added afterwards.
+	 */
+	uint64_t digest() const;
+
+private:
+	uint64_t acc[4];
+	unsigned char buf[32];
+	size_t bufLen;
+	uint64_t totalLen;
+};
+
+struct OutputDigestImpl;
+
+/**
+ * @brief Digests everything written to a file descriptor without keeping it.
+ * Only a running hash, byte and line counts, and optionally the first and last few lines are kept, so memory use stays the same no matter how much is written.
+ *
+ * The file descriptor is redirected into a pipe that a background thread drains, so writes never block for long.
+ * The original file descriptor is restored when the OutputDigest is destructed.
+ *
+ * If a child process inherits the file descriptor, the destructor waits until the child closes it too.
+ */
+class OutputDigest{
+public:
+	/**
+	 * @brief Begins digesting a file descriptor.
+	 *
+	 * @param keepLines How many of the first and last lines to keep for error messages and getFirstLines()/getLastLines().
+	 * Lines longer than 4096 bytes are truncated.
+	 * @param fd The file descriptor to digest. By default, this is stdout.
+	 *
+	 * @exception std::runtime_error Failed to create the pipe, redirect the file descriptor, or start the thread.
+	 */
+	OutputDigest(size_t keepLines = 0, int fd = STDOUT_FILENO);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 * The redirection can only be undone once.
+	 */
+	OutputDigest(const OutputDigest& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 * The redirection can only be undone once.
+	 */
+	OutputDigest& operator=(const OutputDigest& other) = delete;
+
+	/**
+	 * @brief Stops digesting and restores the original file descriptor.
+	 */
+	~OutputDigest();
+
+	/**
+	 * @brief Returns the hash of everything written so far.
+	 * This is the same as OutputDigest::hash() of all of the output.
+	 */
+	uint64_t getHash();
+
+	/**
+	 * @brief Returns the number of bytes written so far.
+	 */
+	uint64_t getBytes();
+
+	/**
+	 * @brief Returns the number of lines written so far.
+	 * This is the number of '\n' characters, plus one if the output does not end with a '\n'.
+	 */
+	uint64_t getLines();
+
+	/**
+	 * @brief Returns up to keepLines of the first lines, without their newlines.
+	 */
+	std::vector<std::string> getFirstLines();
+
+	/**
+	 * @brief Returns up to keepLines of the last lines, without their newlines.
+	 * An unfinished last line is included.
+	 */
+	std::vector<std::string> getLastLines();
+
+	/**
+	 * @brief Hashes data the same way an OutputDigest does.
+	 * Use this to compute the value to pass to EXPECT_OUTPUT_HASH().
+	 *
+	 * @param data The data to hash.
+	 */
+	static uint64_t hash(std::string_view data);
+
+private:
+	std::unique_ptr<OutputDigestImpl> impl;
+};
+
+/**
+ * @brief Starts digesting stdout for the rest of the test instead of capturing it.
+ * Use this for code that writes too much to keep around. EXPECT_OUTPUT_HASH() and EXPECT_OUTPUT_LINES() check the digest.
+ * This can only be used once per scope.
+ *
+ * @param keepLines How many of the first and last lines to keep for error messages.
+ */
+#define DIGEST_OUTPUT(keepLines)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::OutputDigest __stdigest(keepLines)
+
+/**
+ * @brief Expects the hash of everything written to stdout since DIGEST_OUTPUT() to be a particular value, failing the test if not.
+ *
+ * @param h The expected hash, for example simpletest::OutputDigest::hash(expectedOutput).
+ *
+ * @exception FailedExpectation Thrown if the hash is different.
+ */
+#define EXPECT_OUTPUT_HASH(h)\
+	simpletest::__expectoutputhash(h, __stdigest)
+
+/**
+ * @brief Do not call this function directly. Use the EXPECT_OUTPUT_HASH() macro instead.
+ *
+ * @param h        The expected hash.
+ * @param digest   The digest to check.
+ */
+void __expectoutputhash(uint64_t h, OutputDigest& digest);
+
+/**
+ * @brief Expects a particular number of lines to have been written to stdout since DIGEST_OUTPUT(), failing the test if not.
+ *
+ * @param n The expected number of lines.
+ *
+ * @exception FailedExpectation Thrown if the line count is different.
+ */
+#define EXPECT_OUTPUT_LINES(n)\
+	simpletest::__expectoutputlines(n, __stdigest)
+
+/**
+ * @brief Do not call this function directly. Use the EXPECT_OUTPUT_LINES() macro instead.
+ *
+ * @param n        The expected number of lines.
+ * @param digest   The digest to check.
+ */
+void __expectoutputlines(uint64_t n, OutputDigest& digest);
+
+}
+
+#endif
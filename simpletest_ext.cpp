@@ -7,12 +7,19 @@
  */
 
 #include "simpletest_ext.hpp"
+#include "simpletest.hpp"
 
 #include <algorithm>
 #include <cstring>
 #include <cerrno>
 #include <fstream>
+#include <map>
+#include <set>
 #include <sstream>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -62,6 +69,103 @@ static std::string AT_CONST __makepath(std::vector<std::string> components){
  */
 #define MAKE_PATH(...) __makepath({__VA_ARGS__})
 
+/**
+ * @brief The recorded state of one entry of a TestEnvironment.
+ */
+struct EntryStat{
+	/**
+	 * @brief The entry's inode number.
+	 */
+	ino_t ino;
+
+	/**
+	 * @brief The entry's size in bytes.
+	 */
+	off_t size;
+
+	/**
+	 * @brief The entry's modification time.
+	 */
+	struct timespec mtime;
+
+	/**
+	 * @brief The entry's type and permissions.
+	 */
+	mode_t mode;
+
+	/**
+	 * @brief The hash of a regular file's contents.
+	 */
+	uint64_t hash;
+
+	/**
+	 * @brief False if the entry is not a regular file or its contents could not be read.
+	 */
+	bool hashed;
+};
+
+/**
+ * @brief Hashes a file's contents.
+ *
+ * @param path The file.
+ * @param hash Set to the hash.
+ *
+ * @return False if the file could not be read.
+ */
+static bool hashFile(const std::string& path, uint64_t& hash){
+	StreamHash sh;
+	char buf[65536];
+	ssize_t ss;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0){
+		return false;
+	}
+	while ((ss = read(fd, buf, sizeof(buf))) != 0){
+		if (ss < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			close(fd);
+			return false;
+		}
+		sh.update(std::string_view(buf, ss));
+	}
+	close(fd);
+	hash = sh.digest();
+	return true;
+}
+
+/**
+ * @brief Lists a directory and everything under it, not including the directory itself.
+ * Entries that cannot be read are skipped.
+ *
+ * @param dir The directory.
+ * @param out The paths are appended to this.
+ */
+static void walkDirectory(const std::string& dir, std::vector<std::string>& out){
+	DIR* d = opendir(dir.c_str());
+	struct dirent* de;
+	struct stat st;
+
+	if (!d){
+		return;
+	}
+	while ((de = readdir(d)) != nullptr){
+		std::string path;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")){
+			continue;
+		}
+		path = dir + "/" + de->d_name;
+		out.push_back(path);
+		if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN && lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))){
+			walkDirectory(path, out);
+		}
+	}
+	closedir(d);
+}
+
 struct TestEnvironment::TestEnvironmentImpl{
 	/**
 	 * @brief Vector that holds the files within this test environment.
@@ -75,11 +179,55 @@ struct TestEnvironment::TestEnvironmentImpl{
 	 */
 	std::vector<std::string> directories;
 
+	/**
+	 * @brief The path the environment was set up under.
+	 */
+	std::string basePath;
+
+	/**
+	 * @brief The hashes of the files createTestFile() generated, so snapshot() does not have to read them back.
+	 */
+	std::unordered_map<std::string, uint64_t> knownHashes;
+
+	/**
+	 * @brief The state of each entry when snapshot() was last called, including basePath itself.
+	 */
+	std::map<std::string, EntryStat> snapshot;
+
+	/**
+	 * @brief True once snapshot() has been called.
+	 */
+	bool hasSnapshot = false;
+
+	/**
+	 * @brief The inotify instance watching the environment's directories, or -1 if there is none.
+	 */
+	int inotifyFd = -1;
+
+	/**
+	 * @brief The directory each inotify watch descriptor refers to.
+	 */
+	std::unordered_map<int, std::string> watches;
+
+	/**
+	 * @brief The entries inotify reported as touched since the snapshot.
+	 */
+	std::set<std::string> touched;
+
+	/**
+	 * @brief True if inotify's queue overflowed, so events may have been lost.
+	 */
+	bool overflowed = false;
+
 	/**
 	 * @brief Destructor for TestEnvironmentImpl.
 	 * This removes all files and directories in the files/directories vector.
 	 */
 	~TestEnvironmentImpl(){
+		if (inotifyFd >= 0){
+			close(inotifyFd);
+		}
+
 		std::for_each(files.begin(), files.end(), [](const auto& elem){
 			chmod(elem.c_str(), 0644);
 			remove(elem.c_str());
@@ -131,10 +279,134 @@ struct TestEnvironment::TestEnvironmentImpl{
 
 		// now create the file using this data
 		createFile(path, &(randData[0]), randLen, mode);
+		// remember its hash so snapshot() does not have to read it back
+		knownHashes[path] = OutputDigest::hash(std::string_view((char*)randData.data(), randLen));
 		// finally, add the file to our internal file vector
 		files.push_back(path);
 	}
 
+	/**
+	 * @brief Returns basePath without a trailing '/', so paths built from it match the ones readdir() produces.
+	 */
+	std::string root() const{
+		std::string ret = basePath;
+		while (ret.size() > 1 && ret.back() == '/'){
+			ret.pop_back();
+		}
+		return ret;
+	}
+
+	/**
+	 * @brief Watches a directory with inotify.
+	 * If the directory was created after the snapshot, its contents are added to the touched set, since they may have been created before the watch was.
+	 *
+	 * @param dir The directory.
+	 * @param isNew True if the directory did not exist when the snapshot was taken.
+	 */
+	void watch(const std::string& dir, bool isNew){
+		int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR);
+		std::vector<std::string> children;
+
+		if (wd < 0){
+			// an unwatched directory would hide changes, so stat everything instead
+			overflowed = true;
+			return;
+		}
+		watches[wd] = dir;
+		if (!isNew){
+			return;
+		}
+
+		walkDirectory(dir, children);
+		for (const std::string& child : children){
+			struct stat st;
+			touched.insert(child);
+			if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+				wd = inotify_add_watch(inotifyFd, child.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR);
+				if (wd < 0){
+					overflowed = true;
+					return;
+				}
+				watches[wd] = child;
+			}
+		}
+	}
+
+	/**
+	 * @brief Reads the pending inotify events into the touched set.
+	 */
+	void drainEvents(){
+		alignas(struct inotify_event) char buf[65536];
+		ssize_t ss;
+
+		if (inotifyFd < 0){
+			return;
+		}
+		while ((ss = read(inotifyFd, buf, sizeof(buf))) > 0 || (ss < 0 && errno == EINTR)){
+			for (char* ptr = buf; ptr < buf + ss; ){
+				struct inotify_event* ev = (struct inotify_event*)ptr;
+				auto it = watches.find(ev->wd);
+
+				ptr += sizeof(struct inotify_event) + ev->len;
+				if (ev->mask & IN_Q_OVERFLOW){
+					overflowed = true;
+					continue;
+				}
+				if (it == watches.end()){
+					continue;
+				}
+				if (ev->mask & IN_IGNORED){
+					watches.erase(it);
+					continue;
+				}
+				if (ev->len == 0){
+					touched.insert(it->second);
+					continue;
+				}
+
+				std::string path = it->second + "/" + ev->name;
+				touched.insert(path);
+				if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR)){
+					watch(path, true);
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Lists the entries getChanges() has to look at.
+	 */
+	std::set<std::string> candidates(){
+		std::set<std::string> ret;
+		std::vector<std::string> walked;
+
+		drainEvents();
+		if (inotifyFd < 0 || overflowed){
+			std::string base = root();
+			ret.insert(base);
+			walkDirectory(base, walked);
+			ret.insert(walked.begin(), walked.end());
+			for (const auto& elem : snapshot){
+				ret.insert(elem.first);
+			}
+			return ret;
+		}
+
+		for (const std::string& path : touched){
+			auto it = snapshot.find(path);
+			struct stat st;
+
+			ret.insert(path);
+			if (it != snapshot.end() && S_ISDIR(it->second.mode) && (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))){
+				// a removed directory takes everything under it along
+				for (auto sub = snapshot.lower_bound(path + "/"); sub != snapshot.end() && sub->first.compare(0, path.size() + 1, path + "/") == 0; ++sub){
+					ret.insert(sub->first);
+				}
+			}
+		}
+		return ret;
+	}
+
 	/**
 	 * @brief Creates a directory within the test environment and fills it with test files.
 	 * These files will be created with the following format:
@@ -286,10 +558,12 @@ TestEnvironment& TestEnvironment::setupBasicEnvironment(const char* basePath){
 	// seed the rng so we get the same environment every time
 	rand::seed(0);
 
+	impl->basePath = basePath;
 	impl->createNewDirectory(basePath);
 	impl->createTestDirectory(basePath, "file");
 
 	std::sort(impl->files.begin(), impl->files.end());
+	snapshot();
 	return *this;
 }
 
@@ -297,6 +571,7 @@ TestEnvironment& TestEnvironment::setupFullEnvironment(const char* basePath){
 	// seed the rng so we get the same environment every time
 	rand::seed(0);
 
+	impl->basePath = basePath;
 	impl->createNewDirectory(basePath);
 
 	// create 3 test directories under basePath/dir1, basePath/dir2, and basePath/excl
@@ -312,6 +587,7 @@ TestEnvironment& TestEnvironment::setupFullEnvironment(const char* basePath){
 
 	// sort the entries so binary search can be used on them
 	std::sort(impl->files.begin(), impl->files.end());
+	snapshot();
 	return *this;
 }
 
@@ -319,6 +595,155 @@ const std::vector<std::string>& TestEnvironment::getFiles() const{
 	return impl->files;
 }
 
+const std::string& TestEnvironment::getBasePath() const{
+	return impl->basePath;
+}
+
+void TestEnvironment::snapshot(){
+	std::string base = impl->root();
+	std::vector<std::string> entries;
+
+	if (base.empty()){
+		throw std::runtime_error("Cannot snapshot a TestEnvironment that has not been set up");
+	}
+
+	if (impl->inotifyFd >= 0){
+		close(impl->inotifyFd);
+	}
+	impl->snapshot.clear();
+	impl->watches.clear();
+	impl->touched.clear();
+	impl->overflowed = false;
+	// if this fails, getChanges() stats every entry instead
+	impl->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	entries.push_back(base);
+	walkDirectory(base, entries);
+	for (const std::string& path : entries){
+		struct stat st;
+		EntryStat es;
+
+		if (lstat(path.c_str(), &st) != 0){
+			throw std::runtime_error("Failed to stat " + path + " (" + std::strerror(errno) + ")");
+		}
+		es.ino = st.st_ino;
+		es.size = st.st_size;
+		es.mtime = st.st_mtim;
+		es.mode = st.st_mode;
+		es.hash = 0;
+		es.hashed = false;
+
+		if (S_ISREG(st.st_mode)){
+			auto known = impl->knownHashes.find(path);
+			if (known != impl->knownHashes.end()){
+				es.hash = known->second;
+				es.hashed = true;
+			}
+			else{
+				es.hashed = hashFile(path, es.hash);
+			}
+		}
+		else if (S_ISDIR(st.st_mode) && impl->inotifyFd >= 0){
+			impl->watch(path, false);
+		}
+		impl->snapshot[path] = es;
+	}
+	impl->hasSnapshot = true;
+}
+
+ChangeSet TestEnvironment::getChanges(){
+	ChangeSet ret;
+
+	if (!impl->hasSnapshot){
+		throw std::runtime_error("getChanges() was called before snapshot()");
+	}
+
+	for (const std::string& path : impl->candidates()){
+		auto it = impl->snapshot.find(path);
+		struct stat st;
+
+		if (lstat(path.c_str(), &st) != 0){
+			if (it != impl->snapshot.end()){
+				ret.deleted.push_back(path);
+			}
+			continue;
+		}
+		if (it == impl->snapshot.end()){
+			ret.created.push_back(path);
+			continue;
+		}
+
+		const EntryStat& es = it->second;
+		if ((st.st_mode & 07777) != (es.mode & 07777)){
+			ret.modeChanged.push_back(path);
+		}
+		if ((st.st_mode & S_IFMT) != (es.mode & S_IFMT)){
+			ret.modified.push_back(path);
+		}
+		else if (S_ISREG(st.st_mode)){
+			bool sameMeta = st.st_ino == es.ino && st.st_mtim.tv_sec == es.mtime.tv_sec && st.st_mtim.tv_nsec == es.mtime.tv_nsec;
+			uint64_t hash;
+
+			if (st.st_size != es.size){
+				ret.modified.push_back(path);
+			}
+			// the size is the same, so only read the file if something else suggests it was rewritten
+			else if (!sameMeta && (!es.hashed || !hashFile(path, hash) || hash != es.hash)){
+				ret.modified.push_back(path);
+			}
+		}
+	}
+	return ret;
+}
+
+bool ChangeSet::empty() const{
+	return created.empty() && modified.empty() && deleted.empty() && modeChanged.empty();
+}
+
+std::string ChangeSet::describe() const{
+	std::string ret;
+
+	for (const std::string& path : created){
+		ret += "created: " + path + "\n";
+	}
+	for (const std::string& path : modified){
+		ret += "modified: " + path + "\n";
+	}
+	for (const std::string& path : deleted){
+		ret += "deleted: " + path + "\n";
+	}
+	for (const std::string& path : modeChanged){
+		ret += "mode changed: " + path + "\n";
+	}
+	return ret;
+}
+
+void __assertonlymodified(TestEnvironment& env, const std::vector<std::string>& allowed){
+	ChangeSet changes = env.getChanges();
+	auto isAllowed = [&allowed](const std::string& path){
+		return std::any_of(allowed.begin(), allowed.end(), [&path](const std::string& a){
+			// "dir/" allows everything under dir, and dir itself
+			if (!a.empty() && a.back() == '/'){
+				return path.compare(0, a.size(), a) == 0 || path == a.substr(0, a.size() - 1);
+			}
+			return path == a;
+		});
+	};
+	auto prune = [&isAllowed](std::vector<std::string>& paths){
+		paths.erase(std::remove_if(paths.begin(), paths.end(), isAllowed), paths.end());
+	};
+
+	prune(changes.created);
+	prune(changes.modified);
+	prune(changes.deleted);
+	prune(changes.modeChanged);
+	if (!changes.empty()){
+		std::string msg = "Unexpected changes in " + env.getBasePath() + ":\n" + changes.describe();
+		msg.pop_back();
+		throw FailedAssertion(msg.c_str());
+	}
+}
+
 void fillMemory(void* mem, size_t len){
 	unsigned char* ucmem = (unsigned char*)mem;
 	for (size_t i = 0; i < len; ++i){
@@ -96,6 +96,42 @@ int cmpFile(void* mem, size_t memLen, const char* file);
  */
 bool fileExists(const char* file);
 
+/**
+ * @brief The entries of a TestEnvironment that changed since its snapshot was taken.
+ * Each path starts with the environment's basePath, like the ones returned by TestEnvironment::getFiles().
+ */
+struct ChangeSet{
+	/**
+	 * @brief Files and directories that did not exist in the snapshot.
+	 */
+	std::vector<std::string> created;
+
+	/**
+	 * @brief Files whose contents changed.
+	 */
+	std::vector<std::string> modified;
+
+	/**
+	 * @brief Files and directories that no longer exist.
+	 */
+	std::vector<std::string> deleted;
+
+	/**
+	 * @brief Files and directories whose permissions changed.
+	 */
+	std::vector<std::string> modeChanged;
+
+	/**
+	 * @brief Returns true if nothing changed.
+	 */
+	bool empty() const;
+
+	/**
+	 * @brief Returns a human-readable list of the changes, one per line, for example "modified: env/file1.txt".
+	 */
+	std::string describe() const;
+};
+
 /**
  * @brief A test environment class.
  * This makes sure that the test environment is cleaned up even when an exception is thrown.
@@ -146,7 +182,7 @@ public:
 	 * The environment will automatically be cleaned up when the function exits.
 	 *
 	 * @param basePath The path to make the test environment under.
-	 * This can be a relative path or an absolute path.
+	 * This can be a relative path or an absolute path. A relative path is relative to the working directory, which with --sandbox is a fresh directory of the test's own, so tests running at once can use the same one.
 	 *
 	 * @return A new TestEnvironment object with the aforementioned structure.
 	 *
@@ -175,6 +211,32 @@ public:
 	 */
 	const std::vector<std::string>& AT_CONST getFiles() const;
 
+	/**
+	 * @brief Returns the basePath the environment was set up under, or an empty string if it has not been set up.
+	 */
+	const std::string& getBasePath() const;
+
+	/**
+	 * @brief Records the current state of the environment, so getChanges() reports changes relative to it.
+	 * This is done automatically at the end of setupBasicEnvironment() and setupFullEnvironment().
+	 *
+	 * Each entry's inode, size, mtime and mode are recorded along with a hash of each file's contents.
+	 * The hashes of files the environment generated itself are already known, so they are not read back.
+	 * On Linux, the directories are also watched with inotify so getChanges() only has to look at entries that were touched.
+	 *
+	 * @exception std::runtime_error The environment has not been set up, or a file could not be read.
+	 */
+	void snapshot();
+
+	/**
+	 * @brief Returns what was created, modified, deleted or had its permissions changed since the last snapshot().
+	 * Only entries that were touched are examined, and contents are only hashed when an entry's size is unchanged but its inode or times are not.
+	 * If inotify is not available or its queue overflowed, every entry is stat()ed instead.
+	 *
+	 * @exception std::runtime_error No snapshot has been taken.
+	 */
+	ChangeSet getChanges();
+
 private:
 	struct TestEnvironmentImpl;
 	/**
@@ -185,6 +247,44 @@ private:
 	std::unique_ptr<TestEnvironmentImpl> impl;
 };
 
+/**
+ * @brief Asserts that the code under test changed nothing in a TestEnvironment except the given paths, failing the test if not.
+ * Use this instead of comparing every file to prove a tool did not write outside its target.
+ *
+ * @param env The TestEnvironment.
+ * @param ... The paths that may have changed, as strings, including the environment's basePath. A path ending in '/' allows everything under it.
+ *
+ * @exception FailedAssertion Thrown if anything else changed. The message lists the unexpected changes.
+ */
+#define ASSERT_ONLY_MODIFIED(env, ...)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__assertonlymodified(env, {__VA_ARGS__})
+
+/**
+ * @brief Asserts that the code under test changed nothing in a TestEnvironment, failing the test if not.
+ *
+ * @param env The TestEnvironment.
+ *
+ * @exception FailedAssertion Thrown if anything changed. The message lists the changes.
+ */
+#define ASSERT_UNCHANGED(env)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__assertonlymodified(env, {})
+
+/**
+ * @brief Do not call this function directly. Use the ASSERT_ONLY_MODIFIED() or ASSERT_UNCHANGED() macros instead.
+ *
+ * @param env     The TestEnvironment.
+ * @param allowed The paths that may have changed.
+ */
+void __assertonlymodified(TestEnvironment& env, const std::vector<std::string>& allowed);
+
 /**
  * @brief Fills a block of memory using random letters from 'A' to 'Z'.
  *
@@ -0,0 +1,466 @@
+/** @file simpletest_fdcapturer.cpp
+ * @brief simpletest file descriptor capturer.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_fdcapturer.hpp"
+
+// errno
+#include <cerrno>
+// std::strerror, std::strlen
+#include <cstring>
+// std::runtime_error, std::logic_error
+#include <stdexcept>
+// fcntl()
+#include <fcntl.h>
+// poll()
+#include <poll.h>
+// memfd_create(), mmap()
+#include <sys/mman.h>
+// socketpair(), shutdown()
+#include <sys/socket.h>
+// fstat()
+#include <sys/stat.h>
+// dup, dup2, pipe, read, write, etc.
+#include <unistd.h>
+
+#define P_READ  (0)
+#define P_WRITE (1)
+
+namespace simpletest{
+
+/**
+ * @brief The private implementation of the FdCapturer class.
+ */
+struct FdCapturerImpl{
+	/**
+	 * @brief The mode this capturer was created with.
+	 */
+	CaptureMode mode = CaptureMode::OUTPUT;
+
+	/**
+	 * @brief The file descriptor number being captured, or -1 if none was redirected.
+	 */
+	int target = -1;
+
+	/**
+	 * @brief The file descriptor the code under test uses.
+	 * This is the same as target unless target is -1.
+	 */
+	int theirs = -1;
+
+	/**
+	 * @brief A duplicate of the file descriptor that was at target before capture started, or -1 if it was not open.
+	 */
+	int original = -1;
+
+	/**
+	 * @brief Our end of the capture.
+	 * For CaptureMode::OUTPUT, this is the in-memory file.
+	 * For CaptureMode::INPUT, this is the writing end of the pipe.
+	 * For CaptureMode::SOCKET, this is our end of the socketpair.
+	 */
+	int ours = -1;
+
+	/**
+	 * @brief The in-memory file mapped into our address space (CaptureMode::OUTPUT only).
+	 */
+	char* map = nullptr;
+
+	/**
+	 * @brief The length of the aforementioned mapping.
+	 */
+	size_t mapLen = 0;
+
+	/**
+	 * @brief The output read from the socket that has not been compacted away yet (CaptureMode::SOCKET only).
+	 */
+	std::string buffer;
+
+	/**
+	 * @brief The offset of the first unconsumed byte of output.
+	 * For CaptureMode::OUTPUT this is an offset into the in-memory file, otherwise it is an offset into the buffer.
+	 */
+	size_t readOffset = 0;
+
+	/**
+	 * @brief Input that did not fit into the kernel buffer when it was sent.
+	 */
+	std::string pendingIn;
+
+	/**
+	 * @brief True if closeInput() was called while there was still pending input.
+	 */
+	bool closeWhenFlushed = false;
+
+	/**
+	 * @brief Makes sure a newly created file descriptor does not occupy the target number.
+	 * This can happen when the target was not open, since the kernel always returns the lowest free number.
+	 *
+	 * @param newFd The newly created file descriptor.
+	 *
+	 * @return A file descriptor with the same description that is not equal to target.
+	 */
+	int moveOffTarget(int newFd){
+		int moved;
+
+		if (newFd != target || target < 0){
+			return newFd;
+		}
+		moved = fcntl(newFd, F_DUPFD_CLOEXEC, target + 1);
+		close(newFd);
+		if (moved < 0){
+			throw std::runtime_error("Failed to duplicate file descriptor (" + std::string(std::strerror(errno)) + ")");
+		}
+		return moved;
+	}
+
+	/**
+	 * @brief Points target at the given file descriptor, saving the original one first.
+	 *
+	 * @param fd The file descriptor to put in target's place.
+	 */
+	void redirect(int fd){
+		// save the original so it can be restored later. EBADF just means it was not open.
+		original = fcntl(target, F_DUPFD_CLOEXEC, 0);
+		if (original < 0 && errno != EBADF){
+			throw std::runtime_error("Failed to save file descriptor " + std::to_string(target) + " (" + std::strerror(errno) + ")");
+		}
+		// dup2() clears FD_CLOEXEC, so child processes inherit the redirected descriptor like they would the original
+		if (dup2(fd, target) < 0){
+			throw std::runtime_error("Failed to redirect file descriptor " + std::to_string(target) + " (" + std::strerror(errno) + ")");
+		}
+		theirs = target;
+	}
+
+	/**
+	 * @brief Makes a file descriptor the code under test's end without redirecting anything.
+	 * The code under test is handed the descriptor directly, so it is left open across exec() like an inherited one would be.
+	 *
+	 * @param fd The file descriptor to hand over.
+	 */
+	void handOver(int fd){
+		if (fd < 0){
+			throw std::runtime_error("Failed to duplicate file descriptor (" + std::string(std::strerror(errno)) + ")");
+		}
+		fcntl(fd, F_SETFD, 0);
+		theirs = fd;
+	}
+
+	/**
+	 * @brief Writes as much pending input as the kernel will accept without blocking.
+	 */
+	void flushInput(){
+		ssize_t ss;
+
+		while (!pendingIn.empty()){
+			ss = write(ours, pendingIn.data(), pendingIn.size());
+			if (ss < 0){
+				if (errno == EAGAIN || errno == EWOULDBLOCK){
+					return;
+				}
+				if (errno == EINTR){
+					continue;
+				}
+				throw std::runtime_error("Failed to write to file descriptor (" + std::string(std::strerror(errno)) + ")");
+			}
+			pendingIn.erase(0, ss);
+		}
+
+		if (closeWhenFlushed){
+			closeWhenFlushed = false;
+			shutdownInput();
+		}
+	}
+
+	/**
+	 * @brief Closes our writing end.
+	 */
+	void shutdownInput(){
+		if (mode == CaptureMode::SOCKET){
+			shutdown(ours, SHUT_WR);
+		}
+		else if (mode == CaptureMode::INPUT && ours >= 0){
+			close(ours);
+			ours = -1;
+		}
+	}
+
+	/**
+	 * @brief Reads all available output without blocking.
+	 *
+	 * @return The number of new bytes available.
+	 */
+	size_t pumpOutput(){
+		struct stat st;
+		char buf[4096];
+		ssize_t ss;
+		size_t total = 0;
+
+		if (mode == CaptureMode::OUTPUT){
+			if (fstat(ours, &st) != 0){
+				throw std::runtime_error("Failed to stat capture file (" + std::string(std::strerror(errno)) + ")");
+			}
+			// the file only grows, so only remap when it does
+			if ((size_t)st.st_size > mapLen){
+				total = st.st_size - mapLen;
+				remap(st.st_size);
+			}
+			return total;
+		}
+
+		if (mode != CaptureMode::SOCKET){
+			return 0;
+		}
+
+		// throw away consumed data once it makes up most of the buffer, so the buffer does not grow forever
+		if (readOffset > 0 && readOffset >= buffer.size() / 2){
+			buffer.erase(0, readOffset);
+			readOffset = 0;
+		}
+
+		while ((ss = read(ours, buf, sizeof(buf))) != 0){
+			if (ss < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				break;
+			}
+			buffer.append(buf, ss);
+			total += ss;
+		}
+		return total;
+	}
+
+	/**
+	 * @brief Maps the in-memory file into our address space.
+	 *
+	 * @param len The new length of the file.
+	 */
+	void remap(size_t len){
+		void* ptr;
+
+		if (map != nullptr){
+			munmap(map, mapLen);
+			map = nullptr;
+			mapLen = 0;
+		}
+		ptr = mmap(nullptr, len, PROT_READ, MAP_SHARED, ours, 0);
+		if (ptr == MAP_FAILED){
+			throw std::runtime_error("Failed to map capture file (" + std::string(std::strerror(errno)) + ")");
+		}
+		map = (char*)ptr;
+		mapLen = len;
+	}
+
+	/**
+	 * @brief Returns the unconsumed output.
+	 */
+	std::string_view unconsumed() const{
+		if (mode == CaptureMode::OUTPUT){
+			return map == nullptr ? std::string_view() : std::string_view(map + readOffset, mapLen - readOffset);
+		}
+		return std::string_view(buffer).substr(readOffset);
+	}
+
+	/**
+	 * @brief Stops capturing and releases all resources.
+	 */
+	~FdCapturerImpl(){
+		if (map != nullptr){
+			munmap(map, mapLen);
+		}
+		// only touch the target if it was actually redirected. the constructor may have thrown before that point.
+		if (target >= 0 && theirs == target){
+			if (original >= 0){
+				dup2(original, target);
+			}
+			else{
+				close(target);
+			}
+		}
+		else if (theirs >= 0){
+			close(theirs);
+		}
+		if (original >= 0){
+			close(original);
+		}
+		if (ours >= 0){
+			close(ours);
+		}
+	}
+};
+
+FdCapturer::FdCapturer(int fd, CaptureMode mode): impl(std::make_unique<FdCapturerImpl>()){
+	int fds[2];
+
+	impl->mode = mode;
+	impl->target = fd;
+
+	switch (mode){
+	case CaptureMode::OUTPUT:
+		// an in-memory file instead of a pipe means the code under test never blocks on a full pipe, and we can map the output instead of copying it
+		impl->ours = memfd_create("simpletest", MFD_CLOEXEC);
+		if (impl->ours < 0){
+			throw std::runtime_error("Failed to create capture file (" + std::string(std::strerror(errno)) + ")");
+		}
+		impl->ours = impl->moveOffTarget(impl->ours);
+		if (fd < 0){
+			impl->handOver(fcntl(impl->ours, F_DUPFD, 0));
+		}
+		else{
+			impl->redirect(impl->ours);
+		}
+		break;
+
+	case CaptureMode::INPUT:
+		if (pipe2(fds, O_CLOEXEC) != 0){
+			throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+		}
+		fds[P_READ] = impl->moveOffTarget(fds[P_READ]);
+		impl->ours = impl->moveOffTarget(fds[P_WRITE]);
+		// do not block. if the pipe is full, the rest is kept until the next pump()
+		fcntl(impl->ours, F_SETFL, O_NONBLOCK);
+		if (fd < 0){
+			impl->handOver(fds[P_READ]);
+		}
+		else{
+			impl->redirect(fds[P_READ]);
+			close(fds[P_READ]);
+		}
+		break;
+
+	case CaptureMode::SOCKET:
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0){
+			throw std::runtime_error("Failed to create socketpair (" + std::string(std::strerror(errno)) + ")");
+		}
+		fds[0] = impl->moveOffTarget(fds[0]);
+		impl->ours = impl->moveOffTarget(fds[1]);
+		fcntl(impl->ours, F_SETFL, O_NONBLOCK);
+		if (fd < 0){
+			impl->handOver(fds[0]);
+		}
+		else{
+			impl->redirect(fds[0]);
+			close(fds[0]);
+		}
+		break;
+	}
+}
+
+FdCapturer FdCapturer::socketPair(){
+	return FdCapturer(-1, CaptureMode::SOCKET);
+}
+
+FdCapturer::FdCapturer(FdCapturer&& other){
+	impl = std::move(other.impl);
+}
+
+FdCapturer& FdCapturer::operator=(FdCapturer&& other){
+	impl = std::move(other.impl);
+	return *this;
+}
+
+FdCapturer::~FdCapturer() = default;
+
+int FdCapturer::getFd() const{
+	return impl->theirs;
+}
+
+int FdCapturer::getOriginalFd() const{
+	return impl->original;
+}
+
+size_t FdCapturer::pump(){
+	impl->flushInput();
+	return impl->pumpOutput();
+}
+
+std::string_view FdCapturer::peek(){
+	pump();
+	return impl->unconsumed();
+}
+
+void FdCapturer::consume(size_t len){
+	size_t avail = impl->unconsumed().size();
+	impl->readOffset += len < avail ? len : avail;
+}
+
+std::string FdCapturer::getOutput(){
+	std::string_view sv = peek();
+	std::string ret(sv);
+	consume(sv.size());
+	return ret;
+}
+
+size_t FdCapturer::send(const void* data, size_t len){
+	if (impl->mode == CaptureMode::OUTPUT){
+		throw std::logic_error("Cannot send input to a CaptureMode::OUTPUT capturer");
+	}
+	if (impl->ours < 0 || impl->closeWhenFlushed){
+		throw std::logic_error("Cannot send input after closeInput()");
+	}
+
+	// anything already pending has to go first, otherwise the input would be reordered
+	impl->pendingIn.append((const char*)data, len);
+	impl->flushInput();
+	// whatever is still pending is the tail of the queue, which is this call's data
+	return impl->pendingIn.size() >= len ? 0 : len - impl->pendingIn.size();
+}
+
+size_t FdCapturer::sendLine(const char* line){
+	size_t len = std::strlen(line);
+	std::string s(line, len);
+
+	if (len == 0 || line[len - 1] != '\n'){
+		s += '\n';
+	}
+	return send(s.data(), s.size());
+}
+
+size_t FdCapturer::pendingInput() const{
+	return impl->pendingIn.size();
+}
+
+void FdCapturer::closeInput(){
+	if (impl->pendingIn.empty()){
+		impl->shutdownInput();
+	}
+	else{
+		impl->closeWhenFlushed = true;
+	}
+}
+
+bool FdCapturer::waitForOutput(int timeoutMs){
+	struct pollfd pfd;
+	int waited = 0;
+
+	if (!peek().empty()){
+		return true;
+	}
+
+	if (impl->mode == CaptureMode::SOCKET){
+		pfd.fd = impl->ours;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeoutMs) > 0){
+			return !peek().empty();
+		}
+		return false;
+	}
+
+	// an in-memory file is always "readable", so it has to be checked periodically instead
+	while (waited < timeoutMs){
+		usleep(1000);
+		waited++;
+		if (!peek().empty()){
+			return true;
+		}
+	}
+	return false;
+}
+
+}
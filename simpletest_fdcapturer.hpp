@@ -0,0 +1,194 @@
+/** @file simpletest_fdcapturer.hpp
+ * @brief simpletest file descriptor capturer.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_FDCAPTURER_HPP
+#define __SIMPLETEST_FDCAPTURER_HPP
+
+#include "attribute.hpp"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace simpletest{
+
+/**
+ * @brief Determines how an FdCapturer attaches itself to a file descriptor.
+ */
+enum class CaptureMode{
+	/**
+	 * @brief Everything written to the file descriptor is captured.
+	 * The data is stored in an in-memory file, so writes never block no matter how much is written.
+	 */
+	OUTPUT,
+
+	/**
+	 * @brief Everything read from the file descriptor is fed through FdCapturer::send().
+	 */
+	INPUT,
+
+	/**
+	 * @brief The file descriptor becomes one end of a socketpair, and the FdCapturer holds the other.
+	 * Data can be both captured and fed, so this can stand in for an inherited socket.
+	 */
+	SOCKET
+};
+
+struct FdCapturerImpl;
+
+/**
+ * @brief Captures and/or feeds an arbitrary file descriptor.
+ * The original file descriptor is restored when the FdCapturer is destructed.
+ *
+ * All operations are non-blocking, so the code under test can run on the same thread as the capturer.
+ */
+class FdCapturer{
+public:
+	/**
+	 * @brief Begins capturing a file descriptor.
+	 *
+	 * @param fd The file descriptor number to capture, for example 3.
+	 * This does not have to be open beforehand. If it was not, it is closed again when capture stops.
+	 * If this is -1, nothing is redirected, and the code under test's end is left at whatever number the kernel gives it. Use getFd() to retrieve it.
+	 * This is useful for handing the end to a child process.
+	 * @param mode How to capture the file descriptor.
+	 * By default, this is CaptureMode::OUTPUT.
+	 *
+	 * @exception std::runtime_error Failed to create the in-memory file, pipe, or socketpair, or failed to redirect the file descriptor.
+	 */
+	FdCapturer(int fd, CaptureMode mode = CaptureMode::OUTPUT);
+
+	/**
+	 * @brief Creates a socketpair without redirecting any existing file descriptor.
+	 * This is equivalent to FdCapturer(-1, CaptureMode::SOCKET).
+	 *
+	 * @return An FdCapturer whose getFd() is the code under test's end of the socketpair.
+	 */
+	static FdCapturer socketPair();
+
+	/**
+	 * @brief Move constructor for FdCapturer.
+	 */
+	FdCapturer(FdCapturer&& other);
+
+	/**
+	 * @brief Move assignment operator for FdCapturer.
+	 */
+	FdCapturer& operator=(FdCapturer&& other);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 * This class should not be copied because the destructor restores the file descriptor and should only fire once.
+	 */
+	FdCapturer(const FdCapturer& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 * This class should not be copied because the destructor restores the file descriptor and should only fire once.
+	 */
+	FdCapturer& operator=(const FdCapturer& other) = delete;
+
+	/**
+	 * @brief Stops capturing and restores the original file descriptor.
+	 */
+	~FdCapturer();
+
+	/**
+	 * @brief Returns the file descriptor the code under test should use.
+	 */
+	int getFd() const;
+
+	/**
+	 * @brief Returns a duplicate of the file descriptor that was in place before capture started.
+	 *
+	 * @return The original file descriptor, or -1 if it was not open.
+	 */
+	int getOriginalFd() const;
+
+	/**
+	 * @brief Moves any pending data without blocking.
+	 * Input that did not fit when it was sent is written, and available output is read into the internal buffer.
+	 *
+	 * @return The number of new bytes of output available.
+	 */
+	size_t pump();
+
+	/**
+	 * @brief Returns the output that has not been consumed yet without copying it.
+	 * This calls pump() first.
+	 *
+	 * @return A view of the unconsumed output.
+	 * This is invalidated by the next non-const call on this object.
+	 */
+	std::string_view peek();
+
+	/**
+	 * @brief Marks bytes returned by peek() as consumed.
+	 *
+	 * @param len The number of bytes to consume.
+	 * If this is larger than the amount of unconsumed output, all of it is consumed.
+	 */
+	void consume(size_t len);
+
+	/**
+	 * @brief Returns all output since the last call to getOutput() and consumes it.
+	 */
+	std::string getOutput();
+
+	/**
+	 * @brief Sends data to the code under test.
+	 * Data that does not fit in the kernel buffer is kept and sent on subsequent calls to pump().
+	 *
+	 * @param data The data to send.
+	 * @param len The length of the data.
+	 *
+	 * @return The number of bytes that were written immediately.
+	 *
+	 * @exception std::logic_error This capturer was made with CaptureMode::OUTPUT.
+	 * @exception std::runtime_error Failed to write to the file descriptor.
+	 */
+	size_t send(const void* data, size_t len);
+
+	/**
+	 * @brief Sends a line to the code under test.
+	 *
+	 * @param line The line to send.
+	 * If this does not end with a '\n', one will be appended automatically.
+	 *
+	 * @return The number of bytes that were written immediately.
+	 */
+	size_t sendLine(const char* line);
+
+	/**
+	 * @brief Returns the number of bytes sent that have not been written to the kernel yet.
+	 */
+	size_t pendingInput() const;
+
+	/**
+	 * @brief Closes the capturer's writing end.
+	 * The code under test sees end-of-file once it has read any pending data.
+	 */
+	void closeInput();
+
+	/**
+	 * @brief Waits for new output to arrive.
+	 * This is only meaningful if the code under test is running on another thread or in another process.
+	 *
+	 * @param timeoutMs The maximum number of milliseconds to wait.
+	 *
+	 * @return True if unconsumed output is available, false if the timeout expired first.
+	 */
+	bool waitForOutput(int timeoutMs);
+
+private:
+	std::unique_ptr<FdCapturerImpl> impl;
+};
+
+}
+
+#endif
@@ -0,0 +1,351 @@
+/** @file simpletest_fsbench.cpp
+ * @brief simpletest file system metadata benchmarks.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_fsbench.hpp"
+
+// std::atomic
+#include <atomic>
+// std::chrono
+#include <chrono>
+// std::exception_ptr
+#include <exception>
+// std::function
+#include <functional>
+// std::mutex
+#include <mutex>
+// std::ostringstream
+#include <sstream>
+// std::runtime_error
+#include <stdexcept>
+// std::thread
+#include <thread>
+// uint64_t
+#include <cstdint>
+// std::strerror
+#include <cstring>
+// opendir(), readdir()
+#include <dirent.h>
+// open(), O_DIRECTORY, AT_FDCWD
+#include <fcntl.h>
+// stat(), statx(), chmod(), mkdir()
+#include <sys/stat.h>
+// SYS_getdents64
+#include <sys/syscall.h>
+// statfs()
+#include <sys/vfs.h>
+// close(), unlink(), rmdir(), syscall()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief The latencies and wall time of one benchmark run.
+ */
+struct FsPhase{
+	/**
+	 * @brief The latency of each timed call.
+	 */
+	std::vector<std::chrono::nanoseconds> samples;
+
+	/**
+	 * @brief The number of operations completed across all threads.
+	 */
+	size_t ops = 0;
+
+	/**
+	 * @brief The time from the threads starting to the last one finishing.
+	 */
+	std::chrono::nanoseconds wall{0};
+};
+
+/**
+ * @brief Throws a std::runtime_error for a failed operation, including errno.
+ */
+static void fail(const char* op, const std::string& path){
+	throw std::runtime_error("Failed to " + std::string(op) + " " + path + " (" + std::strerror(errno) + ")");
+}
+
+/**
+ * @brief Runs a benchmark on several threads at once.
+ * The threads wait for each other before starting, so thread creation is not timed.
+ *
+ * @param threads The number of threads.
+ * @param items The number of items to divide between the threads. Thread t gets every item i where i % threads == t.
+ * @param op Performs one item and returns the number of operations it counts as.
+ */
+static FsPhase runPhase(size_t threads, size_t items, const std::function<size_t(size_t)>& op){
+	std::vector<std::vector<std::chrono::nanoseconds>> samples(threads);
+	std::vector<size_t> ops(threads);
+	std::vector<std::thread> workers;
+	std::atomic<size_t> ready{0};
+	std::atomic<bool> go{false};
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	std::chrono::steady_clock::time_point start;
+	FsPhase phase;
+
+	for (size_t t = 0; t < threads; ++t){
+		workers.emplace_back([&, t](){
+			samples[t].reserve(items / threads + 1);
+			ready++;
+			while (!go){
+				std::this_thread::yield();
+			}
+			try{
+				for (size_t i = t; i < items; i += threads){
+					auto begin = std::chrono::steady_clock::now();
+					ops[t] += op(i);
+					samples[t].push_back(std::chrono::steady_clock::now() - begin);
+				}
+			}
+			catch (...){
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error){
+					error = std::current_exception();
+				}
+			}
+		});
+	}
+
+	while (ready < threads){
+		std::this_thread::yield();
+	}
+	start = std::chrono::steady_clock::now();
+	go = true;
+	for (std::thread& w : workers){
+		w.join();
+	}
+	phase.wall = std::chrono::steady_clock::now() - start;
+
+	if (error){
+		std::rethrow_exception(error);
+	}
+	for (size_t t = 0; t < threads; ++t){
+		phase.samples.insert(phase.samples.end(), samples[t].begin(), samples[t].end());
+		phase.ops += ops[t];
+	}
+	return phase;
+}
+
+/**
+ * @brief Lists a directory with opendir() and readdir().
+ *
+ * @return The number of entries, including "." and "..".
+ */
+static size_t listReaddir(const std::string& dir){
+	DIR* d = opendir(dir.c_str());
+	size_t n = 0;
+
+	if (!d){
+		fail("open directory", dir);
+	}
+	while (readdir(d) != nullptr){
+		n++;
+	}
+	closedir(d);
+	return n;
+}
+
+/**
+ * @brief Lists a directory with the getdents64 system call.
+ *
+ * @return The number of entries, including "." and "..".
+ */
+static size_t listGetdents(const std::string& dir){
+	// the layout the kernel fills in, which glibc does not declare
+	struct LinuxDirent64{
+		uint64_t ino;
+		int64_t off;
+		unsigned short reclen;
+		unsigned char type;
+		char name[1];
+	};
+	alignas(LinuxDirent64) char buf[65536];
+	long res;
+	size_t n = 0;
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0){
+		fail("open directory", dir);
+	}
+	while ((res = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0){
+		for (long pos = 0; pos < res; pos += ((LinuxDirent64*)(buf + pos))->reclen){
+			n++;
+		}
+	}
+	close(fd);
+	if (res < 0){
+		fail("list", dir);
+	}
+	return n;
+}
+
+std::string fsTypeOf(const char* path){
+	static const std::pair<unsigned long, const char*> types[] = {
+		{0xEF53, "ext4"},
+		{0x58465342, "xfs"},
+		{0x9123683E, "btrfs"},
+		{0x01021994, "tmpfs"},
+		{0x794C7630, "overlayfs"},
+		{0x2FC12FC1, "zfs"},
+		{0xF2F52010, "f2fs"},
+		{0x6969, "nfs"},
+		{0xFF534D42, "cifs"},
+		{0x65735546, "fuse"},
+		{0x4D44, "vfat"},
+		{0x5346544E, "ntfs"},
+		{0x858458F6, "ramfs"},
+		{0x00C36400, "ceph"},
+		{0x01021997, "9p"},
+	};
+	struct statfs sf;
+	std::ostringstream oss;
+
+	if (statfs(path, &sf) != 0){
+		fail("statfs", path);
+	}
+	for (const auto& t : types){
+		if ((unsigned long)sf.f_type == t.first){
+			return t.second;
+		}
+	}
+	oss << "0x" << std::hex << (unsigned long)sf.f_type;
+	return oss.str();
+}
+
+std::vector<FsBenchResult> fsMetadataBenchmark(const TestEnvironment& env, const FsBenchOptions& options){
+	std::vector<FsBenchResult> results;
+	std::string base = env.getBasePath();
+	std::string fsType;
+	const char* testName = getCurrentTestName();
+
+	if (base.empty()){
+		throw std::runtime_error("fsMetadataBenchmark() needs a TestEnvironment that has been set up");
+	}
+	fsType = fsTypeOf(base.c_str());
+
+	for (size_t dirSize : options.dirSizes){
+		for (size_t threads : options.threads){
+			std::string dir = base + "/fsbench-" + std::to_string(dirSize) + "-" + std::to_string(threads);
+			auto file = [&dir](const char* prefix, size_t i){
+				return dir + "/" + prefix + std::to_string(i);
+			};
+			auto record = [&](const char* op, const FsPhase& phase, const char* unit){
+				FsBenchResult res;
+				Benchmark bench;
+				double secs = std::chrono::duration<double>(phase.wall).count();
+
+				res.op = op;
+				res.dirSize = dirSize;
+				res.threads = threads;
+				res.opsPerSec = secs > 0 ? phase.ops / secs : 0;
+
+				bench.name = std::string(testName ? testName : "FS_METADATA_BENCHMARK") + ": " + op + " (" + std::to_string(dirSize) + " files, " + std::to_string(threads) + (threads == 1 ? " thread)" : " threads)");
+				bench.samples = phase.samples;
+				bench.details.push_back({unit, std::to_string((unsigned long long)res.opsPerSec)});
+				bench.details.push_back({"file system", fsType});
+				res.stats = reportBenchmark(std::move(bench));
+				results.push_back(std::move(res));
+			};
+
+			if (threads == 0){
+				continue;
+			}
+			if (mkdir(dir.c_str(), 0755) != 0){
+				fail("create directory", dir);
+			}
+
+			try{
+				record("create", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("f", i);
+					int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+					if (fd < 0){
+						fail("create", path);
+					}
+					close(fd);
+					return 1;
+				}), "ops/sec");
+
+				record("stat", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("f", i);
+					struct stat st;
+					if (stat(path.c_str(), &st) != 0){
+						fail("stat", path);
+					}
+					return 1;
+				}), "ops/sec");
+
+				record("statx", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("f", i);
+					struct statx stx;
+					if (statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, STATX_BASIC_STATS, &stx) != 0){
+						fail("statx", path);
+					}
+					return 1;
+				}), "ops/sec");
+
+				record("open/close", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("f", i);
+					int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+					if (fd < 0){
+						fail("open", path);
+					}
+					close(fd);
+					return 1;
+				}), "ops/sec");
+
+				// every thread lists the whole directory, so these count entries rather than listings
+				record("readdir", runPhase(threads, threads * options.listings, [&](size_t){
+					return listReaddir(dir);
+				}), "entries/sec");
+
+				record("getdents64", runPhase(threads, threads * options.listings, [&](size_t){
+					return listGetdents(dir);
+				}), "entries/sec");
+
+				record("chmod", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("f", i);
+					if (chmod(path.c_str(), 0600) != 0){
+						fail("chmod", path);
+					}
+					return 1;
+				}), "ops/sec");
+
+				record("rename", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("f", i);
+					std::string newPath = file("r", i);
+					if (rename(path.c_str(), newPath.c_str()) != 0){
+						fail("rename", path);
+					}
+					return 1;
+				}), "ops/sec");
+
+				record("unlink", runPhase(threads, dirSize, [&](size_t i){
+					std::string path = file("r", i);
+					if (unlink(path.c_str()) != 0){
+						fail("unlink", path);
+					}
+					return 1;
+				}), "ops/sec");
+			}
+			catch (...){
+				// a failed run can leave files under either name
+				for (size_t i = 0; i < dirSize; ++i){
+					unlink(file("f", i).c_str());
+					unlink(file("r", i).c_str());
+				}
+				rmdir(dir.c_str());
+				throw;
+			}
+			rmdir(dir.c_str());
+		}
+	}
+	return results;
+}
+
+}
@@ -0,0 +1,124 @@
+/** @file simpletest_fsbench.hpp
+ * @brief simpletest file system metadata benchmarks.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_FSBENCH_HPP
+#define __SIMPLETEST_FSBENCH_HPP
+
+#include "simpletest.hpp"
+#include "simpletest_ext.hpp"
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Options for fsMetadataBenchmark().
+ */
+struct FsBenchOptions{
+	/**
+	 * @brief The numbers of files to put in the benchmark directory.
+	 * Large directories show how lookups and listings scale on the file system.
+	 */
+	std::vector<size_t> dirSizes = {100, 1000, 10000};
+
+	/**
+	 * @brief The numbers of threads to run each operation on at once.
+	 * All threads work in the same directory, so this also measures contention on it.
+	 */
+	std::vector<size_t> threads = {1, 4};
+
+	/**
+	 * @brief The number of times each thread lists the directory in the readdir and getdents64 runs.
+	 */
+	size_t listings = 10;
+};
+
+/**
+ * @brief The result of benchmarking one operation at one directory size and thread count.
+ */
+struct FsBenchResult{
+	/**
+	 * @brief The operation, one of "create", "stat", "statx", "open/close", "readdir", "getdents64", "chmod", "rename" or "unlink".
+	 */
+	std::string op;
+
+	/**
+	 * @brief The number of files in the directory.
+	 */
+	size_t dirSize;
+
+	/**
+	 * @brief The number of threads that ran the operation at once.
+	 */
+	size_t threads;
+
+	/**
+	 * @brief The operations completed per second across all threads.
+	 * For readdir and getdents64 this counts directory entries read.
+	 */
+	double opsPerSec;
+
+	/**
+	 * @brief The latency of each operation, or of each whole listing for readdir and getdents64.
+	 */
+	BenchmarkStats stats;
+};
+
+/**
+ * @brief Measures the throughput and latency of metadata operations on the file system a TestEnvironment lives on.
+ * For each directory size and thread count, a directory is created inside the environment and the following run in order:<br>
+ * - create: open() with O_CREAT | O_EXCL, then close(), for each file.<br>
+ * - stat: stat() of each file.<br>
+ * - statx: statx() of each file.<br>
+ * - open/close: open() with O_RDONLY, then close(), of each file.<br>
+ * - readdir: listing the directory with opendir() and readdir().<br>
+ * - getdents64: listing the directory with the raw getdents64 system call, without libc's buffering.<br>
+ * - chmod: chmod() of each file.<br>
+ * - rename: rename() of each file to a new name.<br>
+ * - unlink: unlink() of each file.<br>
+ * <br>
+ * The files are divided between the threads, which all start at once.
+ * Each result is added to the benchmark report printed after the test results, along with the file system type, so results from different build hosts can be told apart.
+ *
+ * @param env The environment. It must already be set up.
+ * @param options What to measure.
+ *
+ * @return The results, in the order they were measured.
+ *
+ * @exception std::runtime_error An operation failed.
+ */
+std::vector<FsBenchResult> fsMetadataBenchmark(const TestEnvironment& env, const FsBenchOptions& options = FsBenchOptions());
+
+/**
+ * @brief Returns the type of the file system a path is on, for example "ext4" or "tmpfs".
+ * Unknown file systems are returned as their magic number in hex.
+ *
+ * @param path The path.
+ *
+ * @exception std::runtime_error Failed to statfs() the path.
+ */
+std::string fsTypeOf(const char* path);
+
+/**
+ * @brief Benchmarks file system metadata operations inside a TestEnvironment with the default FsBenchOptions.
+ * See fsMetadataBenchmark() for details.
+ *
+ * Usage: FS_METADATA_BENCHMARK(env);
+ *
+ * @param env The TestEnvironment. It must already be set up.
+ */
+#define FS_METADATA_BENCHMARK(env)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::fsMetadataBenchmark(env)
+
+}
+
+#endif
@@ -0,0 +1,650 @@
+/** @file simpletest_history.cpp
+ * @brief simpletest run history file with trend and regression queries.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_history.hpp"
+
+// std::sort, std::stable_sort, std::min
+#include <algorithm>
+// std::setw, std::setprecision
+#include <iomanip>
+// std::ostringstream
+#include <sstream>
+// std::map
+#include <map>
+// std::array
+#include <array>
+// LONG_MAX
+#include <climits>
+// std::invalid_argument, std::runtime_error
+#include <stdexcept>
+// std::unordered_map
+#include <unordered_map>
+// std::strerror, std::memcpy
+#include <cstring>
+// errno
+#include <cerrno>
+// localtime_r(), strftime()
+#include <ctime>
+// open()
+#include <fcntl.h>
+// flock()
+#include <sys/file.h>
+// mmap(), munmap()
+#include <sys/mman.h>
+// fstat()
+#include <sys/stat.h>
+// write(), pread(), ftruncate(), close()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief The first 8 bytes of a history file.
+ */
+static const uint64_t historyMagic = 0x3130545349485453ULL; // "STHIST01"
+
+/**
+ * @brief The first 4 bytes of each run in a history file.
+ */
+static const uint32_t runMagic = 0x4e555254; // "TRUN"
+
+/**
+ * @brief The size of a run's header: magic, test count, time and length.
+ */
+static const size_t runHeaderSize = 2 * sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint64_t);
+
+/**
+ * @brief The most bytes of a failure reason that are stored.
+ */
+static const size_t maxReason = 256;
+
+/**
+ * @brief Appends a value to a record.
+ */
+template <typename T>
+static void put(std::string& buf, T val){
+	buf.append((const char*)&val, sizeof(val));
+}
+
+/**
+ * @brief Appends a string of at most 65535 bytes, prefixed by its length.
+ */
+static void putString(std::string& buf, const std::string& str){
+	size_t len = std::min<size_t>(str.size(), UINT16_MAX);
+	put<uint16_t>(buf, len);
+	buf.append(str, 0, len);
+}
+
+/**
+ * @brief Reads a value from the mapping, advancing pos past it.
+ */
+template <typename T>
+static T get(const char* base, size_t& pos){
+	T val;
+	std::memcpy(&val, base + pos, sizeof(val));
+	pos += sizeof(val);
+	return val;
+}
+
+/**
+ * @brief Reads a length-prefixed string from the mapping without copying it, advancing pos past it.
+ */
+static std::string_view getString(const char* base, size_t& pos){
+	uint16_t len = get<uint16_t>(base, pos);
+	std::string_view ret(base + pos, len);
+	pos += len;
+	return ret;
+}
+
+/**
+ * @brief Finds where each complete run in a mapped history file starts.
+ * A run that was being written when the file was mapped, or was cut short by a crash, ends the index.
+ *
+ * @param base The mapping, which starts with the file magic.
+ * @param size The size of the mapping.
+ * @param end Set to where the last complete run ends.
+ */
+static std::vector<size_t> indexRuns(const char* base, size_t size, size_t& end){
+	std::vector<size_t> ret;
+	size_t pos = sizeof(historyMagic);
+
+	while (pos + runHeaderSize <= size){
+		size_t p = pos;
+		uint32_t magic = get<uint32_t>(base, p);
+		uint64_t len;
+
+		p += sizeof(uint32_t) + sizeof(int64_t);
+		len = get<uint64_t>(base, p);
+		if (magic != runMagic || len < runHeaderSize || len > size - pos){
+			break;
+		}
+		ret.push_back(pos);
+		pos += len;
+	}
+	end = pos;
+	return ret;
+}
+
+std::vector<HistoryRecord> makeHistoryRecords(const std::vector<TestResult>& results, const std::function<std::string(const TestResult&)>& nameOf){
+	std::vector<HistoryRecord> ret;
+
+	for (const TestResult& res : results){
+		HistoryRecord rec;
+		rec.name = nameOf(res);
+		rec.status = res.status;
+		rec.reason = res.reason.substr(0, maxReason);
+		rec.duration = res.duration;
+		rec.cpuTime = res.cpuTime;
+		rec.peakMemory = res.peakMemory;
+		for (const Benchmark& b : res.benchmarks){
+			rec.benchmarks.push_back({b.name, BenchmarkStats::of(b.samples)});
+		}
+		ret.push_back(std::move(rec));
+	}
+	return ret;
+}
+
+void appendHistory(const std::string& path, const std::vector<HistoryRecord>& records){
+	std::string run;
+	std::string body;
+	uint64_t magic = 0;
+	struct stat st;
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	int fd;
+
+	for (const HistoryRecord& rec : records){
+		put<uint8_t>(body, rec.status);
+		put<int64_t>(body, rec.duration.count());
+		put<int64_t>(body, rec.cpuTime.count());
+		put<int64_t>(body, rec.peakMemory);
+		putString(body, rec.name);
+		putString(body, rec.reason.substr(0, maxReason));
+		put<uint16_t>(body, std::min<size_t>(rec.benchmarks.size(), UINT16_MAX));
+		for (size_t i = 0; i < rec.benchmarks.size() && i < UINT16_MAX; ++i){
+			const BenchmarkStats& bs = rec.benchmarks[i].second;
+			putString(body, rec.benchmarks[i].first);
+			put<uint64_t>(body, bs.count);
+			for (std::chrono::nanoseconds ns : {bs.min, bs.max, bs.mean, bs.p50, bs.p90, bs.p99}){
+				put<int64_t>(body, ns.count());
+			}
+		}
+	}
+	put<uint32_t>(run, runMagic);
+	put<uint32_t>(run, records.size());
+	put<int64_t>(run, now);
+	put<uint64_t>(run, runHeaderSize + body.size());
+	run += body;
+
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0){
+		throw std::runtime_error("Failed to open history file " + path + " (" + std::strerror(errno) + ")");
+	}
+	// other runs appending at the same time wait for this one
+	flock(fd, LOCK_EX);
+	fstat(fd, &st);
+	if (st.st_size == 0){
+		run = std::string((const char*)&historyMagic, sizeof(historyMagic)) + run;
+	}
+	else if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic != historyMagic){
+		close(fd);
+		throw std::runtime_error(path + " is not a simpletest history file");
+	}
+	else{
+		// a run cut short by a crash is cut off, or readers would take this run as its missing tail
+		void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		size_t end = st.st_size;
+
+		if (map != MAP_FAILED){
+			indexRuns((const char*)map, st.st_size, end);
+			munmap(map, st.st_size);
+		}
+		if (end < (size_t)st.st_size && ftruncate(fd, end) != 0){
+			int err = errno;
+			close(fd);
+			throw std::runtime_error("Failed to repair history file " + path + " (" + std::strerror(err) + ")");
+		}
+	}
+
+	// one write, so a crash leaves at most one incomplete run at the end, which readers ignore and the next append cuts off
+	if (write(fd, run.data(), run.size()) != (ssize_t)run.size()){
+		int err = errno;
+		close(fd);
+		throw std::runtime_error("Failed to write history file " + path + " (" + std::strerror(err) + ")");
+	}
+	close(fd);
+}
+
+struct HistoryImpl{
+	/**
+	 * @brief The mapped file, or nullptr if it is empty.
+	 */
+	const char* map = nullptr;
+
+	/**
+	 * @brief The size of the mapping.
+	 */
+	size_t size = 0;
+
+	/**
+	 * @brief Where each complete run starts.
+	 */
+	std::vector<size_t> runs;
+
+	/**
+	 * @brief Unmaps the file.
+	 */
+	~HistoryImpl(){
+		if (map){
+			munmap((void*)map, size);
+		}
+	}
+};
+
+History::History(const std::string& path): impl(std::make_unique<HistoryImpl>()){
+	struct stat st;
+	size_t end;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0){
+		throw std::runtime_error("Failed to open history file " + path + " (" + std::strerror(errno) + ")");
+	}
+	fstat(fd, &st);
+	if (st.st_size == 0){
+		close(fd);
+		return;
+	}
+	impl->size = st.st_size;
+	void* map = mmap(nullptr, impl->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED){
+		impl->size = 0;
+		throw std::runtime_error("Failed to map history file " + path + " (" + std::strerror(errno) + ")");
+	}
+	impl->map = (const char*)map;
+
+	if (impl->size < sizeof(historyMagic) || std::memcmp(impl->map, &historyMagic, sizeof(historyMagic)) != 0){
+		throw std::runtime_error(path + " is not a simpletest history file");
+	}
+	impl->runs = indexRuns(impl->map, impl->size, end);
+}
+
+History::History(History&& other) = default;
+
+History& History::operator=(History&& other) = default;
+
+History::~History() = default;
+
+size_t History::size() const{
+	return impl->runs.size();
+}
+
+std::chrono::system_clock::time_point History::timeOf(size_t run) const{
+	size_t pos = impl->runs.at(run) + 2 * sizeof(uint32_t);
+	return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(get<int64_t>(impl->map, pos))));
+}
+
+std::vector<HistoryEntry> History::run(size_t run) const{
+	size_t pos = impl->runs.at(run) + sizeof(uint32_t);
+	uint32_t count = get<uint32_t>(impl->map, pos);
+	std::vector<HistoryEntry> ret(count);
+
+	pos = impl->runs[run] + runHeaderSize;
+	for (HistoryEntry& e : ret){
+		uint16_t nBench;
+
+		e.status = (TestResult::Status)get<uint8_t>(impl->map, pos);
+		e.duration = std::chrono::nanoseconds(get<int64_t>(impl->map, pos));
+		e.cpuTime = std::chrono::nanoseconds(get<int64_t>(impl->map, pos));
+		e.peakMemory = get<int64_t>(impl->map, pos);
+		e.name = getString(impl->map, pos);
+		e.reason = getString(impl->map, pos);
+		nBench = get<uint16_t>(impl->map, pos);
+		for (uint16_t i = 0; i < nBench; ++i){
+			std::string_view name = getString(impl->map, pos);
+			BenchmarkStats bs;
+			bs.count = get<uint64_t>(impl->map, pos);
+			for (std::chrono::nanoseconds* ns : {&bs.min, &bs.max, &bs.mean, &bs.p50, &bs.p90, &bs.p99}){
+				*ns = std::chrono::nanoseconds(get<int64_t>(impl->map, pos));
+			}
+			e.benchmarks.push_back({name, bs});
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Formats when a run was recorded in local time, for example "2018-06-01 12:30:00".
+ */
+static std::string formatTime(std::chrono::system_clock::time_point tp){
+	time_t t = std::chrono::system_clock::to_time_t(tp);
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	return buf;
+}
+
+/**
+ * @brief Formats a change between two durations, for example "+12.5%".
+ */
+static std::string formatChange(std::chrono::nanoseconds before, std::chrono::nanoseconds after){
+	std::ostringstream oss;
+
+	if (before.count() <= 0){
+		return "";
+	}
+	oss << std::showpos << std::fixed << std::setprecision(1) << 100.0 * (after.count() - before.count()) / before.count() << '%';
+	return oss.str();
+}
+
+/**
+ * @brief Returns the median of some durations, which must not be empty.
+ */
+static std::chrono::nanoseconds median(std::vector<std::chrono::nanoseconds> v){
+	std::sort(v.begin(), v.end());
+	return v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+}
+
+/**
+ * @brief Returns "Passed", "Failed" and so on.
+ */
+static const char* statusName(TestResult::Status status){
+	switch (status){
+	case TestResult::PASSED:
+		return "Passed";
+	case TestResult::FAILED:
+		return "Failed";
+	case TestResult::ERROR:
+		return "Error";
+	case TestResult::CRASHED:
+		return "Crashed";
+	case TestResult::LIMIT_EXCEEDED:
+		return "Limit";
+	case TestResult::FLAKY:
+		return "Flaky";
+	}
+	return "?";
+}
+
+/**
+ * @brief Returns true if a test did not pass on any run, so a flaky test does not count as failing.
+ */
+static bool failed(TestResult::Status status){
+	return status != TestResult::PASSED && status != TestResult::FLAKY;
+}
+
+/**
+ * @brief Parses a whole number in a query.
+ */
+static long parseQueryNumber(const std::string& value, const std::string& query){
+	size_t pos = 0;
+	long n = 0;
+
+	try{
+		n = std::stol(value, &pos);
+	}
+	catch (std::exception&){
+		pos = 0;
+	}
+	if (pos == 0 || pos != value.size()){
+		throw std::invalid_argument("Query \"" + query + "\" requires a number, not \"" + value + "\"");
+	}
+	return n;
+}
+
+/**
+ * @brief Answers "runs".
+ */
+static void queryRuns(const History& h, std::ostream& os){
+	os << "Run  Date                 Tests  Failed  Flaky  Duration" << std::endl;
+	for (size_t r = 0; r < h.size(); ++r){
+		std::vector<HistoryEntry> entries = h.run(r);
+		size_t nFailed = std::count_if(entries.begin(), entries.end(), [](const HistoryEntry& e){ return failed(e.status); });
+		size_t nFlaky = std::count_if(entries.begin(), entries.end(), [](const HistoryEntry& e){ return e.status == TestResult::FLAKY; });
+		std::chrono::nanoseconds total{0};
+
+		for (const HistoryEntry& e : entries){
+			total += e.duration;
+		}
+		os << std::setw(3) << r + 1 << "  " << formatTime(h.timeOf(r)) << "  " << std::setw(5) << entries.size() << "  " << std::setw(6) << nFailed << "  " << std::setw(5) << nFlaky << "  " << formatDuration(total) << std::endl;
+	}
+}
+
+/**
+ * @brief Answers "trend:TEST".
+ */
+static void queryTrend(const History& h, const std::string& test, std::ostream& os){
+	// benchmark name -> (run, stats), in the order the benchmarks first appear
+	std::vector<std::pair<std::string, std::vector<std::pair<size_t, BenchmarkStats>>>> benches;
+	std::chrono::nanoseconds prev{0};
+	bool found = false;
+
+	os << "Duration trend of " << test << ":" << std::endl;
+	os << "Run  Date                 Result   Duration    Change" << std::endl;
+	for (size_t r = 0; r < h.size(); ++r){
+		for (const HistoryEntry& e : h.run(r)){
+			if (e.name != test){
+				continue;
+			}
+			found = true;
+			os << std::setw(3) << r + 1 << "  " << formatTime(h.timeOf(r)) << "  " << std::left << std::setw(7) << statusName(e.status) << "  " << std::setw(10) << formatDuration(e.duration) << std::right << "  " << formatChange(prev, e.duration);
+			if (e.cpuTime.count() >= 0){
+				os << "  (CPU " << formatDuration(e.cpuTime) << (e.peakMemory >= 0 ? ", peak memory " + formatBytes(e.peakMemory) : "") << ")";
+			}
+			os << std::endl;
+			prev = e.duration;
+
+			for (const auto& b : e.benchmarks){
+				auto it = std::find_if(benches.begin(), benches.end(), [&b](const auto& x){ return x.first == b.first; });
+				if (it == benches.end()){
+					benches.push_back({std::string(b.first), {}});
+					it = benches.end() - 1;
+				}
+				it->second.push_back({r, b.second});
+			}
+		}
+	}
+	if (!found){
+		os << "(not in any run)" << std::endl;
+	}
+
+	for (const auto& b : benches){
+		prev = std::chrono::nanoseconds(0);
+		os << std::endl << b.first << ":" << std::endl;
+		os << "Run  Date                 p50         p90         Change" << std::endl;
+		for (const auto& point : b.second){
+			os << std::setw(3) << point.first + 1 << "  " << formatTime(h.timeOf(point.first)) << "  " << std::left << std::setw(10) << formatDuration(point.second.p50) << "  " << std::setw(10) << formatDuration(point.second.p90) << std::right << "  " << formatChange(prev, point.second.p50) << std::endl;
+			prev = point.second.p50;
+		}
+	}
+}
+
+/**
+ * @brief Answers "slower:PERCENT[:RUNS]".
+ *
+ * @return The number of tests and benchmarks that got slower.
+ */
+static int querySlower(const History& h, double percent, size_t runs, std::ostream& os){
+	// test durations this short are mostly noise
+	const std::chrono::nanoseconds floor = std::chrono::milliseconds(1);
+	// name -> samples before, samples after; benchmarks are named "test / benchmark"
+	std::map<std::string, std::pair<std::vector<std::chrono::nanoseconds>, std::vector<std::chrono::nanoseconds>>> samples;
+	std::vector<std::pair<double, std::string>> found;
+	size_t n = h.size();
+
+	if (n < runs + 1){
+		os << "Not enough runs: comparing the last " << runs << " needs at least " << runs + 1 << ", and there are " << n << "." << std::endl;
+		return 0;
+	}
+	for (size_t r = n - std::min(n, 2 * runs); r < n; ++r){
+		bool recent = r >= n - runs;
+		for (const HistoryEntry& e : h.run(r)){
+			if (e.status != TestResult::PASSED){
+				continue;
+			}
+			auto& test = samples[std::string(e.name)];
+			(recent ? test.second : test.first).push_back(e.duration);
+			for (const auto& b : e.benchmarks){
+				auto& bench = samples[std::string(e.name) + " / " + std::string(b.first)];
+				(recent ? bench.second : bench.first).push_back(b.second.p50);
+			}
+		}
+	}
+
+	os << "Slower by more than " << percent << "% in the last " << runs << " run" << (runs == 1 ? "" : "s") << " than in the " << std::min(n - runs, runs) << " before:" << std::endl;
+	for (const auto& s : samples){
+		std::chrono::nanoseconds before;
+		std::chrono::nanoseconds after;
+		bool isBenchmark = s.first.find(" / ") != std::string::npos;
+
+		if (s.second.first.empty() || s.second.second.empty()){
+			continue;
+		}
+		before = median(s.second.first);
+		after = median(s.second.second);
+		if (before.count() <= 0 || (!isBenchmark && after < floor)){
+			continue;
+		}
+		if (after.count() > before.count() * (1 + percent / 100)){
+			std::ostringstream line;
+			line << s.first << ": " << formatDuration(before) << " -> " << formatDuration(after) << " (" << formatChange(before, after) << ")";
+			found.push_back({(double)after.count() / before.count(), line.str()});
+		}
+	}
+	std::sort(found.begin(), found.end(), [](const auto& a, const auto& b){ return a.first > b.first; });
+	for (const auto& f : found){
+		os << "  " << f.second << std::endl;
+	}
+	if (found.empty()){
+		os << "  (none)" << std::endl;
+	}
+	return std::min<size_t>(found.size(), 255);
+}
+
+/**
+ * @brief Answers "failing-since:RUN".
+ *
+ * @return The number of newly failing tests.
+ */
+static int queryFailingSince(const History& h, long since, std::ostream& os){
+	std::unordered_map<std::string_view, TestResult::Status> then;
+	long n = h.size();
+	long k = since > 0 ? since - 1 : n - 1 + since;
+	int count = 0;
+
+	if (n == 0 || k < 0 || k >= n){
+		throw std::invalid_argument("Run " + std::to_string(since) + " is not in the history, which has " + std::to_string(n) + " runs");
+	}
+	for (const HistoryEntry& e : h.run(k)){
+		then[e.name] = e.status;
+	}
+
+	os << "Failing in run " << n << " but not in run " << k + 1 << ":" << std::endl;
+	for (const HistoryEntry& e : h.run(n - 1)){
+		auto it = then.find(e.name);
+		if (!failed(e.status) || (it != then.end() && failed(it->second))){
+			continue;
+		}
+		os << "  " << e.name << ": " << e.reason << (it == then.end() ? " (new test)" : "") << std::endl;
+		count++;
+	}
+	if (count == 0){
+		os << "  (none)" << std::endl;
+	}
+	return std::min(count, 255);
+}
+
+/**
+ * @brief Answers "flaky[:RUNS]".
+ *
+ * @return The number of flaky tests.
+ */
+static int queryFlaky(const History& h, size_t runs, std::ostream& os){
+	// name -> runs it was in, runs it was flaky in, runs it failed in
+	std::map<std::string_view, std::array<size_t, 3>> counts;
+	std::vector<std::pair<double, std::string>> found;
+	size_t n = h.size();
+	size_t first = n - std::min(n, runs);
+
+	for (size_t r = first; r < n; ++r){
+		for (const HistoryEntry& e : h.run(r)){
+			std::array<size_t, 3>& c = counts[e.name];
+			c[0]++;
+			c[1] += e.status == TestResult::FLAKY;
+			c[2] += failed(e.status);
+		}
+	}
+
+	os << "Flaky tests in the last " << n - first << " run" << (n - first == 1 ? "" : "s") << ":" << std::endl;
+	for (const auto& c : counts){
+		std::ostringstream line;
+		if (c.second[1] == 0){
+			continue;
+		}
+		line << c.first << ": flaky in " << c.second[1] << " of " << c.second[0] << " runs (" << std::fixed << std::setprecision(1) << 100.0 * c.second[1] / c.second[0] << "%)";
+		if (c.second[2] > 0){
+			line << ", failed in " << c.second[2];
+		}
+		found.push_back({(double)c.second[1] / c.second[0], line.str()});
+	}
+	std::stable_sort(found.begin(), found.end(), [](const auto& a, const auto& b){ return a.first > b.first; });
+	for (const auto& f : found){
+		os << "  " << f.second << std::endl;
+	}
+	if (found.empty()){
+		os << "  (none)" << std::endl;
+	}
+	return std::min<size_t>(found.size(), 255);
+}
+
+int queryHistory(const std::string& path, const std::string& query, std::ostream& os){
+	std::vector<std::string> parts;
+	size_t start = 0;
+
+	// the test name in "trend:TEST" may itself contain ':'
+	for (size_t i = 0; i < 2; ++i){
+		size_t colon = query.find(':', start);
+		if (colon == std::string::npos || (!parts.empty() && parts[0] == "trend")){
+			break;
+		}
+		parts.push_back(query.substr(start, colon - start));
+		start = colon + 1;
+	}
+	parts.push_back(query.substr(start));
+
+	if (parts[0] == "runs" && parts.size() == 1){
+		queryRuns(History(path), os);
+		return 0;
+	}
+	if (parts[0] == "trend" && parts.size() == 2){
+		queryTrend(History(path), parts[1], os);
+		return 0;
+	}
+	if (parts[0] == "slower" && (parts.size() == 2 || parts.size() == 3)){
+		long percent = parseQueryNumber(parts[1], query);
+		long runs = parts.size() == 3 ? parseQueryNumber(parts[2], query) : 1;
+		if (percent < 0 || runs < 1){
+			throw std::invalid_argument("Query \"" + query + "\" needs a percentage of at least 0 and at least 1 run");
+		}
+		return querySlower(History(path), percent, runs, os);
+	}
+	if (parts[0] == "failing-since" && parts.size() == 2){
+		return queryFailingSince(History(path), parseQueryNumber(parts[1], query), os);
+	}
+	if (parts[0] == "flaky" && parts.size() <= 2){
+		long runs = parts.size() == 2 ? parseQueryNumber(parts[1], query) : LONG_MAX;
+		if (runs < 1){
+			throw std::invalid_argument("Query \"" + query + "\" needs at least 1 run");
+		}
+		return queryFlaky(History(path), runs, os);
+	}
+	throw std::invalid_argument("Unknown query \"" + query + "\"; expected runs, trend:TEST, slower:PERCENT[:RUNS], failing-since:RUN or flaky[:RUNS]");
+}
+
+}
@@ -0,0 +1,184 @@
+/** @file simpletest_history.hpp
+ * @brief simpletest run history file with trend and regression queries.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_HISTORY_HPP
+#define __SIMPLETEST_HISTORY_HPP
+
+#include "simpletest_runner.hpp"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief One test's outcome in a run, as stored in a history file.
+ * When read from a History, the strings point into the mapped file and stay valid as long as the History does.
+ */
+template <typename String>
+struct BasicHistoryEntry{
+	/**
+	 * @brief The test's name.
+	 */
+	String name;
+
+	/**
+	 * @brief How the test ended.
+	 */
+	TestResult::Status status = TestResult::PASSED;
+
+	/**
+	 * @brief Why the test did not pass, shortened to at most 256 bytes.
+	 */
+	String reason;
+
+	/**
+	 * @brief How long the test took.
+	 */
+	std::chrono::nanoseconds duration{0};
+
+	/**
+	 * @brief The CPU time its cgroup measured, or negative if it was not measured.
+	 */
+	std::chrono::nanoseconds cpuTime{-1};
+
+	/**
+	 * @brief The peak memory its cgroup measured, or -1 if it was not measured.
+	 */
+	int64_t peakMemory = -1;
+
+	/**
+	 * @brief The statistics of the benchmarks the test reported, by name.
+	 */
+	std::vector<std::pair<String, BenchmarkStats>> benchmarks;
+};
+
+/**
+ * @brief A test outcome to append to a history file.
+ */
+typedef BasicHistoryEntry<std::string> HistoryRecord;
+
+/**
+ * @brief A test outcome read from a History.
+ */
+typedef BasicHistoryEntry<std::string_view> HistoryEntry;
+
+/**
+ * @brief Converts the results of a run into the records appendHistory() stores.
+ *
+ * @param results The results.
+ * @param nameOf Returns the name of the test a result belongs to.
+ */
+std::vector<HistoryRecord> makeHistoryRecords(const std::vector<TestResult>& results, const std::function<std::string(const TestResult&)>& nameOf);
+
+/**
+ * @brief Appends a run to a history file, creating it if it does not exist.
+ * The run is written with a single write() under an exclusive lock, so concurrent runs do not interleave. A run cut short by a crash is ignored by History and cut off by the next append.
+ *
+ * @param path The history file.
+ * @param records The outcome of each test in the run.
+ *
+ * @exception std::runtime_error Failed to write the file, or it is not a history file.
+ */
+void appendHistory(const std::string& path, const std::vector<HistoryRecord>& records);
+
+struct HistoryImpl;
+
+/**
+ * @brief A history file, memory-mapped for reading.
+ * Only the index of where each run starts is built up front; runs are decoded from the mapping when they are asked for.
+ */
+class History{
+public:
+	/**
+	 * @brief Maps a history file.
+	 *
+	 * @param path The file.
+	 *
+	 * @exception std::runtime_error The file could not be opened or mapped, or it is not a history file.
+	 */
+	explicit History(const std::string& path);
+
+	/**
+	 * @brief Move constructor for History.
+	 */
+	History(History&& other);
+
+	/**
+	 * @brief Move assignment operator for History.
+	 */
+	History& operator=(History&& other);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	History(const History& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	History& operator=(const History& other) = delete;
+
+	/**
+	 * @brief Unmaps the file.
+	 */
+	~History();
+
+	/**
+	 * @brief Returns the number of complete runs in the file.
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Returns when a run was recorded.
+	 *
+	 * @param run The run, counting from 0.
+	 */
+	std::chrono::system_clock::time_point timeOf(size_t run) const;
+
+	/**
+	 * @brief Decodes a run.
+	 *
+	 * @param run The run, counting from 0.
+	 *
+	 * @return The outcome of each test, in the order they were recorded.
+	 */
+	std::vector<HistoryEntry> run(size_t run) const;
+
+private:
+	std::unique_ptr<HistoryImpl> impl;
+};
+
+/**
+ * @brief Answers a query about a history file, for example for the --query option.
+ * The queries are:<br>
+ * "runs": lists the runs, with how many tests failed and how long they took.<br>
+ * "trend:TEST": shows the duration of TEST and the median of each of its benchmarks in every run.<br>
+ * "slower:PERCENT[:RUNS]": lists the tests and benchmarks whose median over the last RUNS runs (1 by default) is more than PERCENT percent slower than over the RUNS runs before them. Only passing tests count, and tests that take under 1ms are too noisy to compare.<br>
+ * "failing-since:RUN": lists the tests that fail in the last run but did not fail in RUN, counting from 1 as "runs" shows them. A negative RUN counts back from the last run. Flaky tests do not count as failing.<br>
+ * "flaky[:RUNS]": lists the tests that were TestResult::FLAKY in any of the last RUNS runs (all by default), with the share of runs they were flaky in.
+ *
+ * @param path The history file.
+ * @param query The query.
+ * @param os The stream to print the answer to.
+ *
+ * @return For "slower", "failing-since" and "flaky", the number of tests found, so a CI job can fail on them; otherwise 0.
+ *
+ * @exception std::runtime_error The file could not be read.
+ * @exception std::invalid_argument The query is malformed.
+ */
+int queryHistory(const std::string& path, const std::string& query, std::ostream& os);
+
+}
+
+#endif
@@ -7,22 +7,21 @@
  */
 
 #include "simpletest_iocapturer.hpp"
+// FdCapturer
+#include "simpletest_fdcapturer.hpp"
 
 // std::vsnprintf
 #include <cstdio>
 // std::strlen
 #include <cstring>
-// fnctl()
-#include <fcntl.h>
 // stringstream
 #include <sstream>
 // vector
 #include <vector>
 // STDOUT_FILENO, dup, dup2, pipe, etc.
 #include <unistd.h>
-
-#define P_READ  (0)
-#define P_WRITE (1)
+// fcntl, F_DUPFD_CLOEXEC
+#include <fcntl.h>
 
 namespace simpletest{
 
@@ -34,84 +33,47 @@ int IOCapturer::instanceCount = 0;
  */
 struct IOCapturerImpl{
 	/**
-	 * @brief A file descriptor to the actual stdout.
-	 */
-	int stdoutOld = 0;
-
-	/**
-	 * @brief A file descriptor to the actual stderr.
-	 */
-	int stderrOld = 0;
-
-	/**
-	 * @brief A file descriptor to the actual stdin.
+	 * @brief Captures stdout.
+	 * All output sent to stdout while this class is active will instead be sent to an in-memory file.
+	 * stderr is pointed at the same file so both streams end up in order.
 	 */
-	int stdinOld  = 0;
+	FdCapturer stdoutCapt{STDOUT_FILENO, CaptureMode::OUTPUT};
 
 	/**
-	 * @brief Two file descriptors making a pipe.
-	 * All output sent to stdout while this class is active will instead be sent to stdoutPipe[P_WRITE]
-	 * Output can be read from stdoutPipe[P_READ]
+	 * @brief Feeds stdin.
+	 * This data will be read as normal from any input capturing function/class, such as std::cin.
 	 */
-	int stdoutPipe[2] = {0, 0};
+	FdCapturer stdinCapt{STDIN_FILENO, CaptureMode::INPUT};
 
 	/**
-	 * @brief Two file descriptors making a pipe.
-	 * All input normally sent to stdin while this class should be sent to stdinPipe[P_WRITE].
-	 * This data will be read as normal from any input capturing function/class, such as std::cin.
+	 * @brief A file descriptor to the actual stderr.
 	 */
-	int stdinPipe [2] = {0, 0};
+	int stderrOld = 0;
 };
 
-IOCapturer::IOCapturer(): impl(std::make_unique<IOCapturerImpl>()){
+IOCapturer::IOCapturer(){
 	if (instanceCount != 0){
 		throw std::logic_error("Only one instance of IOCapturer can be active at a time");
 	}
 	instanceCount++;
 
-	// Create two pipes that will act as our new stdout/stdin
-	if (pipe(impl->stdoutPipe) != 0){
-		throw std::runtime_error("Failed to create stdout pipe (" + std::string(std::strerror(errno)) + ")");
-	}
-
-	if (pipe(impl->stdinPipe) != 0){
-		throw std::runtime_error("Failed to create stdin pipe (" + std::string(std::strerror(errno)) + ")");
-	}
-
-	// save old stdout/err/in
-	impl->stdoutOld = dup(STDOUT_FILENO);
-	impl->stderrOld = dup(STDERR_FILENO);
-	impl->stdinOld  = dup(STDIN_FILENO);
-
 	// disable buffering. this causes input to be available for our EXPECT() macro instantly and allows stderr and stdout to be synchronized
+	// this has to happen before the redirection, otherwise anything still buffered would end up in the capture
 	setbuf(stdout, NULL);
 	setbuf(stderr, NULL);
 
-	// set out stdout pipe to the stdout fileno
-	// this causes all data written to stdout to go to our pipe instead
-	dup2(impl->stdoutPipe[P_WRITE], STDOUT_FILENO);
-	// send stderr to our stdout pipe.
-	dup2(impl->stdoutPipe[P_WRITE], STDERR_FILENO);
-	// set stdin pipe to the stdin fileno
-	// this causes all stdin reading functions to read from our pipe instead
-	dup2(impl->stdinPipe[P_READ], STDIN_FILENO);
+	// creating the implementation redirects stdout and stdin
+	impl = std::make_unique<IOCapturerImpl>();
+
+	// save old stderr. close-on-exec, so programs the test runs do not inherit it
+	impl->stderrOld = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+
+	// send stderr to our stdout capture file.
+	dup2(STDOUT_FILENO, STDERR_FILENO);
 }
 
 std::string IOCapturer::getStdout(){
-	char buf[1024];
-	std::string s = "";
-	ssize_t ss;
-
-	// do not block. fail instantly if the operation would block
-	fcntl(impl->stdoutPipe[P_READ], F_SETFL, O_NONBLOCK);
-	// while there is data in stdin, read it
-	while ((ss = read(impl->stdoutPipe[P_READ], buf, sizeof(buf) - 1)) > 0){
-		// null terminate the string
-		buf[ss] = '\0';
-		// add the buffer to our output
-		s += buf;
-	}
-	return s;
+	return impl->stdoutCapt.getOutput();
 }
 
 /*
@@ -129,6 +91,14 @@ std::string IOCapturer::getStderr(){
 }
 */
 
+FdCapturer& IOCapturer::getStdoutCapturer(){
+	return impl->stdoutCapt;
+}
+
+FdCapturer& IOCapturer::getStdinCapturer(){
+	return impl->stdinCapt;
+}
+
 std::string IOCapturer::getLastLine(std::string input){
 	// Return everything after the last '\n' before the string's end.
 
@@ -151,31 +121,8 @@ std::string IOCapturer::getLastLine(std::string input){
 }
 
 void IOCapturer::sendToStdin(const char* line){
-	char* val = nullptr;
-	const char* write_ptr = line;
-	// if line does not end with a '\n'
-	if (line[std::strlen(line) - 1] != '\n'){
-		// val = line + '\n'
-		val = new char[std::strlen(line) + 2];
-		std::strcpy(val, line);
-		std::strcat(val, "\n");
-		write_ptr = val;
-	}
-
-	// writes to stdin have to be performed in one shot.
-	// any subsequent writes to stdin without a corresponding read will fail.
-	// this is why we can't just write the string and then the '\n'
-
-	// do not block. if this operation would block, fail instantly.
-	fcntl(impl->stdinPipe[P_WRITE], F_SETFL, O_NONBLOCK);
-
-	// if the amount of bytes we wrote does not equal the length of the string
-	if (write(impl->stdinPipe[P_WRITE], write_ptr, std::strlen(write_ptr)) != (ssize_t)std::strlen(write_ptr)){
-		throw std::runtime_error(std::string("Failed to write to stdin (") + std::strerror(errno) + ")");
-	}
-
-	// delete[] nullptr is safe
-	delete[] val;
+	// anything that does not fit in the pipe right now is kept and written once the code under test reads enough to make room
+	impl->stdinCapt.sendLine(line);
 }
 
 int IOCapturer::printToScreen(const char* format, ...){
@@ -207,7 +154,7 @@ int IOCapturer::printToScreen(const char* format, ...){
 	}
 
 	// finally, write the buffer to stdout
-	if (write(impl->stdoutOld, &(buf[0]), len) != len){
+	if (write(impl->stdoutCapt.getOriginalFd(), &(buf[0]), len) != len){
 		va_end(ap);
 		throw std::runtime_error("write() error");
 	}
@@ -217,10 +164,10 @@ int IOCapturer::printToScreen(const char* format, ...){
 
 IOCapturer::~IOCapturer(){
 	instanceCount--;
-	// restore old file descriptors to their respective original numbers
-	dup2(impl->stdoutOld, STDOUT_FILENO);
+	// restore stderr to its original number
+	// stdout and stdin are restored when their capturers are destructed
 	dup2(impl->stderrOld, STDERR_FILENO);
-	dup2(impl->stdinOld,  STDIN_FILENO);
+	close(impl->stderrOld);
 }
 
 }
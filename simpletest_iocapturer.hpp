@@ -10,6 +10,7 @@
 #define __CS_CSTEST_IOCAPTURER_HPP
 
 #include "attribute.hpp"
+#include "simpletest_fdcapturer.hpp"
 #include <memory>
 #include <string>
 #include <cstdarg>
@@ -32,7 +33,7 @@ public:
 	 * Capture stops when the IOCapturer instance is destructed.
 	 *
 	 * @exception std::logic_error There is already an instance of this class.
-	 * @exception std::runtime_error Failed to create one or more pipes.
+	 * @exception std::runtime_error Failed to create the capture file or the stdin pipe.
 	 */
 	IOCapturer();
 
@@ -53,6 +54,18 @@ public:
 	 */
 	static std::string getLastLine(std::string input);
 
+	/**
+	 * @brief Returns the FdCapturer that holds stdout/stderr's output.
+	 * Use this to look at the output without copying it, for example with FdCapturer::peek().
+	 */
+	FdCapturer& getStdoutCapturer();
+
+	/**
+	 * @brief Returns the FdCapturer that feeds stdin.
+	 * Use FdCapturer::pump() on this to keep sending input that did not fit in the pipe.
+	 */
+	FdCapturer& getStdinCapturer();
+
 	/**
 	 * @brief Sends a line to stdin.
 	 *
@@ -0,0 +1,375 @@
+/** @file simpletest_journal.cpp
+ * @brief simpletest journal of finished tests, for resuming a run that was killed.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_journal.hpp"
+// StreamHash, OutputDigest::hash()
+#include "simpletest_digest.hpp"
+
+// std::map
+#include <map>
+// std::thread
+#include <thread>
+// std::mutex
+#include <mutex>
+// std::condition_variable
+#include <condition_variable>
+// std::cerr
+#include <iostream>
+// std::runtime_error
+#include <stdexcept>
+// std::strerror, std::memcpy
+#include <cstring>
+// errno
+#include <cerrno>
+// open()
+#include <fcntl.h>
+// read(), write(), close(), ftruncate(), fdatasync(), lseek(), unlink()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief The bytes a journal starts with.
+ */
+static const char journalMagic[8] = {'S', 'T', 'J', 'O', 'U', 'R', 'N', '1'};
+
+/**
+ * @brief The size of a journal's header: the magic, the executable's hash and the number of tests.
+ */
+static const size_t headerSize = sizeof(journalMagic) + 2 * sizeof(uint64_t);
+
+/**
+ * @brief The size of what a record has after its encodeResult() message: the CPU time, peak memory, runs and failures, which that message leaves out.
+ */
+static const size_t extraSize = 4 * sizeof(uint64_t);
+
+/**
+ * @brief The most time a result may go without being made durable.
+ */
+static const std::chrono::seconds syncInterval(1);
+
+struct ResultJournalImpl{
+	/**
+	 * @brief The journal's path.
+	 */
+	std::string path;
+
+	/**
+	 * @brief The journal's file descriptor, or -1 once it is closed.
+	 */
+	int fd = -1;
+
+	/**
+	 * @brief The results that were in the journal when it was opened.
+	 */
+	std::vector<TestResult> resumed;
+
+	/**
+	 * @brief True if the journal was started over because it was for another build.
+	 */
+	bool stale = false;
+
+	/**
+	 * @brief True if there are results that were not made durable yet.
+	 */
+	bool dirty = false;
+
+	/**
+	 * @brief True once writing to the journal failed.
+	 */
+	bool failed = false;
+
+	/**
+	 * @brief When the journal was last made durable.
+	 */
+	std::chrono::steady_clock::time_point lastSync;
+
+	/**
+	 * @brief Makes the results durable in the background, at most syncInterval after they were appended.
+	 */
+	std::thread syncer;
+
+	/**
+	 * @brief Guards dirty, failed, lastSync and closing, which the syncer shares with append().
+	 */
+	std::mutex lock;
+
+	/**
+	 * @brief Wakes the syncer when a result is appended or the journal is closed.
+	 */
+	std::condition_variable wake;
+
+	/**
+	 * @brief True once the syncer should stop.
+	 */
+	bool closing = false;
+};
+
+/**
+ * @brief Writes all of a buffer to a file.
+ *
+ * @return False on error, with errno set.
+ */
+static bool writeAll(int fd, const std::string& data){
+	const char* ptr = data.data();
+	size_t len = data.size();
+
+	while (len > 0){
+		ssize_t ss = write(fd, ptr, len);
+		if (ss < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		ptr += ss;
+		len -= ss;
+	}
+	return true;
+}
+
+/**
+ * @brief Reads a whole file from its current position.
+ *
+ * @return False on error, with errno set.
+ */
+static bool readRest(int fd, std::string& out){
+	char buf[65536];
+	ssize_t ss;
+
+	while ((ss = read(fd, buf, sizeof(buf))) != 0){
+		if (ss < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		out.append(buf, ss);
+	}
+	return true;
+}
+
+/**
+ * @brief Reads a value from a buffer at pos.
+ */
+static uint64_t getU64(const std::string& buf, size_t pos){
+	uint64_t val;
+	std::memcpy(&val, buf.data() + pos, sizeof(val));
+	return val;
+}
+
+/**
+ * @brief Appends a value's bytes to a buffer.
+ */
+static void putU64(std::string& buf, uint64_t val){
+	buf.append((const char*)&val, sizeof(val));
+}
+
+uint64_t hashExecutable(){
+	StreamHash hash;
+	std::string data;
+	int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0){
+		throw std::runtime_error("Failed to open the program's executable (" + std::string(std::strerror(errno)) + ")");
+	}
+	if (!readRest(fd, data)){
+		int err = errno;
+		close(fd);
+		throw std::runtime_error("Failed to read the program's executable (" + std::string(std::strerror(err)) + ")");
+	}
+	close(fd);
+	hash.update(data);
+	return hash.digest();
+}
+
+/**
+ * @brief Reads the records after a journal's header.
+ *
+ * @param buf The journal's contents.
+ * @param resumed Set to the last result of each test, in the order their records were written.
+ *
+ * @return The length of the journal up to the end of its last intact record.
+ */
+static size_t readRecords(const std::string& buf, std::vector<TestResult>& resumed){
+	std::map<uint64_t, TestResult> byIndex;
+	std::vector<uint64_t> order;
+	size_t pos = headerSize;
+
+	// slot (8 bytes), payload length (8), payload, the extra fields, then the checksum of all of it (8)
+	while (buf.size() - pos >= 3 * sizeof(uint64_t) + extraSize){
+		uint64_t len = getU64(buf, pos + sizeof(uint64_t));
+		std::string record;
+		std::string message;
+		size_t extra;
+		uint64_t slot;
+		TestResult res;
+
+		if (len > buf.size() - pos - 3 * sizeof(uint64_t) - extraSize){
+			break;
+		}
+		record = buf.substr(pos, 2 * sizeof(uint64_t) + len + extraSize);
+		message = record.substr(0, 2 * sizeof(uint64_t) + len);
+		if (getU64(buf, pos + record.size()) != OutputDigest::hash(record) || !decodeResult(message, slot, res)){
+			break;
+		}
+		extra = record.size() - extraSize;
+		res.index = slot;
+		res.cpuTime = std::chrono::nanoseconds((int64_t)getU64(record, extra));
+		res.peakMemory = getU64(record, extra + sizeof(uint64_t));
+		res.runs = getU64(record, extra + 2 * sizeof(uint64_t));
+		res.failures = getU64(record, extra + 3 * sizeof(uint64_t));
+		if (byIndex.find(slot) == byIndex.end()){
+			order.push_back(slot);
+		}
+		byIndex[slot] = std::move(res);
+		pos += record.size() + sizeof(uint64_t);
+	}
+
+	for (uint64_t slot : order){
+		resumed.push_back(std::move(byIndex[slot]));
+	}
+	return pos;
+}
+
+/**
+ * @brief What a journal's syncer thread runs: waits for appended results, and makes them durable once syncInterval has passed since the last time, so results that come in quick succession share one fdatasync() and one appended right before a long test does not wait for the test to end.
+ */
+static void syncLoop(ResultJournalImpl* impl){
+	std::unique_lock<std::mutex> lock(impl->lock);
+
+	while (!impl->closing){
+		int ret;
+		int err;
+
+		if (!impl->dirty){
+			impl->wake.wait(lock);
+			continue;
+		}
+		if (impl->wake.wait_until(lock, impl->lastSync + syncInterval, [impl](){ return impl->closing; })){
+			break;
+		}
+		// cleared first, so a result appended while the disk is busy is synced the next time
+		impl->dirty = false;
+		lock.unlock();
+		ret = fdatasync(impl->fd);
+		err = errno;
+		lock.lock();
+		impl->lastSync = std::chrono::steady_clock::now();
+		if (ret != 0 && !impl->failed){
+			impl->failed = true;
+			std::cerr << "Failed to write journal " << impl->path << " (" << std::strerror(err) << ")" << std::endl;
+		}
+	}
+}
+
+/**
+ * @brief Stops a journal's syncer thread if it is running. What it did not sync yet is left to the caller.
+ */
+static void stopSyncer(ResultJournalImpl& impl){
+	if (!impl.syncer.joinable()){
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(impl.lock);
+		impl.closing = true;
+	}
+	impl.wake.notify_one();
+	impl.syncer.join();
+}
+
+ResultJournal::ResultJournal(const std::string& path, bool resume, size_t tests): impl(std::make_unique<ResultJournalImpl>()){
+	uint64_t hash = hashExecutable();
+	std::string header(journalMagic, sizeof(journalMagic));
+	std::string buf;
+	size_t keep = 0;
+
+	putU64(header, hash);
+	putU64(header, tests);
+
+	impl->path = path;
+	impl->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (impl->fd < 0){
+		throw std::runtime_error("Failed to open journal " + path + " (" + std::strerror(errno) + ")");
+	}
+
+	if (resume){
+		if (!readRest(impl->fd, buf)){
+			int err = errno;
+			close(impl->fd);
+			throw std::runtime_error("Failed to read journal " + path + " (" + std::strerror(err) + ")");
+		}
+		if (buf.compare(0, headerSize, header) == 0){
+			keep = readRecords(buf, impl->resumed);
+		}
+		else{
+			// an empty journal is a run that has not finished a test yet
+			impl->stale = !buf.empty();
+		}
+	}
+
+	// a record cut short is overwritten by the next one
+	if (ftruncate(impl->fd, keep) != 0 || lseek(impl->fd, keep, SEEK_SET) < 0 || (keep == 0 && !writeAll(impl->fd, header)) || fdatasync(impl->fd) != 0){
+		int err = errno;
+		close(impl->fd);
+		throw std::runtime_error("Failed to write journal " + path + " (" + std::strerror(err) + ")");
+	}
+	impl->lastSync = std::chrono::steady_clock::now();
+	impl->syncer = std::thread(syncLoop, impl.get());
+}
+
+ResultJournal::~ResultJournal(){
+	stopSyncer(*impl);
+	if (impl->fd >= 0){
+		if (impl->dirty && !impl->failed){
+			fdatasync(impl->fd);
+		}
+		close(impl->fd);
+	}
+}
+
+const std::vector<TestResult>& ResultJournal::getResumed() const{
+	return impl->resumed;
+}
+
+bool ResultJournal::isStale() const{
+	return impl->stale;
+}
+
+void ResultJournal::append(const TestResult& res){
+	std::string record = encodeResult(res.index, res);
+	std::lock_guard<std::mutex> lock(impl->lock);
+
+	if (impl->fd < 0 || impl->failed){
+		return;
+	}
+	putU64(record, res.cpuTime.count());
+	putU64(record, res.peakMemory);
+	putU64(record, res.runs);
+	putU64(record, res.failures);
+	putU64(record, OutputDigest::hash(record));
+	if (!writeAll(impl->fd, record)){
+		impl->failed = true;
+		std::cerr << "Failed to write journal " << impl->path << " (" << std::strerror(errno) << ")" << std::endl;
+		return;
+	}
+	// one fdatasync() per result would make a suite of quick tests wait on the disk, so the syncer does it
+	impl->dirty = true;
+	impl->wake.notify_one();
+}
+
+void ResultJournal::remove(){
+	stopSyncer(*impl);
+	if (impl->fd >= 0){
+		close(impl->fd);
+		impl->fd = -1;
+	}
+	unlink(impl->path.c_str());
+}
+
+}
@@ -0,0 +1,92 @@
+/** @file simpletest_journal.hpp
+ * @brief simpletest journal of finished tests, for resuming a run that was killed.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_JOURNAL_HPP
+#define __SIMPLETEST_JOURNAL_HPP
+
+#include "simpletest_runner.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Returns the XXH64 hash of the running program's executable.
+ *
+ * @exception std::runtime_error Failed to read it.
+ */
+uint64_t hashExecutable();
+
+struct ResultJournalImpl;
+
+/**
+ * @brief An append-only file of the results of the tests that finished so far, so a run that is killed can pick up where it left off.
+ * The file starts with the hash of the program's executable and its number of tests, followed by one record per result, each with a checksum. A record cut short by the kill, or damaged, ends the journal there and is overwritten by the next one.
+ * Results are written as soon as they are appended, so they survive the program being killed, and made durable with fdatasync() by a background thread within a second, so they survive the machine going down except for the last second of them, however long the next test takes.
+ */
+class ResultJournal{
+public:
+	/**
+	 * @brief Opens a journal, creating it if it does not exist.
+	 *
+	 * @param path The journal's path.
+	 * @param resume True to keep the results already in it if it was written by the same executable with the same number of tests, or false to start it over.
+	 * @param tests The number of tests.
+	 *
+	 * @exception std::runtime_error Failed to hash the executable, or to open, read or write the journal.
+	 */
+	ResultJournal(const std::string& path, bool resume, size_t tests);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	ResultJournal(const ResultJournal& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	ResultJournal& operator=(const ResultJournal& other) = delete;
+
+	/**
+	 * @brief Makes the journal durable and closes it.
+	 */
+	~ResultJournal();
+
+	/**
+	 * @brief Returns the results that were in the journal when it was opened with resume, with their indexes filled in. A test appears at most once.
+	 */
+	const std::vector<TestResult>& getResumed() const;
+
+	/**
+	 * @brief Returns true if resume was given but the journal was written by a different build of the program, or for a different number of tests, so it was started over.
+	 */
+	bool isStale() const;
+
+	/**
+	 * @brief Appends a test's result, which is made durable within a second, together with the results appended in that time.
+	 * Errors are ignored after the first, which is printed to stderr, since the run itself is still fine.
+	 *
+	 * @param res The result. Its index identifies the test.
+	 */
+	void append(const TestResult& res);
+
+	/**
+	 * @brief Closes the journal and removes it, once every test has a result and there is nothing left to resume.
+	 */
+	void remove();
+
+private:
+	std::unique_ptr<ResultJournalImpl> impl;
+};
+
+}
+
+#endif
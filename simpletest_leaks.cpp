@@ -0,0 +1,260 @@
+/** @file simpletest_leaks.cpp
+ * @brief simpletest per-test resource leak auditing.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_leaks.hpp"
+// formatBytes()
+#include "simpletest_limits.hpp"
+
+// std::map
+#include <map>
+// std::thread
+#include <thread>
+// std::ifstream
+#include <fstream>
+// std::istringstream
+#include <sstream>
+// std::runtime_error
+#include <stdexcept>
+// std::strerror
+#include <cstring>
+// errno
+#include <cerrno>
+// std::sscanf
+#include <cstdio>
+// std::strtol
+#include <cstdlib>
+// mallinfo2(), malloc_trim()
+#include <malloc.h>
+// opendir(), readdir(), dirfd()
+#include <dirent.h>
+// open()
+#include <fcntl.h>
+// readlink(), read(), close(), getpid()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief What a LeakAudit compares.
+ */
+struct ProcessState{
+	/**
+	 * @brief What each open file descriptor refers to.
+	 */
+	std::map<int, std::string> fds;
+
+	/**
+	 * @brief The name of each thread, by thread ID.
+	 */
+	std::map<pid_t, std::string> threads;
+
+	/**
+	 * @brief The name of each child process, by process ID, followed by " (not waited for)" if it exited.
+	 */
+	std::map<pid_t, std::string> children;
+
+	/**
+	 * @brief The path and size of each file mapping, by start address.
+	 */
+	std::map<uint64_t, std::pair<std::string, uint64_t>> mappings;
+};
+
+struct LeakAuditImpl{
+	/**
+	 * @brief The state when the audit started.
+	 */
+	ProcessState before;
+
+	/**
+	 * @brief How much the heap may grow before getHeapGrowth() reports it, in bytes.
+	 */
+	size_t threshold = 0;
+
+	/**
+	 * @brief The heap memory in use when the audit started, in bytes.
+	 */
+	size_t heap = 0;
+
+	/**
+	 * @brief How much the heap grew by when finish() was called, in bytes.
+	 */
+	size_t grown = 0;
+};
+
+/**
+ * @brief Returns the bytes of heap memory in use, including blocks big enough to get a mapping of their own.
+ */
+static size_t heapInUse(){
+	struct mallinfo2 mi;
+
+	// merges the free chunks malloc holds on to and gives what it can back to the system; chunks in the per-thread caches still count as in use, which the threshold absorbs
+	malloc_trim(0);
+	mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+/**
+ * @brief Reads a small file such as one in /proc, or returns an empty string if it cannot be read.
+ */
+static std::string readSmallFile(const std::string& path){
+	char buf[1024];
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	ssize_t ss;
+
+	if (fd < 0){
+		return "";
+	}
+	while ((ss = read(fd, buf, sizeof(buf) - 1)) < 0 && errno == EINTR);
+	close(fd);
+	return std::string(buf, ss > 0 ? ss : 0);
+}
+
+/**
+ * @brief Calls a function with each number a directory such as /proc has an entry for.
+ *
+ * @exception std::runtime_error The directory could not be opened.
+ */
+template <typename F>
+static void forEachNumber(const char* path, F f){
+	DIR* d = opendir(path);
+	struct dirent* de;
+
+	if (d == nullptr){
+		throw std::runtime_error(std::string("Failed to open ") + path + " (" + std::strerror(errno) + ")");
+	}
+	while ((de = readdir(d)) != nullptr){
+		char* end;
+		long n = std::strtol(de->d_name, &end, 10);
+
+		// the directory's own descriptor is the one open in /proc/self/fd that the code under test did not open
+		if (*end == '\0' && end != de->d_name && n != dirfd(d)){
+			f(n);
+		}
+	}
+	closedir(d);
+}
+
+/**
+ * @brief Reads the state a LeakAudit compares.
+ */
+static ProcessState readState(){
+	ProcessState ret;
+	std::ifstream maps;
+	std::string line;
+	pid_t self = getpid();
+
+	forEachNumber("/proc/self/fd", [&ret](long fd){
+		char buf[4096];
+		ssize_t len = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(), buf, sizeof(buf));
+		ret.fds[fd] = len > 0 ? std::string(buf, len) : "?";
+	});
+	forEachNumber("/proc/self/task", [&ret](long tid){
+		std::string name = readSmallFile("/proc/self/task/" + std::to_string(tid) + "/comm");
+		if (!name.empty() && name.back() == '\n'){
+			name.pop_back();
+		}
+		ret.threads[tid] = name;
+	});
+	forEachNumber("/proc", [&ret, self](long pid){
+		// "pid (comm) state ppid ...", where comm can have spaces and parentheses of its own
+		std::string stat = readSmallFile("/proc/" + std::to_string(pid) + "/stat");
+		size_t open = stat.find('(');
+		size_t close = stat.rfind(')');
+		std::istringstream rest;
+		char state;
+		pid_t ppid;
+
+		if (open == std::string::npos || close == std::string::npos || close < open){
+			return;
+		}
+		rest.str(stat.substr(close + 1));
+		if ((rest >> state >> ppid) && ppid == self){
+			ret.children[pid] = stat.substr(open + 1, close - open - 1) + (state == 'Z' ? " (not waited for)" : "");
+		}
+	});
+	// opened after the descriptors were listed, so it is not one of them
+	maps.open("/proc/self/maps");
+	// "start-end perms offset dev inode path"
+	while (std::getline(maps, line)){
+		std::istringstream iss(line);
+		std::string range;
+		std::string skip;
+		std::string path;
+		uint64_t start;
+		uint64_t end;
+
+		iss >> range >> skip >> skip >> skip >> skip;
+		std::getline(iss >> std::ws, path);
+		if (path.empty() || path[0] == '['){
+			continue;
+		}
+		if (std::sscanf(range.c_str(), "%lx-%lx", (unsigned long*)&start, (unsigned long*)&end) == 2){
+			ret.mappings[start] = {path, end - start};
+		}
+	}
+	return ret;
+}
+
+void prepareLeakAudits(){
+	// the first thread started allocates the C library's thread bookkeeping, which stays around after it is joined
+	std::thread([](){}).join();
+}
+
+LeakAudit::LeakAudit(size_t heapThreshold): impl(std::make_unique<LeakAuditImpl>()){
+	impl->threshold = heapThreshold;
+	impl->before = readState();
+	// last, so what the snapshot itself allocated is not counted
+	impl->heap = heapInUse();
+}
+
+LeakAudit::~LeakAudit() = default;
+
+std::vector<std::string> LeakAudit::finish(){
+	// first, for the same reason
+	size_t heap = heapInUse();
+	ProcessState after = readState();
+	std::map<std::string, uint64_t> mapped;
+	std::vector<std::string> ret;
+
+	for (const auto& fd : after.fds){
+		auto it = impl->before.fds.find(fd.first);
+		// a descriptor that was closed and reopened on something else is a leak too
+		if (it == impl->before.fds.end() || it->second != fd.second){
+			ret.push_back("fd " + std::to_string(fd.first) + " (" + fd.second + ")");
+		}
+	}
+	for (const auto& t : after.threads){
+		if (impl->before.threads.count(t.first) == 0){
+			ret.push_back("thread " + std::to_string(t.first) + " (" + t.second + ")");
+		}
+	}
+	for (const auto& c : after.children){
+		if (impl->before.children.count(c.first) == 0){
+			ret.push_back("child process " + std::to_string(c.first) + " (" + c.second + ")");
+		}
+	}
+	// a file is usually mapped as several segments, so they are reported together
+	for (const auto& m : after.mappings){
+		auto it = impl->before.mappings.find(m.first);
+		if (it == impl->before.mappings.end() || it->second != m.second){
+			mapped[m.second.first] += m.second.second;
+		}
+	}
+	for (const auto& m : mapped){
+		ret.push_back("mapping of " + m.first + " (" + formatBytes(m.second) + ")");
+	}
+	impl->grown = heap > impl->heap + impl->threshold ? heap - impl->heap : 0;
+	return ret;
+}
+
+size_t LeakAudit::getHeapGrowth() const{
+	return impl->grown;
+}
+
+}
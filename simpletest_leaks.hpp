@@ -0,0 +1,78 @@
+/** @file simpletest_leaks.hpp
+ * @brief simpletest per-test resource leak auditing.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_LEAKS_HPP
+#define __SIMPLETEST_LEAKS_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Makes the C library do the allocations it only does once, such as setting up its cache of thread stacks, so they are not blamed on the first test that happens to cause them.
+ * Call this once before the first LeakAudit.
+ */
+void prepareLeakAudits();
+
+struct LeakAuditImpl;
+
+/**
+ * @brief Finds what a piece of code left behind in this process: open file descriptors, threads, child processes, file mappings and heap memory.
+ * The process's state is snapshotted on construction, and finish() reports everything there is more of since.
+ * Anonymous mappings are not compared, since the C library keeps thread stacks and malloc arenas mapped after they are released; memory leaked through them shows up as heap or threads instead.
+ */
+class LeakAudit{
+public:
+	/**
+	 * @brief Snapshots the process's state.
+	 *
+	 * @param heapThreshold How many bytes the heap may grow by before getHeapGrowth() reports it.
+	 *
+	 * @exception std::runtime_error /proc could not be read.
+	 */
+	LeakAudit(size_t heapThreshold);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	LeakAudit(const LeakAudit& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	LeakAudit& operator=(const LeakAudit& other) = delete;
+
+	/**
+	 * @brief Destructor for LeakAudit.
+	 */
+	~LeakAudit();
+
+	/**
+	 * @brief Compares the process's descriptors, threads, children and mappings to the snapshot, and measures the heap for getHeapGrowth().
+	 *
+	 * @return A description of each leak, for example "fd 5 (pipe:[81234])" or "thread 4711 (worker)". Empty if nothing leaked.
+	 *
+	 * @exception std::runtime_error /proc could not be read.
+	 */
+	std::vector<std::string> finish();
+
+	/**
+	 * @brief Returns how many bytes more heap memory was in use when finish() was called than on construction, or 0 if it was no more than the threshold.
+	 * Growth is not necessarily a leak: caches filled on first use stay too, and freed memory the C library keeps in its per-thread caches still counts as in use, which is why it is reported separately.
+	 */
+	size_t getHeapGrowth() const;
+
+private:
+	std::unique_ptr<LeakAuditImpl> impl;
+};
+
+}
+
+#endif
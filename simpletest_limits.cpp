@@ -0,0 +1,554 @@
+/** @file simpletest_limits.cpp
+ * @brief simpletest per-test resource limits and cgroup accounting.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_limits.hpp"
+
+// std::min, std::find
+#include <algorithm>
+// std::ifstream
+#include <fstream>
+// std::setprecision
+#include <iomanip>
+// std::ostringstream
+#include <sstream>
+// std::invalid_argument, std::runtime_error
+#include <stdexcept>
+// std::this_thread::sleep_for()
+#include <thread>
+// std::vector
+#include <vector>
+// std::toupper
+#include <cctype>
+// realpath(), free()
+#include <cstdlib>
+// std::strerror, strsignal()
+#include <cstring>
+// errno
+#include <cerrno>
+// SIGXCPU, SIGXFSZ, kill()
+#include <csignal>
+// opendir(), readdir()
+#include <dirent.h>
+// open()
+#include <fcntl.h>
+// mkdir()
+#include <sys/stat.h>
+// WIFSIGNALED(), WTERMSIG()
+#include <sys/wait.h>
+// getpid(), sysconf(), write(), close(), rmdir()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief Parses a positive number with an optional suffix that multiplies it.
+ *
+ * @param value The text to parse.
+ * @param name The name of the limit, for the error message.
+ * @param suffixes Pairs of suffix letters and what they multiply by.
+ */
+static uint64_t parseScaled(const std::string& value, const std::string& name, const std::vector<std::pair<char, uint64_t>>& suffixes){
+	size_t pos = 0;
+	unsigned long long n = 0;
+	uint64_t scale = 1;
+
+	try{
+		n = std::stoull(value, &pos);
+	}
+	catch (std::exception&){
+		pos = 0;
+	}
+	if (pos == 0 || value[0] == '-' || n == 0){
+		throw std::invalid_argument(name + " requires a positive number");
+	}
+	if (pos < value.size()){
+		bool found = false;
+		for (const auto& suffix : suffixes){
+			if (pos + 1 == value.size() && std::toupper((unsigned char)value[pos]) == suffix.first){
+				scale = suffix.second;
+				found = true;
+			}
+		}
+		if (!found){
+			throw std::invalid_argument(name + " has an unknown suffix \"" + value.substr(pos) + "\"");
+		}
+	}
+	return n * scale;
+}
+
+/**
+ * @brief Formats a size the way parseLimits() reads it, for example "512M".
+ */
+static std::string compactSize(uint64_t bytes){
+	static const char units[] = "KMG";
+	int unit = -1;
+
+	while (unit < 2 && bytes % 1024 == 0){
+		bytes /= 1024;
+		unit++;
+	}
+	return std::to_string(bytes) + (unit >= 0 ? std::string(1, units[unit]) : "");
+}
+
+bool ResourceLimits::empty() const{
+	return memory == 0 && cpu.count() == 0 && files == 0 && processes == 0 && output == 0;
+}
+
+void ResourceLimits::merge(const ResourceLimits& other){
+	if (other.memory != 0){
+		memory = other.memory;
+	}
+	if (other.cpu.count() != 0){
+		cpu = other.cpu;
+	}
+	if (other.files != 0){
+		files = other.files;
+	}
+	if (other.processes != 0){
+		processes = other.processes;
+	}
+	if (other.output != 0){
+		output = other.output;
+	}
+}
+
+std::string ResourceLimits::describe() const{
+	std::vector<std::string> parts;
+	std::string ret;
+
+	if (memory != 0){
+		parts.push_back("memory=" + compactSize(memory));
+	}
+	if (cpu.count() != 0){
+		parts.push_back("cpu=" + std::to_string(cpu.count()) + "s");
+	}
+	if (files != 0){
+		parts.push_back("files=" + std::to_string(files));
+	}
+	if (processes != 0){
+		parts.push_back("processes=" + std::to_string(processes));
+	}
+	if (output != 0){
+		parts.push_back("output=" + compactSize(output));
+	}
+	for (const std::string& part : parts){
+		ret += (ret.empty() ? "" : ",") + part;
+	}
+	return ret;
+}
+
+uint64_t parseSize(const std::string& value, const std::string& name){
+	static const std::vector<std::pair<char, uint64_t>> sizes = {{'K', 1ULL << 10}, {'M', 1ULL << 20}, {'G', 1ULL << 30}};
+	return parseScaled(value, name, sizes);
+}
+
+std::chrono::seconds parseSeconds(const std::string& value, const std::string& name){
+	static const std::vector<std::pair<char, uint64_t>> times = {{'S', 1}, {'M', 60}, {'H', 3600}};
+	return std::chrono::seconds(parseScaled(value, name, times));
+}
+
+ResourceLimits parseLimits(const std::string& spec){
+	static const std::vector<std::pair<char, uint64_t>> none;
+	ResourceLimits ret;
+	std::istringstream iss(spec);
+	std::string item;
+
+	while (std::getline(iss, item, ',')){
+		size_t eq = item.find('=');
+		std::string key = item.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+
+		if (eq == std::string::npos){
+			throw std::invalid_argument("Limit \"" + item + "\" must look like name=value");
+		}
+		if (key == "memory"){
+			ret.memory = parseSize(value, key);
+		}
+		else if (key == "cpu"){
+			ret.cpu = parseSeconds(value, key);
+		}
+		else if (key == "files"){
+			ret.files = parseScaled(value, key, none);
+		}
+		else if (key == "processes"){
+			ret.processes = parseScaled(value, key, none);
+		}
+		else if (key == "output"){
+			ret.output = parseSize(value, key);
+		}
+		else{
+			throw std::invalid_argument("Unknown limit \"" + key + "\"; expected memory, cpu, files, processes or output");
+		}
+	}
+	return ret;
+}
+
+std::string formatBytes(uint64_t bytes){
+	static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+	std::ostringstream oss;
+	double n = bytes;
+	size_t unit = 0;
+
+	while (n >= 1024 && unit < 4){
+		n /= 1024;
+		unit++;
+	}
+	if (unit == 0){
+		oss << bytes << " B";
+	}
+	else{
+		oss << std::fixed << std::setprecision(2) << n << ' ' << units[unit];
+	}
+	return oss.str();
+}
+
+/**
+ * @brief The resources LimitScope sets, in the order of LimitScope::saved.
+ */
+static const int scopedResources[] = {RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_FSIZE};
+
+/**
+ * @brief Returns the size of this process's address space in bytes.
+ */
+static uint64_t addressSpaceSize(){
+	std::ifstream ifs("/proc/self/statm");
+	uint64_t pages = 0;
+
+	ifs >> pages;
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Returns the CPU time this process has used so far, rounded up to whole seconds.
+ */
+static rlim_t cpuSecondsUsed(){
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + 1;
+}
+
+/**
+ * @brief Returns how many file descriptors this process has open.
+ */
+static rlim_t openFileCount(){
+	DIR* dp = opendir("/proc/self/fd");
+	struct dirent* dnt;
+	rlim_t n = 0;
+
+	if (!dp){
+		return 0;
+	}
+	while ((dnt = readdir(dp)) != nullptr){
+		if (dnt->d_name[0] != '.'){
+			n++;
+		}
+	}
+	closedir(dp);
+	// the directory itself was one of them
+	return n - 1;
+}
+
+LimitScope::LimitScope(const ResourceLimits& limits): limits(limits){
+	rlim_t wanted[4] = {
+		limits.memory != 0 ? addressSpaceSize() + limits.memory : 0,
+		limits.cpu.count() != 0 ? cpuSecondsUsed() + limits.cpu.count() : 0,
+		limits.files != 0 ? openFileCount() + limits.files : 0,
+		limits.output
+	};
+
+	for (size_t i = 0; i < 4; ++i){
+		getrlimit(scopedResources[i], &saved[i]);
+	}
+	for (size_t i = 0; i < 4; ++i){
+		struct rlimit rl = saved[i];
+
+		if (wanted[i] == 0){
+			continue;
+		}
+		// the hard limit stays put, so the soft limit can be raised again afterwards
+		rl.rlim_cur = rl.rlim_max == RLIM_INFINITY ? wanted[i] : std::min<rlim_t>(wanted[i], rl.rlim_max);
+		if (setrlimit(scopedResources[i], &rl) != 0){
+			int err = errno;
+			for (size_t j = 0; j < i; ++j){
+				setrlimit(scopedResources[j], &saved[j]);
+			}
+			throw std::runtime_error("Failed to set resource limit (" + std::string(std::strerror(err)) + ")");
+		}
+	}
+}
+
+LimitScope::~LimitScope(){
+	for (size_t i = 0; i < 4; ++i){
+		setrlimit(scopedResources[i], &saved[i]);
+	}
+}
+
+std::string LimitScope::explainFailure() const{
+	if (limits.memory != 0 && errno == ENOMEM){
+		return "Exceeded the memory limit of " + formatBytes(limits.memory);
+	}
+	if (limits.files != 0 && errno == EMFILE){
+		return "Reached the limit of " + std::to_string(limits.files) + " open files";
+	}
+	if (limits.output != 0 && errno == EFBIG){
+		return "Exceeded the output size limit of " + formatBytes(limits.output);
+	}
+	return "";
+}
+
+std::string describeLimitCrash(int status, const ResourceLimits& limits, const ResourceUsage& usage){
+	std::string ret;
+
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU){
+		ret = "Exceeded the CPU time limit";
+		if (limits.cpu.count() != 0){
+			ret += " of " + std::to_string(limits.cpu.count()) + "s";
+		}
+	}
+	else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXFSZ){
+		ret = "Exceeded the output size limit";
+		if (limits.output != 0){
+			ret += " of " + formatBytes(limits.output);
+		}
+	}
+	else if (usage.oomKilled){
+		ret = "Exceeded the memory limit";
+		if (limits.memory != 0){
+			ret += " of " + formatBytes(limits.memory);
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Writes a value to a cgroup control file.
+ *
+ * @return False on failure, with errno set.
+ */
+static bool writeControl(const std::string& path, const std::string& value){
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	ssize_t ss;
+	int err;
+
+	if (fd < 0){
+		return false;
+	}
+	ss = write(fd, value.c_str(), value.size());
+	err = errno;
+	close(fd);
+	errno = err;
+	return ss == (ssize_t)value.size();
+}
+
+/**
+ * @brief Returns the value of a key in a cgroup file of "key value" lines such as cpu.stat, or -1 if it is not there.
+ */
+static int64_t readKey(const std::string& path, const std::string& key){
+	std::ifstream ifs(path);
+	std::string k;
+	int64_t v;
+
+	while (ifs >> k >> v){
+		if (k == key){
+			return v;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Moves a process into a cgroup.
+ */
+static void moveProcess(const std::string& cgroup, pid_t pid){
+	// a process that already exited has nothing left to move, and whoever waits for it finds out why
+	if (!writeControl(cgroup + "/cgroup.procs", std::to_string(pid)) && errno != ESRCH){
+		throw std::runtime_error("Failed to move process " + std::to_string(pid) + " into cgroup " + cgroup + " (" + std::strerror(errno) + ")");
+	}
+}
+
+struct TestCgroupImpl{
+	/**
+	 * @brief The cgroup's directory.
+	 */
+	std::string path;
+};
+
+TestCgroup::TestCgroup(const std::string& parent, const std::string& name, const ResourceLimits& limits): impl(std::make_unique<TestCgroupImpl>()){
+	impl->path = parent + "/" + name;
+	if (mkdir(impl->path.c_str(), 0755) != 0){
+		throw std::runtime_error("Failed to create cgroup " + impl->path + " (" + std::strerror(errno) + ")");
+	}
+	// these files only exist if the controller is enabled; the rlimits still apply without them
+	if (limits.memory != 0){
+		writeControl(impl->path + "/memory.max", std::to_string(limits.memory));
+		// otherwise a test over the limit is swapped out instead of stopped
+		writeControl(impl->path + "/memory.swap.max", "0");
+	}
+	if (limits.processes != 0){
+		writeControl(impl->path + "/pids.max", std::to_string(limits.processes));
+	}
+}
+
+TestCgroup::~TestCgroup(){
+	if (!impl){
+		return;
+	}
+
+	// anything the test left running goes with it
+	if (!writeControl(impl->path + "/cgroup.kill", "1")){
+		std::ifstream ifs(impl->path + "/cgroup.procs");
+		pid_t pid;
+		while (ifs >> pid){
+			kill(pid, SIGKILL);
+		}
+	}
+	// the processes take a moment to die, and the cgroup cannot be removed until they have
+	for (int i = 0; i < 1000 && readKey(impl->path + "/cgroup.events", "populated") > 0; ++i){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	rmdir(impl->path.c_str());
+}
+
+void TestCgroup::add(pid_t pid){
+	moveProcess(impl->path, pid);
+}
+
+ResourceUsage TestCgroup::usage() const{
+	ResourceUsage ret;
+	int64_t usec = readKey(impl->path + "/cpu.stat", "usage_usec");
+	std::ifstream peak(impl->path + "/memory.peak");
+	int64_t bytes;
+
+	if (usec >= 0){
+		ret.cpu = std::chrono::microseconds(usec);
+	}
+	if (peak >> bytes){
+		ret.peakMemory = bytes;
+	}
+	ret.oomKilled = readKey(impl->path + "/memory.events", "oom_kill") > 0;
+	ret.processLimitHit = readKey(impl->path + "/pids.events", "max") > 0;
+	return ret;
+}
+
+/**
+ * @brief Returns the cgroup v2 directory the calling process is in.
+ */
+static std::string ownCgroup(){
+	std::ifstream mounts("/proc/self/mountinfo");
+	std::ifstream cgroups("/proc/self/cgroup");
+	std::string line;
+	std::string mount;
+	std::string path;
+
+	// the mount point is the 5th field, and the file system type follows " - "
+	while (mount.empty() && std::getline(mounts, line)){
+		std::istringstream iss(line);
+		std::string field;
+		std::string point;
+		for (int i = 0; i < 5 && iss >> field; ++i){
+			point = field;
+		}
+		while (iss >> field && field != "-");
+		if (iss >> field && field == "cgroup2"){
+			mount = point;
+		}
+	}
+	// the unified hierarchy is the one numbered 0 with no controllers listed
+	while (std::getline(cgroups, line)){
+		if (line.compare(0, 3, "0::") == 0){
+			path = line.substr(3);
+		}
+	}
+	if (mount.empty() || path.empty()){
+		throw std::runtime_error("This process is not in a cgroup v2 hierarchy");
+	}
+	return path == "/" ? mount : mount + path;
+}
+
+/**
+ * @brief Resolves symbolic links and trailing slashes, so two paths to a cgroup can be compared.
+ */
+static std::string canonical(const std::string& path){
+	char* p = realpath(path.c_str(), nullptr);
+	std::string ret;
+
+	if (!p){
+		throw std::runtime_error("Failed to resolve " + path + " (" + std::strerror(errno) + ")");
+	}
+	ret = p;
+	free(p);
+	return ret;
+}
+
+CgroupDelegation::CgroupDelegation(const std::string& dir){
+	std::ifstream available;
+	std::ifstream active;
+	std::vector<std::string> already;
+	std::string controller;
+
+	if (access((dir + "/cgroup.controllers").c_str(), F_OK) != 0){
+		throw std::runtime_error(dir + " is not a cgroup v2 directory");
+	}
+	this->dir = canonical(dir);
+	home = canonical(ownCgroup());
+
+	// the root cgroup has no cgroup.type, and is the only one that may hold processes and enable controllers for its children at once
+	if (home == this->dir && access((this->dir + "/cgroup.type").c_str(), F_OK) == 0){
+		std::string leaf = this->dir + "/simpletest-" + std::to_string(getpid());
+		if (mkdir(leaf.c_str(), 0755) != 0){
+			throw std::runtime_error("Failed to create cgroup " + leaf + " (" + std::strerror(errno) + ")");
+		}
+		try{
+			moveProcess(leaf, getpid());
+		}
+		catch (...){
+			rmdir(leaf.c_str());
+			throw;
+		}
+		moved = home;
+		home = leaf;
+	}
+
+	// controllers that cannot be enabled, for example because other processes live in dir, are left out, and what they would measure is reported as unknown
+	active.open(this->dir + "/cgroup.subtree_control");
+	while (active >> controller){
+		already.push_back(controller);
+	}
+	available.open(this->dir + "/cgroup.controllers");
+	while (available >> controller){
+		if (std::find(already.begin(), already.end(), controller) != already.end()){
+			continue;
+		}
+		if (controller == "memory" || controller == "cpu" || controller == "pids"){
+			if (writeControl(this->dir + "/cgroup.subtree_control", "+" + controller)){
+				enabled.push_back(controller);
+			}
+		}
+	}
+}
+
+CgroupDelegation::~CgroupDelegation(){
+	for (const std::string& controller : enabled){
+		writeControl(dir + "/cgroup.subtree_control", "-" + controller);
+	}
+	if (!moved.empty()){
+		writeControl(moved + "/cgroup.procs", std::to_string(getpid()));
+		rmdir(home.c_str());
+	}
+}
+
+const std::string& CgroupDelegation::getDir() const{
+	return dir;
+}
+
+void CgroupDelegation::release(pid_t pid){
+	moveProcess(home, pid);
+}
+
+}
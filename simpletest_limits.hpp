@@ -0,0 +1,310 @@
+/** @file simpletest_limits.hpp
+ * @brief simpletest per-test resource limits and cgroup accounting.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_LIMITS_HPP
+#define __SIMPLETEST_LIMITS_HPP
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief The resources a test may use. A limit of 0 means no limit.
+ */
+struct ResourceLimits{
+	/**
+	 * @brief The bytes of address space the test may map on top of what the process had when the test started (RLIMIT_AS).
+	 * In a cgroup, this is also the limit on the memory used by the test's whole process tree (memory.max).
+	 */
+	uint64_t memory = 0;
+
+	/**
+	 * @brief The CPU time the test may use (RLIMIT_CPU, which counts whole seconds).
+	 */
+	std::chrono::seconds cpu{0};
+
+	/**
+	 * @brief The number of files the test may open on top of the ones open when it started (RLIMIT_NOFILE).
+	 */
+	uint64_t files = 0;
+
+	/**
+	 * @brief The number of processes and threads the test may start.
+	 * This is only enforced in a cgroup (pids.max), since RLIMIT_NPROC counts every process of the user.
+	 */
+	uint64_t processes = 0;
+
+	/**
+	 * @brief The largest file the test may write, including output captured in memory files (RLIMIT_FSIZE).
+	 */
+	uint64_t output = 0;
+
+	/**
+	 * @brief Returns true if no limit is set.
+	 */
+	bool empty() const;
+
+	/**
+	 * @brief Replaces the limits that are set in other.
+	 *
+	 * @param other The limits that take precedence, for example a test's own over the global ones.
+	 */
+	void merge(const ResourceLimits& other);
+
+	/**
+	 * @brief Describes the limits in the format parseLimits() reads, for example "memory=512M,cpu=10s".
+	 */
+	std::string describe() const;
+};
+
+/**
+ * @brief Parses limits such as "memory=512M,cpu=10s,files=64,processes=16,output=1G".
+ * Sizes take an optional K, M or G suffix (powers of 1024), and CPU time an optional s, m or h suffix.
+ *
+ * @param spec The limits, separated by commas.
+ *
+ * @return The limits.
+ *
+ * @exception std::invalid_argument spec is malformed.
+ */
+ResourceLimits parseLimits(const std::string& spec);
+
+/**
+ * @brief Parses a positive size in bytes with an optional K, M or G suffix (powers of 1024), for example "512M".
+ *
+ * @param value The text to parse.
+ * @param name What the size is of, for the error message.
+ *
+ * @exception std::invalid_argument value is malformed.
+ */
+uint64_t parseSize(const std::string& value, const std::string& name);
+
+/**
+ * @brief Parses a positive duration in seconds with an optional S, M or H suffix, for example "8h".
+ *
+ * @param value The text to parse.
+ * @param name What the duration is of, for the error message.
+ *
+ * @exception std::invalid_argument value is malformed.
+ */
+std::chrono::seconds parseSeconds(const std::string& value, const std::string& name);
+
+/**
+ * @brief Formats a number of bytes, for example "512.00 MiB".
+ */
+std::string formatBytes(uint64_t bytes);
+
+/**
+ * @brief What a test used, as measured by its cgroup. Values that could not be measured are negative.
+ */
+struct ResourceUsage{
+	/**
+	 * @brief The CPU time used by the test's whole process tree.
+	 */
+	std::chrono::nanoseconds cpu{-1};
+
+	/**
+	 * @brief The most memory the test's whole process tree had charged to it at once, in bytes.
+	 */
+	int64_t peakMemory = -1;
+
+	/**
+	 * @brief True if the kernel killed a process of the test for exceeding the memory limit.
+	 */
+	bool oomKilled = false;
+
+	/**
+	 * @brief True if the test tried to start more processes than it was allowed.
+	 */
+	bool processLimitHit = false;
+};
+
+/**
+ * @brief Applies a test's limits to the calling process for the lifetime of this object.
+ * Only soft limits are lowered, so they can be put back afterwards and the process can go on to run other tests.
+ */
+class LimitScope{
+public:
+	/**
+	 * @brief Applies the limits.
+	 *
+	 * @param limits The limits. Those that are 0 are left alone.
+	 *
+	 * @exception std::runtime_error Failed to set a limit.
+	 */
+	LimitScope(const ResourceLimits& limits);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	LimitScope(const LimitScope& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	LimitScope& operator=(const LimitScope& other) = delete;
+
+	/**
+	 * @brief Puts the previous limits back.
+	 */
+	~LimitScope();
+
+	/**
+	 * @brief Explains a failed test with the limit it most likely ran into, judging by errno.
+	 *
+	 * @return For example "Reached the limit of 64 open files", or an empty string if no limit seems to be the cause.
+	 */
+	std::string explainFailure() const;
+
+private:
+	/**
+	 * @brief The limits that were applied.
+	 */
+	ResourceLimits limits;
+
+	/**
+	 * @brief The soft limits before, in the order RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_FSIZE.
+	 */
+	struct rlimit saved[4];
+};
+
+/**
+ * @brief Describes a worker that died because of a limit, for example from SIGXCPU or the out-of-memory killer.
+ *
+ * @param status The status from waitpid().
+ * @param limits The test's limits. Empty limits only recognize the signals the kernel sends for them.
+ * @param usage What the test's cgroup measured, if anything.
+ *
+ * @return A failure reason, or an empty string if the worker did not die because of a limit.
+ */
+std::string describeLimitCrash(int status, const ResourceLimits& limits, const ResourceUsage& usage = ResourceUsage());
+
+struct TestCgroupImpl;
+
+/**
+ * @brief A cgroup v2 that holds one test's process tree, so its memory and CPU time can be limited and measured exactly.
+ * Destroying it kills anything the test left running and removes the cgroup.
+ */
+class TestCgroup{
+public:
+	/**
+	 * @brief Creates the cgroup and applies the limits the controllers available to it support.
+	 *
+	 * @param parent The cgroup directory to create it in, as given to CgroupDelegation.
+	 * @param name The name of the cgroup.
+	 * @param limits The test's limits.
+	 *
+	 * @exception std::runtime_error Failed to create the cgroup.
+	 */
+	TestCgroup(const std::string& parent, const std::string& name, const ResourceLimits& limits);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	TestCgroup(const TestCgroup& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	TestCgroup& operator=(const TestCgroup& other) = delete;
+
+	/**
+	 * @brief Kills the processes still in the cgroup and removes it.
+	 */
+	~TestCgroup();
+
+	/**
+	 * @brief Moves a process into the cgroup. Processes it starts from then on are in the cgroup as well.
+	 *
+	 * @exception std::runtime_error Failed to move the process.
+	 */
+	void add(pid_t pid);
+
+	/**
+	 * @brief Returns what the processes in the cgroup have used so far.
+	 */
+	ResourceUsage usage() const;
+
+private:
+	std::unique_ptr<TestCgroupImpl> impl;
+};
+
+/**
+ * @brief Prepares a delegated cgroup v2 directory to hold a TestCgroup per test, and undoes it when destroyed.
+ * This enables the memory, cpu and pids controllers for the directory's children where possible.
+ * If the calling process is in the directory itself, it is moved into a child cgroup first, since a cgroup with controllers enabled for its children cannot hold processes.
+ */
+class CgroupDelegation{
+public:
+	/**
+	 * @brief Prepares the directory.
+	 *
+	 * @param dir The cgroup directory, for example "/sys/fs/cgroup/user.slice/user-1000.slice/user@1000.service/app.slice/tests.scope".
+	 *
+	 * @exception std::runtime_error dir is not a cgroup v2 directory this process can manage.
+	 */
+	explicit CgroupDelegation(const std::string& dir);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	CgroupDelegation(const CgroupDelegation& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	CgroupDelegation& operator=(const CgroupDelegation& other) = delete;
+
+	/**
+	 * @brief Moves the calling process back if it was moved, and disables the controllers that were enabled.
+	 */
+	~CgroupDelegation();
+
+	/**
+	 * @brief Returns the directory.
+	 */
+	const std::string& getDir() const;
+
+	/**
+	 * @brief Moves a process back to the cgroup the calling process is in, for example a worker between tests.
+	 *
+	 * @exception std::runtime_error Failed to move the process.
+	 */
+	void release(pid_t pid);
+
+private:
+	/**
+	 * @brief The delegated directory.
+	 */
+	std::string dir;
+
+	/**
+	 * @brief The cgroup the calling process is in.
+	 */
+	std::string home;
+
+	/**
+	 * @brief The cgroup the calling process was in before it was moved, or empty if it was not moved.
+	 */
+	std::string moved;
+
+	/**
+	 * @brief The controllers that were enabled, for example "memory".
+	 */
+	std::vector<std::string> enabled;
+};
+
+}
+
+#endif
@@ -0,0 +1,640 @@
+/** @file simpletest_netsim.cpp
+ * @brief simpletest event loop and simulated network links.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_netsim.hpp"
+
+// errno
+#include <cerrno>
+// std::strerror
+#include <cstring>
+// std::deque
+#include <deque>
+// std::map
+#include <map>
+// std::priority_queue
+#include <queue>
+// std::runtime_error
+#include <stdexcept>
+// std::vector
+#include <vector>
+// fcntl()
+#include <fcntl.h>
+// ppoll()
+#include <poll.h>
+// socketpair(), shutdown(), recv()
+#include <sys/socket.h>
+// read(), write(), close()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief A callback scheduled to run at a certain time.
+ */
+struct Timer{
+	/**
+	 * @brief When the callback should run.
+	 */
+	EventLoop::Clock::time_point when;
+
+	/**
+	 * @brief The order the timer was scheduled in.
+	 * This makes timers that are due at the same time run in the order they were scheduled.
+	 */
+	uint64_t seq;
+
+	/**
+	 * @brief The function to call.
+	 */
+	std::function<void()> callback;
+
+	/**
+	 * @brief Orders timers so the earliest one is at the top of a std::priority_queue.
+	 */
+	bool operator<(const Timer& other) const{
+		if (when != other.when){
+			return when > other.when;
+		}
+		return seq > other.seq;
+	}
+};
+
+/**
+ * @brief The private implementation of the EventLoop class.
+ */
+struct EventLoopImpl{
+	/**
+	 * @brief The watched file descriptors and their callbacks.
+	 */
+	std::map<int, std::function<void()>> watchers;
+
+	/**
+	 * @brief The pending timers.
+	 */
+	std::priority_queue<Timer> timers;
+
+	/**
+	 * @brief The sequence number of the next timer.
+	 */
+	uint64_t nextSeq = 0;
+
+	/**
+	 * @brief True if stop() was called.
+	 */
+	bool stopped = false;
+};
+
+EventLoop::EventLoop(): impl(std::make_unique<EventLoopImpl>()){}
+
+EventLoop::~EventLoop() = default;
+
+void EventLoop::watch(int fd, std::function<void()> onReadable){
+	impl->watchers[fd] = std::move(onReadable);
+}
+
+void EventLoop::unwatch(int fd){
+	impl->watchers.erase(fd);
+}
+
+void EventLoop::after(std::chrono::nanoseconds delay, std::function<void()> callback){
+	impl->timers.push(Timer{Clock::now() + delay, impl->nextSeq++, std::move(callback)});
+}
+
+bool EventLoop::runOnce(std::chrono::milliseconds maxWait){
+	std::vector<struct pollfd> pfds;
+	std::chrono::nanoseconds wait = maxWait;
+	struct timespec ts;
+	bool ran = false;
+	Clock::time_point now;
+
+	// do not sleep past the next timer
+	if (!impl->timers.empty()){
+		std::chrono::nanoseconds untilTimer = impl->timers.top().when - Clock::now();
+		if (untilTimer < wait){
+			wait = untilTimer < std::chrono::nanoseconds(0) ? std::chrono::nanoseconds(0) : untilTimer;
+		}
+	}
+	ts.tv_sec = wait.count() / 1000000000;
+	ts.tv_nsec = wait.count() % 1000000000;
+
+	for (const auto& elem : impl->watchers){
+		pfds.push_back({elem.first, POLLIN, 0});
+	}
+
+	// ppoll() instead of poll() so timers are not rounded to the millisecond
+	if (ppoll(pfds.data(), pfds.size(), &ts, nullptr) > 0){
+		for (const auto& pfd : pfds){
+			if (pfd.revents == 0){
+				continue;
+			}
+			// an earlier callback may have unwatched this one
+			auto it = impl->watchers.find(pfd.fd);
+			if (it == impl->watchers.end()){
+				continue;
+			}
+			// copy the callback, because it may replace or unwatch itself while running
+			std::function<void()> callback = it->second;
+			callback();
+			ran = true;
+		}
+	}
+
+	now = Clock::now();
+	while (!impl->timers.empty() && impl->timers.top().when <= now){
+		std::function<void()> callback = impl->timers.top().callback;
+		impl->timers.pop();
+		callback();
+		ran = true;
+	}
+
+	return ran;
+}
+
+void EventLoop::runFor(std::chrono::nanoseconds duration){
+	runUntil([]{ return false; }, duration);
+}
+
+bool EventLoop::runUntil(const std::function<bool()>& condition, std::chrono::nanoseconds timeout){
+	Clock::time_point end = Clock::now() + timeout;
+
+	impl->stopped = false;
+	while (!condition()){
+		Clock::time_point now = Clock::now();
+		if (now >= end || impl->stopped){
+			return false;
+		}
+		runOnce(std::chrono::duration_cast<std::chrono::milliseconds>(end - now) + std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+void EventLoop::stop(){
+	impl->stopped = true;
+}
+
+bool EventLoop::idle() const{
+	return impl->watchers.empty() && impl->timers.empty();
+}
+
+/**
+ * @brief The state of one direction of a SimulatedLink.
+ */
+struct LinkDirection{
+	/**
+	 * @brief The conditions for this direction.
+	 */
+	LinkShape shape;
+
+	/**
+	 * @brief The counters for this direction.
+	 */
+	LinkStats stats;
+
+	/**
+	 * @brief When the simulated wire is done serializing the last chunk.
+	 */
+	EventLoop::Clock::time_point busyUntil;
+
+	/**
+	 * @brief When the last chunk that was not reordered arrives.
+	 * Stream links do not reorder on their own, so chunks never arrive before this.
+	 */
+	EventLoop::Clock::time_point lastArrival;
+
+	/**
+	 * @brief The number of bytes scheduled for delivery but not delivered yet.
+	 */
+	size_t inFlight = 0;
+
+	/**
+	 * @brief Data that arrived but could not be written because the receiver's buffer was full.
+	 */
+	std::deque<std::string> blocked;
+
+	/**
+	 * @brief True if the sender closed its end.
+	 */
+	bool senderClosed = false;
+
+	/**
+	 * @brief True once LinkShape::disconnectAfterBytes were delivered, so the link disconnects as soon as they are written to the receiver.
+	 */
+	bool disconnectPending = false;
+};
+
+/**
+ * @brief The private implementation of the SimulatedLink class.
+ */
+struct SimulatedLinkImpl{
+	SimulatedLinkImpl(EventLoop& loop): loop(loop){}
+
+	/**
+	 * @brief The event loop driving this link.
+	 */
+	EventLoop& loop;
+
+	/**
+	 * @brief The code under test's end.
+	 */
+	int endA = -1;
+
+	/**
+	 * @brief The link's end of the code under test's socketpair.
+	 */
+	int innerA = -1;
+
+	/**
+	 * @brief The peer's end.
+	 */
+	int endB = -1;
+
+	/**
+	 * @brief The link's end of the peer's socketpair.
+	 */
+	int innerB = -1;
+
+	/**
+	 * @brief The two directions, indexed by SimulatedLink::Direction.
+	 */
+	LinkDirection dirs[2];
+
+	/**
+	 * @brief True if the socketpairs are SOCK_SEQPACKET.
+	 */
+	bool datagram = false;
+
+	/**
+	 * @brief True if the link was disconnected.
+	 */
+	bool disconnected = false;
+
+	/**
+	 * @brief The random number generator state.
+	 */
+	uint64_t rngState = 0;
+
+	/**
+	 * @brief Scheduled callbacks hold a weak reference to this, so they do nothing once the link is gone.
+	 */
+	std::shared_ptr<SimulatedLinkImpl*> self;
+
+	/**
+	 * @brief Returns a random number from 0 (inclusive) to 1 (exclusive).
+	 * This uses its own generator rather than simpletest::rand, so links do not disturb (or get disturbed by) anything else that uses random numbers.
+	 */
+	double random(){
+		// splitmix64
+		uint64_t z = (rngState += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		z ^= z >> 31;
+		return (z >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	/**
+	 * @brief Returns the file descriptor data traveling in a direction is written to.
+	 */
+	int destination(SimulatedLink::Direction dir) const{
+		return dir == SimulatedLink::TO_PEER ? innerB : innerA;
+	}
+
+	/**
+	 * @brief Schedules a function on the event loop that only runs if the link still exists.
+	 */
+	void schedule(std::chrono::nanoseconds delay, std::function<void(SimulatedLinkImpl&)> func){
+		std::weak_ptr<SimulatedLinkImpl*> weak = self;
+		loop.after(delay, [weak, func]{
+			std::shared_ptr<SimulatedLinkImpl*> strong = weak.lock();
+			if (strong){
+				func(**strong);
+			}
+		});
+	}
+
+	/**
+	 * @brief Reads one chunk from a socket.
+	 * A datagram link reads the next message whole, however big it is, since the part of it that does not fit in the buffer would be discarded.
+	 *
+	 * @param fd The socket.
+	 * @param buf Resized to fit the chunk.
+	 * @param size The most to read from a stream link.
+	 *
+	 * @return What read() returns.
+	 */
+	ssize_t readChunk(int fd, std::string& buf, size_t size){
+		if (datagram){
+			ssize_t len = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+			if (len < 0){
+				return len;
+			}
+			size = len;
+		}
+		buf.resize(size);
+		return read(fd, &(buf[0]), size);
+	}
+
+	/**
+	 * @brief Reads everything the sender wrote and puts it on the simulated wire.
+	 *
+	 * @param dir The direction to read.
+	 */
+	void readSender(SimulatedLink::Direction dir){
+		int fd = dir == SimulatedLink::TO_PEER ? innerA : innerB;
+		std::string buf;
+		ssize_t ss;
+
+		while ((ss = readChunk(fd, buf, dirs[dir].shape.chunkSize == 0 ? 1500 : dirs[dir].shape.chunkSize)) != 0){
+			if (ss < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				// EAGAIN means we are done for now. anything else is treated like the sender hanging up
+				if (errno == EAGAIN || errno == EWOULDBLOCK){
+					return;
+				}
+				break;
+			}
+			transmit(dir, std::string(buf, 0, ss));
+		}
+
+		// the sender closed its end. stop watching it and pass the end-of-file on once everything in flight is delivered
+		loop.unwatch(fd);
+		dirs[dir].senderClosed = true;
+		closeIfDrained(dir);
+	}
+
+	/**
+	 * @brief Puts a chunk on the simulated wire.
+	 *
+	 * @param dir The direction the chunk travels.
+	 * @param data The chunk.
+	 */
+	void transmit(SimulatedLink::Direction dir, std::string data){
+		LinkDirection& d = dirs[dir];
+		EventLoop::Clock::time_point now = EventLoop::Clock::now();
+		EventLoop::Clock::time_point arrival;
+		std::chrono::microseconds latency = d.shape.latencyMin;
+
+		if (disconnected){
+			return;
+		}
+
+		d.stats.bytesSent += data.size();
+
+		if (d.shape.lossRate > 0 && random() < d.shape.lossRate){
+			d.stats.chunksLost++;
+			return;
+		}
+		if (d.shape.truncateRate > 0 && !data.empty() && random() < d.shape.truncateRate){
+			data.resize((size_t)(random() * data.size()));
+			d.stats.chunksTruncated++;
+		}
+
+		// serialize the chunk onto the wire at the link's bandwidth
+		if (d.busyUntil < now){
+			d.busyUntil = now;
+		}
+		if (d.shape.bandwidth > 0){
+			d.busyUntil += std::chrono::nanoseconds((int64_t)(data.size() * 1000000000.0 / d.shape.bandwidth));
+		}
+
+		// then let it propagate
+		if (d.shape.latencyMax > d.shape.latencyMin){
+			latency += std::chrono::microseconds((int64_t)(random() * (d.shape.latencyMax - d.shape.latencyMin).count()));
+		}
+		arrival = d.busyUntil + latency;
+
+		if (d.shape.reorderRate > 0 && random() < d.shape.reorderRate){
+			// held back chunks do not move lastArrival, so the chunks behind them overtake them
+			arrival += d.shape.reorderDelay;
+			d.stats.chunksReordered++;
+		}
+		else{
+			if (arrival < d.lastArrival){
+				arrival = d.lastArrival;
+			}
+			d.lastArrival = arrival;
+		}
+
+		d.inFlight += data.size();
+		schedule(arrival - now, [dir, data](SimulatedLinkImpl& self){
+			self.dirs[dir].inFlight -= data.size();
+			self.deliver(dir, data);
+		});
+	}
+
+	/**
+	 * @brief Writes a chunk that reached the end of the wire to its receiver.
+	 *
+	 * @param dir The direction the chunk traveled.
+	 * @param data The chunk.
+	 */
+	void deliver(SimulatedLink::Direction dir, std::string data){
+		LinkDirection& d = dirs[dir];
+
+		// nothing past the disconnect threshold is delivered
+		if (disconnected || d.disconnectPending){
+			return;
+		}
+		if (d.shape.disconnectAfterBytes > 0 && d.stats.bytesDelivered + data.size() >= d.shape.disconnectAfterBytes){
+			data.resize(d.shape.disconnectAfterBytes - d.stats.bytesDelivered);
+			d.disconnectPending = true;
+		}
+
+		d.stats.bytesDelivered += data.size();
+		d.stats.chunksDelivered++;
+		d.blocked.push_back(std::move(data));
+		flushBlocked(dir);
+		closeIfDrained(dir);
+		disconnectIfFlushed(dir);
+	}
+
+	/**
+	 * @brief Writes as much delivered data to the receiver as it will take.
+	 * Anything left is retried shortly, since the receiver has to read before there is room.
+	 *
+	 * @param dir The direction to flush.
+	 */
+	void flushBlocked(SimulatedLink::Direction dir){
+		LinkDirection& d = dirs[dir];
+		ssize_t ss;
+
+		while (!d.blocked.empty() && !disconnected){
+			std::string& front = d.blocked.front();
+			if (front.empty()){
+				d.blocked.pop_front();
+				continue;
+			}
+			ss = write(destination(dir), front.data(), front.size());
+			if (ss < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK){
+					schedule(std::chrono::milliseconds(1), [dir](SimulatedLinkImpl& self){
+						self.flushBlocked(dir);
+						self.closeIfDrained(dir);
+						self.disconnectIfFlushed(dir);
+					});
+				}
+				// anything else means the receiver hung up, so the data has nowhere to go
+				else{
+					d.blocked.clear();
+				}
+				return;
+			}
+			front.erase(0, ss);
+		}
+	}
+
+	/**
+	 * @brief Passes end-of-file on to the receiver if the sender closed its end and nothing is left in flight.
+	 *
+	 * @param dir The direction to check.
+	 */
+	void closeIfDrained(SimulatedLink::Direction dir){
+		LinkDirection& d = dirs[dir];
+		if (d.senderClosed && d.inFlight == 0 && d.blocked.empty() && !disconnected){
+			shutdown(destination(dir), SHUT_WR);
+		}
+	}
+
+	/**
+	 * @brief Disconnects the link once the data up to LinkShape::disconnectAfterBytes was written to the receiver, so the receiver gets all of it before end-of-file even if it was slow to read.
+	 *
+	 * @param dir The direction to check.
+	 */
+	void disconnectIfFlushed(SimulatedLink::Direction dir){
+		if (dirs[dir].disconnectPending && dirs[dir].blocked.empty()){
+			disconnect();
+		}
+	}
+
+	/**
+	 * @brief Drops everything in flight and closes the link's inner ends, so both sides see end-of-file.
+	 */
+	void disconnect(){
+		if (disconnected){
+			return;
+		}
+		disconnected = true;
+		for (LinkDirection& d : dirs){
+			d.blocked.clear();
+			d.inFlight = 0;
+		}
+		loop.unwatch(innerA);
+		loop.unwatch(innerB);
+		close(innerA);
+		close(innerB);
+		innerA = -1;
+		innerB = -1;
+	}
+
+	~SimulatedLinkImpl(){
+		// make any callbacks still scheduled on the loop do nothing
+		self.reset();
+		for (int fd : {endA, innerA, endB, innerB}){
+			if (fd >= 0){
+				loop.unwatch(fd);
+				close(fd);
+			}
+		}
+	}
+};
+
+SimulatedLink::SimulatedLink(EventLoop& loop, const LinkShape& toPeer, const LinkShape& fromPeer, bool datagram, unsigned seed): impl(std::make_unique<SimulatedLinkImpl>(loop)){
+	int type = (datagram ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_CLOEXEC;
+	int fds[2];
+
+	impl->self = std::make_shared<SimulatedLinkImpl*>(impl.get());
+	impl->rngState = seed;
+	impl->datagram = datagram;
+	impl->dirs[TO_PEER].shape = toPeer;
+	impl->dirs[FROM_PEER].shape = fromPeer;
+
+	if (socketpair(AF_UNIX, type, 0, fds) != 0){
+		throw std::runtime_error("Failed to create socketpair (" + std::string(std::strerror(errno)) + ")");
+	}
+	impl->endA = fds[0];
+	impl->innerA = fds[1];
+
+	if (socketpair(AF_UNIX, type, 0, fds) != 0){
+		throw std::runtime_error("Failed to create socketpair (" + std::string(std::strerror(errno)) + ")");
+	}
+	impl->endB = fds[0];
+	impl->innerB = fds[1];
+
+	// the loop must never block on the inner ends
+	fcntl(impl->innerA, F_SETFL, O_NONBLOCK);
+	fcntl(impl->innerB, F_SETFL, O_NONBLOCK);
+
+	SimulatedLinkImpl* p = impl.get();
+	loop.watch(impl->innerA, [p]{ p->readSender(TO_PEER); });
+	loop.watch(impl->innerB, [p]{ p->readSender(FROM_PEER); });
+}
+
+SimulatedLink::~SimulatedLink() = default;
+
+int SimulatedLink::getFd() const{
+	return impl->endA;
+}
+
+int SimulatedLink::getPeerFd() const{
+	return impl->endB;
+}
+
+void SimulatedLink::onPeerData(std::function<void(std::string_view, SimulatedLink&)> callback){
+	int fd = impl->endB;
+
+	impl->loop.watch(fd, [this, fd, callback]{
+		std::string buf;
+		ssize_t ss = impl->readChunk(fd, buf, 4096);
+		if (ss < 0 && errno == EINTR){
+			return;
+		}
+		// end-of-file (or an error) means the link went down. there is nothing more to read.
+		if (ss <= 0){
+			impl->loop.unwatch(fd);
+			return;
+		}
+		callback(std::string_view(buf.data(), ss), *this);
+	});
+}
+
+void SimulatedLink::peerSend(std::string_view data){
+	size_t chunk = impl->dirs[FROM_PEER].shape.chunkSize == 0 || impl->datagram ? data.size() : impl->dirs[FROM_PEER].shape.chunkSize;
+
+	// bypass the peer's socket and put the data straight on the wire, split into chunks like a write to getPeerFd() would be
+	for (size_t i = 0; i < data.size(); i += chunk){
+		impl->transmit(FROM_PEER, std::string(data.substr(i, chunk)));
+	}
+}
+
+void SimulatedLink::disconnect(){
+	impl->disconnect();
+}
+
+void SimulatedLink::disconnectAfter(std::chrono::nanoseconds delay){
+	impl->schedule(delay, [](SimulatedLinkImpl& self){
+		self.disconnect();
+	});
+}
+
+bool SimulatedLink::disconnected() const{
+	return impl->disconnected;
+}
+
+size_t SimulatedLink::inFlight(Direction dir) const{
+	return impl->dirs[dir].inFlight;
+}
+
+const LinkStats& SimulatedLink::getStats(Direction dir) const{
+	return impl->dirs[dir].stats;
+}
+
+}
@@ -0,0 +1,330 @@
+/** @file simpletest_netsim.hpp
+ * @brief simpletest event loop and simulated network links.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_NETSIM_HPP
+#define __SIMPLETEST_NETSIM_HPP
+
+#include "attribute.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace simpletest{
+
+struct EventLoopImpl;
+
+/**
+ * @brief A single-threaded poll()-based event loop.
+ * Callbacks run on whichever thread calls one of the run functions.
+ */
+class EventLoop{
+public:
+	/**
+	 * @brief The clock used for timers.
+	 */
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * @brief Constructs an event loop with nothing to do.
+	 */
+	EventLoop();
+
+	/**
+	 * @brief Deleted copy constructor.
+	 * Callbacks usually capture a reference to their loop, so it should not be copied.
+	 */
+	EventLoop(const EventLoop& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 * Callbacks usually capture a reference to their loop, so it should not be copied.
+	 */
+	EventLoop& operator=(const EventLoop& other) = delete;
+
+	/**
+	 * @brief Destructor for EventLoop.
+	 * Pending timers are discarded without being called.
+	 */
+	~EventLoop();
+
+	/**
+	 * @brief Calls a function whenever a file descriptor becomes readable.
+	 * If the file descriptor is already being watched, its callback is replaced.
+	 *
+	 * @param fd The file descriptor to watch.
+	 * @param onReadable The function to call. It should read from the file descriptor, otherwise it will be called again immediately.
+	 */
+	void watch(int fd, std::function<void()> onReadable);
+
+	/**
+	 * @brief Stops watching a file descriptor.
+	 * This is safe to call from within the file descriptor's own callback.
+	 *
+	 * @param fd The file descriptor to stop watching.
+	 */
+	void unwatch(int fd);
+
+	/**
+	 * @brief Calls a function once after a delay.
+	 *
+	 * @param delay How long to wait.
+	 * @param callback The function to call.
+	 */
+	void after(std::chrono::nanoseconds delay, std::function<void()> callback);
+
+	/**
+	 * @brief Waits for at most one round of events and dispatches them.
+	 *
+	 * @param maxWait The maximum amount of time to wait if nothing is ready.
+	 *
+	 * @return True if any callback was called.
+	 */
+	bool runOnce(std::chrono::milliseconds maxWait);
+
+	/**
+	 * @brief Dispatches events until the given amount of time has passed or stop() is called.
+	 *
+	 * @param duration How long to run.
+	 */
+	void runFor(std::chrono::nanoseconds duration);
+
+	/**
+	 * @brief Dispatches events until a condition becomes true.
+	 *
+	 * @param condition Checked before waiting and after every round of events.
+	 * @param timeout The maximum amount of time to run.
+	 *
+	 * @return True if the condition became true, false if the timeout expired or stop() was called first.
+	 */
+	bool runUntil(const std::function<bool()>& condition, std::chrono::nanoseconds timeout);
+
+	/**
+	 * @brief Makes the current runFor()/runUntil() call return after the current round of events.
+	 */
+	void stop();
+
+	/**
+	 * @brief Returns true if there is nothing left to watch and no pending timers.
+	 */
+	bool idle() const;
+
+private:
+	std::unique_ptr<EventLoopImpl> impl;
+};
+
+/**
+ * @brief The conditions one direction of a SimulatedLink is subjected to.
+ * By default, a direction delivers everything instantly.
+ */
+struct LinkShape{
+	/**
+	 * @brief The minimum one-way latency.
+	 */
+	std::chrono::microseconds latencyMin{0};
+
+	/**
+	 * @brief The maximum one-way latency.
+	 * Each chunk gets a latency chosen uniformly between latencyMin and latencyMax.
+	 */
+	std::chrono::microseconds latencyMax{0};
+
+	/**
+	 * @brief The bandwidth in bytes per second, or 0 for unlimited.
+	 * Chunks are serialized one after another at this rate before their latency is applied.
+	 */
+	size_t bandwidth = 0;
+
+	/**
+	 * @brief The largest chunk that is sent at once, like an MTU.
+	 * A datagram link sends each message as one chunk, however big it is, so this only applies to stream links.
+	 */
+	size_t chunkSize = 1500;
+
+	/**
+	 * @brief The probability (0 to 1) that a chunk is held back and delivered after the ones sent behind it.
+	 */
+	double reorderRate = 0;
+
+	/**
+	 * @brief How long a reordered chunk is held back for.
+	 */
+	std::chrono::microseconds reorderDelay{1000};
+
+	/**
+	 * @brief The probability (0 to 1) that a chunk is silently dropped.
+	 */
+	double lossRate = 0;
+
+	/**
+	 * @brief The probability (0 to 1) that a chunk is cut short at a random length.
+	 */
+	double truncateRate = 0;
+
+	/**
+	 * @brief The link disconnects after this many bytes have been delivered in this direction, or never if 0.
+	 * The receiver gets all of them before it sees end-of-file, even if it is slow to read them. Anything after them is dropped.
+	 */
+	size_t disconnectAfterBytes = 0;
+};
+
+/**
+ * @brief Counters for one direction of a SimulatedLink.
+ */
+struct LinkStats{
+	/**
+	 * @brief Bytes written by the sender.
+	 */
+	uint64_t bytesSent = 0;
+
+	/**
+	 * @brief Bytes delivered to the receiver.
+	 */
+	uint64_t bytesDelivered = 0;
+
+	/**
+	 * @brief Chunks delivered to the receiver.
+	 */
+	uint64_t chunksDelivered = 0;
+
+	/**
+	 * @brief Chunks dropped because of LinkShape::lossRate.
+	 */
+	uint64_t chunksLost = 0;
+
+	/**
+	 * @brief Chunks cut short because of LinkShape::truncateRate.
+	 */
+	uint64_t chunksTruncated = 0;
+
+	/**
+	 * @brief Chunks held back because of LinkShape::reorderRate.
+	 */
+	uint64_t chunksReordered = 0;
+};
+
+struct SimulatedLinkImpl;
+
+/**
+ * @brief A fake network link between the code under test and a fake peer.
+ * The link is made from two socketpairs with the event loop shuttling data between them, so no real sockets or services are involved.
+ *
+ * The code under test uses getFd(). The peer is either a callback set with onPeerData() or code that uses getPeerFd() directly.
+ * Nothing is delivered unless the event loop is running.
+ */
+class SimulatedLink{
+public:
+	/**
+	 * @brief Which way data is flowing.
+	 */
+	enum Direction{
+		/**
+		 * @brief From the code under test to the peer.
+		 */
+		TO_PEER = 0,
+
+		/**
+		 * @brief From the peer to the code under test.
+		 */
+		FROM_PEER = 1
+	};
+
+	/**
+	 * @brief Creates a link.
+	 *
+	 * @param loop The event loop that drives the link. It must outlive the link.
+	 * @param toPeer The conditions for data sent by the code under test.
+	 * @param fromPeer The conditions for data sent by the peer.
+	 * @param datagram True to use SOCK_SEQPACKET, so each write is one chunk and message boundaries survive. False to use SOCK_STREAM.
+	 * @param seed The seed for the link's random number generator. The same seed produces the same losses, latencies, etc.
+	 *
+	 * @exception std::runtime_error Failed to create the socketpairs.
+	 */
+	SimulatedLink(EventLoop& loop, const LinkShape& toPeer = LinkShape(), const LinkShape& fromPeer = LinkShape(), bool datagram = false, unsigned seed = 0);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 * The event loop holds callbacks that point to this object.
+	 */
+	SimulatedLink(const SimulatedLink& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 * The event loop holds callbacks that point to this object.
+	 */
+	SimulatedLink& operator=(const SimulatedLink& other) = delete;
+
+	/**
+	 * @brief Tears down the link and closes all of its file descriptors.
+	 */
+	~SimulatedLink();
+
+	/**
+	 * @brief Returns the file descriptor the code under test should use.
+	 */
+	int getFd() const;
+
+	/**
+	 * @brief Returns the peer's file descriptor.
+	 * Do not read from this if a callback was set with onPeerData().
+	 */
+	int getPeerFd() const;
+
+	/**
+	 * @brief Makes the peer a callback that is called whenever data arrives from the code under test.
+	 *
+	 * @param callback The function to call. It receives the data and the link, which it can reply through with peerSend().
+	 */
+	void onPeerData(std::function<void(std::string_view, SimulatedLink&)> callback);
+
+	/**
+	 * @brief Sends data from the peer to the code under test, subject to the link's conditions.
+	 *
+	 * @param data The data to send.
+	 */
+	void peerSend(std::string_view data);
+
+	/**
+	 * @brief Disconnects the link in both directions.
+	 * Data already in flight is discarded, and both sides see end-of-file.
+	 * Writes made afterwards fail with EPIPE, which raises SIGPIPE unless it is ignored.
+	 */
+	void disconnect();
+
+	/**
+	 * @brief Disconnects the link after a delay.
+	 *
+	 * @param delay How long to wait, measured from now.
+	 */
+	void disconnectAfter(std::chrono::nanoseconds delay);
+
+	/**
+	 * @brief Returns true if the link has been disconnected.
+	 */
+	bool disconnected() const;
+
+	/**
+	 * @brief Returns the number of bytes in flight in one direction.
+	 */
+	size_t inFlight(Direction dir) const;
+
+	/**
+	 * @brief Returns the counters for one direction.
+	 */
+	const LinkStats& getStats(Direction dir) const;
+
+private:
+	std::unique_ptr<SimulatedLinkImpl> impl;
+};
+
+}
+
+#endif
@@ -0,0 +1,341 @@
+/** @file simpletest_options.cpp
+ * @brief simpletest command-line options.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_options.hpp"
+#include "simpletest_scheduler.hpp"
+
+// std::cout
+#include <iostream>
+// std::invalid_argument
+#include <stdexcept>
+// std::istringstream
+#include <sstream>
+// std::strncmp, std::strlen
+#include <cstring>
+
+namespace simpletest{
+
+/**
+ * @brief Checks if an argument is a particular option that takes a value, for example "--record=FILE".
+ *
+ * @param arg The argument to check.
+ * @param name The option's name including the leading dashes, for example "--record".
+ * @param value Set to everything after the '=' if the argument matches.
+ *
+ * @return True if the argument is the option, false if not.
+ *
+ * @exception std::invalid_argument The argument is the option but it has no value.
+ */
+static bool matchValue(const char* arg, const char* name, std::string& value){
+	size_t len = std::strlen(name);
+
+	if (std::strncmp(arg, name, len) != 0){
+		return false;
+	}
+	if (arg[len] == '\0'){
+		throw std::invalid_argument(std::string(name) + " requires a value (" + name + "=...)");
+	}
+	if (arg[len] != '='){
+		return false;
+	}
+	value = arg + len + 1;
+	return true;
+}
+
+/**
+ * @brief Parses the value of an option that takes a count, for example "--jobs=4".
+ *
+ * @param value The value.
+ * @param name The option's name, for error messages.
+ *
+ * @return The count.
+ *
+ * @exception std::invalid_argument The value is not a positive integer.
+ */
+static size_t parseCount(const std::string& value, const char* name){
+	size_t pos = 0;
+	unsigned long long n = 0;
+
+	try{
+		n = std::stoull(value, &pos);
+	}
+	catch (std::exception&){
+		pos = 0;
+	}
+	if (pos == 0 || pos != value.size() || value[0] == '-' || n == 0){
+		throw std::invalid_argument(std::string(name) + " requires a positive integer");
+	}
+	return n;
+}
+
+Options parseOptions(int argc, char** argv){
+	Options opt;
+	std::string value;
+	int i;
+
+	for (i = 1; i < argc; ++i){
+		const char* arg = argv[i];
+
+		if (std::strcmp(arg, "--") == 0){
+			// everything after this belongs to the program being recorded
+			++i;
+			break;
+		}
+		else if (std::strcmp(arg, "--help") == 0 || std::strcmp(arg, "-h") == 0){
+			opt.help = true;
+		}
+		else if (matchValue(arg, "--record", value)){
+			opt.recordPath = value;
+		}
+		else if (std::strcmp(arg, "--list") == 0){
+			opt.list = true;
+		}
+		else if (matchValue(arg, "--worker", value)){
+			opt.workerFd = parseCount(value, "--worker");
+		}
+		else if (matchValue(arg, "--ring", value)){
+			opt.ringFd = parseCount(value, "--ring");
+		}
+		else if (std::strcmp(arg, "--fork") == 0){
+			opt.fork = true;
+		}
+		else if (std::strcmp(arg, "--zygote") == 0){
+			opt.fork = true;
+			opt.zygote = true;
+		}
+		else if (matchValue(arg, "--jobs", value)){
+			opt.jobs = parseCount(value, "--jobs");
+			opt.fork = true;
+		}
+		else if (matchValue(arg, "--batch", value)){
+			opt.batch = parseCount(value, "--batch");
+			opt.fork = true;
+		}
+		else if (matchValue(arg, "--limits", value)){
+			opt.limits = parseLimits(value);
+			if (opt.limits.empty()){
+				throw std::invalid_argument("--limits requires limits such as memory=512M,cpu=10s");
+			}
+			opt.fork = true;
+		}
+		else if (matchValue(arg, "--cgroup", value)){
+			if (value.empty()){
+				throw std::invalid_argument("--cgroup requires a directory");
+			}
+			opt.cgroup = value;
+			opt.fork = true;
+		}
+		else if (matchValue(arg, "--capacity", value)){
+			// checked here, so a typo is reported before any test runs
+			parseWeights(value);
+			opt.capacity = value;
+			opt.fork = true;
+		}
+		else if (matchValue(arg, "--retries", value)){
+			opt.retries = parseCount(value, "--retries");
+		}
+		else if (matchValue(arg, "--repeat", value)){
+			opt.repeat = parseCount(value, "--repeat");
+		}
+		else if (std::strcmp(arg, "--until-fail") == 0){
+			opt.untilFail = true;
+		}
+		else if (matchValue(arg, "--soak", value)){
+			opt.soak = parseSeconds(value, "--soak");
+		}
+		else if (matchValue(arg, "--tests", value)){
+			std::istringstream iss(value);
+			std::string name;
+
+			while (std::getline(iss, name, ',')){
+				if (!name.empty()){
+					opt.tests.push_back(name);
+				}
+			}
+			if (opt.tests.empty()){
+				throw std::invalid_argument("--tests requires at least one test name");
+			}
+		}
+		else if (std::strcmp(arg, "--sandbox") == 0){
+			opt.sandbox = true;
+		}
+		else if (std::strcmp(arg, "--leaks") == 0){
+			opt.leaks = true;
+		}
+		else if (std::strcmp(arg, "--leaks=strict") == 0){
+			opt.leaks = true;
+			opt.strictLeaks = true;
+		}
+		else if (std::strncmp(arg, "--leaks=", 8) == 0){
+			throw std::invalid_argument("--leaks only takes the value strict");
+		}
+		else if (matchValue(arg, "--leaks-heap", value)){
+			opt.leakHeapThreshold = parseSize(value, "--leaks-heap");
+			opt.leaks = true;
+		}
+		else if (std::strcmp(arg, "--shuffle") == 0){
+			opt.shuffle = true;
+		}
+		else if (std::strncmp(arg, "--shuffle=", 10) == 0){
+			size_t pos = 0;
+
+			value = arg + 10;
+			try{
+				opt.seed = std::stoull(value, &pos);
+			}
+			catch (std::exception&){
+				pos = 0;
+			}
+			if (pos == 0 || pos != value.size() || value[0] == '-'){
+				throw std::invalid_argument("--shuffle requires a seed that is a non-negative integer");
+			}
+			opt.shuffle = true;
+		}
+		else if (std::strcmp(arg, "--bisect") == 0){
+			opt.bisect = true;
+		}
+		else if (matchValue(arg, "--history", value)){
+			if (value.empty()){
+				throw std::invalid_argument("--history requires a file");
+			}
+			opt.history = value;
+		}
+		else if (matchValue(arg, "--query", value)){
+			if (value.empty()){
+				throw std::invalid_argument("--query requires a query such as runs, trend:TEST, slower:20:5 or failing-since:-1");
+			}
+			opt.query = value;
+		}
+		else if (matchValue(arg, "--coverage", value)){
+			if (value.empty()){
+				throw std::invalid_argument("--coverage requires a file");
+			}
+			opt.coverage = value;
+		}
+		else if (matchValue(arg, "--affected-by", value)){
+			std::istringstream iss(value);
+			std::string file;
+
+			// an empty list is allowed, since nothing changing means nothing has to run
+			opt.affectedBy.emplace();
+			while (std::getline(iss, file, ',')){
+				if (!file.empty()){
+					opt.affectedBy->push_back(file);
+				}
+			}
+		}
+		else if (matchValue(arg, "--journal", value)){
+			if (value.empty()){
+				throw std::invalid_argument("--journal requires a file");
+			}
+			opt.journal = value;
+		}
+		else if (std::strcmp(arg, "--resume") == 0){
+			opt.resume = true;
+		}
+		else if (matchValue(arg, "--watch", value)){
+			std::istringstream iss(value);
+			std::string file;
+
+			while (std::getline(iss, file, ',')){
+				if (!file.empty()){
+					opt.watch.push_back(file);
+				}
+			}
+			if (opt.watch.empty()){
+				throw std::invalid_argument("--watch requires at least one shared object");
+			}
+		}
+		else{
+			throw std::invalid_argument("Unrecognized option " + std::string(arg));
+		}
+	}
+
+	for (; i < argc; ++i){
+		opt.recordArgs.push_back(argv[i]);
+	}
+
+	if (!opt.recordPath.empty() && opt.recordArgs.empty()){
+		throw std::invalid_argument("--record requires a program to run after \"--\"");
+	}
+	if (opt.recordPath.empty() && !opt.recordArgs.empty()){
+		throw std::invalid_argument("A program after \"--\" is only used with --record");
+	}
+	if (!opt.query.empty() && opt.history.empty()){
+		throw std::invalid_argument("--query requires --history");
+	}
+	if (opt.affectedBy && opt.coverage.empty()){
+		throw std::invalid_argument("--affected-by requires --coverage");
+	}
+	if (opt.soak.count() != 0 && (opt.fork || opt.retries != 0 || opt.repeat != 1 || opt.untilFail || opt.bisect)){
+		throw std::invalid_argument("--soak watches the tests run over and over in this process, so it cannot be combined with options that run them in child processes or a set number of times");
+	}
+	if (opt.resume && opt.journal.empty()){
+		throw std::invalid_argument("--resume requires --journal");
+	}
+	if (!opt.journal.empty() && (opt.untilFail || opt.soak.count() != 0 || !opt.watch.empty() || opt.bisect || opt.workerFd >= 0)){
+		throw std::invalid_argument("--journal records one run of the tests, so it cannot be combined with options that run them over and over or rerun them to bisect");
+	}
+	if (!opt.watch.empty() && (opt.soak.count() != 0 || opt.untilFail || opt.bisect || !opt.coverage.empty() || !opt.history.empty() || opt.workerFd >= 0)){
+		throw std::invalid_argument("--watch keeps running until it is interrupted, so it cannot be combined with options that run the tests a set way or record them");
+	}
+
+	return opt;
+}
+
+void printUsage(const char* progName){
+	std::cout << "Usage: " << progName << " [options]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "Options:" << std::endl;
+	std::cout << "  -h, --help                 Shows this help text." << std::endl;
+	std::cout << "  --record=FILE -- PROG ARGS Runs PROG with the real stdin and records the session to FILE." << std::endl;
+	std::cout << "  --list                     Prints the names of the tests, one per line, without running them." << std::endl;
+	std::cout << "  --worker=FD                Runs tests requested by simpletest-run over file descriptor FD." << std::endl;
+	std::cout << "  --ring=FD                  With --worker, reports results in the shared memory at file descriptor FD." << std::endl;
+	std::cout << "  --fork                     Runs each test in a child process forked after the global setup." << std::endl;
+	std::cout << "  --zygote                   Like --fork, but keeps children forked ahead of time so tests start instantly." << std::endl;
+	std::cout << "  --jobs=N                   Runs up to N tests at once in child processes. Implies --fork." << std::endl;
+	std::cout << "  --batch=N                  Lets each child run N tests before it is replaced. Implies --fork." << std::endl;
+	std::cout << "  --limits=SPEC              Limits what each test may use, for example memory=512M,cpu=10s,files=64,processes=16,output=100M." << std::endl;
+	std::cout << "                             TEST_LIMITS() in the tests take precedence. Implies --fork." << std::endl;
+	std::cout << "  --capacity=SPEC            Packs parallel tests so their TEST_WEIGHTS() never add up to more than SPEC," << std::endl;
+	std::cout << "                             for example cores=16,memory=32G,io=100. Defaults to what the machine has. Implies --fork." << std::endl;
+	std::cout << "  --cgroup=DIR               Runs each test in a cgroup of its own under the delegated cgroup v2 directory DIR," << std::endl;
+	std::cout << "                             to limit and measure its whole process tree exactly. Implies --fork." << std::endl;
+	std::cout << "  --retries=N                Runs a test that did not pass up to N more times, in a fresh child with --fork." << std::endl;
+	std::cout << "                             A test that passes on a retry is reported as flaky and does not fail the run." << std::endl;
+	std::cout << "  --repeat=N                 Runs each test N times, at the same time as each other with --jobs." << std::endl;
+	std::cout << "                             A test that passes only some of the times is reported as flaky." << std::endl;
+	std::cout << "  --until-fail               Runs the tests over and over until one of them does not pass." << std::endl;
+	std::cout << "  --soak=DURATION            Runs the tests over and over in this process for DURATION, for example 30m or 8h, and reports" << std::endl;
+	std::cout << "                             whether its memory, open files and heap or the tests' latencies trend upward." << std::endl;
+	std::cout << "  --tests=LIST               Runs only the tests in the comma-separated LIST, which may have shell wildcards." << std::endl;
+	std::cout << "  --sandbox                  Starts each test in a fresh temporary directory, and undoes its changes to the working" << std::endl;
+	std::cout << "                             directory, environment variables, umask and signal handlers when it ends." << std::endl;
+	std::cout << "  --leaks[=strict]           Reports the file descriptors, threads, child processes, file mappings and heap memory" << std::endl;
+	std::cout << "                             each test leaves behind. With strict, a test that leaks fails." << std::endl;
+	std::cout << "  --leaks-heap=SIZE          Only reports heap growth of more than SIZE, 16K by default. Implies --leaks." << std::endl;
+	std::cout << "  --shuffle[=SEED]           Runs the tests in a random order, the same one for the same SEED, and prints the seed." << std::endl;
+	std::cout << "                             With --until-fail, each round is shuffled with the next seed." << std::endl;
+	std::cout << "  --bisect                   Finds a smallest set of the tests that ran before a failing test after which it fails," << std::endl;
+	std::cout << "                             if it passes on its own, by rerunning them in child processes." << std::endl;
+	std::cout << "  --history=FILE             Appends the outcome, duration, resource usage and benchmarks of each test to FILE." << std::endl;
+	std::cout << "  --query=QUERY              Answers QUERY from the --history file instead of running the tests:" << std::endl;
+	std::cout << "                             runs, trend:TEST, slower:PERCENT[:RUNS], failing-since:RUN or flaky[:RUNS]." << std::endl;
+	std::cout << "  --coverage=FILE            Records which functions each test runs to FILE. Requires building with --coverage" << std::endl;
+	std::cout << "                             and linking with -Wl,-u,__gcov_dump,-u,__gcov_reset." << std::endl;
+	std::cout << "  --affected-by=LIST         Runs only the tests that the comma-separated changed files can affect, according to" << std::endl;
+	std::cout << "                             the --coverage file, and tests it knows nothing about." << std::endl;
+	std::cout << "  --journal=FILE             Appends each test's result to FILE as it finishes, and removes FILE once every test has one." << std::endl;
+	std::cout << "  --resume                   Skips the tests whose results are in the --journal file, if the same build of the program" << std::endl;
+	std::cout << "                             wrote it, and reports their results along with the rest." << std::endl;
+	std::cout << "  --watch=LIST               Loads the tests of the comma-separated shared objects, and reruns them, the failing ones" << std::endl;
+	std::cout << "                             first, each time one is rebuilt until interrupted." << std::endl;
+}
+
+}
@@ -0,0 +1,209 @@
+/** @file simpletest_options.hpp
+ * @brief simpletest command-line options.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_OPTIONS_HPP
+#define __SIMPLETEST_OPTIONS_HPP
+
+#include "simpletest_limits.hpp"
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief The command-line options understood by EXECUTE_TESTS().
+ */
+struct Options{
+	/**
+	 * @brief True if --help was given.
+	 */
+	bool help = false;
+
+	/**
+	 * @brief The session file to record to (--record=FILE), or empty to run the tests as normal.
+	 */
+	std::string recordPath;
+
+	/**
+	 * @brief The program and arguments to record, given after "--".
+	 */
+	std::vector<std::string> recordArgs;
+
+	/**
+	 * @brief True to print the names of the tests, one per line, instead of running them (--list).
+	 */
+	bool list = false;
+
+	/**
+	 * @brief The file descriptor to serve tests to a driver such as simpletest-run over (--worker=FD), or -1 to run the tests as normal.
+	 */
+	int workerFd = -1;
+
+	/**
+	 * @brief The file descriptor of a ResultRing to report results on while serving a driver (--ring=FD), or -1 to send them over workerFd.
+	 */
+	int ringFd = -1;
+
+	/**
+	 * @brief The limits of every test that does not set its own with TEST_LIMITS() (--limits=SPEC).
+	 */
+	ResourceLimits limits;
+
+	/**
+	 * @brief A delegated cgroup v2 directory to run each test in a cgroup of its own under (--cgroup=DIR), or empty for none.
+	 */
+	std::string cgroup;
+
+	/**
+	 * @brief What the tests running at once may need in total, in the format parseWeights() reads (--capacity=SPEC), or empty for what the machine has.
+	 * Keys that are not given keep the machine's values.
+	 */
+	std::string capacity;
+
+	/**
+	 * @brief How many more times to run a test that did not pass (--retries=N). A test that passes on a retry is reported as flaky instead of failed.
+	 */
+	size_t retries = 0;
+
+	/**
+	 * @brief The number of times to run each test (--repeat=N). A test that passes some of the times is reported as flaky.
+	 */
+	size_t repeat = 1;
+
+	/**
+	 * @brief True to run the tests over and over until one of them fails (--until-fail).
+	 */
+	bool untilFail = false;
+
+	/**
+	 * @brief How long to run the tests over and over in this process while watching its resource usage and their latencies for growth (--soak=DURATION), or 0 to run them once.
+	 */
+	std::chrono::seconds soak{0};
+
+	/**
+	 * @brief The names of the tests to run, which may have shell wildcards (--tests=LIST), or empty to run them all.
+	 */
+	std::vector<std::string> tests;
+
+	/**
+	 * @brief True to run each test in a fresh directory of its own and undo its changes to the working directory, environment, umask and signals (--sandbox).
+	 */
+	bool sandbox = false;
+
+	/**
+	 * @brief True to report the file descriptors, threads, child processes, file mappings and heap memory each test leaves behind (--leaks).
+	 */
+	bool leaks = false;
+
+	/**
+	 * @brief True to also fail the tests that leak (--leaks=strict).
+	 */
+	bool strictLeaks = false;
+
+	/**
+	 * @brief How many bytes the heap may grow by during a test before --leaks reports it (--leaks-heap=SIZE).
+	 * Freed memory the C library keeps in its per-thread caches still counts as in use, which makes the growth vary by a few KiB.
+	 */
+	size_t leakHeapThreshold = 16 << 10;
+
+	/**
+	 * @brief True to run the tests in a random order (--shuffle[=SEED]).
+	 */
+	bool shuffle = false;
+
+	/**
+	 * @brief The seed to shuffle with, or nullopt to pick one. It is printed either way, so the order can be reproduced.
+	 */
+	std::optional<uint64_t> seed;
+
+	/**
+	 * @brief True to find the tests each failing test fails after, if it passes on its own (--bisect).
+	 */
+	bool bisect = false;
+
+	/**
+	 * @brief The history file to append the outcome of this run to (--history=FILE), or empty for none.
+	 */
+	std::string history;
+
+	/**
+	 * @brief A query to answer from the history file instead of running the tests (--query=QUERY), or empty to run them.
+	 */
+	std::string query;
+
+	/**
+	 * @brief The coverage map to record which functions each test runs to, and to read for --affected-by (--coverage=FILE), or empty for none.
+	 */
+	std::string coverage;
+
+	/**
+	 * @brief The changed files to run only the affected tests of, read from the comma-separated list of --affected-by=LIST, or nullopt to run every test.
+	 */
+	std::optional<std::vector<std::string>> affectedBy;
+
+	/**
+	 * @brief The shared objects to load test suites from, and to load again and rerun the tests of when they are rebuilt (--watch=LIST), or empty for none.
+	 */
+	std::vector<std::string> watch;
+
+	/**
+	 * @brief The file to journal each finished test's result to, so the run can be resumed if it is killed (--journal=FILE), or empty for none.
+	 */
+	std::string journal;
+
+	/**
+	 * @brief True to skip the tests the journal already has results for, if it was written by the same build of the program (--resume).
+	 */
+	bool resume = false;
+
+	/**
+	 * @brief True to run each test in a child process forked after the global setup (--fork).
+	 */
+	bool fork = false;
+
+	/**
+	 * @brief True to also keep children forked ahead of time, ready to receive tests (--zygote).
+	 */
+	bool zygote = false;
+
+	/**
+	 * @brief The most tests to run at once in fork or zygote mode (--jobs=N).
+	 */
+	size_t jobs = 1;
+
+	/**
+	 * @brief The number of tests each child runs before it is replaced (--batch=N).
+	 */
+	size_t batch = 1;
+};
+
+/**
+ * @brief Parses the command-line arguments given to EXECUTE_TESTS().
+ *
+ * @param argc The command-line argument count.
+ * @param argv The command-line arguments.
+ *
+ * @return The parsed options.
+ *
+ * @exception std::invalid_argument An option was not recognized or had an invalid value. See e.what() for details.
+ */
+Options parseOptions(int argc, char** argv);
+
+/**
+ * @brief Prints the command-line usage to stdout.
+ *
+ * @param progName The name of the program, normally argv[0].
+ */
+void printUsage(const char* progName);
+
+}
+
+#endif
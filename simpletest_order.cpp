@@ -0,0 +1,266 @@
+/** @file simpletest_order.cpp
+ * @brief simpletest randomized test order and order-dependency bisection.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_order.hpp"
+
+// std::min, std::max
+#include <algorithm>
+// std::map
+#include <map>
+// std::mt19937_64, std::random_device
+#include <random>
+// std::runtime_error
+#include <stdexcept>
+// std::cout
+#include <iostream>
+// std::strerror
+#include <cstring>
+// errno
+#include <cerrno>
+// signal(), SIGPIPE
+#include <csignal>
+// waitpid()
+#include <sys/wait.h>
+// fork(), pipe(), read(), write(), close(), _exit()
+#include <unistd.h>
+
+namespace simpletest{
+
+void shuffleOrder(std::vector<size_t>& order, uint64_t seed){
+	// std::shuffle() differs between standard libraries, so Fisher-Yates is spelled out to keep seeds portable
+	std::mt19937_64 rng(seed);
+
+	for (size_t i = order.size(); i > 1; --i){
+		std::swap(order[i - 1], order[rng() % i]);
+	}
+}
+
+uint64_t randomSeed(){
+	std::random_device rd;
+
+	return ((uint64_t)rd() << 32) | rd();
+}
+
+bool failsAfter(const std::vector<size_t>& before, size_t target, const std::function<TestResult(size_t)>& runOne){
+	int fds[2];
+	pid_t pid;
+	int status;
+	char started = 0;
+
+	if (pipe(fds) != 0){
+		throw std::runtime_error(std::string("Failed to create a pipe (") + std::strerror(errno) + ")");
+	}
+	// or whatever is buffered would be printed by the child too
+	std::cout.flush();
+	pid = fork();
+	if (pid < 0){
+		close(fds[0]);
+		close(fds[1]);
+		throw std::runtime_error(std::string("Failed to fork (") + std::strerror(errno) + ")");
+	}
+	if (pid == 0){
+		TestResult res;
+
+		close(fds[0]);
+		for (size_t i : before){
+			runOne(i);
+		}
+		// from here on, the child dying means the target test did
+		started = 1;
+		while (write(fds[1], &started, 1) < 0 && errno == EINTR);
+		res = runOne(target);
+		_exit(res.status == TestResult::PASSED ? 0 : 1);
+	}
+
+	close(fds[1]);
+	while (read(fds[0], &started, 1) < 0 && errno == EINTR);
+	close(fds[0]);
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	if (!started){
+		return false;
+	}
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/**
+ * @brief Writes a whole buffer to a pipe.
+ *
+ * @return False if the other end is gone.
+ */
+static bool writeAll(int fd, const void* buf, size_t len){
+	const char* p = (const char*)buf;
+
+	while (len > 0){
+		ssize_t ss = write(fd, p, len);
+		if (ss < 0 && errno == EINTR){
+			continue;
+		}
+		if (ss <= 0){
+			return false;
+		}
+		p += ss;
+		len -= ss;
+	}
+	return true;
+}
+
+/**
+ * @brief Reads a whole buffer from a pipe.
+ *
+ * @return False if the other end closed it first.
+ */
+static bool readAll(int fd, void* buf, size_t len){
+	char* p = (char*)buf;
+
+	while (len > 0){
+		ssize_t ss = read(fd, p, len);
+		if (ss < 0 && errno == EINTR){
+			continue;
+		}
+		if (ss <= 0){
+			return false;
+		}
+		p += ss;
+		len -= ss;
+	}
+	return true;
+}
+
+TrialRunner::TrialRunner(const std::function<TestResult(size_t)>& runOne){
+	int req[2];
+	int resp[2];
+
+	if (pipe(req) != 0){
+		throw std::runtime_error(std::string("Failed to create a pipe (") + std::strerror(errno) + ")");
+	}
+	if (pipe(resp) != 0){
+		close(req[0]);
+		close(req[1]);
+		throw std::runtime_error(std::string("Failed to create a pipe (") + std::strerror(errno) + ")");
+	}
+	std::cout.flush();
+	pid = fork();
+	if (pid < 0){
+		close(req[0]);
+		close(req[1]);
+		close(resp[0]);
+		close(resp[1]);
+		throw std::runtime_error(std::string("Failed to fork (") + std::strerror(errno) + ")");
+	}
+	if (pid == 0){
+		uint32_t n;
+
+		close(req[1]);
+		close(resp[0]);
+		// each request is the number of tests, the tests to run first, and the test to check
+		while (readAll(req[0], &n, sizeof(n))){
+			std::vector<uint32_t> tests(n);
+			char failed;
+
+			if (n == 0 || !readAll(req[0], tests.data(), n * sizeof(tests[0]))){
+				break;
+			}
+			try{
+				failed = simpletest::failsAfter(std::vector<size_t>(tests.begin(), tests.end() - 1), tests.back(), runOne);
+			}
+			catch (std::exception&){
+				_exit(1);
+			}
+			if (!writeAll(resp[1], &failed, 1)){
+				break;
+			}
+		}
+		_exit(0);
+	}
+	close(req[0]);
+	close(resp[1]);
+	toFd = req[1];
+	fromFd = resp[0];
+}
+
+TrialRunner::~TrialRunner(){
+	// the forked process stops when it sees the end of its requests
+	close(toFd);
+	close(fromFd);
+	while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR);
+}
+
+bool TrialRunner::failsAfter(const std::vector<size_t>& before, size_t target){
+	std::vector<uint32_t> req;
+	char failed;
+
+	bool ok;
+	// so a forked process that is gone is an error instead of killing this one
+	void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+	req.push_back(before.size() + 1);
+	req.insert(req.end(), before.begin(), before.end());
+	req.push_back(target);
+	ok = writeAll(toFd, req.data(), req.size() * sizeof(req[0])) && readAll(fromFd, &failed, 1);
+	signal(SIGPIPE, oldPipe);
+	if (!ok){
+		throw std::runtime_error("The process tests are rerun from is gone");
+	}
+	return failed != 0;
+}
+
+std::vector<size_t> minimizeFailingPrefix(const std::vector<size_t>& before, const std::function<bool(const std::vector<size_t>&)>& fails){
+	std::vector<size_t> cur = before;
+	std::map<std::vector<size_t>, bool> tried;
+	size_t n = 2;
+	auto check = [&](const std::vector<size_t>& subset){
+		auto it = tried.find(subset);
+		if (it == tried.end()){
+			it = tried.emplace(subset, fails(subset)).first;
+		}
+		return it->second;
+	};
+
+	tried[cur] = true;
+	while (cur.size() >= 2){
+		std::vector<std::vector<size_t>> chunks(n);
+		bool reduced = false;
+
+		for (size_t i = 0; i < cur.size(); ++i){
+			chunks[i * n / cur.size()].push_back(cur[i]);
+		}
+		for (const std::vector<size_t>& chunk : chunks){
+			if (check(chunk)){
+				cur = chunk;
+				n = 2;
+				reduced = true;
+				break;
+			}
+		}
+		// tests that only break the test together are found by removing chunks instead; with two chunks, that was just done
+		for (size_t c = 0; !reduced && n > 2 && c < chunks.size(); ++c){
+			std::vector<size_t> complement;
+
+			for (size_t d = 0; d < chunks.size(); ++d){
+				if (d != c){
+					complement.insert(complement.end(), chunks[d].begin(), chunks[d].end());
+				}
+			}
+			if (check(complement)){
+				cur = complement;
+				n = std::max<size_t>(n - 1, 2);
+				reduced = true;
+			}
+		}
+		if (reduced){
+			continue;
+		}
+		if (n >= cur.size()){
+			break;
+		}
+		n = std::min(n * 2, cur.size());
+	}
+	return cur;
+}
+
+}
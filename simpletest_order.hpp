@@ -0,0 +1,115 @@
+/** @file simpletest_order.hpp
+ * @brief simpletest randomized test order and order-dependency bisection.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_ORDER_HPP
+#define __SIMPLETEST_ORDER_HPP
+
+#include "simpletest_runner.hpp"
+#include <sys/types.h>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Shuffles the order tests run in.
+ * The same seed gives the same order on every platform, so a seed printed by one run reproduces its order in another.
+ *
+ * @param order The indexes of the tests, shuffled in place.
+ * @param seed The seed.
+ */
+void shuffleOrder(std::vector<size_t>& order, uint64_t seed);
+
+/**
+ * @brief Picks a seed for shuffleOrder() when none was given.
+ */
+uint64_t randomSeed();
+
+/**
+ * @brief Runs tests one after another in a child process forked from this one, and tells whether the last of them did not pass.
+ * The child starts from this process's state, so for example after GLOBAL_SETUP(), and none of what the tests do leaks back.
+ *
+ * @param before The indexes of the tests to run first. Their results do not matter.
+ * @param target The index of the test to check.
+ * @param runOne Runs a test in the calling process and returns its result.
+ *
+ * @return True if the target test did not pass. False if it passed, or if an earlier test took the child down before it ran.
+ *
+ * @exception std::runtime_error Failed to fork.
+ */
+bool failsAfter(const std::vector<size_t>& before, size_t target, const std::function<TestResult(size_t)>& runOne);
+
+/**
+ * @brief Runs failsAfter() in a process forked when it is constructed, so every check starts from the state this process had then, for example right after GLOBAL_SETUP() and before any test changed it.
+ */
+class TrialRunner{
+public:
+	/**
+	 * @brief Forks the process the checks are run from.
+	 *
+	 * @param runOne Runs a test in the calling process and returns its result.
+	 *
+	 * @exception std::runtime_error Failed to fork.
+	 */
+	explicit TrialRunner(const std::function<TestResult(size_t)>& runOne);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	TrialRunner(const TrialRunner& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	TrialRunner& operator=(const TrialRunner& other) = delete;
+
+	/**
+	 * @brief Stops the forked process.
+	 */
+	~TrialRunner();
+
+	/**
+	 * @brief Checks whether a test fails after others, as failsAfter() does, from the state this process had when the TrialRunner was constructed.
+	 *
+	 * @exception std::runtime_error The forked process is gone.
+	 */
+	bool failsAfter(const std::vector<size_t>& before, size_t target);
+
+private:
+	/**
+	 * @brief The forked process.
+	 */
+	pid_t pid = -1;
+
+	/**
+	 * @brief The pipe the checks are sent over.
+	 */
+	int toFd = -1;
+
+	/**
+	 * @brief The pipe their results come back over.
+	 */
+	int fromFd = -1;
+};
+
+/**
+ * @brief Finds a smallest set of tests after which a test fails, by delta debugging.
+ * The result is 1-minimal: the test passes after it with any one of the tests removed. It is usually, but not always, the smallest such set.
+ * It takes O(log n) calls to fails() when a single test is to blame, and O(n^2) at worst.
+ *
+ * @param before The tests after which the test fails, in the order they ran. fails(before) must be true.
+ * @param fails Returns true if the test fails after a subset of before, given in the same order.
+ *
+ * @return The subset, in the order the tests ran.
+ */
+std::vector<size_t> minimizeFailingPrefix(const std::vector<size_t>& before, const std::function<bool(const std::vector<size_t>&)>& fails);
+
+}
+
+#endif
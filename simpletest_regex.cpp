@@ -0,0 +1,891 @@
+/** @file simpletest_regex.cpp
+ * @brief simpletest regular expressions.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_regex.hpp"
+
+// std::sort, std::unique
+#include <algorithm>
+// std::array
+#include <array>
+// std::bitset
+#include <bitset>
+// std::map
+#include <map>
+// std::invalid_argument
+#include <stdexcept>
+// std::vector
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief A set of bytes.
+ */
+typedef std::bitset<256> ByteSet;
+
+/**
+ * @brief A node of a parsed regular expression.
+ */
+struct RegexNode{
+	/**
+	 * @brief The kind of node.
+	 */
+	enum Type{
+		EMPTY,
+		CHARS,
+		CONCAT,
+		ALTERNATE,
+		REPEAT,
+		LINE_START,
+		LINE_END
+	};
+
+	/**
+	 * @brief The kind of node.
+	 */
+	Type type = EMPTY;
+
+	/**
+	 * @brief The bytes matched by a CHARS node.
+	 */
+	ByteSet chars;
+
+	/**
+	 * @brief The children of a CONCAT, ALTERNATE or REPEAT node.
+	 */
+	std::vector<RegexNode> children;
+
+	/**
+	 * @brief The minimum number of repetitions of a REPEAT node.
+	 */
+	int min = 0;
+
+	/**
+	 * @brief The maximum number of repetitions of a REPEAT node, or -1 for unlimited.
+	 */
+	int max = -1;
+};
+
+/**
+ * @brief The largest repetition count allowed in x{m,n}.
+ * Each repetition makes a copy of x in the NFA, so this keeps patterns from blowing up.
+ */
+static const int maxRepeat = 1000;
+
+/**
+ * @brief A recursive descent parser for regular expressions.
+ */
+class RegexParser{
+public:
+	RegexParser(const std::string& pattern): pattern(pattern){}
+
+	/**
+	 * @brief Parses the entire pattern.
+	 *
+	 * @exception std::invalid_argument The pattern is not valid.
+	 */
+	RegexNode parse(){
+		RegexNode ret = parseAlternate();
+		if (pos != pattern.size()){
+			fail("unmatched ')'");
+		}
+		return ret;
+	}
+
+private:
+	const std::string& pattern;
+	size_t pos = 0;
+
+	[[noreturn]] void AT_COLD fail(const char* reason){
+		throw std::invalid_argument("Invalid regex /" + pattern + "/ at position " + std::to_string(pos) + ": " + reason);
+	}
+
+	bool atEnd() const{
+		return pos >= pattern.size();
+	}
+
+	char peek() const{
+		return pattern[pos];
+	}
+
+	RegexNode parseAlternate(){
+		RegexNode alt;
+		alt.type = RegexNode::ALTERNATE;
+		alt.children.push_back(parseConcat());
+		while (!atEnd() && peek() == '|'){
+			pos++;
+			alt.children.push_back(parseConcat());
+		}
+		return alt.children.size() == 1 ? alt.children[0] : alt;
+	}
+
+	RegexNode parseConcat(){
+		RegexNode cat;
+		cat.type = RegexNode::CONCAT;
+		while (!atEnd() && peek() != '|' && peek() != ')'){
+			cat.children.push_back(parseRepeat());
+		}
+		if (cat.children.empty()){
+			return RegexNode();
+		}
+		return cat.children.size() == 1 ? cat.children[0] : cat;
+	}
+
+	RegexNode parseRepeat(){
+		RegexNode atom = parseAtom();
+
+		while (!atEnd()){
+			RegexNode rep;
+			rep.type = RegexNode::REPEAT;
+
+			if (peek() == '*'){
+				rep.min = 0;
+				rep.max = -1;
+				pos++;
+			}
+			else if (peek() == '+'){
+				rep.min = 1;
+				rep.max = -1;
+				pos++;
+			}
+			else if (peek() == '?'){
+				rep.min = 0;
+				rep.max = 1;
+				pos++;
+			}
+			else if (peek() == '{'){
+				pos++;
+				rep.min = parseNumber();
+				rep.max = rep.min;
+				if (!atEnd() && peek() == ','){
+					pos++;
+					rep.max = (!atEnd() && peek() == '}') ? -1 : parseNumber();
+				}
+				if (atEnd() || peek() != '}'){
+					fail("expected '}'");
+				}
+				pos++;
+				if (rep.max != -1 && rep.max < rep.min){
+					fail("repetition maximum is less than the minimum");
+				}
+			}
+			else{
+				break;
+			}
+
+			if (atom.type == RegexNode::LINE_START || atom.type == RegexNode::LINE_END){
+				fail("nothing to repeat");
+			}
+			rep.children.push_back(atom);
+			atom = rep;
+		}
+		return atom;
+	}
+
+	int parseNumber(){
+		int val = 0;
+		if (atEnd() || peek() < '0' || peek() > '9'){
+			fail("expected a number");
+		}
+		while (!atEnd() && peek() >= '0' && peek() <= '9'){
+			val = val * 10 + (peek() - '0');
+			if (val > maxRepeat){
+				fail("repetition count is too large");
+			}
+			pos++;
+		}
+		return val;
+	}
+
+	RegexNode parseAtom(){
+		RegexNode node;
+		char c = peek();
+
+		switch (c){
+		case '(':
+			pos++;
+			// non-capturing groups are the same as capturing ones, since nothing is captured anyway
+			if (pattern.compare(pos, 2, "?:") == 0){
+				pos += 2;
+			}
+			node = parseAlternate();
+			if (atEnd() || peek() != ')'){
+				fail("expected ')'");
+			}
+			pos++;
+			return node;
+		case '^':
+			pos++;
+			node.type = RegexNode::LINE_START;
+			return node;
+		case '$':
+			pos++;
+			node.type = RegexNode::LINE_END;
+			return node;
+		case '.':
+			pos++;
+			node.type = RegexNode::CHARS;
+			node.chars.set();
+			node.chars.reset('\n');
+			return node;
+		case '[':
+			pos++;
+			return parseClass();
+		case '\\':
+			pos++;
+			node.type = RegexNode::CHARS;
+			node.chars = parseEscape();
+			return node;
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			fail("nothing to repeat");
+		default:
+			pos++;
+			node.type = RegexNode::CHARS;
+			node.chars.set((unsigned char)c);
+			return node;
+		}
+	}
+
+	ByteSet parseEscape(){
+		ByteSet set;
+		char c;
+
+		if (atEnd()){
+			fail("trailing '\\'");
+		}
+		c = pattern[pos++];
+		switch (c){
+		case 'd':
+		case 'D':
+			for (int i = '0'; i <= '9'; ++i){
+				set.set(i);
+			}
+			break;
+		case 'w':
+		case 'W':
+			for (int i = 0; i < 256; ++i){
+				if ((i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') || (i >= '0' && i <= '9') || i == '_'){
+					set.set(i);
+				}
+			}
+			break;
+		case 's':
+		case 'S':
+			for (char ws : {' ', '\t', '\n', '\r', '\f', '\v'}){
+				set.set((unsigned char)ws);
+			}
+			break;
+		case 'n':
+			set.set('\n');
+			return set;
+		case 't':
+			set.set('\t');
+			return set;
+		case 'r':
+			set.set('\r');
+			return set;
+		default:
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')){
+				pos--;
+				fail("unsupported escape");
+			}
+			set.set((unsigned char)c);
+			return set;
+		}
+		// uppercase classes are the opposite of their lowercase counterparts
+		if (c >= 'A' && c <= 'Z'){
+			set.flip();
+		}
+		return set;
+	}
+
+	RegexNode parseClass(){
+		RegexNode node;
+		bool negate = false;
+		bool first = true;
+
+		node.type = RegexNode::CHARS;
+		if (!atEnd() && peek() == '^'){
+			negate = true;
+			pos++;
+		}
+
+		// a ']' right at the start is a literal
+		while (!atEnd() && (peek() != ']' || first)){
+			ByteSet single;
+			unsigned char lo;
+
+			first = false;
+			if (peek() == '\\'){
+				pos++;
+				single = parseEscape();
+			}
+			else{
+				single.set((unsigned char)pattern[pos++]);
+			}
+
+			// a range needs a single character on both sides
+			if (pos + 1 < pattern.size() && peek() == '-' && pattern[pos + 1] != ']' && single.count() == 1){
+				unsigned char hi;
+				for (lo = 0; !single.test(lo); ++lo);
+				pos++;
+				hi = (unsigned char)pattern[pos++];
+				if (hi == '\\'){
+					fail("escapes are not supported as the end of a range");
+				}
+				if (hi < lo){
+					fail("invalid range");
+				}
+				for (int i = lo; i <= hi; ++i){
+					node.chars.set(i);
+				}
+			}
+			else{
+				node.chars |= single;
+			}
+		}
+		if (atEnd()){
+			fail("expected ']'");
+		}
+		pos++;
+
+		if (negate){
+			node.chars.flip();
+		}
+		return node;
+	}
+};
+
+/**
+ * @brief A state in the NFA.
+ */
+struct NfaState{
+	/**
+	 * @brief The kind of state.
+	 */
+	enum Type{
+		/**
+		 * @brief Consumes one byte from chars and moves to out.
+		 */
+		CHARS,
+		/**
+		 * @brief Moves to out and out1 without consuming anything.
+		 */
+		SPLIT,
+		/**
+		 * @brief Moves to out without consuming anything, but only at the start of a line.
+		 */
+		LINE_START,
+		/**
+		 * @brief Moves to out without consuming anything, but only at the end of a line.
+		 */
+		LINE_END,
+		/**
+		 * @brief The pattern matched.
+		 */
+		MATCH
+	};
+
+	Type type;
+	ByteSet chars;
+	int out = -1;
+	int out1 = -1;
+};
+
+/**
+ * @brief A state in the lazily built DFA.
+ */
+struct DfaState{
+	/**
+	 * @brief The NFA states reached by consuming the last byte, before following any epsilon transitions.
+	 */
+	std::vector<int> kernel;
+
+	/**
+	 * @brief True if the last byte was a '\n' (or there was no last byte).
+	 */
+	bool lineStart;
+
+	/**
+	 * @brief True if the pattern has matched, assuming the next byte is not a line end.
+	 */
+	bool accept = false;
+
+	/**
+	 * @brief True if the pattern has matched, assuming the next byte is a line end.
+	 */
+	bool acceptAtLineEnd = false;
+
+	/**
+	 * @brief The state reached by each byte, or -1 if it has not been built yet.
+	 */
+	std::array<int, 256> next;
+};
+
+/**
+ * @brief The most DFA states that are kept at once.
+ * Once there are more than this, the DFA is thrown away and rebuilt from scratch, which keeps memory bounded for patterns whose DFA would be huge.
+ */
+static const size_t maxDfaStates = 4096;
+
+/**
+ * @brief A DFA that is built as it is used.
+ */
+struct LazyDfa{
+	/**
+	 * @brief The NFA this DFA is built from.
+	 */
+	const std::vector<NfaState>* nfa = nullptr;
+
+	/**
+	 * @brief The NFA's start state.
+	 */
+	int nfaStart = 0;
+
+	/**
+	 * @brief True if the NFA's start state is added after every byte, so a match can begin anywhere.
+	 */
+	bool unanchored = false;
+
+	/**
+	 * @brief The states built so far.
+	 */
+	std::vector<DfaState> states;
+
+	/**
+	 * @brief Maps a kernel and line start flag to its state's index.
+	 */
+	std::map<std::pair<std::vector<int>, bool>, int> index;
+
+	/**
+	 * @brief Follows epsilon transitions from a set of NFA states.
+	 *
+	 * @param kernel The states to start from.
+	 * @param lineStart True if ^ can be passed.
+	 * @param lineEnd True if $ can be passed.
+	 * @param out Receives the CHARS and MATCH states that were reached.
+	 */
+	void closure(const std::vector<int>& kernel, bool lineStart, bool lineEnd, std::vector<int>& out) const{
+		std::vector<bool> seen(nfa->size());
+		std::vector<int> stack(kernel.rbegin(), kernel.rend());
+
+		out.clear();
+		while (!stack.empty()){
+			int s = stack.back();
+			stack.pop_back();
+			if (s < 0 || seen[s]){
+				continue;
+			}
+			seen[s] = true;
+
+			const NfaState& st = (*nfa)[s];
+			switch (st.type){
+			case NfaState::SPLIT:
+				stack.push_back(st.out1);
+				stack.push_back(st.out);
+				break;
+			case NfaState::LINE_START:
+				if (lineStart){
+					stack.push_back(st.out);
+				}
+				break;
+			case NfaState::LINE_END:
+				if (lineEnd){
+					stack.push_back(st.out);
+				}
+				break;
+			default:
+				out.push_back(s);
+			}
+		}
+	}
+
+	/**
+	 * @brief Returns true if a set of states contains the match state.
+	 */
+	bool containsMatch(const std::vector<int>& states) const{
+		for (int s : states){
+			if ((*nfa)[s].type == NfaState::MATCH){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Returns the index of the state with the given kernel, building it if needed.
+	 */
+	int getState(std::vector<int> kernel, bool lineStart){
+		std::vector<int> reached;
+
+		if (unanchored){
+			kernel.push_back(nfaStart);
+		}
+		std::sort(kernel.begin(), kernel.end());
+		kernel.erase(std::unique(kernel.begin(), kernel.end()), kernel.end());
+
+		auto key = std::make_pair(kernel, lineStart);
+		auto it = index.find(key);
+		if (it != index.end()){
+			return it->second;
+		}
+
+		DfaState st;
+		st.kernel = kernel;
+		st.lineStart = lineStart;
+		st.next.fill(-1);
+		closure(kernel, lineStart, false, reached);
+		st.accept = containsMatch(reached);
+		closure(kernel, lineStart, true, reached);
+		st.acceptAtLineEnd = containsMatch(reached);
+
+		states.push_back(std::move(st));
+		index.emplace(std::move(key), states.size() - 1);
+		return states.size() - 1;
+	}
+
+	/**
+	 * @brief Returns the state reached from another state by consuming one byte, building it if needed.
+	 */
+	int step(int from, unsigned char c){
+		std::vector<int> reached;
+		std::vector<int> kernel;
+		int to = states[from].next[c];
+
+		if (to >= 0){
+			return to;
+		}
+
+		// the DFA got too big. start over from this state alone.
+		if (states.size() >= maxDfaStates){
+			DfaState keep = states[from];
+			states.clear();
+			index.clear();
+			from = getState(keep.kernel, keep.lineStart);
+		}
+
+		closure(states[from].kernel, states[from].lineStart, c == '\n', reached);
+		for (int s : reached){
+			const NfaState& st = (*nfa)[s];
+			if (st.type == NfaState::CHARS && st.chars.test(c)){
+				kernel.push_back(st.out);
+			}
+		}
+		to = getState(kernel, c == '\n');
+		states[from].next[c] = to;
+		return to;
+	}
+
+	/**
+	 * @brief Returns the index of the start state.
+	 * This is not always 0, since the states are renumbered when the DFA is thrown away.
+	 */
+	int startState(){
+		return getState({nfaStart}, true);
+	}
+
+	/**
+	 * @brief Runs the DFA over some text.
+	 *
+	 * @param text The text.
+	 * @param stopOnAccept True to return as soon as the pattern matches, for searching.
+	 *
+	 * @return True if the pattern matched.
+	 */
+	bool run(std::string_view text, bool stopOnAccept){
+		int cur = startState();
+
+		if (stopOnAccept){
+			return feed(cur, text) || states[cur].acceptAtLineEnd;
+		}
+
+		for (unsigned char c : text){
+			cur = step(cur, c);
+		}
+		// the end of the text is also the end of a line
+		return states[cur].acceptAtLineEnd;
+	}
+
+	/**
+	 * @brief Continues a search with more text.
+	 *
+	 * @param cur The state the search is in. This is updated to the state after the text.
+	 * @param text The text.
+	 *
+	 * @return True if the pattern matched. The end of the text does not count as the end of a line, since more text may follow.
+	 */
+	bool feed(int& cur, std::string_view text){
+		for (unsigned char c : text){
+			if (c == '\n' ? states[cur].acceptAtLineEnd : states[cur].accept){
+				return true;
+			}
+			cur = step(cur, c);
+		}
+		return states[cur].accept;
+	}
+};
+
+/**
+ * @brief The private implementation of the Regex class.
+ */
+struct RegexImpl{
+	/**
+	 * @brief The pattern.
+	 */
+	std::string pattern;
+
+	/**
+	 * @brief The compiled NFA.
+	 */
+	std::vector<NfaState> nfa;
+
+	/**
+	 * @brief The NFA's start state.
+	 */
+	int start = 0;
+
+	/**
+	 * @brief The DFA used by Regex::search().
+	 * It is mutable since it is built while searching, which is const.
+	 */
+	mutable LazyDfa searchDfa;
+
+	/**
+	 * @brief The DFA used by Regex::match().
+	 * It is mutable since it is built while matching, which is const.
+	 */
+	mutable LazyDfa matchDfa;
+
+	/**
+	 * @brief The DFA used by Regex::feed().
+	 */
+	LazyDfa feedDfa;
+
+	/**
+	 * @brief The state of the search Regex::feed() is doing, or -1 if it has not started.
+	 */
+	int feedState = -1;
+
+	/**
+	 * @brief True if Regex::feed() has matched since the last Regex::resetFeed().
+	 */
+	bool feedMatched = false;
+
+	/**
+	 * @brief The dangling transitions of a partially built NFA fragment, as (state, which out) pairs.
+	 */
+	typedef std::vector<std::pair<int, int>> OutList;
+
+	/**
+	 * @brief Points all of a fragment's dangling transitions at a state.
+	 */
+	void patch(const OutList& outs, int target){
+		for (const auto& o : outs){
+			(o.second == 0 ? nfa[o.first].out : nfa[o.first].out1) = target;
+		}
+	}
+
+	/**
+	 * @brief Adds a state to the NFA.
+	 */
+	int addState(NfaState::Type type){
+		NfaState st;
+		st.type = type;
+		nfa.push_back(st);
+		return nfa.size() - 1;
+	}
+
+	/**
+	 * @brief Compiles a parsed node into NFA states using Thompson's construction.
+	 *
+	 * @param node The node to compile.
+	 * @param outs Receives the fragment's dangling transitions.
+	 *
+	 * @return The fragment's start state.
+	 */
+	int compile(const RegexNode& node, OutList& outs){
+		int s;
+		OutList childOuts;
+
+		switch (node.type){
+		case RegexNode::EMPTY:
+			// a split with both ends patched to the same place is an epsilon transition
+			s = addState(NfaState::SPLIT);
+			outs = {{s, 0}, {s, 1}};
+			return s;
+
+		case RegexNode::CHARS:
+			s = addState(NfaState::CHARS);
+			nfa[s].chars = node.chars;
+			outs = {{s, 0}};
+			return s;
+
+		case RegexNode::LINE_START:
+		case RegexNode::LINE_END:
+			s = addState(node.type == RegexNode::LINE_START ? NfaState::LINE_START : NfaState::LINE_END);
+			outs = {{s, 0}};
+			return s;
+
+		case RegexNode::CONCAT:
+			s = compile(node.children[0], outs);
+			for (size_t i = 1; i < node.children.size(); ++i){
+				int next = compile(node.children[i], childOuts);
+				patch(outs, next);
+				outs = childOuts;
+			}
+			return s;
+
+		case RegexNode::ALTERNATE:{
+			int first = compile(node.children[0], outs);
+			for (size_t i = 1; i < node.children.size(); ++i){
+				int second = compile(node.children[i], childOuts);
+				s = addState(NfaState::SPLIT);
+				nfa[s].out = first;
+				nfa[s].out1 = second;
+				outs.insert(outs.end(), childOuts.begin(), childOuts.end());
+				first = s;
+			}
+			return first;
+		}
+
+		case RegexNode::REPEAT:
+			return compileRepeat(node, outs);
+		}
+		return -1;
+	}
+
+	/**
+	 * @brief Compiles a REPEAT node by making a copy of its child for each repetition.
+	 */
+	int compileRepeat(const RegexNode& node, OutList& outs){
+		const RegexNode& child = node.children[0];
+		OutList childOuts;
+		int start = -1;
+		int s;
+
+		// the mandatory copies, one after another
+		for (int i = 0; i < node.min; ++i){
+			s = compile(child, childOuts);
+			if (start < 0){
+				start = s;
+			}
+			else{
+				patch(outs, s);
+			}
+			outs = childOuts;
+		}
+
+		if (node.max == -1){
+			// x* is a split that either enters x (which loops back) or leaves
+			int loop = addState(NfaState::SPLIT);
+			int body = compile(child, childOuts);
+			nfa[loop].out = body;
+			patch(childOuts, loop);
+			if (start < 0){
+				start = loop;
+			}
+			else{
+				patch(outs, loop);
+			}
+			outs = {{loop, 1}};
+			return start;
+		}
+
+		// the optional copies, each one guarded by a split that can skip the rest
+		OutList skips;
+		for (int i = node.min; i < node.max; ++i){
+			int opt = addState(NfaState::SPLIT);
+			int body = compile(child, childOuts);
+			nfa[opt].out = body;
+			skips.push_back({opt, 1});
+			if (start < 0){
+				start = opt;
+			}
+			else{
+				patch(outs, opt);
+			}
+			outs = childOuts;
+		}
+		outs.insert(outs.end(), skips.begin(), skips.end());
+
+		// x{0} matches the empty string
+		if (start < 0){
+			start = addState(NfaState::SPLIT);
+			outs = {{start, 0}, {start, 1}};
+		}
+		return start;
+	}
+};
+
+Regex::Regex(const char* pattern): impl(std::make_unique<RegexImpl>()){
+	RegexImpl::OutList outs;
+	RegexNode root;
+	int match;
+
+	impl->pattern = pattern;
+	root = RegexParser(impl->pattern).parse();
+
+	impl->start = impl->compile(root, outs);
+	match = impl->addState(NfaState::MATCH);
+	impl->patch(outs, match);
+
+	for (LazyDfa* dfa : {&impl->searchDfa, &impl->matchDfa, &impl->feedDfa}){
+		dfa->nfa = &impl->nfa;
+		dfa->nfaStart = impl->start;
+	}
+	impl->searchDfa.unanchored = true;
+	impl->feedDfa.unanchored = true;
+}
+
+Regex::Regex(Regex&& other){
+	impl = std::move(other.impl);
+}
+
+Regex& Regex::operator=(Regex&& other){
+	impl = std::move(other.impl);
+	return *this;
+}
+
+Regex::~Regex() = default;
+
+bool Regex::search(std::string_view text) const{
+	return impl->searchDfa.run(text, true);
+}
+
+bool Regex::match(std::string_view text) const{
+	return impl->matchDfa.run(text, false);
+}
+
+bool Regex::feed(std::string_view text){
+	if (impl->feedMatched){
+		return true;
+	}
+	if (impl->feedState < 0){
+		impl->feedState = impl->feedDfa.startState();
+	}
+	impl->feedMatched = impl->feedDfa.feed(impl->feedState, text);
+	return impl->feedMatched;
+}
+
+void Regex::resetFeed(){
+	impl->feedState = -1;
+	impl->feedMatched = false;
+}
+
+const std::string& Regex::getPattern() const{
+	return impl->pattern;
+}
+
+size_t Regex::getStateCount() const{
+	return impl->searchDfa.states.size() + impl->matchDfa.states.size() + impl->feedDfa.states.size();
+}
+
+}
@@ -0,0 +1,141 @@
+/** @file simpletest_regex.hpp
+ * @brief simpletest regular expressions.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_REGEX_HPP
+#define __SIMPLETEST_REGEX_HPP
+
+#include "attribute.hpp"
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace simpletest{
+
+struct RegexImpl;
+
+/**
+ * @brief A compiled regular expression.
+ * The pattern is compiled into an NFA once, and the NFA is turned into a DFA lazily as text is matched, so the states only get built for the input that is actually seen.
+ * The DFA is kept between calls, so matching runs in linear time and gets faster with every call.
+ *
+ * The following syntax is supported:<br>
+ * <pre>
+ * abc       Literal characters
+ * .         Any character except '\n'
+ * [a-z] [^0-9]  Character classes
+ * \\d \\w \\s   Digits, word characters and whitespace (\\D \\W \\S for the opposite)
+ * \\n \\t \\.   Escaped characters
+ * x* x+ x?  Zero or more, one or more, zero or one
+ * x{m} x{m,} x{m,n}  Repetition
+ * a|b       Alternation
+ * (x) (?:x) Grouping
+ * ^ $       The start and end of a line
+ * </pre>
+ * <br>
+ * Backreferences and lookaround are not supported, since they cannot be matched in linear time.
+ *
+ * A Regex is not thread-safe, even through a const reference, because matching updates the DFA.
+ */
+class Regex{
+public:
+	/**
+	 * @brief Compiles a regular expression.
+	 *
+	 * @param pattern The pattern to compile.
+	 *
+	 * @exception std::invalid_argument The pattern is not valid. See e.what() for details.
+	 */
+	Regex(const char* pattern);
+
+	/**
+	 * @brief Move constructor for Regex.
+	 */
+	Regex(Regex&& other);
+
+	/**
+	 * @brief Move assignment operator for Regex.
+	 */
+	Regex& operator=(Regex&& other);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 * Compile the pattern again instead, or share the Regex by reference.
+	 */
+	Regex(const Regex& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 * Compile the pattern again instead, or share the Regex by reference.
+	 */
+	Regex& operator=(const Regex& other) = delete;
+
+	/**
+	 * @brief Destructor for Regex.
+	 */
+	~Regex();
+
+	/**
+	 * @brief Returns true if the pattern matches anywhere in the text.
+	 * This is const, but it builds DFA states as it goes, so it must not be called on the same Regex from more than one thread at once.
+	 *
+	 * @param text The text to search.
+	 */
+	bool search(std::string_view text) const;
+
+	/**
+	 * @brief Returns true if the pattern matches the entire text.
+	 * This is const, but it builds DFA states as it goes, so it must not be called on the same Regex from more than one thread at once.
+	 *
+	 * @param text The text to match.
+	 */
+	bool match(std::string_view text) const;
+
+	/**
+	 * @brief Searches text that arrives in pieces, without looking at any piece twice.
+	 * Call resetFeed() to start a new search.
+	 *
+	 * @param text The next piece of text.
+	 *
+	 * @return True if the pattern has matched anywhere in the text fed since the last resetFeed().
+	 * Since more text may follow, $ only matches before a '\n' here.
+	 */
+	bool feed(std::string_view text);
+
+	/**
+	 * @brief Starts a new search for feed().
+	 * The DFA states built so far are kept.
+	 */
+	void resetFeed();
+
+	/**
+	 * @brief Returns the pattern this Regex was compiled from.
+	 */
+	const std::string& getPattern() const;
+
+	/**
+	 * @brief Returns the number of DFA states built so far.
+	 * This is mostly useful for checking that the DFA is being reused.
+	 */
+	size_t getStateCount() const;
+
+private:
+	std::unique_ptr<RegexImpl> impl;
+};
+
+/**
+ * @brief Do not use this macro directly.
+ * Evaluates to a Regex that is compiled the first time this line runs and reused afterwards.
+ *
+ * @param pattern A string literal containing the pattern.
+ */
+#define __STATIC_REGEX(pattern)\
+	([]() -> simpletest::Regex& { static simpletest::Regex __re(pattern); return __re; }())
+
+}
+
+#endif
@@ -0,0 +1,502 @@
+/** @file simpletest_ring.cpp
+ * @brief simpletest shared-memory result channel between test workers and the runner.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_ring.hpp"
+
+// std::atomic
+#include <atomic>
+// std::runtime_error
+#include <stdexcept>
+// std::string
+#include <string>
+// std::this_thread::yield()
+#include <thread>
+// std::strerror, std::memcpy
+#include <cstring>
+// memfd_create(), mmap()
+#include <sys/mman.h>
+// fstat()
+#include <sys/stat.h>
+// ftruncate(), write(), close()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief Identifies shared memory laid out as a ResultRing.
+ */
+static const uint64_t ringMagic = 0x676e6972747372ULL;
+
+/**
+ * @brief The kinds of records in the ring.
+ */
+enum RecordType : uint32_t{
+	/**
+	 * @brief A test started. time is when, in steady_clock nanoseconds.
+	 */
+	RECORD_START = 1,
+
+	/**
+	 * @brief len bytes of variable-length data for the next FINISH record were appended to the arena.
+	 */
+	RECORD_DATA,
+
+	/**
+	 * @brief A test finished. time is its duration, len is the length of its reason, and benchLen is the length of its encoded benchmarks, both sent in DATA records beforehand.
+	 */
+	RECORD_FINISH
+};
+
+/**
+ * @brief A fixed-size record in the ring. It is one cache line long.
+ */
+struct RingRecord{
+	/**
+	 * @brief The kind of record.
+	 */
+	uint32_t type;
+
+	/**
+	 * @brief The test's TestResult::Status, for FINISH records.
+	 */
+	uint32_t status;
+
+	/**
+	 * @brief Identifies the test.
+	 */
+	uint64_t slot;
+
+	/**
+	 * @brief A time in nanoseconds, whose meaning depends on the type.
+	 */
+	int64_t time;
+
+	/**
+	 * @brief A length in bytes, whose meaning depends on the type.
+	 */
+	uint64_t len;
+
+	/**
+	 * @brief The length of the encoded benchmarks, for FINISH records.
+	 */
+	uint64_t benchLen;
+
+	/**
+	 * @brief Pads the record to 64 bytes.
+	 */
+	uint64_t pad[3];
+};
+
+static_assert(sizeof(RingRecord) == 64, "RingRecord should be one cache line");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ResultRing needs lock-free 64-bit atomics to work across processes");
+
+/**
+ * @brief The start of the shared memory. The records follow it, then the arena.
+ * Each counter only ever grows, and is reduced modulo the ring or arena size when indexing.
+ */
+struct RingShared{
+	/**
+	 * @brief Always ringMagic.
+	 */
+	uint64_t magic;
+
+	/**
+	 * @brief The number of records, a power of two.
+	 */
+	uint64_t records;
+
+	/**
+	 * @brief The size of the arena in bytes, a power of two.
+	 */
+	uint64_t arenaSize;
+
+	/**
+	 * @brief The number of records written. Only the producer writes this.
+	 */
+	alignas(64) std::atomic<uint64_t> head;
+
+	/**
+	 * @brief The number of arena bytes written. Only the producer writes this.
+	 */
+	std::atomic<uint64_t> arenaHead;
+
+	/**
+	 * @brief The number of records read. Only the consumer writes this.
+	 */
+	alignas(64) std::atomic<uint64_t> tail;
+
+	/**
+	 * @brief The number of arena bytes read. Only the consumer writes this.
+	 */
+	std::atomic<uint64_t> arenaTail;
+
+	/**
+	 * @brief 1 while the consumer is waiting on the doorbell.
+	 */
+	alignas(64) std::atomic<uint32_t> waiting;
+};
+
+/**
+ * @brief Rounds a number up to a power of two.
+ */
+static size_t roundUpPow2(size_t n){
+	size_t ret = 1;
+	while (ret < n){
+		ret <<= 1;
+	}
+	return ret;
+}
+
+/**
+ * @brief The private implementation of the ResultRing class.
+ */
+struct ResultRingImpl{
+	/**
+	 * @brief The shared memory's file descriptor.
+	 */
+	int fd = -1;
+
+	/**
+	 * @brief True if this object created the shared memory and should close fd.
+	 */
+	bool owner = false;
+
+	/**
+	 * @brief The mapping.
+	 */
+	void* mem = nullptr;
+
+	/**
+	 * @brief The mapping's length.
+	 */
+	size_t memLen = 0;
+
+	/**
+	 * @brief The header at the start of the mapping.
+	 */
+	RingShared* shared = nullptr;
+
+	/**
+	 * @brief The records, right after the header.
+	 */
+	RingRecord* records = nullptr;
+
+	/**
+	 * @brief The arena, right after the records.
+	 */
+	char* arena = nullptr;
+
+	/**
+	 * @brief The producer's doorbell, or -1 for none.
+	 */
+	int doorbell = -1;
+
+	/**
+	 * @brief Consumer: the variable-length data received for the next FINISH record.
+	 */
+	std::string pending;
+
+	/**
+	 * @brief Consumer: true if a START record was read without a FINISH after it.
+	 */
+	bool isRunning = false;
+
+	/**
+	 * @brief Consumer: the slot of the running test.
+	 */
+	uint64_t runningSlot = 0;
+
+	/**
+	 * @brief Consumer: when the running test started, in steady_clock nanoseconds.
+	 */
+	int64_t runningSince = 0;
+
+	/**
+	 * @brief Maps the shared memory and finds its parts.
+	 *
+	 * @exception std::runtime_error Failed to map the memory, or it is not a ResultRing.
+	 */
+	void map(){
+		mem = mmap(nullptr, memLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mem == MAP_FAILED){
+			mem = nullptr;
+			throw std::runtime_error("Failed to map result ring (" + std::string(std::strerror(errno)) + ")");
+		}
+		shared = (RingShared*)mem;
+		records = (RingRecord*)((char*)mem + sizeof(RingShared));
+	}
+
+	/**
+	 * @brief Producer: wakes the consumer if it is waiting.
+	 */
+	void notify(){
+		// pairs with the fence in prepareToWait(), so either the consumer sees the new record or we see that it is waiting
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (doorbell >= 0 && shared->waiting.load(std::memory_order_relaxed) && shared->waiting.exchange(0)){
+			ssize_t ss;
+			while ((ss = write(doorbell, "", 1)) < 0 && errno == EINTR);
+		}
+	}
+
+	/**
+	 * @brief Producer: appends a record, waiting for room if the ring is full.
+	 *
+	 * @param wake False to leave the consumer asleep, for records it can just as well read along with the next one.
+	 */
+	void push(const RingRecord& rec, bool wake = true){
+		uint64_t head = shared->head.load(std::memory_order_relaxed);
+
+		while (head - shared->tail.load(std::memory_order_acquire) >= shared->records){
+			notify();
+			std::this_thread::yield();
+		}
+		records[head & (shared->records - 1)] = rec;
+		shared->head.store(head + 1, std::memory_order_release);
+		if (wake){
+			notify();
+		}
+	}
+
+	/**
+	 * @brief Producer: sends variable-length data in DATA records, as many pieces as the arena needs.
+	 */
+	void pushData(const char* data, size_t len){
+		while (len > 0){
+			uint64_t head = shared->arenaHead.load(std::memory_order_relaxed);
+			size_t room = shared->arenaSize - (head - shared->arenaTail.load(std::memory_order_acquire));
+			size_t chunk = std::min(len, room);
+			size_t pos = head & (shared->arenaSize - 1);
+			size_t first = std::min(chunk, (size_t)shared->arenaSize - pos);
+			RingRecord rec = {};
+
+			if (chunk == 0){
+				notify();
+				std::this_thread::yield();
+				continue;
+			}
+			// the piece may wrap around the end of the arena
+			std::memcpy(arena + pos, data, first);
+			std::memcpy(arena, data + first, chunk - first);
+			shared->arenaHead.store(head + chunk, std::memory_order_relaxed);
+
+			rec.type = RECORD_DATA;
+			rec.len = chunk;
+			push(rec);
+			data += chunk;
+			len -= chunk;
+		}
+	}
+
+	/**
+	 * @brief Consumer: copies a DATA record's bytes out of the arena and frees them.
+	 */
+	void takeData(size_t len){
+		uint64_t tail = shared->arenaTail.load(std::memory_order_relaxed);
+		size_t pos = tail & (shared->arenaSize - 1);
+		size_t first = std::min(len, (size_t)shared->arenaSize - pos);
+
+		pending.append(arena + pos, first);
+		pending.append(arena, len - first);
+		shared->arenaTail.store(tail + len, std::memory_order_release);
+	}
+};
+
+/**
+ * @brief Returns the current steady_clock time in nanoseconds, which is the same clock in every process.
+ */
+static int64_t nowNs(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ResultRing::ResultRing(size_t records, size_t arenaSize): impl(std::make_unique<ResultRingImpl>()){
+	records = roundUpPow2(std::max<size_t>(records, 16));
+	arenaSize = roundUpPow2(std::max<size_t>(arenaSize, 4096));
+
+	impl->fd = memfd_create("simpletest-ring", MFD_CLOEXEC);
+	if (impl->fd < 0){
+		throw std::runtime_error("Failed to create result ring (" + std::string(std::strerror(errno)) + ")");
+	}
+	impl->owner = true;
+	impl->memLen = sizeof(RingShared) + records * sizeof(RingRecord) + arenaSize;
+	if (ftruncate(impl->fd, impl->memLen) != 0){
+		int err = errno;
+		close(impl->fd);
+		throw std::runtime_error("Failed to size result ring (" + std::string(std::strerror(err)) + ")");
+	}
+	try{
+		impl->map();
+	}
+	catch (...){
+		close(impl->fd);
+		throw;
+	}
+
+	// the memory starts zeroed, which is a valid state for the atomics
+	impl->shared->records = records;
+	impl->shared->arenaSize = arenaSize;
+	impl->shared->magic = ringMagic;
+	impl->arena = (char*)(impl->records + records);
+}
+
+ResultRing::ResultRing(int fd): impl(std::make_unique<ResultRingImpl>()){
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RingShared)){
+		throw std::runtime_error("File descriptor " + std::to_string(fd) + " is not a result ring");
+	}
+	impl->fd = fd;
+	impl->memLen = st.st_size;
+	impl->map();
+
+	if (impl->shared->magic != ringMagic || impl->memLen != sizeof(RingShared) + impl->shared->records * sizeof(RingRecord) + impl->shared->arenaSize){
+		munmap(impl->mem, impl->memLen);
+		impl->mem = nullptr;
+		throw std::runtime_error("File descriptor " + std::to_string(fd) + " is not a result ring");
+	}
+	impl->arena = (char*)(impl->records + impl->shared->records);
+}
+
+ResultRing::ResultRing(ResultRing&& other){
+	impl = std::move(other.impl);
+}
+
+ResultRing& ResultRing::operator=(ResultRing&& other){
+	impl = std::move(other.impl);
+	return *this;
+}
+
+ResultRing::~ResultRing(){
+	if (!impl){
+		return;
+	}
+	if (impl->mem){
+		munmap(impl->mem, impl->memLen);
+	}
+	if (impl->owner){
+		close(impl->fd);
+	}
+}
+
+int ResultRing::getFd() const{
+	return impl->fd;
+}
+
+void ResultRing::setDoorbell(int fd){
+	impl->doorbell = fd;
+}
+
+void ResultRing::testStarted(uint64_t slot){
+	RingRecord rec = {};
+
+	rec.type = RECORD_START;
+	rec.slot = slot;
+	rec.time = nowNs();
+	// waking the runner for this would cost a context switch per test, and it only needs to know once the test ends or the worker dies
+	impl->push(rec, false);
+}
+
+void ResultRing::testFinished(uint64_t slot, const TestResult& res){
+	RingRecord rec = {};
+	std::string bench;
+
+	// benchmarks and leaks are rare, so they reuse the general encoding instead of getting records of their own
+	if (!res.benchmarks.empty() || !res.leaks.empty()){
+		TestResult onlyBench;
+		onlyBench.benchmarks = res.benchmarks;
+		onlyBench.leaks = res.leaks;
+		bench = encodeResult(slot, onlyBench);
+	}
+	impl->pushData(res.reason.data(), res.reason.size());
+	impl->pushData(bench.data(), bench.size());
+
+	rec.type = RECORD_FINISH;
+	rec.status = res.status;
+	rec.slot = slot;
+	rec.time = res.duration.count();
+	rec.len = res.reason.size();
+	rec.benchLen = bench.size();
+	impl->push(rec);
+}
+
+bool ResultRing::next(uint64_t& slot, TestResult& res){
+	RingShared* shared = impl->shared;
+	uint64_t tail = shared->tail.load(std::memory_order_relaxed);
+	uint64_t head = shared->head.load(std::memory_order_acquire);
+
+	for (; tail < head; ++tail){
+		const RingRecord& rec = impl->records[tail & (shared->records - 1)];
+
+		if (rec.type == RECORD_START){
+			impl->isRunning = true;
+			impl->runningSlot = rec.slot;
+			impl->runningSince = rec.time;
+		}
+		else if (rec.type == RECORD_DATA){
+			impl->takeData(rec.len);
+		}
+		else if (rec.type == RECORD_FINISH){
+			uint64_t benchSlot;
+			TestResult bench;
+			std::string benchData = impl->pending.substr(rec.len, rec.benchLen);
+
+			slot = rec.slot;
+			res = TestResult();
+			res.status = (TestResult::Status)rec.status;
+			res.duration = std::chrono::nanoseconds(rec.time);
+			res.reason = impl->pending.substr(0, rec.len);
+			if (!benchData.empty() && decodeResult(benchData, benchSlot, bench)){
+				res.benchmarks = std::move(bench.benchmarks);
+				res.leaks = std::move(bench.leaks);
+			}
+			impl->pending.clear();
+			impl->isRunning = false;
+
+			shared->tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+		shared->tail.store(tail + 1, std::memory_order_release);
+	}
+	return false;
+}
+
+bool ResultRing::running(uint64_t& slot, std::chrono::nanoseconds& elapsed) const{
+	if (!impl->isRunning){
+		return false;
+	}
+	slot = impl->runningSlot;
+	elapsed = std::chrono::nanoseconds(nowNs() - impl->runningSince);
+	return true;
+}
+
+bool ResultRing::prepareToWait(){
+	RingShared* shared = impl->shared;
+
+	shared->waiting.store(1);
+	// pairs with the fence in notify()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (shared->head.load(std::memory_order_acquire) != shared->tail.load(std::memory_order_relaxed)){
+		shared->waiting.store(0);
+		return false;
+	}
+	return true;
+}
+
+void ResultRing::reset(){
+	RingShared* shared = impl->shared;
+
+	shared->head.store(0);
+	shared->arenaHead.store(0);
+	shared->tail.store(0);
+	shared->arenaTail.store(0);
+	shared->waiting.store(0);
+	impl->doorbell = -1;
+	impl->pending.clear();
+	impl->isRunning = false;
+}
+
+}
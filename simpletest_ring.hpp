@@ -0,0 +1,146 @@
+/** @file simpletest_ring.hpp
+ * @brief simpletest shared-memory result channel between test workers and the runner.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_RING_HPP
+#define __SIMPLETEST_RING_HPP
+
+#include "simpletest_runner.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace simpletest{
+
+struct ResultRingImpl;
+
+/**
+ * @brief A single-producer single-consumer channel in shared memory, which a worker process uses to report test starts and results to the runner.
+ *
+ * The channel is a ring of fixed-size records plus an arena for variable-length data such as failure reasons and benchmarks.
+ * Reporting a result copies it into shared memory with no system call, unless the runner is asleep waiting for results, in which case one byte is written to a doorbell file descriptor to wake it.
+ *
+ * Records stay readable after the worker dies, so the runner still receives everything the worker reported, and knows which test it was running and for how long.
+ *
+ * The memory is a memfd, so it can be shared with a forked child or passed to another program by file descriptor.
+ */
+class ResultRing{
+public:
+	/**
+	 * @brief Creates a new channel.
+	 *
+	 * @param records The number of records the ring holds. Rounded up to a power of two.
+	 * @param arenaSize The size of the arena for variable-length data in bytes. Rounded up to a power of two.
+	 * Longer data is sent in pieces, so this only limits how much can be in flight at once.
+	 *
+	 * @exception std::runtime_error Failed to create or map the shared memory.
+	 */
+	ResultRing(size_t records = 1024, size_t arenaSize = 1 << 20);
+
+	/**
+	 * @brief Attaches to a channel created by another process.
+	 *
+	 * @param fd The channel's getFd(), as received from the other process. It is not closed by this object.
+	 *
+	 * @exception std::runtime_error The file descriptor is not a channel, or could not be mapped.
+	 */
+	explicit ResultRing(int fd);
+
+	/**
+	 * @brief Move constructor for ResultRing.
+	 */
+	ResultRing(ResultRing&& other);
+
+	/**
+	 * @brief Move assignment operator for ResultRing.
+	 */
+	ResultRing& operator=(ResultRing&& other);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	ResultRing(const ResultRing& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	ResultRing& operator=(const ResultRing& other) = delete;
+
+	/**
+	 * @brief Unmaps the channel, and closes its file descriptor if this object created it.
+	 */
+	~ResultRing();
+
+	/**
+	 * @brief Returns the file descriptor of the shared memory, for passing to another process.
+	 */
+	int getFd() const;
+
+	/**
+	 * @brief Sets the file descriptor the producer writes a byte to when the consumer is waiting for records.
+	 *
+	 * @param fd The write end of a pipe or socket the consumer polls.
+	 */
+	void setDoorbell(int fd);
+
+	/**
+	 * @brief Producer: reports that a test started.
+	 *
+	 * @param slot Identifies the test, for example its position in the list of tests to run.
+	 */
+	void testStarted(uint64_t slot);
+
+	/**
+	 * @brief Producer: reports a test's result.
+	 * This waits if the consumer has fallen too far behind.
+	 *
+	 * @param slot Identifies the test.
+	 * @param res The result.
+	 */
+	void testFinished(uint64_t slot, const TestResult& res);
+
+	/**
+	 * @brief Consumer: reads the next result, handling any other records before it.
+	 *
+	 * @param slot Set to the identifier of the test that finished.
+	 * @param res Set to its result. Its index is not filled in.
+	 *
+	 * @return False if no complete result is waiting.
+	 */
+	bool next(uint64_t& slot, TestResult& res);
+
+	/**
+	 * @brief Consumer: returns the test that has started but not finished, as far as the records read so far tell.
+	 *
+	 * @param slot Set to the test's identifier.
+	 * @param elapsed Set to how long ago it started.
+	 *
+	 * @return False if no test is running.
+	 */
+	bool running(uint64_t& slot, std::chrono::nanoseconds& elapsed) const;
+
+	/**
+	 * @brief Consumer: announces that the consumer is about to wait on the doorbell.
+	 * Call this for every channel before polling the doorbells, and poll only if all of them returned true.
+	 *
+	 * @return False if records arrived in the meantime, in which case the consumer must not wait.
+	 */
+	bool prepareToWait();
+
+	/**
+	 * @brief Consumer: empties the channel so a new producer can use it, which is much cheaper than creating another.
+	 * Only call this once the previous producer is gone, for example after its process was reaped.
+	 */
+	void reset();
+
+private:
+	std::unique_ptr<ResultRingImpl> impl;
+};
+
+}
+
+#endif
@@ -0,0 +1,970 @@
+/** @file simpletest_runner.cpp
+ * @brief simpletest multi-process test runner.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_runner.hpp"
+// ResultRing
+#include "simpletest_ring.hpp"
+
+// std::count_if, std::find_if, std::none_of, std::max
+#include <algorithm>
+// std::deque
+#include <deque>
+// std::map
+#include <map>
+// std::optional
+#include <optional>
+// std::unique_ptr
+#include <memory>
+// std::cout
+#include <iostream>
+// std::runtime_error
+#include <stdexcept>
+// uint64_t
+#include <cstdint>
+// std::strerror, strsignal()
+#include <cstring>
+// signal(), SIGPIPE, SIGCHLD
+#include <csignal>
+// CLONE_PARENT
+#include <sched.h>
+// pipe2()
+#include <fcntl.h>
+// poll()
+#include <poll.h>
+// fstat()
+#include <sys/stat.h>
+// SYS_clone
+#include <sys/syscall.h>
+// socketpair(), sendmsg(), recvmsg(), SCM_RIGHTS
+#include <sys/socket.h>
+// waitpid()
+#include <sys/wait.h>
+// fork(), syscall(), read(), write(), close(), _exit()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief A child process that runs tests.
+ */
+struct Worker{
+	/**
+	 * @brief The child's process id, or 0 while the zygote has not said it yet.
+	 */
+	pid_t pid = 0;
+
+	/**
+	 * @brief The number of the request the zygote forks the child for, with --zygote.
+	 */
+	uint64_t request = 0;
+
+	/**
+	 * @brief The pipe test indexes are sent to the child over.
+	 */
+	int cmdFd;
+
+	/**
+	 * @brief The pipe the child rings when the runner is waiting for results. It reaches end of file when the child exits.
+	 */
+	int resFd;
+
+	/**
+	 * @brief The shared memory the child reports test starts and results on.
+	 */
+	std::optional<ResultRing> ring;
+
+	/**
+	 * @brief The cgroup of the test the child is running, if tests run in cgroups.
+	 */
+	std::unique_ptr<TestCgroup> group;
+
+	/**
+	 * @brief What the test the child is running has reserved of the machine.
+	 */
+	Allocation alloc;
+
+	/**
+	 * @brief True while alloc is reserved.
+	 */
+	bool reserved = false;
+
+	/**
+	 * @brief The number of tests sent to the child so far.
+	 */
+	size_t sent = 0;
+
+	/**
+	 * @brief True while the child is running a test.
+	 */
+	bool busy = false;
+
+	/**
+	 * @brief The position in the list of tests to run of the test the child is running.
+	 */
+	size_t current = 0;
+};
+
+/**
+ * @brief Writes a whole buffer, retrying after partial writes and interruptions.
+ *
+ * @return False if the other end is gone.
+ */
+static bool writeAll(int fd, const void* data, size_t len){
+	const char* ptr = (const char*)data;
+
+	while (len > 0){
+		ssize_t ss = write(fd, ptr, len);
+		if (ss < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		ptr += ss;
+		len -= ss;
+	}
+	return true;
+}
+
+/**
+ * @brief Reads exactly len bytes.
+ *
+ * @return False on end of file or error.
+ */
+static bool readAll(int fd, void* data, size_t len){
+	char* ptr = (char*)data;
+
+	while (len > 0){
+		ssize_t ss = read(fd, ptr, len);
+		if (ss < 0 && errno == EINTR){
+			continue;
+		}
+		if (ss <= 0){
+			return false;
+		}
+		ptr += ss;
+		len -= ss;
+	}
+	return true;
+}
+
+/**
+ * @brief Appends a value's bytes to a message.
+ */
+template <typename T>
+static void put(std::string& msg, T val){
+	msg.append((const char*)&val, sizeof(val));
+}
+
+/**
+ * @brief Appends a length-prefixed string to a message.
+ */
+static void putString(std::string& msg, const std::string& str){
+	put<uint32_t>(msg, str.size());
+	msg += str;
+}
+
+/**
+ * @brief Reads a value from a message, advancing pos past it.
+ */
+template <typename T>
+static T get(const std::string& msg, size_t& pos){
+	T val;
+	std::memcpy(&val, msg.data() + pos, sizeof(val));
+	pos += sizeof(val);
+	return val;
+}
+
+/**
+ * @brief Reads a length-prefixed string from a message, advancing pos past it.
+ */
+static std::string getString(const std::string& msg, size_t& pos){
+	uint32_t len = get<uint32_t>(msg, pos);
+	std::string ret = msg.substr(pos, len);
+	pos += len;
+	return ret;
+}
+
+// the format is: slot (8 bytes), payload length (8), then the status, duration, reason, benchmarks and leaks
+std::string encodeResult(uint64_t slot, const TestResult& res){
+	std::string payload;
+	std::string msg;
+
+	put<uint8_t>(payload, res.status);
+	put<int64_t>(payload, res.duration.count());
+	putString(payload, res.reason);
+	put<uint32_t>(payload, res.benchmarks.size());
+	for (const Benchmark& b : res.benchmarks){
+		putString(payload, b.name);
+		put<uint32_t>(payload, b.details.size());
+		for (const auto& d : b.details){
+			putString(payload, d.first);
+			putString(payload, d.second);
+		}
+		put<uint64_t>(payload, b.samples.size());
+		for (std::chrono::nanoseconds ns : b.samples){
+			put<int64_t>(payload, ns.count());
+		}
+	}
+	put<uint32_t>(payload, res.leaks.size());
+	for (const std::string& leak : res.leaks){
+		putString(payload, leak);
+	}
+
+	put<uint64_t>(msg, slot);
+	put<uint64_t>(msg, payload.size());
+	return msg + payload;
+}
+
+bool decodeResult(std::string& buf, uint64_t& slot, TestResult& res){
+	const size_t header = 2 * sizeof(uint64_t);
+	size_t pos = 0;
+	uint64_t len;
+	uint32_t nBench;
+	uint32_t nLeaks;
+
+	if (buf.size() < header){
+		return false;
+	}
+	slot = get<uint64_t>(buf, pos);
+	len = get<uint64_t>(buf, pos);
+	if (buf.size() < header + len){
+		return false;
+	}
+
+	res.status = (TestResult::Status)get<uint8_t>(buf, pos);
+	res.duration = std::chrono::nanoseconds(get<int64_t>(buf, pos));
+	res.reason = getString(buf, pos);
+	res.benchmarks.clear();
+	nBench = get<uint32_t>(buf, pos);
+	for (uint32_t i = 0; i < nBench; ++i){
+		Benchmark b;
+		uint32_t nDetails;
+		uint64_t nSamples;
+
+		b.name = getString(buf, pos);
+		nDetails = get<uint32_t>(buf, pos);
+		for (uint32_t j = 0; j < nDetails; ++j){
+			std::string key = getString(buf, pos);
+			b.details.push_back({key, getString(buf, pos)});
+		}
+		nSamples = get<uint64_t>(buf, pos);
+		for (uint64_t j = 0; j < nSamples; ++j){
+			b.samples.push_back(std::chrono::nanoseconds(get<int64_t>(buf, pos)));
+		}
+		res.benchmarks.push_back(std::move(b));
+	}
+	res.leaks.clear();
+	nLeaks = get<uint32_t>(buf, pos);
+	for (uint32_t i = 0; i < nLeaks; ++i){
+		res.leaks.push_back(getString(buf, pos));
+	}
+	buf.erase(0, header + len);
+	return true;
+}
+
+std::string describeCrash(int status, std::chrono::nanoseconds elapsed){
+	std::string ret;
+
+	if (WIFSIGNALED(status)){
+		ret = "Crashed: killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+	}
+	else{
+		ret = "Crashed: exited with status " + std::to_string(WEXITSTATUS(status)) + " before reporting a result";
+	}
+	if (elapsed.count() >= 0){
+		ret += " after " + formatDuration(elapsed);
+	}
+	return ret;
+}
+
+TestResult summarizeRuns(const std::vector<TestResult>& runs){
+	TestResult ret = runs.back();
+	const TestResult* firstFailure = nullptr;
+	std::chrono::nanoseconds total{0};
+
+	ret.runs = runs.size();
+	ret.failures = 0;
+	ret.benchmarks.clear();
+	for (const TestResult& r : runs){
+		total += r.duration;
+		if (ret.leaks.empty()){
+			ret.leaks = r.leaks;
+		}
+		if (r.status != TestResult::PASSED){
+			ret.failures++;
+			if (!firstFailure){
+				firstFailure = &r;
+			}
+		}
+		for (const Benchmark& b : r.benchmarks){
+			auto it = std::find_if(ret.benchmarks.begin(), ret.benchmarks.end(), [&b](const Benchmark& x){ return x.name == b.name; });
+			if (it == ret.benchmarks.end()){
+				ret.benchmarks.push_back(b);
+			}
+			else{
+				it->samples.insert(it->samples.end(), b.samples.begin(), b.samples.end());
+			}
+		}
+	}
+	ret.duration = total / runs.size();
+
+	if (!firstFailure){
+		ret.status = TestResult::PASSED;
+		ret.reason.clear();
+	}
+	else if (ret.failures == runs.size()){
+		ret.status = firstFailure->status;
+		ret.reason = firstFailure->reason;
+		if (runs.size() > 1){
+			ret.reason += " (failed all " + std::to_string(runs.size()) + " runs)";
+		}
+	}
+	else{
+		ret.status = TestResult::FLAKY;
+		ret.reason = "Flaky: failed " + std::to_string(ret.failures) + " of " + std::to_string(runs.size()) + " runs (" + (firstFailure->status == TestResult::FAILED ? "Failed: " : "") + firstFailure->reason + ")";
+	}
+	return ret;
+}
+
+int serveTests(int fd, size_t count, const std::function<TestResult(size_t)>& runOne, int ringFd){
+	std::unique_ptr<ResultRing> ring;
+	uint64_t index;
+
+	if (ringFd >= 0){
+		ring = std::make_unique<ResultRing>(ringFd);
+		ring->setDoorbell(fd);
+	}
+
+	while (readAll(fd, &index, sizeof(index))){
+		TestResult res;
+		std::string msg;
+
+		if (ring){
+			ring->testStarted(index);
+		}
+		if (index < count){
+			res = runOne(index);
+		}
+		else{
+			res.status = TestResult::ERROR;
+			res.reason = "Internal error: there is no test " + std::to_string(index + 1);
+		}
+
+		if (ring){
+			ring->testFinished(index, res);
+			continue;
+		}
+		msg = encodeResult(index, res);
+		if (!writeAll(fd, msg.data(), msg.size())){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief The loop a child runs: receive a slot, run its test, report the result on the ring.
+ * The child exits once it has run batch tests or the runner closes the command pipe.
+ */
+[[noreturn]] static void workerMain(int cmdFd, ResultRing& ring, size_t batch, const std::vector<size_t>& indexes, const std::function<TestResult(size_t)>& runOne){
+	for (size_t n = 0; n < batch; ++n){
+		uint64_t slot;
+
+		if (!readAll(cmdFd, &slot, sizeof(slot)) || slot >= indexes.size()){
+			break;
+		}
+		ring.testStarted(slot);
+		ring.testFinished(slot, runOne(indexes[slot]));
+	}
+	// skip static destructors and atexit handlers, which belong to the runner
+	_exit(0);
+}
+
+/**
+ * @brief Forks a new worker.
+ *
+ * @param workers The existing workers, whose pipes the child must not hold on to.
+ * @param spareRings The rings of workers that exited, which are reused before creating another.
+ */
+static Worker spawnWorker(const std::vector<Worker>& workers, std::vector<ResultRing>& spareRings, size_t batch, const std::vector<size_t>& indexes, const std::function<TestResult(size_t)>& runOne){
+	int cmd[2];
+	int res[2];
+	Worker w;
+
+	// set up before forking, so both sides share it. a new ring costs a memfd, a mapping and faulting in its pages, which is more than a short test takes.
+	if (!spareRings.empty()){
+		w.ring.emplace(std::move(spareRings.back()));
+		spareRings.pop_back();
+	}
+	else{
+		w.ring.emplace();
+	}
+	if (pipe2(cmd, O_CLOEXEC) != 0){
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+	if (pipe2(res, O_CLOEXEC) != 0){
+		close(cmd[0]);
+		close(cmd[1]);
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+
+	// anything still buffered would otherwise be printed by the child as well
+	std::cout.flush();
+	fflush(stdout);
+
+	w.pid = fork();
+	if (w.pid < 0){
+		int err = errno;
+		close(cmd[0]);
+		close(cmd[1]);
+		close(res[0]);
+		close(res[1]);
+		throw std::runtime_error("Failed to fork (" + std::string(std::strerror(err)) + ")");
+	}
+	if (w.pid == 0){
+		// otherwise the other workers never see their command pipes close
+		for (const Worker& other : workers){
+			close(other.cmdFd);
+			close(other.resFd);
+		}
+		close(cmd[1]);
+		close(res[0]);
+		signal(SIGPIPE, SIG_DFL);
+		// the runner sleeps on the read end of res until there are results
+		w.ring->setDoorbell(res[1]);
+		workerMain(cmd[0], *w.ring, batch, indexes, runOne);
+	}
+
+	close(cmd[0]);
+	close(res[1]);
+	w.cmdFd = cmd[1];
+	w.resFd = res[0];
+	return w;
+}
+
+/**
+ * @brief A process that forks the workers for --zygote, so the runner never forks itself.
+ * It is forked once at the start of the run. The runner does not wait for it to fork, so with a spare CPU the next worker is forked while tests run, and the runner takes no copy-on-write faults after each fork either.
+ * The workers it forks are children of the runner, which waits for them as usual.
+ */
+struct Zygote{
+	/**
+	 * @brief The zygote's process id, or -1 if there is none.
+	 */
+	pid_t pid = -1;
+
+	/**
+	 * @brief The runner's end of the socket to the zygote.
+	 */
+	int fd = -1;
+
+	/**
+	 * @brief The number of requests sent to the zygote so far.
+	 */
+	uint64_t requested = 0;
+
+	/**
+	 * @brief The number of requests the zygote answered so far. It answers them in order.
+	 */
+	uint64_t answered = 0;
+
+	/**
+	 * @brief The answers that were read but not yet claimed by their worker, by request.
+	 */
+	std::map<uint64_t, pid_t> answers;
+};
+
+/**
+ * @brief The loop the zygote runs: fork a worker for each request from the runner and send back its process id, or the negated errno if it could not be forked.
+ * A request carries the worker's end of its command pipe, its doorbell and its ring. The zygote exits once the runner closes the socket.
+ */
+[[noreturn]] static void zygoteMain(int fd, size_t batch, const std::vector<size_t>& indexes, const std::function<TestResult(size_t)>& runOne){
+	// the runner reuses its rings, so each is mapped once here and the workers inherit the mapping instead of making their own
+	std::map<ino_t, ResultRing> rings;
+
+	for (;;){
+		char byte;
+		int fds[3];
+		char control[CMSG_SPACE(sizeof(fds))];
+		struct iovec iov = {&byte, 1};
+		struct msghdr msg = {};
+		struct cmsghdr* cmsg;
+		ssize_t ss;
+		pid_t pid;
+		struct stat st;
+		ResultRing* ring;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ss = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (ss < 0 && errno == EINTR){
+			continue;
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (ss <= 0 || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))){
+			break;
+		}
+		std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+		if (fstat(fds[2], &st) != 0){
+			break;
+		}
+		if (rings.find(st.st_ino) == rings.end()){
+			try{
+				// the ring keeps the descriptor it was attached with
+				rings.emplace(st.st_ino, ResultRing(fds[2]));
+				fds[2] = -1;
+			}
+			catch (...){
+				break;
+			}
+		}
+		ring = &rings.at(st.st_ino);
+
+		// CLONE_PARENT makes the worker the runner's child instead of the zygote's. the zygote is single-threaded and holds no locks here, so fork()'s handlers are not needed.
+		pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, nullptr, nullptr, 0);
+		if (pid == 0){
+			close(fd);
+			signal(SIGPIPE, SIG_DFL);
+			// the runner sleeps on the read end of the doorbell until there are results
+			ring->setDoorbell(fds[1]);
+			workerMain(fds[0], *ring, batch, indexes, runOne);
+		}
+		if (pid < 0){
+			pid = -errno;
+		}
+		while (send(fd, &pid, sizeof(pid), MSG_NOSIGNAL) < 0 && errno == EINTR);
+		close(fds[0]);
+		close(fds[1]);
+		if (fds[2] >= 0){
+			close(fds[2]);
+		}
+	}
+	_exit(0);
+}
+
+/**
+ * @brief Forks the zygote.
+ *
+ * @exception std::runtime_error Failed to create its socket or fork it.
+ */
+static Zygote startZygote(size_t batch, const std::vector<size_t>& indexes, const std::function<TestResult(size_t)>& runOne){
+	int sv[2];
+	Zygote z;
+
+	// message boundaries keep each request together with its file descriptors
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0){
+		throw std::runtime_error("Failed to create socketpair (" + std::string(std::strerror(errno)) + ")");
+	}
+
+	// anything still buffered would otherwise be printed by the workers as well
+	std::cout.flush();
+	fflush(stdout);
+
+	z.pid = fork();
+	if (z.pid < 0){
+		int err = errno;
+		close(sv[0]);
+		close(sv[1]);
+		throw std::runtime_error("Failed to fork (" + std::string(std::strerror(err)) + ")");
+	}
+	if (z.pid == 0){
+		close(sv[0]);
+		zygoteMain(sv[1], batch, indexes, runOne);
+	}
+	close(sv[1]);
+	z.fd = sv[0];
+	return z;
+}
+
+/**
+ * @brief Asks the zygote to fork a new worker, without waiting for it. The worker's pid is 0 until zygotePid() is called for it.
+ *
+ * @param spareRings The rings of workers that exited, which are reused before creating another.
+ *
+ * @exception std::runtime_error Failed to create a pipe or reach the zygote.
+ */
+static Worker spawnFromZygote(Zygote& z, std::vector<ResultRing>& spareRings){
+	int cmd[2];
+	int res[2];
+	Worker w;
+	int fds[3];
+	char byte = 0;
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct iovec iov = {&byte, 1};
+	struct msghdr msg = {};
+	struct cmsghdr* cmsg;
+	ssize_t ss;
+
+	if (!spareRings.empty()){
+		w.ring.emplace(std::move(spareRings.back()));
+		spareRings.pop_back();
+	}
+	else{
+		w.ring.emplace();
+	}
+	if (pipe2(cmd, O_CLOEXEC) != 0){
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+	if (pipe2(res, O_CLOEXEC) != 0){
+		close(cmd[0]);
+		close(cmd[1]);
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+
+	fds[0] = cmd[0];
+	fds[1] = res[1];
+	fds[2] = w.ring->getFd();
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	while ((ss = sendmsg(z.fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	// the zygote holds its own copies now
+	close(cmd[0]);
+	close(res[1]);
+	if (ss < 0){
+		int err = errno;
+		close(cmd[1]);
+		close(res[0]);
+		throw std::runtime_error("Failed to reach the zygote (" + std::string(std::strerror(err)) + ")");
+	}
+
+	w.request = z.requested++;
+	w.cmdFd = cmd[1];
+	w.resFd = res[0];
+	return w;
+}
+
+/**
+ * @brief Returns the process id of the worker the zygote forked for a request, waiting for its answer if it was not read yet.
+ *
+ * @return The process id, or the negated errno if it could not be forked or the zygote is gone.
+ */
+static pid_t zygotePid(Zygote& z, uint64_t request){
+	pid_t pid;
+
+	while (z.answers.find(request) == z.answers.end()){
+		ssize_t ss;
+
+		while ((ss = recv(z.fd, &pid, sizeof(pid), 0)) < 0 && errno == EINTR);
+		if (ss != sizeof(pid)){
+			return -EPIPE;
+		}
+		z.answers[z.answered++] = pid;
+	}
+	pid = z.answers[request];
+	z.answers.erase(request);
+	return pid;
+}
+
+/**
+ * @brief Closes the socket to the zygote, which makes it exit, and waits for it.
+ */
+static void stopZygote(Zygote& z){
+	if (z.pid < 0){
+		return;
+	}
+	close(z.fd);
+	while (waitpid(z.pid, nullptr, 0) < 0 && errno == EINTR);
+	z.pid = -1;
+}
+
+std::vector<TestResult> runForked(const std::vector<size_t>& indexes, const std::function<TestResult(size_t)>& runOne, const std::function<void(const TestResult&)>& onResult, const ForkOptions& options){
+	std::deque<size_t> queue;
+	std::vector<TestResult> results(indexes.size());
+	// the runs of each test so far, how many are still queued or running, and how many retries it had
+	std::vector<std::vector<TestResult>> runs(indexes.size());
+	std::vector<size_t> pending(indexes.size(), std::max<size_t>(options.repeat, 1));
+	std::vector<size_t> retried(indexes.size(), 0);
+	// names each test's cgroup, since runs of the same test can overlap
+	size_t started = 0;
+	size_t done = 0;
+	// declared before the workers, so their cgroups are gone by the time it is undone
+	std::unique_ptr<CgroupDelegation> delegation;
+	ResourcePool pool(options.capacity, std::max<size_t>(options.jobs, 1) > 1);
+	std::vector<Worker> workers;
+	// one per job slot at most, since a ring is only reused once its worker has exited
+	std::vector<ResultRing> spareRings;
+	Zygote zygote;
+	size_t jobs = std::max<size_t>(options.jobs, 1);
+	size_t batch = std::max<size_t>(options.batch, 1);
+	// a worker whose child is gone must not kill the runner when it is written to
+	void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+	auto limitsOf = [&](size_t slot){
+		return options.limits ? options.limits(indexes[slot]) : ResourceLimits();
+	};
+	auto weightsOf = [&](size_t slot){
+		return options.weights ? options.weights(indexes[slot]) : ResourceWeights();
+	};
+	// gives back what the worker's test reserved, takes the measurements of its cgroup, then removes the cgroup along with anything the test left running
+	auto settle = [&](Worker& w, TestResult& res, bool alive){
+		ResourceUsage usage;
+
+		if (w.reserved){
+			pool.release(w.alloc);
+			w.reserved = false;
+		}
+		if (!w.group){
+			return usage;
+		}
+		if (alive){
+			delegation->release(w.pid);
+		}
+		usage = w.group->usage();
+		w.group.reset();
+
+		res.cpuTime = usage.cpu;
+		res.peakMemory = usage.peakMemory;
+		if (usage.processLimitHit && res.status != TestResult::PASSED && res.status != TestResult::LIMIT_EXCEEDED){
+			res.status = TestResult::LIMIT_EXCEEDED;
+			res.reason = "Reached the limit of " + std::to_string(limitsOf(w.current).processes) + " processes (" + res.reason + ")";
+		}
+		return usage;
+	};
+	// returns true if the test was queued to run again instead
+	auto finish = [&](size_t slot, TestResult& res){
+		res.index = indexes[slot];
+		runs[slot].push_back(std::move(res));
+		if (--pending[slot] > 0){
+			return false;
+		}
+		if (retried[slot] < options.retries && std::none_of(runs[slot].begin(), runs[slot].end(), [](const TestResult& r){ return r.status == TestResult::PASSED; })){
+			// at the front, so the test's result is not held up behind the rest of the run
+			retried[slot]++;
+			pending[slot]++;
+			queue.push_front(slot);
+			return true;
+		}
+
+		results[slot] = summarizeRuns(runs[slot]);
+		runs[slot].clear();
+		// benchmarks reported by the child would otherwise be lost with it
+		for (const Benchmark& b : results[slot].benchmarks){
+			reportBenchmark(b);
+		}
+		done++;
+		onResult(results[slot]);
+		return false;
+	};
+	auto busyCount = [&](){
+		return (size_t)std::count_if(workers.begin(), workers.end(), [](const Worker& w){ return w.busy; });
+	};
+	auto idleCount = [&](){
+		return (size_t)std::count_if(workers.begin(), workers.end(), [batch](const Worker& w){ return !w.busy && w.sent < batch; });
+	};
+	auto spawn = [&](){
+		return options.zygote ? spawnFromZygote(zygote, spareRings) : spawnWorker(workers, spareRings, batch, indexes, runOne);
+	};
+	// the zygote's answer is only needed once the worker is given a test or has exited
+	auto resolve = [&](Worker& w){
+		if (w.pid != 0){
+			return;
+		}
+		w.pid = zygotePid(zygote, w.request);
+		if (w.pid < 0){
+			int err = -w.pid;
+			w.pid = -1;
+			throw std::runtime_error("Failed to fork (" + std::string(std::strerror(err)) + ")");
+		}
+	};
+	auto dispatch = [&](Worker& w, uint64_t slot, const Allocation& alloc){
+		resolve(w);
+		started++;
+		w.busy = true;
+		w.current = slot;
+		w.sent++;
+		w.alloc = alloc;
+		w.reserved = true;
+		pinProcess(w.pid, alloc.cpus);
+		if (delegation){
+			w.group = std::make_unique<TestCgroup>(delegation->getDir(), "simpletest-" + std::to_string(getpid()) + "-" + std::to_string(started), limitsOf(slot));
+			w.group->add(w.pid);
+		}
+		if (!writeAll(w.cmdFd, &slot, sizeof(slot))){
+			// the child is gone; its exit is noticed by the poll loop below, which reports the test as crashed
+			close(w.cmdFd);
+			w.cmdFd = -1;
+		}
+	};
+
+	// each test's runs are queued next to each other, so with several jobs they run at the same time
+	for (size_t i = 0; i < indexes.size(); ++i){
+		queue.insert(queue.end(), pending[i], i);
+	}
+
+	auto drain = [&](Worker& w){
+		uint64_t slot;
+		TestResult res;
+
+		while (w.ring->next(slot, res)){
+			w.busy = false;
+			settle(w, res, true);
+			if (finish(slot, res) && w.cmdFd >= 0){
+				// whatever the failed run left behind in this child must not decide the retry
+				close(w.cmdFd);
+				w.cmdFd = -1;
+				w.sent = batch;
+			}
+		}
+	};
+
+	try{
+		if (options.zygote){
+			zygote = startZygote(batch, indexes, runOne);
+		}
+		if (!options.cgroup.empty()){
+			delegation = std::make_unique<CgroupDelegation>(options.cgroup);
+		}
+
+		while (done < indexes.size()){
+			std::vector<struct pollfd> pfds;
+			bool canWait = true;
+
+			for (Worker& w : workers){
+				drain(w);
+			}
+			if (done == indexes.size()){
+				break;
+			}
+
+			// start the first queued tests that fit next to the ones running, on children waiting for one or new ones
+			for (auto it = queue.begin(); it != queue.end() && busyCount() < jobs && !pool.full(); ){
+				Allocation alloc;
+				size_t slot = *it;
+				auto idle = std::find_if(workers.begin(), workers.end(), [batch](const Worker& w){ return !w.busy && w.sent < batch && w.cmdFd >= 0; });
+
+				if (!pool.acquire(weightsOf(slot), alloc)){
+					++it;
+					continue;
+				}
+				it = queue.erase(it);
+				if (idle == workers.end()){
+					workers.push_back(spawn());
+					idle = workers.end() - 1;
+				}
+				dispatch(*idle, slot, alloc);
+			}
+			// keep children forked ahead of time for the next tests, so a test does not wait for fork()
+			while (options.zygote && idleCount() < std::min(jobs, queue.size())){
+				workers.push_back(spawn());
+			}
+
+			for (Worker& w : workers){
+				pfds.push_back({w.resFd, POLLIN, 0});
+				// every ring must agree before sleeping, or a result could arrive without a doorbell
+				if (canWait && !w.ring->prepareToWait()){
+					canWait = false;
+				}
+			}
+			if (poll(pfds.data(), pfds.size(), canWait ? -1 : 0) < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				throw std::runtime_error("Failed to poll workers (" + std::string(std::strerror(errno)) + ")");
+			}
+
+			for (size_t i = pfds.size(); i-- > 0; ){
+				Worker& w = workers[i];
+				char buf[256];
+				ssize_t ss;
+				uint64_t slot;
+				std::chrono::nanoseconds elapsed{-1};
+				TestResult res;
+
+				if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))){
+					continue;
+				}
+				ss = read(w.resFd, buf, sizeof(buf));
+				if (ss != 0){
+					// doorbell bytes carry no data; the results are read from the ring at the top of the loop
+					continue;
+				}
+
+				// end of file: the child exited, on purpose or not
+				int status = 0;
+				resolve(w);
+				close(w.resFd);
+				if (w.cmdFd >= 0){
+					close(w.cmdFd);
+				}
+				while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR);
+				// anything the child reported before dying is still in the ring
+				drain(w);
+				if (w.busy){
+					w.ring->running(slot, elapsed);
+					res = TestResult();
+					res.reason = describeLimitCrash(status, limitsOf(w.current), settle(w, res, false));
+					res.status = TestResult::LIMIT_EXCEEDED;
+					if (res.reason.empty()){
+						res.status = TestResult::CRASHED;
+						res.reason = describeCrash(status, elapsed);
+					}
+					finish(w.current, res);
+				}
+				w.ring->reset();
+				spareRings.push_back(std::move(*w.ring));
+				workers.erase(workers.begin() + i);
+			}
+		}
+	}
+	catch (...){
+		for (Worker& w : workers){
+			if (w.pid == 0){
+				w.pid = zygotePid(zygote, w.request);
+			}
+			if (w.pid > 0){
+				kill(w.pid, SIGKILL);
+			}
+		}
+		for (Worker& w : workers){
+			close(w.resFd);
+			if (w.cmdFd >= 0){
+				close(w.cmdFd);
+			}
+			if (w.pid > 0){
+				waitpid(w.pid, nullptr, 0);
+			}
+		}
+		stopZygote(zygote);
+		signal(SIGPIPE, oldPipe);
+		throw;
+	}
+
+	// idle children exit once their command pipe closes
+	for (Worker& w : workers){
+		if (w.cmdFd >= 0){
+			close(w.cmdFd);
+		}
+	}
+	for (Worker& w : workers){
+		close(w.resFd);
+		if (w.pid == 0){
+			w.pid = zygotePid(zygote, w.request);
+		}
+		if (w.pid > 0){
+			while (waitpid(w.pid, nullptr, 0) < 0 && errno == EINTR);
+		}
+	}
+	stopZygote(zygote);
+	signal(SIGPIPE, oldPipe);
+
+	return results;
+}
+
+}
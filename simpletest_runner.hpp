@@ -0,0 +1,249 @@
+/** @file simpletest_runner.hpp
+ * @brief simpletest multi-process test runner.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_RUNNER_HPP
+#define __SIMPLETEST_RUNNER_HPP
+
+#include "simpletest_benchmark.hpp"
+#include "simpletest_limits.hpp"
+#include "simpletest_scheduler.hpp"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief The outcome of running one test.
+ */
+struct TestResult{
+	/**
+	 * @brief How the test ended.
+	 */
+	enum Status{
+		/**
+		 * @brief The test passed.
+		 */
+		PASSED,
+
+		/**
+		 * @brief An assertion or expectation failed.
+		 */
+		FAILED,
+
+		/**
+		 * @brief The test threw something other than a failed assertion or expectation, or raised a handled signal.
+		 */
+		ERROR,
+
+		/**
+		 * @brief The process running the test died before reporting a result.
+		 */
+		CRASHED,
+
+		/**
+		 * @brief The test ran into one of its ResourceLimits.
+		 */
+		LIMIT_EXCEEDED,
+
+		/**
+		 * @brief The test ran more than once, and some runs passed while others did not.
+		 */
+		FLAKY
+	};
+
+	/**
+	 * @brief The test's index in the order the tests were registered.
+	 */
+	size_t index = 0;
+
+	/**
+	 * @brief How the test ended.
+	 */
+	Status status = PASSED;
+
+	/**
+	 * @brief Why the test did not pass, or empty if it did.
+	 */
+	std::string reason;
+
+	/**
+	 * @brief How long the test took to run.
+	 */
+	std::chrono::nanoseconds duration{0};
+
+	/**
+	 * @brief The benchmarks the test reported.
+	 * runForked() reports these again in the calling process, so they show up in its benchmark report.
+	 */
+	std::vector<Benchmark> benchmarks;
+
+	/**
+	 * @brief The CPU time used by the test's whole process tree as measured by its cgroup, or negative if it was not measured.
+	 */
+	std::chrono::nanoseconds cpuTime{-1};
+
+	/**
+	 * @brief The most memory the test's whole process tree used at once as measured by its cgroup, in bytes, or -1 if it was not measured.
+	 */
+	int64_t peakMemory = -1;
+
+	/**
+	 * @brief The number of times the test ran, counting retries and repeats.
+	 */
+	size_t runs = 1;
+
+	/**
+	 * @brief The number of those runs that did not pass.
+	 */
+	size_t failures = 0;
+
+	/**
+	 * @brief What the test left behind, as LeakAudit::finish() describes it, if leaks were audited.
+	 */
+	std::vector<std::string> leaks;
+};
+
+/**
+ * @brief Combines the results of running a test several times into one.
+ * The result passes if every run passed and is TestResult::FLAKY if only some did. If no run passed, it has the status and reason of the first run.
+ * The duration is the mean of the runs, and the samples of benchmarks with the same name are merged.
+ *
+ * @param runs The results of each run, in the order they finished. Must not be empty.
+ *
+ * @return The combined result.
+ */
+TestResult summarizeRuns(const std::vector<TestResult>& runs);
+
+/**
+ * @brief Options for runForked().
+ */
+struct ForkOptions{
+	/**
+	 * @brief The most tests to run at once.
+	 * With more than one, each test is pinned to CPUs that no other test running at the same time has.
+	 */
+	size_t jobs = 1;
+
+	/**
+	 * @brief Returns the weights of the test with the given index, or nothing to count every test as one core.
+	 */
+	std::function<ResourceWeights(size_t)> weights;
+
+	/**
+	 * @brief What the tests running at once may need in total. Tests start in order, except that a test that does not fit next to the running ones waits while later ones that do fit start.
+	 */
+	ResourceWeights capacity = machineCapacity();
+
+	/**
+	 * @brief The number of tests each child process runs before it exits and is replaced.
+	 * 1 gives every test a fresh copy of the runner's state.
+	 */
+	size_t batch = 1;
+
+	/**
+	 * @brief True to keep up to jobs idle children forked ahead of time, so a test is handed to a child that already exists instead of waiting for fork().
+	 * The children are forked by a zygote process forked at the start of the run, so the runner does not wait for the forks or take copy-on-write faults after them.
+	 */
+	bool zygote = false;
+
+	/**
+	 * @brief Returns the limits of the test with the given index, or nothing to run every test without limits.
+	 * The limits are applied by runOne in the child. The runner uses them to set up the test's cgroup and to explain a child that was killed for exceeding one.
+	 */
+	std::function<ResourceLimits(size_t)> limits;
+
+	/**
+	 * @brief A delegated cgroup v2 directory to run each test in a cgroup of its own under, or empty to not use cgroups.
+	 * This limits the memory and processes of a test's whole process tree and measures its CPU time and peak memory exactly.
+	 */
+	std::string cgroup;
+
+	/**
+	 * @brief How many more times to run a test that did not pass, each time in a freshly forked child.
+	 * A test that passes on a retry is reported as TestResult::FLAKY.
+	 */
+	size_t retries = 0;
+
+	/**
+	 * @brief The number of times to run each test.
+	 * Runs of the same test start as soon as there is room, so with several jobs they race each other, which brings out nondeterminism.
+	 */
+	size_t repeat = 1;
+};
+
+/**
+ * @brief Runs tests in child processes forked from the calling process.
+ * Each child starts as a copy-on-write snapshot of the caller, so anything set up beforehand (for example by GLOBAL_SETUP()) is shared without being redone.
+ * Children receive test indexes over a pipe and report results on a ResultRing in shared memory. A child that dies mid-test is reported as TestResult::CRASHED, along with how long the test ran.
+ * A test that runs more than once because of options.retries or options.repeat is reported once, with the results of its runs combined by summarizeRuns().
+ *
+ * @param indexes The tests to run.
+ * @param runOne Runs a test inside a child and returns its result.
+ * @param onResult Called in the calling process as each test's result is known, in no particular order.
+ * @param options How to run the tests.
+ *
+ * @return The results, in the order of indexes.
+ *
+ * @exception std::runtime_error Failed to create a pipe, fork, or set up the cgroups.
+ */
+std::vector<TestResult> runForked(const std::vector<size_t>& indexes, const std::function<TestResult(size_t)>& runOne, const std::function<void(const TestResult&)>& onResult, const ForkOptions& options);
+
+/**
+ * @brief Serves tests to a driver such as simpletest-run over a socket or pipe, until the other end closes it.
+ * The driver sends each test index as 8 native-endian bytes.
+ * Results are reported on a ResultRing if the driver passed one, in which case fd is only rung as its doorbell, or else sent back over fd in the format decodeResult() reads.
+ * Tests run one after another in this process, so it stays warm between them.
+ *
+ * @param fd The connection to the driver.
+ * @param count The number of tests. Indexes outside this range are answered with an error result.
+ * @param runOne Runs a test and returns its result.
+ * @param ringFd The file descriptor of the driver's ResultRing, or -1 for none.
+ *
+ * @return 0 once the driver closes the connection, or 1 if it could not be written to.
+ *
+ * @exception std::runtime_error ringFd is not a ResultRing.
+ */
+int serveTests(int fd, size_t count, const std::function<TestResult(size_t)>& runOne, int ringFd = -1);
+
+/**
+ * @brief Describes how a worker that died before reporting a result ended.
+ *
+ * @param status The status from waitpid().
+ * @param elapsed How long the test had been running, or a negative value if unknown.
+ *
+ * @return A failure reason, for example "Crashed: killed by signal 9 (Killed) after 1.20s".
+ */
+std::string describeCrash(int status, std::chrono::nanoseconds elapsed = std::chrono::nanoseconds(-1));
+
+/**
+ * @brief Serializes a test result for sending to another process.
+ *
+ * @param slot A number identifying the request the result answers, such as the test's index.
+ * @param res The result.
+ *
+ * @return The message.
+ */
+std::string encodeResult(uint64_t slot, const TestResult& res);
+
+/**
+ * @brief Deserializes a test result from the front of a buffer of received bytes, removing it from the buffer.
+ *
+ * @param buf The received bytes.
+ * @param slot Set to the number given to encodeResult().
+ * @param res Set to the result. Its index is not filled in.
+ *
+ * @return False if the buffer does not hold a whole message yet.
+ */
+bool decodeResult(std::string& buf, uint64_t& slot, TestResult& res);
+
+}
+
+#endif
@@ -0,0 +1,222 @@
+/** @file simpletest_sandbox.cpp
+ * @brief simpletest per-test working directory and process state isolation.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_sandbox.hpp"
+
+// std::runtime_error
+#include <stdexcept>
+// std::vector
+#include <vector>
+// std::set
+#include <set>
+// std::strerror
+#include <cstring>
+// errno
+#include <cerrno>
+// getenv(), setenv(), unsetenv(), mkdtemp()
+#include <cstdlib>
+// sigaction(), sigprocmask(), NSIG
+#include <csignal>
+// opendir(), readdir()
+#include <dirent.h>
+// open(), O_DIRECTORY
+#include <fcntl.h>
+// lstat(), umask(), chmod()
+#include <sys/stat.h>
+// fchdir(), chdir(), close(), unlink(), rmdir(), environ
+#include <unistd.h>
+
+namespace simpletest{
+
+struct TestSandboxImpl{
+	/**
+	 * @brief The test's directory.
+	 */
+	std::string dir;
+
+	/**
+	 * @brief The working directory before the test, opened so it can be returned to even if it was renamed.
+	 */
+	int cwdFd = -1;
+
+	/**
+	 * @brief The umask before the test.
+	 */
+	mode_t mask = 0;
+
+	/**
+	 * @brief The environment before the test, as "NAME=value" strings in the order environ had them.
+	 */
+	std::vector<std::string> environment;
+
+	/**
+	 * @brief The disposition of each signal before the test.
+	 */
+	struct sigaction actions[NSIG];
+
+	/**
+	 * @brief Whether each signal's disposition could be read, which is not the case for ones the C library reserves.
+	 */
+	bool haveAction[NSIG] = {};
+
+	/**
+	 * @brief The signal mask before the test.
+	 */
+	sigset_t sigmask;
+};
+
+/**
+ * @brief Removes a directory and everything in it, making each directory accessible first.
+ */
+static void removeTree(const std::string& path){
+	DIR* dir;
+	struct dirent* ent;
+
+	// a test may have left a directory without permissions, as TestEnvironment's noacc one
+	chmod(path.c_str(), 0700);
+	dir = opendir(path.c_str());
+	if (dir == nullptr){
+		unlink(path.c_str());
+		return;
+	}
+	while ((ent = readdir(dir)) != nullptr){
+		std::string name = ent->d_name;
+		struct stat st;
+
+		if (name == "." || name == ".."){
+			continue;
+		}
+		if (lstat((path + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+			removeTree(path + "/" + name);
+		}
+		else{
+			unlink((path + "/" + name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
+/**
+ * @brief Returns the environment as "NAME=value" strings.
+ */
+static std::vector<std::string> readEnvironment(){
+	std::vector<std::string> ret;
+
+	for (char** e = environ; *e != nullptr; ++e){
+		ret.push_back(*e);
+	}
+	return ret;
+}
+
+/**
+ * @brief Splits a "NAME=value" string at its '='.
+ */
+static std::pair<std::string, std::string> splitVariable(const std::string& var){
+	size_t eq = var.find('=');
+
+	if (eq == std::string::npos){
+		return {var, ""};
+	}
+	return {var.substr(0, eq), var.substr(eq + 1)};
+}
+
+/**
+ * @brief Changes the environment back to a snapshot, leaving variables that did not change alone.
+ */
+static void restoreEnvironment(const std::vector<std::string>& saved){
+	std::vector<std::string> cur = readEnvironment();
+	std::set<std::string> names;
+
+	// the common case, a test that did not touch it
+	if (cur == saved){
+		return;
+	}
+	for (const std::string& var : saved){
+		names.insert(splitVariable(var).first);
+	}
+	for (const std::string& var : cur){
+		std::string name = splitVariable(var).first;
+		if (names.count(name) == 0){
+			unsetenv(name.c_str());
+		}
+	}
+	for (const std::string& var : saved){
+		auto nv = splitVariable(var);
+		const char* now = getenv(nv.first.c_str());
+
+		if (now == nullptr || nv.second != now){
+			setenv(nv.first.c_str(), nv.second.c_str(), 1);
+		}
+	}
+}
+
+TestSandbox::TestSandbox(const std::string& root, const std::string& name): impl(std::make_unique<TestSandboxImpl>()){
+	std::string templ = root + "/" + name + "-XXXXXX";
+
+	if (mkdtemp(&templ[0]) == nullptr){
+		throw std::runtime_error("Failed to create a directory for " + name + " (" + std::strerror(errno) + ")");
+	}
+	impl->dir = templ;
+	impl->cwdFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (impl->cwdFd < 0 || chdir(impl->dir.c_str()) != 0){
+		int err = errno;
+		if (impl->cwdFd >= 0){
+			close(impl->cwdFd);
+		}
+		removeTree(impl->dir);
+		throw std::runtime_error("Failed to change into " + templ + " (" + std::strerror(err) + ")");
+	}
+
+	impl->mask = umask(022);
+	umask(impl->mask);
+	impl->environment = readEnvironment();
+	for (int sig = 1; sig < NSIG; ++sig){
+		if (sig != SIGKILL && sig != SIGSTOP){
+			impl->haveAction[sig] = sigaction(sig, nullptr, &impl->actions[sig]) == 0;
+		}
+	}
+	sigprocmask(SIG_SETMASK, nullptr, &impl->sigmask);
+}
+
+TestSandbox::~TestSandbox(){
+	for (int sig = 1; sig < NSIG; ++sig){
+		if (impl->haveAction[sig]){
+			sigaction(sig, &impl->actions[sig], nullptr);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &impl->sigmask, nullptr);
+	restoreEnvironment(impl->environment);
+	umask(impl->mask);
+	if (fchdir(impl->cwdFd) != 0){
+		// somewhere the test's directory is not, so it can be removed
+		(void)!chdir("/");
+	}
+	close(impl->cwdFd);
+	removeTree(impl->dir);
+}
+
+const std::string& TestSandbox::getDirectory() const{
+	return impl->dir;
+}
+
+std::string makeSandboxRoot(){
+	const char* tmp = getenv("TMPDIR");
+	std::string templ = std::string(tmp && *tmp ? tmp : "/tmp") + "/simpletest-sandbox-XXXXXX";
+
+	if (mkdtemp(&templ[0]) == nullptr){
+		throw std::runtime_error("Failed to create a directory for the tests (" + std::string(std::strerror(errno)) + ")");
+	}
+	return templ;
+}
+
+void removeSandboxRoot(const std::string& root){
+	removeTree(root);
+}
+
+}
@@ -0,0 +1,77 @@
+/** @file simpletest_sandbox.hpp
+ * @brief simpletest per-test working directory and process state isolation.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_SANDBOX_HPP
+#define __SIMPLETEST_SANDBOX_HPP
+
+#include <memory>
+#include <string>
+
+namespace simpletest{
+
+struct TestSandboxImpl;
+
+/**
+ * @brief Gives a test a fresh working directory of its own and undoes what it did to the process's state when it goes out of scope.
+ * The working directory, environment variables, umask, signal dispositions and signal mask are snapshotted on construction and restored on destruction, so a test that calls chdir(), setenv(), umask() or signal() cannot break the tests after it.
+ * Restoring only touches what changed, so a test that leaves everything alone costs one comparison of the environment.
+ */
+class TestSandbox{
+public:
+	/**
+	 * @brief Creates a directory for the test under root and changes into it.
+	 *
+	 * @param root The directory to create the test's directory in, for example one made with makeSandboxRoot().
+	 * @param name The test's name, which the directory's name starts with.
+	 *
+	 * @exception std::runtime_error Failed to create the directory or change into it.
+	 */
+	TestSandbox(const std::string& root, const std::string& name);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	TestSandbox(const TestSandbox& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	TestSandbox& operator=(const TestSandbox& other) = delete;
+
+	/**
+	 * @brief Restores the process's state and removes the test's directory along with everything in it.
+	 */
+	~TestSandbox();
+
+	/**
+	 * @brief Returns the absolute path of the test's directory.
+	 */
+	const std::string& getDirectory() const;
+
+private:
+	std::unique_ptr<TestSandboxImpl> impl;
+};
+
+/**
+ * @brief Creates a directory for the directories of a run's tests under $TMPDIR, or /tmp if it is not set.
+ * Removing it with removeSandboxRoot() once the run is done also cleans up after tests that crashed their child process before their TestSandbox could.
+ *
+ * @return The directory's absolute path.
+ *
+ * @exception std::runtime_error Failed to create the directory.
+ */
+std::string makeSandboxRoot();
+
+/**
+ * @brief Removes a directory made by makeSandboxRoot() and everything in it, including directories a test made inaccessible.
+ */
+void removeSandboxRoot(const std::string& root);
+
+}
+
+#endif
@@ -0,0 +1,291 @@
+/** @file simpletest_scheduler.cpp
+ * @brief simpletest resource-aware packing of parallel tests onto the machine.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+// sched_getaffinity() needs this before any system header
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "simpletest_scheduler.hpp"
+// parseSize()
+#include "simpletest_limits.hpp"
+
+// std::min, std::max
+#include <algorithm>
+// std::ifstream
+#include <fstream>
+// std::istringstream
+#include <sstream>
+// std::invalid_argument, std::runtime_error
+#include <stdexcept>
+// std::map
+#include <map>
+// std::strerror
+#include <cstring>
+// errno
+#include <cerrno>
+// sched_getaffinity(), sched_setaffinity()
+#include <sched.h>
+
+namespace simpletest{
+
+/**
+ * @brief Parses a positive whole number.
+ */
+static unsigned parseNumber(const std::string& value, const std::string& name){
+	size_t pos = 0;
+	unsigned long n = 0;
+
+	try{
+		n = std::stoul(value, &pos);
+	}
+	catch (std::exception&){
+		pos = 0;
+	}
+	if (pos == 0 || pos != value.size() || value[0] == '-' || n == 0){
+		throw std::invalid_argument(name + " requires a positive integer");
+	}
+	return n;
+}
+
+std::string ResourceWeights::describe() const{
+	std::string ret = "cores=" + std::to_string(cores);
+
+	if (memory != 0){
+		ret += ",memory=" + std::to_string(memory);
+	}
+	if (io != 0){
+		ret += ",io=" + std::to_string(io);
+	}
+	if (isolated){
+		ret += ",isolated";
+	}
+	return ret;
+}
+
+ResourceWeights parseWeights(const std::string& spec, const ResourceWeights& base){
+	ResourceWeights ret = base;
+	std::istringstream iss(spec);
+	std::string item;
+
+	while (std::getline(iss, item, ',')){
+		size_t eq = item.find('=');
+		std::string key = item.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+
+		if (key == "isolated" && eq == std::string::npos){
+			ret.isolated = true;
+		}
+		else if (eq == std::string::npos){
+			throw std::invalid_argument("Weight \"" + item + "\" must look like name=value");
+		}
+		else if (key == "cores"){
+			ret.cores = parseNumber(value, key);
+		}
+		else if (key == "memory"){
+			ret.memory = parseSize(value, key);
+		}
+		else if (key == "io"){
+			ret.io = parseNumber(value, key);
+			if (ret.io > 100){
+				throw std::invalid_argument("io is a percentage and cannot be more than 100");
+			}
+		}
+		else{
+			throw std::invalid_argument("Unknown weight \"" + key + "\"; expected cores, memory, io or isolated");
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Returns the CPUs this process may run on.
+ */
+static std::vector<int> allowedCpus(){
+	cpu_set_t set;
+	std::vector<int> ret;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0){
+		return ret;
+	}
+	for (int i = 0; i < CPU_SETSIZE; ++i){
+		if (CPU_ISSET(i, &set)){
+			ret.push_back(i);
+		}
+	}
+	return ret;
+}
+
+ResourceWeights machineCapacity(){
+	ResourceWeights ret;
+	std::ifstream meminfo("/proc/meminfo");
+	std::string key;
+	uint64_t kb;
+	std::string unit;
+
+	ret.cores = std::max<size_t>(allowedCpus().size(), 1);
+	ret.io = 100;
+	while (meminfo >> key >> kb >> unit){
+		if (key == "MemAvailable:"){
+			ret.memory = kb * 1024;
+		}
+	}
+	return ret;
+}
+
+/**
+ * @brief Returns a number that is the same for CPUs that are hyperthreads of the same physical core.
+ */
+static int physicalCore(int cpu){
+	std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+	std::ifstream package(dir + "physical_package_id");
+	std::ifstream core(dir + "core_id");
+	int p = 0;
+	int c = cpu;
+
+	package >> p;
+	core >> c;
+	// core ids are only unique within a package
+	return p * 65536 + c;
+}
+
+ResourcePool::ResourcePool(const ResourceWeights& capacity, bool pin): capacity(capacity), pin(pin){
+	used.cores = 0;
+
+	if (pin){
+		cpus = allowedCpus();
+		// disjoint sets are impossible if there is more capacity than CPUs
+		if (cpus.size() < capacity.cores){
+			this->pin = false;
+			cpus.clear();
+		}
+		for (int cpu : cpus){
+			physical.push_back(physicalCore(cpu));
+		}
+		taken.assign(cpus.size(), false);
+	}
+}
+
+bool ResourcePool::acquire(const ResourceWeights& want, Allocation& out){
+	ResourceWeights w = want;
+	std::vector<size_t> chosen;
+
+	w.cores = std::min(std::max(w.cores, 1u), capacity.cores);
+	w.memory = std::min(w.memory, capacity.memory);
+	w.io = std::min(w.io, capacity.io);
+
+	if (used.cores + w.cores > capacity.cores || used.memory + w.memory > capacity.memory || used.io + w.io > capacity.io){
+		return false;
+	}
+
+	if (pin){
+		std::map<int, std::vector<size_t>> freeCores;
+		std::map<int, bool> whole;
+
+		for (size_t i = 0; i < cpus.size(); ++i){
+			if (!whole.count(physical[i])){
+				whole[physical[i]] = true;
+			}
+			if (taken[i]){
+				whole[physical[i]] = false;
+			}
+			else{
+				freeCores[physical[i]].push_back(i);
+			}
+		}
+
+		if (w.isolated){
+			// whole physical cores, so no other test shares them through a hyperthread sibling
+			for (const auto& core : freeCores){
+				if (chosen.size() >= w.cores){
+					break;
+				}
+				if (whole[core.first]){
+					chosen.insert(chosen.end(), core.second.begin(), core.second.end());
+				}
+			}
+			if (chosen.size() < w.cores){
+				return false;
+			}
+			// the siblings count against the capacity too, since nothing else may use them
+			w.cores = std::min<size_t>(chosen.size(), capacity.cores);
+			if (used.cores + w.cores > capacity.cores){
+				return false;
+			}
+		}
+		else{
+			// fill up physical cores that are already in use first, to keep whole ones free for isolated tests
+			for (int pass = 0; pass < 2 && chosen.size() < w.cores; ++pass){
+				for (const auto& core : freeCores){
+					if (whole[core.first] != (pass == 1)){
+						continue;
+					}
+					for (size_t i : core.second){
+						if (chosen.size() < w.cores){
+							chosen.push_back(i);
+						}
+					}
+				}
+			}
+			if (chosen.size() < w.cores){
+				return false;
+			}
+		}
+	}
+
+	out.weights = w;
+	out.cpus.clear();
+	for (size_t i : chosen){
+		taken[i] = true;
+		out.cpus.push_back(cpus[i]);
+	}
+	used.cores += w.cores;
+	used.memory += w.memory;
+	used.io += w.io;
+	return true;
+}
+
+void ResourcePool::release(const Allocation& alloc){
+	used.cores -= alloc.weights.cores;
+	used.memory -= alloc.weights.memory;
+	used.io -= alloc.weights.io;
+	for (int cpu : alloc.cpus){
+		for (size_t i = 0; i < cpus.size(); ++i){
+			if (cpus[i] == cpu){
+				taken[i] = false;
+			}
+		}
+	}
+}
+
+bool ResourcePool::full() const{
+	return used.cores >= capacity.cores;
+}
+
+bool ResourcePool::pinning() const{
+	return pin;
+}
+
+void pinProcess(pid_t pid, const std::vector<int>& cpus){
+	cpu_set_t set;
+
+	if (cpus.empty()){
+		return;
+	}
+	CPU_ZERO(&set);
+	for (int cpu : cpus){
+		CPU_SET(cpu, &set);
+	}
+	// a process that already exited is noticed by whoever waits for it
+	if (sched_setaffinity(pid, sizeof(set), &set) != 0 && errno != ESRCH){
+		throw std::runtime_error("Failed to pin process " + std::to_string(pid) + " to its CPUs (" + std::strerror(errno) + ")");
+	}
+}
+
+}
@@ -0,0 +1,165 @@
+/** @file simpletest_scheduler.hpp
+ * @brief simpletest resource-aware packing of parallel tests onto the machine.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_SCHEDULER_HPP
+#define __SIMPLETEST_SCHEDULER_HPP
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief How much of the machine a test needs while it runs, or how much the machine has.
+ */
+struct ResourceWeights{
+	/**
+	 * @brief The number of CPUs the test keeps busy, for example the size of its thread pool.
+	 */
+	unsigned cores = 1;
+
+	/**
+	 * @brief The memory the test needs in bytes.
+	 */
+	uint64_t memory = 0;
+
+	/**
+	 * @brief The share of the disk's bandwidth the test needs, in percent.
+	 */
+	unsigned io = 0;
+
+	/**
+	 * @brief True if the test must have whole physical cores to itself, including their hyperthread siblings, for example because it benchmarks.
+	 */
+	bool isolated = false;
+
+	/**
+	 * @brief Describes the weights in the format parseWeights() reads, for example "cores=8,memory=4G".
+	 */
+	std::string describe() const;
+};
+
+/**
+ * @brief Parses weights such as "cores=8,memory=4G,io=50,isolated".
+ * Keys that are not given keep their values from base, which by default are 1 core, no memory, no disk bandwidth, and not isolated.
+ *
+ * @param spec The weights, separated by commas.
+ * @param base The weights to start from.
+ *
+ * @return The weights.
+ *
+ * @exception std::invalid_argument spec is malformed.
+ */
+ResourceWeights parseWeights(const std::string& spec, const ResourceWeights& base = ResourceWeights());
+
+/**
+ * @brief Returns what this machine has: the CPUs this process may run on, the memory available right now, and 100% of disk bandwidth.
+ */
+ResourceWeights machineCapacity();
+
+/**
+ * @brief What a test was given by a ResourcePool.
+ */
+struct Allocation{
+	/**
+	 * @brief The weights that were reserved, which are the test's weights reduced to fit the capacity.
+	 */
+	ResourceWeights weights;
+
+	/**
+	 * @brief The CPUs the test is pinned to, or empty if it is not pinned.
+	 */
+	std::vector<int> cpus;
+};
+
+/**
+ * @brief Hands out a machine's capacity to tests, so the tests running at once never need more than there is.
+ * With pinning, each test also gets CPUs that no other test running at the same time has.
+ */
+class ResourcePool{
+public:
+	/**
+	 * @brief Creates a pool.
+	 *
+	 * @param capacity What there is to hand out. A test that needs more than this is reduced to all of it, so it runs on its own.
+	 * @param pin True to give each test CPUs of its own. This is only possible if capacity.cores is no more than the CPUs this process may run on, and is turned off otherwise.
+	 */
+	ResourcePool(const ResourceWeights& capacity, bool pin);
+
+	/**
+	 * @brief Reserves what a test needs, if it is free.
+	 *
+	 * @param want The test's weights.
+	 * @param out Set to what was reserved.
+	 *
+	 * @return False if the test does not fit next to the tests already running.
+	 */
+	bool acquire(const ResourceWeights& want, Allocation& out);
+
+	/**
+	 * @brief Returns what a test had reserved.
+	 */
+	void release(const Allocation& alloc);
+
+	/**
+	 * @brief Returns true if every core is reserved, so no test can fit.
+	 */
+	bool full() const;
+
+	/**
+	 * @brief Returns true if tests are pinned to CPUs.
+	 */
+	bool pinning() const;
+
+private:
+	/**
+	 * @brief What there is.
+	 */
+	ResourceWeights capacity;
+
+	/**
+	 * @brief What is reserved by running tests.
+	 */
+	ResourceWeights used;
+
+	/**
+	 * @brief The CPUs tests may be pinned to, if pinning.
+	 */
+	std::vector<int> cpus;
+
+	/**
+	 * @brief The physical core of each entry in cpus, so hyperthread siblings can be told apart.
+	 */
+	std::vector<int> physical;
+
+	/**
+	 * @brief True for each entry in cpus that a running test has.
+	 */
+	std::vector<bool> taken;
+
+	/**
+	 * @brief True if tests are pinned to CPUs.
+	 */
+	bool pin;
+};
+
+/**
+ * @brief Restricts a process, and the threads and processes it starts from then on, to the given CPUs.
+ *
+ * @param pid The process.
+ * @param cpus The CPUs. If empty, nothing is done.
+ *
+ * @exception std::runtime_error Failed to set the process's affinity.
+ */
+void pinProcess(pid_t pid, const std::vector<int>& cpus);
+
+}
+
+#endif
@@ -0,0 +1,506 @@
+/** @file simpletest_session.cpp
+ * @brief simpletest interactive session recording and replay.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_session.hpp"
+
+// errno
+#include <cerrno>
+// std::strerror
+#include <cstring>
+// kill(), sigaction()
+#include <csignal>
+// std::ifstream, std::ofstream
+#include <fstream>
+// std::istreambuf_iterator
+#include <iterator>
+// std::runtime_error
+#include <stdexcept>
+// posix_spawnp()
+#include <spawn.h>
+// poll()
+#include <poll.h>
+// waitpid()
+#include <sys/wait.h>
+// pipe2()
+#include <fcntl.h>
+// read(), write(), close()
+#include <unistd.h>
+
+extern char** environ;
+
+namespace simpletest{
+
+/**
+ * @brief The first bytes of every session file, followed by the format version.
+ */
+static const char sessionMagic[] = "STSESS";
+
+/**
+ * @brief The current session file format version.
+ */
+static const unsigned char sessionVersion = 1;
+
+/**
+ * @brief Appends an unsigned LEB128 varint to a buffer.
+ */
+static void putVarint(std::string& out, uint64_t val){
+	while (val >= 0x80){
+		out += (char)((val & 0x7F) | 0x80);
+		val >>= 7;
+	}
+	out += (char)val;
+}
+
+/**
+ * @brief Reads an unsigned LEB128 varint from a buffer.
+ *
+ * @param in The buffer.
+ * @param pos The position to read from. This is advanced past the varint.
+ *
+ * @exception std::runtime_error The buffer ends in the middle of the varint.
+ */
+static uint64_t getVarint(const std::string& in, size_t& pos){
+	uint64_t val = 0;
+	int shift = 0;
+
+	while (pos < in.size() && shift < 64){
+		unsigned char c = in[pos++];
+		val |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)){
+			return val;
+		}
+		shift += 7;
+	}
+	throw std::runtime_error("Truncated session file");
+}
+
+/**
+ * @brief Reads a length-prefixed string from a buffer.
+ */
+static std::string getBytes(const std::string& in, size_t& pos){
+	uint64_t len = getVarint(in, pos);
+	std::string ret;
+
+	if (len > in.size() - pos){
+		throw std::runtime_error("Truncated session file");
+	}
+	ret = in.substr(pos, len);
+	pos += len;
+	return ret;
+}
+
+/**
+ * @brief Converts a waitpid() status into a session exit status.
+ */
+static int exitStatus(int status){
+	if (WIFSIGNALED(status)){
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+/**
+ * @brief Ignores SIGPIPE while it is in scope.
+ * The program may exit without reading all of its input, and writing to its stdin afterwards should fail with EPIPE instead of killing us.
+ */
+class IgnoreSigpipe{
+public:
+	IgnoreSigpipe(){
+		struct sigaction sa;
+		sa.sa_handler = SIG_IGN;
+		sigemptyset(&(sa.sa_mask));
+		sa.sa_flags = 0;
+		sigaction(SIGPIPE, &sa, &old);
+	}
+	~IgnoreSigpipe(){
+		sigaction(SIGPIPE, &old, NULL);
+	}
+private:
+	struct sigaction old;
+};
+
+/**
+ * @brief Starts a program with its standard streams pointed at the given file descriptors.
+ *
+ * @param args The program and its arguments. The program is searched for in $PATH.
+ * @param in The file descriptor to use as the program's stdin.
+ * @param out The file descriptor to use as the program's stdout.
+ * @param err The file descriptor to use as the program's stderr.
+ *
+ * @return The program's pid.
+ *
+ * @exception std::runtime_error Failed to start the program.
+ */
+static pid_t spawn(const std::vector<std::string>& args, int in, int out, int err){
+	posix_spawn_file_actions_t fa;
+	std::vector<char*> argv;
+	pid_t pid;
+	int res;
+
+	for (const std::string& arg : args){
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, err, STDERR_FILENO);
+	res = posix_spawnp(&pid, argv[0], &fa, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (res != 0){
+		throw std::runtime_error("Failed to start " + args[0] + " (" + std::strerror(res) + ")");
+	}
+	return pid;
+}
+
+Session Session::load(const char* path){
+	std::ifstream ifs(path, std::ios::binary);
+	std::string in;
+	Session ret;
+	size_t pos = sizeof(sessionMagic) - 1;
+	uint64_t argc;
+	std::chrono::nanoseconds time(0);
+
+	if (!ifs){
+		throw std::runtime_error("Failed to open session file " + std::string(path) + " (" + std::strerror(errno) + ")");
+	}
+	in.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+
+	if (in.compare(0, pos, sessionMagic) != 0 || in.size() <= pos){
+		throw std::runtime_error(std::string(path) + " is not a session file");
+	}
+	if ((unsigned char)in[pos++] != sessionVersion){
+		throw std::runtime_error(std::string(path) + " has an unsupported session file version");
+	}
+
+	argc = getVarint(in, pos);
+	for (uint64_t i = 0; i < argc; ++i){
+		ret.args.push_back(getBytes(in, pos));
+	}
+
+	while (pos < in.size()){
+		SessionEvent ev;
+		unsigned char stream = in[pos++];
+
+		// checked before it is an enumerator, and nothing can follow the exit
+		if (stream > SessionEvent::EXIT || (!ret.events.empty() && ret.events.back().stream == SessionEvent::EXIT)){
+			throw std::runtime_error(std::string(path) + " contains an invalid event");
+		}
+		ev.stream = (SessionEvent::Stream)stream;
+		time += std::chrono::nanoseconds(getVarint(in, pos));
+		ev.time = time;
+		if (ev.stream == SessionEvent::EXIT){
+			ev.status = getVarint(in, pos);
+		}
+		else{
+			ev.data = getBytes(in, pos);
+		}
+		ret.events.push_back(std::move(ev));
+	}
+
+	return ret;
+}
+
+void Session::save(const char* path) const{
+	std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+	std::string out(sessionMagic);
+	std::chrono::nanoseconds prev(0);
+
+	out += (char)sessionVersion;
+	putVarint(out, args.size());
+	for (const std::string& arg : args){
+		putVarint(out, arg.size());
+		out += arg;
+	}
+
+	for (const SessionEvent& ev : events){
+		out += (char)ev.stream;
+		// store the time since the previous event, since that is almost always small enough for one or two bytes
+		putVarint(out, (ev.time - prev).count());
+		prev = ev.time;
+		if (ev.stream == SessionEvent::EXIT){
+			putVarint(out, ev.status);
+		}
+		else{
+			putVarint(out, ev.data.size());
+			out += ev.data;
+		}
+	}
+
+	if (!ofs){
+		throw std::runtime_error("Failed to create session file " + std::string(path) + " (" + std::strerror(errno) + ")");
+	}
+	ofs.write(out.data(), out.size());
+	ofs.close();
+	if (!ofs){
+		throw std::runtime_error("Failed to write to session file " + std::string(path));
+	}
+}
+
+std::string Session::getStream(SessionEvent::Stream stream) const{
+	std::string ret;
+	for (const SessionEvent& ev : events){
+		if (ev.stream == stream){
+			ret += ev.data;
+		}
+	}
+	return ret;
+}
+
+int Session::getExitStatus() const{
+	if (events.empty() || events.back().stream != SessionEvent::EXIT){
+		return -1;
+	}
+	return events.back().status;
+}
+
+int recordSession(const char* path, const std::vector<std::string>& args){
+	using Clock = std::chrono::steady_clock;
+	int inPipe[2];
+	int outPipe[2];
+	int errPipe[2];
+	Session session;
+	Clock::time_point start;
+	IgnoreSigpipe ignoreSigpipe;
+	pid_t pid;
+	int status;
+	char buf[4096];
+
+	if (pipe2(inPipe, O_CLOEXEC) != 0 || pipe2(outPipe, O_CLOEXEC) != 0 || pipe2(errPipe, O_CLOEXEC) != 0){
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+
+	session.args = args;
+	start = Clock::now();
+	pid = spawn(args, inPipe[0], outPipe[1], errPipe[1]);
+	close(inPipe[0]);
+	close(outPipe[1]);
+	close(errPipe[1]);
+
+	// [0] is the real stdin, [1] and [2] are the program's stdout and stderr
+	struct pollfd pfds[3] = {{STDIN_FILENO, POLLIN, 0}, {outPipe[0], POLLIN, 0}, {errPipe[0], POLLIN, 0}};
+	const SessionEvent::Stream streams[3] = {SessionEvent::STDIN, SessionEvent::STDOUT, SessionEvent::STDERR};
+	// where each stream is forwarded to
+	int forward[3] = {inPipe[1], STDOUT_FILENO, STDERR_FILENO};
+
+	// keep going until the program closes both stdout and stderr
+	while (pfds[1].fd >= 0 || pfds[2].fd >= 0){
+		if (poll(pfds, 3, -1) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			throw std::runtime_error("poll() failed (" + std::string(std::strerror(errno)) + ")");
+		}
+
+		for (int i = 0; i < 3; ++i){
+			ssize_t ss;
+
+			if (pfds[i].fd < 0 || pfds[i].revents == 0){
+				continue;
+			}
+			ss = read(pfds[i].fd, buf, sizeof(buf));
+			if (ss <= 0){
+				// end-of-file. for stdin, pass it on to the program. negative fds are ignored by poll()
+				if (i == 0){
+					close(inPipe[1]);
+					forward[0] = -1;
+				}
+				else{
+					close(pfds[i].fd);
+				}
+				pfds[i].fd = -1;
+				continue;
+			}
+
+			session.events.push_back(SessionEvent{streams[i], Clock::now() - start, std::string(buf, ss)});
+			// the program may have stopped reading stdin, in which case the write fails. that is part of the session, so it is not an error
+			if (forward[i] >= 0 && write(forward[i], buf, ss) != ss && i == 0){
+				close(inPipe[1]);
+				forward[0] = -1;
+				pfds[0].fd = -1;
+			}
+		}
+	}
+
+	if (forward[0] >= 0){
+		close(inPipe[1]);
+	}
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+	SessionEvent exitEvent{SessionEvent::EXIT, Clock::now() - start, ""};
+	exitEvent.status = exitStatus(status);
+	session.events.push_back(exitEvent);
+	session.save(path);
+
+	return exitEvent.status;
+}
+
+/**
+ * @brief Throws a FailedExpectation describing the first line where the actual output differs from the expected output.
+ *
+ * @param streamName The name of the stream that differs.
+ * @param expected The recorded output.
+ * @param actual The replayed output.
+ */
+static void AT_COLD throwDiff(const char* streamName, const std::string& expected, const std::string& actual){
+	size_t lineStart = 0;
+	size_t line = 1;
+	size_t i = 0;
+
+	// find the first byte that differs, keeping track of which line it is on
+	for (; i < expected.size() && i < actual.size() && expected[i] == actual[i]; ++i){
+		if (expected[i] == '\n'){
+			lineStart = i + 1;
+			line++;
+		}
+	}
+
+	std::string exLine = expected.substr(lineStart, expected.find('\n', lineStart) - lineStart);
+	std::string acLine = actual.substr(lineStart, actual.find('\n', lineStart) - lineStart);
+	throw FailedExpectation(exLine.c_str(), acLine.c_str(), (std::string(streamName) + " line " + std::to_string(line)).c_str());
+}
+
+ReplayResult replaySession(const char* path, const ReplayOptions& options){
+	using Clock = std::chrono::steady_clock;
+	Session session = Session::load(path);
+	FdCapturer in(-1, CaptureMode::INPUT);
+	FdCapturer out(-1, CaptureMode::OUTPUT);
+	FdCapturer err(-1, CaptureMode::OUTPUT);
+	std::vector<size_t> inputs;
+	std::vector<size_t> syncPoints;
+	ReplayResult result;
+	Clock::time_point start;
+	Clock::time_point deadline;
+	size_t outputSoFar = 0;
+	IgnoreSigpipe ignoreSigpipe;
+	pid_t pid;
+	int status = 0;
+	bool exited = false;
+
+	if (session.args.empty()){
+		throw std::runtime_error(std::string(path) + " does not say which program to run");
+	}
+
+	// for each chunk of input, figure out how much output the program had written before it was sent, and how long the program took to write it
+	for (size_t i = 0; i < session.events.size(); ++i){
+		const SessionEvent& ev = session.events[i];
+		if (ev.stream == SessionEvent::STDIN){
+			inputs.push_back(i);
+			syncPoints.push_back(outputSoFar);
+		}
+		else if (ev.stream != SessionEvent::EXIT){
+			outputSoFar += ev.data.size();
+		}
+	}
+	syncPoints.push_back(outputSoFar);
+
+	for (size_t k = 0; k < inputs.size(); ++k){
+		std::chrono::nanoseconds sent = session.events[inputs[k]].time;
+		std::chrono::nanoseconds responded = sent;
+		// the response is the last output written before the next chunk of input
+		size_t end = k + 1 < inputs.size() ? inputs[k + 1] : session.events.size();
+		for (size_t i = inputs[k] + 1; i < end; ++i){
+			if (session.events[i].stream == SessionEvent::STDOUT || session.events[i].stream == SessionEvent::STDERR){
+				responded = session.events[i].time;
+			}
+		}
+		result.recordedResponseTimes.push_back(responded - sent);
+	}
+
+	start = Clock::now();
+	pid = spawn(session.args, in.getFd(), out.getFd(), err.getFd());
+
+	// waits until the program has written a certain amount of output, returning false on timeout
+	auto waitForOutput = [&](size_t amount){
+		deadline = Clock::now() + options.timeout;
+		while (out.peek().size() + err.peek().size() < amount){
+			if (Clock::now() >= deadline){
+				return false;
+			}
+			// an in-memory file cannot be poll()ed, so check it often enough that response times are still meaningful
+			usleep(50);
+		}
+		return true;
+	};
+
+	for (size_t k = 0; k < inputs.size(); ++k){
+		const SessionEvent& ev = session.events[inputs[k]];
+		Clock::time_point sentAt;
+
+		if (options.preserveTiming){
+			Clock::time_point when = start + ev.time;
+			while (Clock::now() < when){
+				usleep(50);
+			}
+		}
+		else if (!waitForOutput(syncPoints[k])){
+			break;
+		}
+
+		sentAt = Clock::now();
+		in.send(ev.data.data(), ev.data.size());
+		if (!waitForOutput(syncPoints[k + 1])){
+			break;
+		}
+		result.responseTimes.push_back(Clock::now() - sentAt);
+		in.pump();
+	}
+	in.closeInput();
+
+	// give the program until the timeout to exit, then kill it
+	deadline = Clock::now() + options.timeout;
+	while (!exited){
+		in.pump();
+		pid_t res = waitpid(pid, &status, WNOHANG);
+		if (res == pid){
+			exited = true;
+		}
+		else if (Clock::now() >= deadline){
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			break;
+		}
+		else{
+			usleep(1000);
+		}
+	}
+	result.duration = Clock::now() - start;
+
+	std::string expectedOut = session.getStream(SessionEvent::STDOUT);
+	std::string expectedErr = session.getStream(SessionEvent::STDERR);
+	std::string actualOut(out.peek());
+	std::string actualErr(err.peek());
+
+	if (actualOut != expectedOut){
+		throwDiff("stdout", expectedOut, actualOut);
+	}
+	if (actualErr != expectedErr){
+		throwDiff("stderr", expectedErr, actualErr);
+	}
+	if (!exited){
+		throw FailedExpectation(std::to_string(session.getExitStatus()).c_str(), "still running", "exit status");
+	}
+	if (exitStatus(status) != session.getExitStatus()){
+		throw FailedExpectation(std::to_string(session.getExitStatus()).c_str(), std::to_string(exitStatus(status)).c_str(), "exit status");
+	}
+
+	if (options.maxSlowdown > 0){
+		for (size_t k = 0; k < result.responseTimes.size(); ++k){
+			std::chrono::nanoseconds allowed = std::chrono::nanoseconds((int64_t)(result.recordedResponseTimes[k].count() * options.maxSlowdown)) + std::chrono::milliseconds(1);
+			if (result.responseTimes[k] > allowed){
+				throw FailedExpectation((std::to_string(allowed.count() / 1000) + "us").c_str(), (std::to_string(result.responseTimes[k].count() / 1000) + "us").c_str(), ("response " + std::to_string(k + 1) + " time").c_str());
+			}
+		}
+	}
+
+	return result;
+}
+
+}
@@ -0,0 +1,227 @@
+/** @file simpletest_session.hpp
+ * @brief simpletest interactive session recording and replay.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_SESSION_HPP
+#define __SIMPLETEST_SESSION_HPP
+
+#include "simpletest.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief One chunk of a recorded session.
+ */
+struct SessionEvent{
+	/**
+	 * @brief Where the chunk came from.
+	 */
+	enum Stream : uint8_t{
+		/**
+		 * @brief Input sent to the program.
+		 */
+		STDIN = 0,
+
+		/**
+		 * @brief Output the program wrote to stdout.
+		 */
+		STDOUT = 1,
+
+		/**
+		 * @brief Output the program wrote to stderr.
+		 */
+		STDERR = 2,
+
+		/**
+		 * @brief The program exited. This is always the last event.
+		 */
+		EXIT = 3
+	};
+
+	/**
+	 * @brief Where the chunk came from.
+	 */
+	Stream stream;
+
+	/**
+	 * @brief When the chunk arrived, measured from the start of the session.
+	 */
+	std::chrono::nanoseconds time;
+
+	/**
+	 * @brief The bytes of the chunk. This is empty for Stream::EXIT.
+	 */
+	std::string data;
+
+	/**
+	 * @brief The program's exit code, or 128 + the signal number if it was killed by a signal. Only used for Stream::EXIT.
+	 */
+	int status = 0;
+};
+
+/**
+ * @brief A recorded interactive session.
+ *
+ * Sessions are stored in a compact binary format:<br>
+ * <pre>
+ * "STSESS" version(1 byte)
+ * argc(varint) {length(varint) bytes}...
+ * {stream(1 byte) time-since-previous-event-in-ns(varint) {length(varint) bytes | exit-status(varint)}}...
+ * </pre>
+ * All varints are unsigned LEB128.
+ */
+struct Session{
+	/**
+	 * @brief The program and its arguments.
+	 */
+	std::vector<std::string> args;
+
+	/**
+	 * @brief The chunks in the order they arrived.
+	 */
+	std::vector<SessionEvent> events;
+
+	/**
+	 * @brief Reads a session file.
+	 *
+	 * @param path The path of the session file.
+	 *
+	 * @return The session.
+	 *
+	 * @exception std::runtime_error Failed to read the file, or it is not a valid session file.
+	 */
+	static Session load(const char* path);
+
+	/**
+	 * @brief Writes the session to a file.
+	 *
+	 * @param path The path of the session file. If a file already exists at this path, it will be overwritten.
+	 *
+	 * @exception std::runtime_error Failed to write the file.
+	 */
+	void save(const char* path) const;
+
+	/**
+	 * @brief Returns everything sent on one stream, concatenated.
+	 *
+	 * @param stream The stream to return.
+	 */
+	std::string getStream(SessionEvent::Stream stream) const;
+
+	/**
+	 * @brief Returns the program's exit status, or -1 if the session has no exit event.
+	 */
+	int getExitStatus() const;
+};
+
+/**
+ * @brief Runs a program with the real stdin, echoing its output to the real stdout/stderr, and records the session.
+ * This is what the --record command-line option does.
+ *
+ * @param path The session file to write.
+ * @param args The program and its arguments. The program is searched for in $PATH.
+ *
+ * @return The program's exit status.
+ *
+ * @exception std::runtime_error Failed to start the program or write the session file.
+ */
+int recordSession(const char* path, const std::vector<std::string>& args);
+
+/**
+ * @brief Options for replaySession().
+ */
+struct ReplayOptions{
+	/**
+	 * @brief True to send each chunk of input at the same time it was sent in the recording.
+	 * False to send each chunk as soon as the program has written the output that preceded it in the recording.
+	 */
+	bool preserveTiming = false;
+
+	/**
+	 * @brief The longest time to wait for the program to produce the output it produced in the recording.
+	 */
+	std::chrono::milliseconds timeout{10000};
+
+	/**
+	 * @brief If greater than 0, the replay fails if any response takes longer than this many times its recorded duration (plus 1ms of slack).
+	 */
+	double maxSlowdown = 0;
+};
+
+/**
+ * @brief The timing of a replayed session.
+ */
+struct ReplayResult{
+	/**
+	 * @brief For each chunk of input, the time from sending it to the program writing the output that followed it in the recording.
+	 */
+	std::vector<std::chrono::nanoseconds> responseTimes;
+
+	/**
+	 * @brief The same as responseTimes, but measured in the recording.
+	 */
+	std::vector<std::chrono::nanoseconds> recordedResponseTimes;
+
+	/**
+	 * @brief The time from starting the program to it exiting.
+	 */
+	std::chrono::nanoseconds duration{0};
+};
+
+/**
+ * @brief Replays a recorded session and checks that the program produces the same output.
+ * Input is fed through an FdCapturer, and stdout/stderr are captured separately and compared byte for byte with the recording.
+ *
+ * @param path The session file to replay.
+ * @param options How to replay the session.
+ *
+ * @return The timing of the replay.
+ *
+ * @exception FailedExpectation The program's output or exit status differed from the recording, or it was too slow.
+ * @exception std::runtime_error Failed to read the session file or start the program.
+ */
+ReplayResult replaySession(const char* path, const ReplayOptions& options = ReplayOptions());
+
+/**
+ * @brief Defines a unit test that replays a recorded session.
+ * Record the session first with the --record command-line option.
+ *
+ * @param name The name of the test.
+ * @param path The session file to replay.
+ */
+#define REPLAY_TEST(name, path)\
+	UNIT_TEST(name){\
+		(void)__iocapt;\
+		(void)__sighand;\
+		simpletest::replaySession(path);\
+	}
+
+/**
+ * @brief Defines a unit test that replays a recorded session with its original timing.
+ * The test fails if any response is more than slowdown times slower than it was in the recording.
+ *
+ * @param name The name of the test.
+ * @param path The session file to replay.
+ * @param slowdown How many times slower than the recording a response may be.
+ */
+#define REPLAY_TEST_TIMED(name, path, slowdown)\
+	UNIT_TEST(name){\
+		simpletest::ReplayOptions __ro;\
+		(void)__iocapt;\
+		(void)__sighand;\
+		__ro.preserveTiming = true;\
+		__ro.maxSlowdown = slowdown;\
+		simpletest::replaySession(path, __ro);\
+	}
+
+}
+
+#endif
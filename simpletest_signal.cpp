@@ -35,7 +35,7 @@ static volatile sig_atomic_t s_exit = 0;
 /**
  * @brief Stores the execution context of the function to longjmp() to.
  */
-static jmp_buf s_jmpbuf;
+static sigjmp_buf s_jmpbuf;
 
 /**
  * @brief The signals we should capture.
@@ -77,8 +77,8 @@ static void handler(int signo){
 		s_exit = 1;
 	}
 	s_signo = signo;
-	// jump to a previous call to setjmp()
-	longjmp(s_jmpbuf, signo);
+	// jump to a previous call to sigsetjmp(), which also unblocks this signal, so the next one is handled as well
+	siglongjmp(s_jmpbuf, signo);
 }
 
 SignalHandler::SignalHandler(){
@@ -105,7 +105,7 @@ SignalHandler::SignalHandler(){
 
 	// longjmp() in handler() needs a corresponding setjmp() location, or bad things happen.
 	// this gives the handler a default setjmp() location
-	if (setjmp(s_jmpbuf)){
+	if (sigsetjmp(s_jmpbuf, 1)){
 		std::cerr << "An ActivateSignalHandler() location was not specified." << std::endl;
 		std::exit(1);
 	}
@@ -158,7 +158,7 @@ const char* SignalHandler::signalToString(sig_atomic_t signo){
 	}
 }
 
-jmp_buf& SignalHandler::getBuf(){
+sigjmp_buf& SignalHandler::getBuf(){
 	return s_jmpbuf;
 }
 
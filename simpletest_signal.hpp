@@ -10,6 +10,7 @@
 #define __SIMPLETEST_SIGNAL_HPP
 
 #include <csetjmp>
+#include <setjmp.h>
 #include <csignal>
 #include <iostream>
 
@@ -107,7 +108,7 @@ public:
 	 * @brief Do not call directly. Use the ActivateSignalHandler() macro instead.
 	 * Gets a reference to the jump buffer for use with the ActivateSignalHandler() macro.
 	 */
-	static jmp_buf& getBuf();
+	static sigjmp_buf& getBuf();
 
 	/**
 	 * @brief Do not call this function directly. Use the ActivateSignalHandler() macro instead.
@@ -121,8 +122,9 @@ public:
  * This allows RAII cleanup to occur when a signal is thrown.
  */
 #define ActivateSignalHandler(handler)\
-	/* returns 0 on its first call, returns signo (>0) when being jumped to through longjmp() */\
-	if (setjmp(simpletest::SignalHandler::getBuf())){\
+	/* returns 0 on its first call, returns signo (>0) when being jumped to through siglongjmp() */\
+	/* the signal mask is saved too, so the signal blocked during its handler is unblocked again after the jump */\
+	if (sigsetjmp(simpletest::SignalHandler::getBuf(), 1)){\
 		/* SIGABRT, SIGINT, etc. */\
 		if (handler.shouldExit()){\
 			std::cerr << "Terminating program (" << simpletest::SignalHandler::signalToString(handler.lastSignal()) << ")" << std::endl;\
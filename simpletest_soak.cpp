@@ -0,0 +1,376 @@
+/** @file simpletest_soak.cpp
+ * @brief simpletest soak runs that look for resource usage and latency growing over time.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_soak.hpp"
+// formatDuration()
+#include "simpletest_benchmark.hpp"
+// formatBytes()
+#include "simpletest_limits.hpp"
+
+// std::sort, std::nth_element
+#include <algorithm>
+// std::sqrt, std::llround
+#include <cmath>
+// std::map
+#include <map>
+// std::setw
+#include <iomanip>
+// std::ostringstream
+#include <sstream>
+// std::strtoull
+#include <cstdlib>
+// mallinfo2()
+#include <malloc.h>
+// opendir(), readdir(), dirfd()
+#include <dirent.h>
+// open()
+#include <fcntl.h>
+// read(), close(), sysconf()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief How many intervals a soak run is split into, each of which gets one sample of each measurement.
+ */
+static const size_t soakIntervals = 100;
+
+/**
+ * @brief How many of the first intervals are left out of the fits, while caches and pools are still filling up.
+ */
+static const size_t warmupIntervals = 10;
+
+/**
+ * @brief The fewest samples a trend is judged on.
+ */
+static const size_t minSamples = 8;
+
+/**
+ * @brief The Mann-Kendall z above which a trend is significant, which is a one-sided p of 0.001.
+ */
+static const double significantZ = 3.09;
+
+/**
+ * @brief A measurement sampled over a soak run.
+ */
+struct SoakSeries{
+	/**
+	 * @brief What was measured.
+	 */
+	std::string name;
+
+	/**
+	 * @brief What the values are.
+	 */
+	SoakUnit unit;
+
+	/**
+	 * @brief The latencies reported during the current interval, for latency series.
+	 */
+	std::vector<std::chrono::nanoseconds> pending;
+
+	/**
+	 * @brief The (seconds since the start, value) samples.
+	 */
+	std::vector<std::pair<double, double>> points;
+};
+
+struct SoakMonitorImpl{
+	/**
+	 * @brief When the run started.
+	 */
+	std::chrono::steady_clock::time_point start;
+
+	/**
+	 * @brief How long the run is to take.
+	 */
+	std::chrono::steady_clock::duration duration;
+
+	/**
+	 * @brief Where progress is printed.
+	 */
+	std::ostream* progress;
+
+	/**
+	 * @brief The index of the interval the next sample is due at the end of.
+	 */
+	size_t interval = 0;
+
+	/**
+	 * @brief The number of calls to sample().
+	 */
+	size_t iterations = 0;
+
+	/**
+	 * @brief The resident memory, open file descriptors and heap, followed by the latencies in the order they were first reported.
+	 */
+	std::vector<SoakSeries> series;
+
+	/**
+	 * @brief The index in series of each latency series, by name.
+	 */
+	std::map<std::string, size_t> latencyIndex;
+};
+
+/**
+ * @brief Returns the median of the values in v, which must not be empty. v is reordered.
+ */
+template <typename T>
+static T median(std::vector<T>& v){
+	std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+	return v[v.size() / 2];
+}
+
+TrendFit fitTrend(const std::vector<std::pair<double, double>>& points){
+	std::vector<std::pair<double, double>> sorted = points;
+	std::vector<double> slopes;
+	std::vector<double> intercepts;
+	double n = sorted.size();
+	double s = 0;
+	double var;
+	TrendFit ret;
+
+	if (sorted.size() < 2){
+		return ret;
+	}
+	std::sort(sorted.begin(), sorted.end());
+	for (size_t i = 0; i < sorted.size(); ++i){
+		for (size_t j = i + 1; j < sorted.size(); ++j){
+			double dy = sorted[j].second - sorted[i].second;
+			double dt = sorted[j].first - sorted[i].first;
+
+			s += (dy > 0) - (dy < 0);
+			if (dt > 0){
+				slopes.push_back(dy / dt);
+			}
+		}
+	}
+	if (!slopes.empty()){
+		ret.slope = median(slopes);
+	}
+	for (const auto& p : sorted){
+		intercepts.push_back(p.second - ret.slope * p.first);
+	}
+	ret.intercept = median(intercepts);
+
+	// the variance of s when there is no trend. ties make the real one smaller, so this errs on the side of no trend.
+	var = n * (n - 1) * (2 * n + 5) / 18;
+	if (s > 0){
+		ret.z = (s - 1) / std::sqrt(var);
+	}
+	else if (s < 0){
+		ret.z = (s + 1) / std::sqrt(var);
+	}
+	return ret;
+}
+
+/**
+ * @brief Returns the resident memory of this process in bytes, or 0 if it cannot be read.
+ */
+static size_t residentBytes(){
+	char buf[256];
+	int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	ssize_t len;
+	char* p;
+
+	if (fd < 0){
+		return 0;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0){
+		return 0;
+	}
+	buf[len] = '\0';
+	// "size resident shared ...", in pages
+	std::strtoull(buf, &p, 10);
+	return std::strtoull(p, nullptr, 10) * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Returns the number of file descriptors this process has open.
+ */
+static size_t openFds(){
+	DIR* d = opendir("/proc/self/fd");
+	struct dirent* de;
+	size_t ret = 0;
+
+	if (d == nullptr){
+		return 0;
+	}
+	while ((de = readdir(d)) != nullptr){
+		// the directory's own descriptor is not one the tests opened
+		if (de->d_name[0] != '.' && std::atoi(de->d_name) != dirfd(d)){
+			ret++;
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+/**
+ * @brief Returns the bytes of heap memory in use, including blocks big enough to get a mapping of their own.
+ */
+static size_t heapInUse(){
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+/**
+ * @brief Formats a value of a SoakTrend, which may be fractional or negative.
+ */
+static std::string formatValue(SoakUnit unit, double v){
+	std::ostringstream oss;
+
+	if (v < 0){
+		return "-" + formatValue(unit, -v);
+	}
+	switch (unit){
+	case SoakUnit::BYTES:
+		return formatBytes(std::llround(v));
+	case SoakUnit::NANOSECONDS:
+		return formatDuration(std::chrono::nanoseconds(std::llround(v)));
+	default:
+		oss << std::fixed << std::setprecision(v == std::floor(v) ? 0 : 2) << v;
+		return oss.str();
+	}
+}
+
+SoakMonitor::SoakMonitor(std::chrono::seconds duration, std::ostream& progress): impl(std::make_unique<SoakMonitorImpl>()){
+	impl->start = std::chrono::steady_clock::now();
+	impl->duration = duration;
+	impl->progress = &progress;
+	impl->series.push_back({"RSS", SoakUnit::BYTES, {}, {}});
+	impl->series.push_back({"open fds", SoakUnit::COUNT, {}, {}});
+	impl->series.push_back({"heap", SoakUnit::BYTES, {}, {}});
+}
+
+SoakMonitor::~SoakMonitor() = default;
+
+bool SoakMonitor::done() const{
+	return std::chrono::steady_clock::now() - impl->start >= impl->duration;
+}
+
+void SoakMonitor::recordLatency(const std::string& series, std::chrono::nanoseconds latency){
+	auto it = impl->latencyIndex.find(series);
+
+	if (it == impl->latencyIndex.end()){
+		it = impl->latencyIndex.emplace(series, impl->series.size()).first;
+		impl->series.push_back({series, SoakUnit::NANOSECONDS, {}, {}});
+	}
+	impl->series[it->second].pending.push_back(latency);
+}
+
+void SoakMonitor::sample(){
+	auto elapsed = std::chrono::steady_clock::now() - impl->start;
+	size_t interval = elapsed * soakIntervals / impl->duration;
+	double t = std::chrono::duration<double>(elapsed).count();
+	size_t rss;
+	size_t fds;
+	size_t heap;
+
+	impl->iterations++;
+	if (interval <= impl->interval && elapsed < impl->duration){
+		return;
+	}
+
+	rss = residentBytes();
+	fds = openFds();
+	heap = heapInUse();
+	impl->series[0].points.emplace_back(t, rss);
+	impl->series[1].points.emplace_back(t, fds);
+	impl->series[2].points.emplace_back(t, heap);
+	for (SoakSeries& s : impl->series){
+		if (!s.pending.empty()){
+			s.points.emplace_back(t, median(s.pending).count());
+			s.pending.clear();
+		}
+	}
+
+	// one line for each tenth of the run that went by, even if a long iteration skipped some
+	if (interval / 10 > impl->interval / 10 || elapsed >= impl->duration){
+		*impl->progress << "Soak " << std::min<size_t>(interval, soakIntervals) << "%: " << impl->iterations << " iterations, RSS " << formatBytes(rss) << ", " << fds << " open fds, heap " << formatBytes(heap) << std::endl;
+	}
+	impl->interval = interval;
+}
+
+size_t SoakMonitor::getIterations() const{
+	return impl->iterations;
+}
+
+std::vector<SoakTrend> SoakMonitor::getTrends() const{
+	double warmup = std::chrono::duration<double>(impl->duration).count() * warmupIntervals / soakIntervals;
+	std::vector<SoakTrend> ret;
+
+	for (const SoakSeries& s : impl->series){
+		std::vector<std::pair<double, double>> points;
+		SoakTrend trend;
+		TrendFit fit;
+		double growth;
+
+		for (const auto& p : s.points){
+			if (p.first >= warmup){
+				points.push_back(p);
+			}
+		}
+		trend.name = s.name;
+		trend.unit = s.unit;
+		trend.samples = points.size();
+		if (points.empty()){
+			ret.push_back(trend);
+			continue;
+		}
+		fit = fitTrend(points);
+		trend.start = fit.intercept + fit.slope * points.front().first;
+		trend.end = fit.intercept + fit.slope * points.back().first;
+		trend.perHour = fit.slope * 3600;
+		growth = trend.end - trend.start;
+
+		// significant, and big enough to matter
+		if (trend.samples >= minSamples && fit.z > significantZ){
+			switch (s.unit){
+			case SoakUnit::BYTES:
+				trend.growing = growth >= 64 * 1024 && growth >= trend.start * 0.02;
+				break;
+			case SoakUnit::COUNT:
+				trend.growing = growth >= 1;
+				break;
+			case SoakUnit::NANOSECONDS:
+				trend.growing = growth >= trend.start * 0.1;
+				break;
+			}
+		}
+		ret.push_back(trend);
+	}
+	return ret;
+}
+
+void printSoakReport(std::ostream& os, const std::vector<SoakTrend>& trends){
+	size_t width = 0;
+
+	for (const SoakTrend& t : trends){
+		width = std::max(width, t.name.size());
+	}
+	os << std::endl;
+	os << "Trends:" << std::endl;
+	for (const SoakTrend& t : trends){
+		os << "  " << std::left << std::setw(width) << t.name << "  ";
+		if (t.samples < minSamples){
+			os << "too few samples (" << t.samples << ") to tell" << std::endl;
+			continue;
+		}
+		os << formatValue(t.unit, t.start) << " -> " << formatValue(t.unit, t.end) << ", " << (t.perHour >= 0 ? "+" : "") << formatValue(t.unit, t.perHour) << " per hour";
+		if (t.growing){
+			os << "  GROWING";
+		}
+		os << std::endl;
+	}
+}
+
+}
@@ -0,0 +1,189 @@
+/** @file simpletest_soak.hpp
+ * @brief simpletest soak runs that look for resource usage and latency growing over time.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_SOAK_HPP
+#define __SIMPLETEST_SOAK_HPP
+
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief A straight line fit through measurements taken over time, and how sure it is that they go up.
+ */
+struct TrendFit{
+	/**
+	 * @brief How much the measurements change per second.
+	 * This is the Theil-Sen estimate, the median of the slopes between every pair of points, so a few outliers such as a garbage collection pause do not move it.
+	 */
+	double slope = 0;
+
+	/**
+	 * @brief The fitted value at time 0.
+	 */
+	double intercept = 0;
+
+	/**
+	 * @brief The Mann-Kendall statistic, which is positive when later measurements tend to be higher than earlier ones and negative when they tend to be lower.
+	 * It is roughly normally distributed when there is no trend, so above 3.09 there is less than a 0.1% chance that the measurements only go up by accident.
+	 */
+	double z = 0;
+};
+
+/**
+ * @brief Fits a TrendFit through measurements.
+ * This takes O(n^2 log n) time for n points.
+ *
+ * @param points The (seconds, value) pairs, in any order.
+ *
+ * @return The fit. All zero if there are fewer than 2 points.
+ */
+TrendFit fitTrend(const std::vector<std::pair<double, double>>& points);
+
+/**
+ * @brief What the values of a SoakSeries are.
+ */
+enum class SoakUnit{
+	/**
+	 * @brief A number of bytes.
+	 */
+	BYTES,
+
+	/**
+	 * @brief A count of something, for example open file descriptors.
+	 */
+	COUNT,
+
+	/**
+	 * @brief A duration in nanoseconds.
+	 */
+	NANOSECONDS
+};
+
+/**
+ * @brief The trend of one measurement over a soak run.
+ */
+struct SoakTrend{
+	/**
+	 * @brief What was measured, for example "RSS" or a test's name.
+	 */
+	std::string name;
+
+	/**
+	 * @brief What the values are.
+	 */
+	SoakUnit unit = SoakUnit::COUNT;
+
+	/**
+	 * @brief The number of samples the trend was fit through.
+	 */
+	size_t samples = 0;
+
+	/**
+	 * @brief The fitted value when the samples it was fit through start.
+	 */
+	double start = 0;
+
+	/**
+	 * @brief The fitted value when they end.
+	 */
+	double end = 0;
+
+	/**
+	 * @brief How much it grows per hour according to the fit.
+	 */
+	double perHour = 0;
+
+	/**
+	 * @brief True if it kept going up by more than noise would explain.
+	 */
+	bool growing = false;
+};
+
+struct SoakMonitorImpl;
+
+/**
+ * @brief Samples the process's resident memory, open file descriptors and heap, and the latencies reported to it, while tests run over and over, and fits trends through them at the end.
+ * The run is split into 100 intervals, and each gets one sample of each measurement: the resource usage at its end, and the median of the latencies reported during it. The samples from the first 10% of the run are left out of the fits, since caches and pools are still filling up then.
+ * A measurement is growing if its trend is significant (a Mann-Kendall z above 3.09) and it grew by enough to matter over the samples: 1 for counts, 64 KiB and 2% for bytes, and 10% for latencies.
+ */
+class SoakMonitor{
+public:
+	/**
+	 * @brief Starts the clock.
+	 *
+	 * @param duration How long the run is to take.
+	 * @param progress Where to print a line about the measurements every 10% of the run.
+	 */
+	SoakMonitor(std::chrono::seconds duration, std::ostream& progress);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	SoakMonitor(const SoakMonitor& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	SoakMonitor& operator=(const SoakMonitor& other) = delete;
+
+	/**
+	 * @brief Destructor for SoakMonitor.
+	 */
+	~SoakMonitor();
+
+	/**
+	 * @brief Returns true once the duration is up.
+	 */
+	bool done() const;
+
+	/**
+	 * @brief Reports how long something took once, for example one run of a test.
+	 *
+	 * @param series The name of what was measured. Each name gets a trend of its own, in the order they were first reported.
+	 * @param latency How long it took.
+	 */
+	void recordLatency(const std::string& series, std::chrono::nanoseconds latency);
+
+	/**
+	 * @brief Samples the measurements if the current interval is over. Call this between iterations, when nothing the tests do is in progress.
+	 */
+	void sample();
+
+	/**
+	 * @brief Returns the number of times sample() was called, which is the number of iterations.
+	 */
+	size_t getIterations() const;
+
+	/**
+	 * @brief Fits a trend through the samples of each measurement.
+	 *
+	 * @return The trends of the resident memory, open file descriptors and heap, followed by those of the latencies.
+	 */
+	std::vector<SoakTrend> getTrends() const;
+
+private:
+	std::unique_ptr<SoakMonitorImpl> impl;
+};
+
+/**
+ * @brief Prints a table of the trends of a soak run, marking the ones that are growing.
+ *
+ * @param os Where to print it.
+ * @param trends The trends.
+ */
+void printSoakReport(std::ostream& os, const std::vector<SoakTrend>& trends);
+
+}
+
+#endif
@@ -0,0 +1,410 @@
+/** @file simpletest_startup.cpp
+ * @brief simpletest process startup benchmarks.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_startup.hpp"
+
+// std::sort
+#include <algorithm>
+// std::runtime_error
+#include <stdexcept>
+// std::strerror, std::memcmp
+#include <cstring>
+// Elf64_Ehdr, Elf64_Phdr, PT_INTERP
+#include <elf.h>
+// posix_spawn()
+#include <spawn.h>
+// poll()
+#include <poll.h>
+// wait4()
+#include <sys/wait.h>
+// struct rusage
+#include <sys/resource.h>
+// pipe2(), open(), posix_fadvise()
+#include <fcntl.h>
+// read(), pread(), close(), access()
+#include <unistd.h>
+// kill()
+#include <csignal>
+
+extern char** environ;
+
+namespace simpletest{
+
+/**
+ * @brief Finds a program the same way execvp() would.
+ *
+ * @param name The program's name or path.
+ *
+ * @return The program's path.
+ *
+ * @exception std::runtime_error The program is not in $PATH.
+ */
+static std::string resolveProgram(const std::string& name){
+	const char* path = getenv("PATH");
+	std::string dirs = path ? path : "/usr/local/bin:/bin:/usr/bin";
+	size_t pos = 0;
+
+	if (name.find('/') != std::string::npos){
+		return name;
+	}
+
+	while (pos <= dirs.size()){
+		size_t end = dirs.find(':', pos);
+		std::string dir;
+		std::string candidate;
+
+		if (end == std::string::npos){
+			end = dirs.size();
+		}
+		dir = dirs.substr(pos, end - pos);
+		// an empty entry means the current directory
+		candidate = (dir.empty() ? "." : dir) + "/" + name;
+		if (access(candidate.c_str(), X_OK) == 0){
+			return candidate;
+		}
+		pos = end + 1;
+	}
+	throw std::runtime_error("Could not find " + name + " in $PATH");
+}
+
+/**
+ * @brief Starts a program with its stdin and output redirected.
+ *
+ * @param path The program's path.
+ * @param args The program followed by its arguments.
+ * @param env The program's environment.
+ * @param in The file descriptor to use as stdin.
+ * @param out The file descriptor to use as stdout and stderr.
+ *
+ * @return The program's process id.
+ */
+static pid_t spawn(const std::string& path, const std::vector<std::string>& args, char** env, int in, int out){
+	posix_spawn_file_actions_t fa;
+	std::vector<char*> argv;
+	pid_t pid;
+	int res;
+
+	for (const std::string& arg : args){
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, out, STDERR_FILENO);
+	res = posix_spawn(&pid, path.c_str(), &fa, nullptr, argv.data(), env);
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (res != 0){
+		throw std::runtime_error("Failed to start " + path + " (" + std::strerror(res) + ")");
+	}
+	return pid;
+}
+
+/**
+ * @brief Reads the dynamic loader an ELF program asks for in its PT_INTERP program header.
+ *
+ * @param fd The program, opened for reading.
+ *
+ * @return The loader's path, or empty if it has none.
+ */
+template <typename Ehdr, typename Phdr>
+static std::string readInterpreter(int fd){
+	Ehdr eh;
+
+	if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || eh.e_phentsize != sizeof(Phdr)){
+		return "";
+	}
+	for (size_t i = 0; i < eh.e_phnum; ++i){
+		Phdr ph;
+		std::string interp;
+
+		if (pread(fd, &ph, sizeof(ph), eh.e_phoff + i * sizeof(ph)) != sizeof(ph)){
+			return "";
+		}
+		if (ph.p_type != PT_INTERP){
+			continue;
+		}
+		if (ph.p_filesz == 0 || ph.p_filesz > 4096){
+			return "";
+		}
+		interp.resize(ph.p_filesz);
+		if (pread(fd, &(interp[0]), interp.size(), ph.p_offset) != (ssize_t)interp.size()){
+			return "";
+		}
+		return interp.substr(0, interp.find('\0'));
+	}
+	return "";
+}
+
+/**
+ * @brief Finds the dynamic loader of a program.
+ *
+ * @param path The program's path.
+ *
+ * @return The loader's path, or empty for static programs and anything that is not an ELF file, like a script.
+ */
+static std::string findInterpreter(const std::string& path){
+	unsigned char ident[EI_NIDENT];
+	std::string ret;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0){
+		return ret;
+	}
+	if (pread(fd, ident, sizeof(ident), 0) == sizeof(ident) && std::memcmp(ident, ELFMAG, SELFMAG) == 0){
+		ret = ident[EI_CLASS] == ELFCLASS64 ? readInterpreter<Elf64_Ehdr, Elf64_Phdr>(fd) : readInterpreter<Elf32_Ehdr, Elf32_Phdr>(fd);
+	}
+	close(fd);
+	return ret;
+}
+
+/**
+ * @brief Lists the shared libraries a program loads, including the dynamic loader.
+ * This asks the dynamic loader itself by running the program with LD_TRACE_LOADED_OBJECTS=1, which is what ldd does.
+ * Only glibc's loader knows that variable, and a static program has no loader to see it, so anything else would just run. Those programs are checked for first and get no libraries.
+ *
+ * @param path The program's path.
+ *
+ * @return The libraries' paths. This is empty for static programs, scripts, and programs with a loader other than glibc's, like musl's.
+ */
+static std::vector<std::string> findLibraries(const std::string& path){
+	std::vector<std::string> env;
+	std::vector<char*> envp;
+	std::vector<std::string> libs;
+	std::string out;
+	char buf[4096];
+	ssize_t ss;
+	int fds[2];
+	int devnull;
+	int status;
+	pid_t pid;
+	size_t pos = 0;
+	std::string interp = findInterpreter(path);
+	std::string loader = interp.substr(interp.rfind('/') + 1);
+
+	// glibc's loader is ld-linux*.so, ld64.so or ld.so depending on the architecture
+	if (loader.compare(0, 8, "ld-linux") != 0 && loader.compare(0, 7, "ld64.so") != 0 && loader.compare(0, 5, "ld.so") != 0){
+		return libs;
+	}
+
+	for (char** e = environ; *e; ++e){
+		env.push_back(*e);
+	}
+	env.push_back("LD_TRACE_LOADED_OBJECTS=1");
+	for (std::string& e : env){
+		envp.push_back(const_cast<char*>(e.c_str()));
+	}
+	envp.push_back(nullptr);
+
+	if (pipe2(fds, O_CLOEXEC) != 0){
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+	devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	try{
+		pid = spawn(path, {path}, envp.data(), devnull, fds[1]);
+	}
+	catch (...){
+		close(fds[0]);
+		close(fds[1]);
+		close(devnull);
+		throw;
+	}
+	close(fds[1]);
+	close(devnull);
+
+	while ((ss = read(fds[0], buf, sizeof(buf))) > 0 || (ss < 0 && errno == EINTR)){
+		if (ss > 0){
+			out.append(buf, ss);
+		}
+	}
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	// lines look like "libc.so.6 => /lib/libc.so.6 (0x...)" or "/lib64/ld-linux-x86-64.so.2 (0x...)"
+	while (pos < out.size()){
+		size_t end = out.find('\n', pos);
+		std::string line = out.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+		size_t arrow = line.find("=> ");
+		size_t start = arrow != std::string::npos ? arrow + 3 : line.find_first_not_of(" \t");
+
+		if (start != std::string::npos && start < line.size() && line[start] == '/'){
+			libs.push_back(line.substr(start, line.find(' ', start) - start));
+		}
+		if (end == std::string::npos){
+			break;
+		}
+		pos = end + 1;
+	}
+	return libs;
+}
+
+/**
+ * @brief Asks the kernel to drop a file's pages from the page cache.
+ */
+static void evict(const std::string& path){
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0){
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/**
+ * @brief Starts the program once and measures it.
+ */
+static StartupRun runOnce(const std::string& path, const std::vector<std::string>& args, std::chrono::milliseconds timeout){
+	StartupRun run;
+	struct rusage ru;
+	char buf[4096];
+	int fds[2];
+	int devnull;
+	int status;
+	pid_t pid;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point deadline;
+
+	if (pipe2(fds, O_CLOEXEC) != 0){
+		throw std::runtime_error("Failed to create pipe (" + std::string(std::strerror(errno)) + ")");
+	}
+	devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	start = std::chrono::steady_clock::now();
+	deadline = start + timeout;
+	try{
+		pid = spawn(path, args, environ, devnull, fds[1]);
+	}
+	catch (...){
+		close(fds[0]);
+		close(fds[1]);
+		close(devnull);
+		throw;
+	}
+	// the program must hold the only writing end, so its exit shows up as EOF
+	close(fds[1]);
+	close(devnull);
+
+	for (;;){
+		struct pollfd pfd = {fds[0], POLLIN, 0};
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		ssize_t ss;
+
+		if (remaining.count() <= 0 || poll(&pfd, 1, remaining.count()) == 0){
+			kill(pid, SIGKILL);
+			wait4(pid, &status, 0, &ru);
+			close(fds[0]);
+			throw std::runtime_error(path + " did not exit within " + std::to_string(timeout.count()) + "ms");
+		}
+
+		ss = read(fds[0], buf, sizeof(buf));
+		if (ss > 0 && run.firstByte.count() < 0){
+			run.firstByte = std::chrono::steady_clock::now() - start;
+		}
+		if (ss == 0 || (ss < 0 && errno != EINTR)){
+			break;
+		}
+	}
+	close(fds[0]);
+
+	while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR);
+	run.exit = std::chrono::steady_clock::now() - start;
+
+	run.minorFaults = ru.ru_minflt;
+	run.majorFaults = ru.ru_majflt;
+	run.maxRss = ru.ru_maxrss;
+	run.status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+	return run;
+}
+
+/**
+ * @brief Returns the median of some values.
+ */
+static long median(std::vector<long> vals){
+	if (vals.empty()){
+		return 0;
+	}
+	std::sort(vals.begin(), vals.end());
+	return vals[vals.size() / 2];
+}
+
+std::vector<StartupRun> startupBenchmark(const char* path, const std::vector<std::string>& args, const StartupOptions& options){
+	std::string resolved = resolveProgram(path);
+	std::vector<std::string> argv = {path};
+	std::vector<std::string> files;
+	std::vector<StartupRun> runs;
+	Benchmark firstByte;
+	Benchmark exit;
+	std::vector<long> minor;
+	std::vector<long> major;
+	std::vector<long> rss;
+	const char* testName = getCurrentTestName();
+	std::string name;
+
+	argv.insert(argv.end(), args.begin(), args.end());
+	if (options.runs == 0){
+		return runs;
+	}
+
+	if (options.cold){
+		files = findLibraries(resolved);
+		files.push_back(resolved);
+	}
+
+	for (size_t i = 0; i < options.runs; ++i){
+		StartupRun run;
+
+		// this process has libc and the loader mapped itself, so their pages stay cached and only the program's own libraries start cold
+		for (const std::string& f : files){
+			evict(f);
+		}
+		run = runOnce(resolved, argv, options.timeout);
+
+		if (run.firstByte.count() >= 0){
+			firstByte.samples.push_back(run.firstByte);
+		}
+		exit.samples.push_back(run.exit);
+		minor.push_back(run.minorFaults);
+		major.push_back(run.majorFaults);
+		rss.push_back(run.maxRss);
+		runs.push_back(run);
+	}
+
+	for (const std::string& arg : argv){
+		name += (name.empty() ? "" : " ") + arg;
+	}
+	name = std::string(testName ? testName : "STARTUP_BENCHMARK") + ": " + name + (options.cold ? " (cold)" : " (warm)");
+
+	if (!firstByte.samples.empty()){
+		firstByte.name = name + " time to first byte";
+		reportBenchmark(std::move(firstByte));
+	}
+	exit.name = name + " time to exit";
+	exit.details.push_back({"page faults", "minor p50 " + std::to_string(median(minor)) + ", major p50 " + std::to_string(median(major))});
+	exit.details.push_back({"max RSS", "p50 " + std::to_string(median(rss)) + " kB, max " + std::to_string(*std::max_element(rss.begin(), rss.end())) + " kB"});
+	if (options.cold){
+		exit.details.push_back({"evicted files", std::to_string(files.size())});
+	}
+	if (runs.back().status != 0){
+		exit.details.push_back({"exit status", std::to_string(runs.back().status)});
+	}
+	reportBenchmark(std::move(exit));
+
+	return runs;
+}
+
+std::vector<StartupRun> __startupbenchmark(bool cold, const std::vector<std::string>& argv){
+	StartupOptions opt;
+
+	opt.cold = cold;
+	return startupBenchmark(argv[0].c_str(), std::vector<std::string>(argv.begin() + 1, argv.end()), opt);
+}
+
+}
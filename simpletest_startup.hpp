@@ -0,0 +1,130 @@
+/** @file simpletest_startup.hpp
+ * @brief simpletest process startup benchmarks.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_STARTUP_HPP
+#define __SIMPLETEST_STARTUP_HPP
+
+#include "simpletest.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+/**
+ * @brief Options for startupBenchmark().
+ */
+struct StartupOptions{
+	/**
+	 * @brief The number of times to start the program.
+	 */
+	size_t runs = 20;
+
+	/**
+	 * @brief True to evict the program and its shared libraries from the page cache before each run.
+	 * Eviction uses posix_fadvise(POSIX_FADV_DONTNEED), which cannot evict pages that another process has mapped, so libraries like libc usually stay cached anyway.
+	 * The libraries are only known for programs that use glibc's dynamic loader, so static programs, scripts and programs built against another libc only have their own file evicted.
+	 * Check the major page fault counts to see how cold the runs really were.
+	 */
+	bool cold = false;
+
+	/**
+	 * @brief The longest time a single run may take.
+	 */
+	std::chrono::milliseconds timeout{10000};
+};
+
+/**
+ * @brief The measurements of one run of startupBenchmark().
+ */
+struct StartupRun{
+	/**
+	 * @brief The time from spawning the program to it writing its first byte to stdout or stderr, or -1ns if it wrote nothing.
+	 */
+	std::chrono::nanoseconds firstByte{-1};
+
+	/**
+	 * @brief The time from spawning the program to it exiting.
+	 */
+	std::chrono::nanoseconds exit{0};
+
+	/**
+	 * @brief The page faults that did not need I/O.
+	 */
+	long minorFaults = 0;
+
+	/**
+	 * @brief The page faults that needed I/O. These are high for cold runs.
+	 */
+	long majorFaults = 0;
+
+	/**
+	 * @brief The peak resident set size in kilobytes.
+	 */
+	long maxRss = 0;
+
+	/**
+	 * @brief The program's exit code, or 128 + the signal number if it was killed by a signal.
+	 */
+	int status = 0;
+};
+
+/**
+ * @brief Repeatedly starts a program and measures how long it takes to produce output and to exit.
+ * The program's stdin is /dev/null and its output is discarded.
+ * The results are added to the benchmark report printed after the test results.
+ *
+ * @param path The program. If this does not contain a '/', it is searched for in $PATH.
+ * @param args The program's arguments, not including the program itself.
+ * @param options How to run the benchmark.
+ *
+ * @return The measurements of each run.
+ *
+ * @exception std::runtime_error Failed to start the program, or a run took longer than options.timeout.
+ */
+std::vector<StartupRun> startupBenchmark(const char* path, const std::vector<std::string>& args, const StartupOptions& options = StartupOptions());
+
+/**
+ * @brief Benchmarks a program's startup with a warm page cache.
+ * See startupBenchmark() for details.
+ *
+ * Usage: STARTUP_BENCHMARK("/usr/bin/mytool", "--version");
+ *
+ * @param ... The program followed by its arguments, as strings.
+ */
+#define STARTUP_BENCHMARK(...)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__startupbenchmark(false, {__VA_ARGS__})
+
+/**
+ * @brief Benchmarks a program's startup with its binary and shared libraries evicted from the page cache before each run.
+ * See startupBenchmark() for details.
+ *
+ * @param ... The program followed by its arguments, as strings.
+ */
+#define STARTUP_BENCHMARK_COLD(...)\
+	/* silences unused __iocapt warning */\
+	(void)__iocapt;\
+	/* silences unused __sighand warning */\
+	(void)__sighand;\
+	simpletest::__startupbenchmark(true, {__VA_ARGS__})
+
+/**
+ * @brief Do not call this function directly. Use the STARTUP_BENCHMARK() or STARTUP_BENCHMARK_COLD() macros instead.
+ *
+ * @param cold True to evict the program from the page cache before each run.
+ * @param argv The program followed by its arguments.
+ */
+std::vector<StartupRun> __startupbenchmark(bool cold, const std::vector<std::string>& argv);
+
+}
+
+#endif
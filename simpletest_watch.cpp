@@ -0,0 +1,234 @@
+/** @file simpletest_watch.cpp
+ * @brief simpletest test suites loaded from shared objects and reloaded when they are rebuilt.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "simpletest_watch.hpp"
+
+// std::map
+#include <map>
+// std::set
+#include <set>
+// std::runtime_error
+#include <stdexcept>
+// std::strerror
+#include <cstring>
+// errno
+#include <cerrno>
+// getenv(), mkdtemp()
+#include <cstdlib>
+// dlopen(), dlclose(), dlerror()
+#include <dlfcn.h>
+// open()
+#include <fcntl.h>
+// poll()
+#include <poll.h>
+// inotify_init1(), inotify_add_watch()
+#include <sys/inotify.h>
+// read(), write(), close(), unlink(), rmdir()
+#include <unistd.h>
+
+namespace simpletest{
+
+/**
+ * @brief How long nothing has to be written to the suites' files before a change is picked up, in milliseconds.
+ */
+static const int settleMs = 300;
+
+/**
+ * @brief A suite being watched.
+ */
+struct WatchedSuite{
+	/**
+	 * @brief The path it was given as.
+	 */
+	std::string path;
+
+	/**
+	 * @brief The directory its file is in.
+	 */
+	std::string dir;
+
+	/**
+	 * @brief Its file's name within the directory.
+	 */
+	std::string file;
+
+	/**
+	 * @brief Its handle from dlopen(), or nullptr if it is not loaded.
+	 */
+	void* handle = nullptr;
+};
+
+struct SuiteWatcherImpl{
+	/**
+	 * @brief The suites.
+	 */
+	std::vector<WatchedSuite> suites;
+
+	/**
+	 * @brief The inotify descriptor.
+	 */
+	int fd = -1;
+
+	/**
+	 * @brief The directory each inotify watch descriptor is for.
+	 */
+	std::map<int, std::string> watches;
+};
+
+/**
+ * @brief Copies a file, replacing the destination.
+ *
+ * @exception std::runtime_error Failed to read or write it.
+ */
+static void copyFile(const std::string& from, const std::string& to){
+	char buf[65536];
+	int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	int out;
+	ssize_t n;
+
+	if (in < 0){
+		throw std::runtime_error("Failed to open " + from + " (" + std::strerror(errno) + ")");
+	}
+	out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0700);
+	if (out < 0){
+		int err = errno;
+		close(in);
+		throw std::runtime_error("Failed to create " + to + " (" + std::strerror(err) + ")");
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0){
+		for (ssize_t done = 0; done < n; ){
+			ssize_t w = write(out, buf + done, n - done);
+			if (w < 0 && errno != EINTR){
+				int err = errno;
+				close(in);
+				close(out);
+				throw std::runtime_error("Failed to write " + to + " (" + std::strerror(err) + ")");
+			}
+			done += w > 0 ? w : 0;
+		}
+	}
+	close(in);
+	if (close(out) != 0 || n < 0){
+		throw std::runtime_error("Failed to copy " + from + " (" + std::strerror(errno) + ")");
+	}
+}
+
+SuiteWatcher::SuiteWatcher(const std::vector<std::string>& paths): impl(std::make_unique<SuiteWatcherImpl>()){
+	impl->fd = inotify_init1(IN_CLOEXEC);
+	if (impl->fd < 0){
+		throw std::runtime_error("Failed to set up inotify (" + std::string(std::strerror(errno)) + ")");
+	}
+
+	for (const std::string& path : paths){
+		WatchedSuite s;
+		size_t slash = path.find_last_of('/');
+
+		s.path = path;
+		s.dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+		s.file = slash == std::string::npos ? path : path.substr(slash + 1);
+		impl->suites.push_back(s);
+	}
+	for (const WatchedSuite& s : impl->suites){
+		// the directory rather than the file, since a linker replaces the file instead of writing to it
+		int wd = inotify_add_watch(impl->fd, s.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0){
+			int err = errno;
+			close(impl->fd);
+			throw std::runtime_error("Failed to watch " + s.dir + " (" + std::strerror(err) + ")");
+		}
+		impl->watches[wd] = s.dir;
+	}
+}
+
+SuiteWatcher::~SuiteWatcher(){
+	for (size_t i = 0; i < impl->suites.size(); ++i){
+		unload(i);
+	}
+	close(impl->fd);
+}
+
+size_t SuiteWatcher::size() const{
+	return impl->suites.size();
+}
+
+const std::string& SuiteWatcher::getPath(size_t suite) const{
+	return impl->suites[suite].path;
+}
+
+void SuiteWatcher::load(size_t suite){
+	WatchedSuite& s = impl->suites[suite];
+	const char* tmp = getenv("TMPDIR");
+	// a new directory every time, since the C library hands back the library it already has for a name it has seen
+	std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/simpletest-watch-XXXXXX";
+	std::string copy;
+	void* handle;
+
+	if (mkdtemp(&dir[0]) == nullptr){
+		throw std::runtime_error("Failed to create a directory to copy " + s.path + " to (" + std::strerror(errno) + ")");
+	}
+	copy = dir + "/" + s.file;
+	try{
+		copyFile(s.path, copy);
+	}
+	catch (...){
+		unlink(copy.c_str());
+		rmdir(dir.c_str());
+		throw;
+	}
+	handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+	// the library stays mapped once it is loaded, so nothing is left behind even if the program is killed
+	unlink(copy.c_str());
+	rmdir(dir.c_str());
+	if (handle == nullptr){
+		throw std::runtime_error("Failed to load " + s.path + " (" + dlerror() + ")");
+	}
+	s.handle = handle;
+}
+
+void SuiteWatcher::unload(size_t suite){
+	WatchedSuite& s = impl->suites[suite];
+
+	if (s.handle == nullptr){
+		return;
+	}
+	dlclose(s.handle);
+	s.handle = nullptr;
+}
+
+std::vector<size_t> SuiteWatcher::waitForChanges(){
+	alignas(struct inotify_event) char buf[4096];
+	std::set<size_t> changed;
+	struct pollfd pfd = {impl->fd, POLLIN, 0};
+
+	// block until something changes, then wait for it to settle
+	while (changed.empty() || poll(&pfd, 1, settleMs) > 0){
+		ssize_t len = read(impl->fd, buf, sizeof(buf));
+
+		if (len < 0){
+			// asked to stop
+			if (errno == EINTR){
+				break;
+			}
+			throw std::runtime_error("Failed to read from inotify (" + std::string(std::strerror(errno)) + ")");
+		}
+		for (char* p = buf; p < buf + len; ){
+			struct inotify_event* ev = (struct inotify_event*)p;
+			auto dir = impl->watches.find(ev->wd);
+
+			for (size_t i = 0; dir != impl->watches.end() && ev->len > 0 && i < impl->suites.size(); ++i){
+				if (impl->suites[i].dir == dir->second && impl->suites[i].file == ev->name){
+					changed.insert(i);
+				}
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return std::vector<size_t>(changed.begin(), changed.end());
+}
+
+}
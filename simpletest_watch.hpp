@@ -0,0 +1,97 @@
+/** @file simpletest_watch.hpp
+ * @brief simpletest test suites loaded from shared objects and reloaded when they are rebuilt.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SIMPLETEST_WATCH_HPP
+#define __SIMPLETEST_WATCH_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace simpletest{
+
+struct SuiteWatcherImpl;
+
+/**
+ * @brief Loads test suites built as shared objects into this process, and tells when they are rebuilt so they can be loaded again.
+ * Each suite is loaded from a copy of its file, so a rebuilt suite is always loaded fresh even if the C library could not unload the old one, and the build can replace the file while the copy is in use.
+ * The copy is removed as soon as it is loaded, so none are left behind when the program is killed.
+ * A suite's UNIT_TEST()s register themselves with this program while it is loaded, so the program has to export simpletest's functions to it: link it with -rdynamic and the whole library (-Wl,--whole-archive libsimpletest.a -Wl,--no-whole-archive), and do not link the suite with libsimpletest.a.
+ */
+class SuiteWatcher{
+public:
+	/**
+	 * @brief Starts watching the directories the suites are in.
+	 * Nothing is loaded yet.
+	 *
+	 * @param paths The paths of the suites' shared objects.
+	 *
+	 * @exception std::runtime_error Failed to set up inotify.
+	 */
+	explicit SuiteWatcher(const std::vector<std::string>& paths);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	SuiteWatcher(const SuiteWatcher& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	SuiteWatcher& operator=(const SuiteWatcher& other) = delete;
+
+	/**
+	 * @brief Unloads the suites and stops watching them.
+	 */
+	~SuiteWatcher();
+
+	/**
+	 * @brief Returns the number of suites.
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Returns the path a suite was given as.
+	 *
+	 * @param suite The index of the suite.
+	 */
+	const std::string& getPath(size_t suite) const;
+
+	/**
+	 * @brief Loads a suite from a fresh copy of its file, which runs its static initializers and with them its registrations.
+	 * A suite that is already loaded has to be unloaded first.
+	 *
+	 * @param suite The index of the suite.
+	 *
+	 * @exception std::runtime_error The file could not be copied or loaded, for example because it has an undefined symbol. See e.what() for details.
+	 */
+	void load(size_t suite);
+
+	/**
+	 * @brief Unloads a suite, if it is loaded. Nothing the suite registered may be used after this.
+	 *
+	 * @param suite The index of the suite.
+	 */
+	void unload(size_t suite);
+
+	/**
+	 * @brief Waits until at least one of the suites' files is rewritten, then until nothing has been written to any of them for a moment, so a build that writes several is picked up as one change.
+	 *
+	 * @return The indexes of the suites whose files changed, in ascending order. Empty if a signal interrupted the wait before anything changed.
+	 *
+	 * @exception std::runtime_error Failed to read from inotify.
+	 */
+	std::vector<size_t> waitForChanges();
+
+private:
+	std::unique_ptr<SuiteWatcherImpl> impl;
+};
+
+}
+
+#endif